@@ -0,0 +1,392 @@
+﻿#include "cdrom.h"
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cdio/cdio.h>
+#include <cdio/util.h>
+#ifdef SPU_MIX_SSE
+#include <emmintrin.h>
+#endif
+
+namespace ps1e {
+
+// CD-DA 总是以单倍速播放
+#define CD_DA_SECTORS_PER_SEC 75
+#define CD_DA_SECTOR_CYCLES   (SYSTEM_CLOCK_FREQ / CD_DA_SECTORS_PER_SEC)
+// 等待 CPU 应答中断后再发送 INT4
+#define CD_DA_RETRY_CYCLES    0x400
+
+// XA-ADPCM 的 4 个预测滤波器
+static const s32 XA_K0[4] = { 0, 60, 115,  98 };
+static const s32 XA_K1[4] = { 0,  0, -52, -55 };
+
+
+// CdSpuVol 的 80h 是 100%, 同时把 s16 转换到 [-1, 1)
+struct CdVolMatrix {
+  PcmSample ll, lr, rr, rl;
+
+  CdVolMatrix(const CdSpuVol& v) {
+    const PcmSample u = PcmSample(0x80 * 0x8000);
+    ll = v.cd_l_spu_l / u;
+    lr = v.cd_l_spu_r / u;
+    rr = v.cd_r_spu_r / u;
+    rl = v.cd_r_spu_l / u;
+  }
+};
+
+
+CdXaDecoder::CdXaDecoder() {
+  reset();
+}
+
+
+void CdXaDecoder::reset() {
+  old[0] = old[1] = 0;
+  older[0] = older[1] = 0;
+  phase = 0;
+  in[0][0] = in[1][0] = 0;
+}
+
+
+// 每个 32 位字的第 u 个 4bit/8bit 是单元 u 的采样, 左移到最高位并清除低位后
+// 算术右移, 同时完成符号扩展和 shift. 只有预测滤波依赖前两个采样, 需要逐个计算.
+void CdXaDecoder::decodeGroup(const u8* g, CdAudioCode code, u32& n) {
+  const bool bit8   = code.bit == 1;
+  const bool stereo = code.ch == 1;
+  const u32  units  = bit8 ? 4 : 8;
+  const u8*  words  = g + 16;
+  s32 raw[28];
+
+  for (u32 u = 0; u < units; ++u) {
+    const u8  head  = g[4 + u];
+    const u32 shift = (head & 0x0F) > 12 ? 9 : (head & 0x0F);
+    const u32 f     = (head >> 4) & 3;
+    const u32 c     = stereo ? (u & 1) : 0;
+    const u32 left  = bit8 ? 24 - (u << 3) : 28 - (u << 2);
+    const u32 right = 16 + shift;
+    const u32 mask  = bit8 ? 0xFF00'0000 : 0xF000'0000;
+
+#ifdef SPU_MIX_SSE
+    const __m128i l = _mm_cvtsi32_si128(left);
+    const __m128i r = _mm_cvtsi32_si128(right);
+    const __m128i m = _mm_set1_epi32(mask);
+    for (u32 j = 0; j < 28; j += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(words + (j << 2)));
+      v = _mm_sra_epi32(_mm_and_si128(_mm_sll_epi32(v, l), m), r);
+      _mm_storeu_si128((__m128i*)(raw + j), v);
+    }
+#else
+    for (u32 j = 0; j < 28; ++j) {
+      u32 w;
+      memcpy(&w, words + (j << 2), 4);
+      raw[j] = s32((w << left) & mask) >> right;
+    }
+#endif
+
+    s16* dst = in[c] + 1 + n + (stereo ? (u >> 1) : u) * 28;
+    s32 s1 = old[c];
+    s32 s2 = older[c];
+
+    for (u32 j = 0; j < 28; ++j) {
+      s32 s = raw[j] + ((s1 * XA_K0[f] + s2 * XA_K1[f] + 32) >> 6);
+      if (s > 0x7FFF) s = 0x7FFF;
+      if (s < -0x8000) s = -0x8000;
+      dst[j] = s16(s);
+      s2 = s1;
+      s1 = s;
+    }
+    old[c] = s1;
+    older[c] = s2;
+  }
+  n += (stereo ? units >> 1 : units) * 28;
+}
+
+
+u32 CdXaDecoder::decode(const u8* sub, const CdSpuVol& vol, PcmRing* ring) {
+  CdAudioCode code;
+  code.v = sub[3];
+  u32 n = 0;
+  for (u32 i = 0; i < GROUPS; ++i) {
+    decodeGroup(sub + 8 + (i << 7), code, n);
+  }
+  if (code.ch != 1) {
+    memcpy(in[1], in[0], (n + 1) * sizeof(s16));
+  }
+
+  // 37800Hz 是 44100Hz 的 6/7, 18900Hz 是 3/7
+  const u32 step = code.rate == 1 ? 3 : 6;
+  const CdVolMatrix m(vol);
+  PcmSample* o = out.get(((n * 7 / step) + 1) << 1);
+  const s16* L = in[0];
+  const s16* R = in[1];
+  u32 pos = 0;
+  u32 ph  = phase;
+  u32 k   = 0;
+
+  while (pos < n) {
+    const s32 l = L[pos] + (L[pos+1] - L[pos]) * s32(ph) / 7;
+    const s32 r = R[pos] + (R[pos+1] - R[pos]) * s32(ph) / 7;
+    o[k+0] = l * m.ll + r * m.rl;
+    o[k+1] = r * m.rr + l * m.lr;
+    k += 2;
+    ph += step;
+    if (ph >= 7) {
+      ph -= 7;
+      ++pos;
+    }
+  }
+  phase = ph;
+  in[0][0] = L[n];
+  in[1][0] = R[n];
+  return ring ? ring->push(o, k >> 1) : 0;
+}
+
+
+
+CdDaPlayer::CdDaPlayer(CDrom& _p, CdDrive& d, ClockScheduler& s)
+: p(_p), drive(d), sched(s), fetch(0), stride(1), pos(0), track_end(0),
+  head(0), filled(0), generation(0), active(false), ended(false), 
+  running(true), starve(0)
+{
+  ring = new u8[RING_SECTORS * CdDrive::AUDIO_BUF_SIZE];
+  lock = new std::mutex();
+  wake  = new std::condition_variable();
+  th    = new std::thread(&CdDaPlayer::worker, this);
+}
+
+
+CdDaPlayer::~CdDaPlayer() {
+  {
+    std::lock_guard<std::mutex> _lk(*lock);
+    running = false;
+    wake->notify_one();
+  }
+  th->join();
+  sched.cancel(this);
+  delete th;
+  delete wake;
+  delete lock;
+  delete [] ring;
+}
+
+
+void CdDaPlayer::worker() {
+  info("CD-ROM Audio Thread ID: %x\n", this_thread_id());
+  std::unique_lock<std::mutex> lk(*lock);
+
+  while (running) {
+    if (!active || ended || filled >= RING_SECTORS) {
+      wake->wait(lk);
+      continue;
+    }
+
+    // 写入位置在消费者推进 head 时不变
+    const u32 i = (head + filled) % RING_SECTORS;
+    const u32 gen = generation;
+    const CdLsn lsn = fetch;
+    lk.unlock();
+    const bool ok = lsn >= 0 && drive.readAudio(lsn, ring + i * CdDrive::AUDIO_BUF_SIZE);
+    lk.lock();
+
+    if (gen != generation) continue;
+    if (!ok) {
+      ended = true;
+    } else {
+      lsns[i] = lsn;
+      fetch += stride;
+      ++filled;
+    }
+  }
+}
+
+
+void CdDaPlayer::restart(CdLsn lsn, s32 _stride) {
+  std::lock_guard<std::mutex> _lk(*lock);
+  ++generation;
+  head   = 0;
+  filled = 0;
+  fetch  = lsn;
+  stride = _stride;
+  ended  = false;
+  active = true;
+  wake->notify_one();
+}
+
+
+void CdDaPlayer::play(CdLsn from) {
+  pos = from;
+  track_end = drive.trackEnd(from);
+  starve = 0;
+  restart(from, 1);
+  sched.schedule(this, CD_DA_SECTOR_CYCLES);
+}
+
+
+void CdDaPlayer::scan(s32 dir) {
+  if (!isPlaying()) return;
+  const s32 st = dir * SCAN_STRIDE;
+  restart(pos + st, st);
+}
+
+
+CdLsn CdDaPlayer::stop() {
+  {
+    std::lock_guard<std::mutex> _lk(*lock);
+    ++generation;
+    active = false;
+    filled = 0;
+  }
+  sched.cancel(this);
+  if (starve) {
+    info("CD-DA starved %d sectors\n", starve);
+  }
+  return pos;
+}
+
+
+bool CdDaPlayer::isPlaying() {
+  std::lock_guard<std::mutex> _lk(*lock);
+  return active;
+}
+
+
+// 交错的立体声, o[l] = l * ll + r * rl; o[r] = r * rr + l * lr
+static inline void mix_matrix(PcmSample* o, const s16* pcm, const CdVolMatrix& m, u32 nframe) {
+  u32 i = 0;
+  const u32 n = nframe << 1;
+#ifdef SPU_MIX_SSE
+  // 一次 4 帧, 交换左右声道后与交叉音量相乘
+  const __m128 same  = _mm_setr_ps(m.ll, m.rr, m.ll, m.rr);
+  const __m128 cross = _mm_setr_ps(m.rl, m.lr, m.rl, m.lr);
+  for (; i + 8 <= n; i += 8) {
+    const __m128i s = _mm_loadu_si128((const __m128i*)(pcm + i));
+    const __m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+    const __m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+    const __m128 sa = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+    const __m128 sb = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 3, 0, 1));
+    _mm_storeu_ps(o + i,     _mm_add_ps(_mm_mul_ps(a, same), _mm_mul_ps(sa, cross)));
+    _mm_storeu_ps(o + i + 4, _mm_add_ps(_mm_mul_ps(b, same), _mm_mul_ps(sb, cross)));
+  }
+#endif
+  for (; i < n; i += 2) {
+    const PcmSample l = pcm[i+0];
+    const PcmSample r = pcm[i+1];
+    o[i+0] = l * m.ll + r * m.rl;
+    o[i+1] = r * m.rr + l * m.lr;
+  }
+}
+
+
+void CdDaPlayer::mix(const u8* sector) {
+  if (p.mute || !p.audio_out) return;
+  PcmSample* o = out.get(FRAMES << 1);
+  mix_matrix(o, (const s16*) sector, CdVolMatrix(p.apply), FRAMES);
+  p.audio_out->push(o, FRAMES);
+}
+
+
+// 保持 SPU 的 CD 输入连续
+void CdDaPlayer::silence() {
+  if (!p.audio_out) return;
+  PcmSample* o = out.get(FRAMES << 1);
+  memset(o, 0, (FRAMES << 1) * sizeof(PcmSample));
+  p.audio_out->push(o, FRAMES);
+}
+
+
+u32 CdDaPlayer::finish() {
+  if (p.irq_flag) return CD_DA_RETRY_CYCLES;
+  p.stopAudio();
+  p.attr.idle();
+  p.pushResponse();
+  p.sendIrq(4);
+  return 0;
+}
+
+
+// 响应: stat, 轨道, 索引, mm, ss, ff, 峰值低/高字节, 都是 BCD (峰值除外).
+// 秒内扇区号的十位为偶数时是绝对时间, 奇数时是轨道内的相对时间且 ss 的 bit7 为 1.
+// 峰值是一个声道的最大绝对值, bit15 表示右声道. 前一个中断还没有应答时丢弃这次报告.
+void CdDaPlayer::report(CdLsn lsn, const u8* sector) {
+  msf_t a;
+  cdio_lsn_to_msf(lsn, &a);
+  const u8 f = cdio_from_bcd8(a.f);
+  if (f % 10 || p.irq_flag) return;
+
+  CDTrack track;
+  u8 index;
+  CdLsn start;
+  if (!drive.trackOf(lsn, track, index, start)) return;
+
+  const bool relative = (f / 10) & 1;
+  if (relative) {
+    const CdLsn r = lsn >= start ? lsn - start : start - lsn;
+    a.m = cdio_to_bcd8(u8(r / (CD_DA_SECTORS_PER_SEC * 60)));
+    a.s = cdio_to_bcd8(u8((r / CD_DA_SECTORS_PER_SEC) % 60)) | 0x80;
+    a.f = cdio_to_bcd8(u8(r % CD_DA_SECTORS_PER_SEC));
+  }
+
+  const s16* pcm = (const s16*) sector;
+  u32 peak = 0;
+  for (u32 i = relative; i < FRAMES * 2; i += 2) {
+    const u32 v = pcm[i] < 0 ? -s32(pcm[i]) : pcm[i];
+    if (v > peak) peak = v;
+  }
+  if (peak > 0x7FFF) peak = 0x7FFF;
+  if (relative) peak |= 0x8000;
+
+  p.pushResponse();
+  p.pushResponse(cdio_to_bcd8(u8(track)));
+  p.pushResponse(cdio_to_bcd8(index));
+  p.pushResponse(a.m);
+  p.pushResponse(a.s);
+  p.pushResponse(a.f);
+  p.pushResponse(u8(peak));
+  p.pushResponse(u8(peak >> 8));
+  p.sendIrq(1);
+}
+
+
+u32 CdDaPlayer::onClock(u32 /*late*/) {
+  const u8* s = 0;
+  CdLsn lsn = 0;
+  bool end;
+  {
+    std::lock_guard<std::mutex> lk(*lock);
+    if (!active) return 0;
+    end = ended && !filled;
+    if (filled) {
+      s = ring + head * CdDrive::AUDIO_BUF_SIZE;
+      lsn = lsns[head];
+    }
+  }
+
+  if (end) return finish();
+  if (!s) {
+    // 主机 IO 太慢或模拟比实际时间快, 不在时钟事件中等待预读;
+    // 这个扇区时间内输出静音, 播放位置不变
+    ++starve;
+    cddbg("CD-DA starve %d\n", starve);
+    silence();
+    return CD_DA_SECTOR_CYCLES;
+  }
+
+  if (stride > 0 && lsn >= track_end) {
+    if (p.mode_auto_pause) return finish();
+    track_end = drive.trackEnd(lsn);
+  }
+
+  mix(s);
+  if (p.mode_play_irq) report(lsn, s);
+  pos = lsn + 1;
+  {
+    std::lock_guard<std::mutex> _lk(*lock);
+    head = (head + 1) % RING_SECTORS;
+    --filled;
+    wake->notify_one();
+  }
+  return CD_DA_SECTOR_CYCLES;
+}
+
+}
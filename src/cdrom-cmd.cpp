@@ -55,6 +55,7 @@ public:
         return false;
 
       case 1:
+        p.stopAudio();
         p.setMode(0);
         p.attr.reset();
         //attr.motor = 0; //TODO: 1?0
@@ -116,6 +117,7 @@ public:
   bool docmd(CDrom& p) override {
     switch (stage++) {
       case 0:
+        p.stopAudio();
         p.moveToFirstTrack();
         p.attr.read = 0;
         p.pushResponse();
@@ -138,6 +140,7 @@ public:
   bool docmd(CDrom& p) override {
     switch (stage++) {
       case 0:
+        p.stopAudio();
         p.pushResponse();
         p.sendIrq(3);
         return false;
@@ -179,8 +182,10 @@ public:
   bool docmd(CDrom& p) override {
     switch (stage++) {
       case 0:
+        p.stopAudio();
         p.pushResponse();
         p.sendIrq(3);
+        wait = p.seekCycles();
         return false;
 
       case 1:
@@ -199,8 +204,10 @@ public:
   bool docmd(CDrom& p) override {
     switch (stage++) {
       case 0:
+        p.stopAudio();
         p.pushResponse();
         p.sendIrq(3);
+        wait = p.seekCycles();
         return false;
 
       case 1:
@@ -265,29 +272,42 @@ public:
     std::lock_guard<std::mutex> _lk(*p.readLock());
     switch (stage) {
       case 0:
+        p.stopAudio();
         p.attr.clearerr();
         p.pushResponse();
         p.sendIrq(3);
         stage = 1;
+        wait = p.sectorCycles();
         return false;
 
-      case 3:
-        p.moveNextTrack();
-        // no break;
       case 1:
         p.attr.reading();
         p.pushResponse();
         p.sendIrq(1);
         stage = 2;
+        wait = p.sectorCycles();
         return false;
 
-      case 2:
-        sleep(5);
-        if (p.dataIsEmpty() && p.want_data) {
+      case 2: {
+        bool sent = true;
+        // 声音扇区送到 SPU 后不等待 CPU 读取数据
+        if (p.playXaSector()) {
+          p.moveNextTrack();
+        }
+        else if (p.dataIsEmpty() && p.want_data) {
           p.readSectionData();
-          stage = 3;
+          p.moveNextTrack();
+          p.attr.reading();
+          p.pushResponse();
+          p.sendIrq(1);
         }
+        else {
+          sent = false;
+        }
+        // 每个扇区的间隔由 setMode 的速度决定, 只有送出扇区才算节省的时间
+        wait = p.sectorCycles(sent);
         return p.nextCmdIsStop();
+      }
     }
   }
 };
@@ -490,11 +510,13 @@ public:
 };
 
 
-//TODO: Report/AutoPause
+// 参数是 BCD 格式的轨道号, 没有参数或为 0 则从 setLoc 位置开始
 class CDCmdPlay : public ICDCommand {
 public:
   bool docmd(CDrom& p) override {
-    CDTrack t = p.pop_param();
+    CDTrack t = p.hasParam() ? ::cdio_from_bcd8(p.pop_param()) : 0;
+    p.playAudio(t);
+    p.attr.playing();
     p.pushResponse(); 
     p.sendIrq(3);
     return true;
@@ -505,6 +527,7 @@ public:
 class CDCmdForward : public ICDCommand {
 public:
   bool docmd(CDrom& p) override {
+    p.scanAudio(1);
     p.pushResponse(); 
     p.sendIrq(3);
     return true;
@@ -515,6 +538,7 @@ public:
 class CDCmdBackward : public ICDCommand {
 public:
   bool docmd(CDrom& p) override {
+    p.scanAudio(-1);
     p.pushResponse(); 
     p.sendIrq(3);
     return true;
@@ -0,0 +1,505 @@
+﻿#include "cdrom.h"
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace ps1e {
+
+#define HUNK_MAGIC        "PSOEHUNK"
+#define HUNK_VERSION      1
+#define LZ_HASH_BITS      12
+#define LZ_MIN_MATCH      4
+
+static const s32 NO_HUNK   = -1;
+static const s32 BUSY_HUNK = -2;
+
+
+// long 在 Windows 上是 32 位, 超过 2GB 的偏移必须使用 64 位的版本
+static int seek64(FILE* f, u64 offset) {
+#ifdef WIN_NT
+  return _fseeki64(f, s64(offset), SEEK_SET);
+#else
+  return fseeko(f, off_t(offset), SEEK_SET);
+#endif
+}
+
+
+enum class HunkCodec : u32 {
+  store = 0,
+  // LZ77, 格式与 LZ4 块相同
+  lz    = 1,
+  // 16 位立体声采样先做差分, 再 LZ77, 用于音轨
+  delta = 2,
+};
+
+
+// 文件中所有数值都是小端, 启动时已经检查了 CPU 字节序
+#pragma pack(push, 1)
+struct HunkHeader {
+  char magic[8];
+  u32 version;
+  u32 hunk_sectors;
+  u32 num_sectors;
+  u32 num_hunks;
+  u32 num_tracks;
+  u32 reserved;
+};
+
+
+struct HunkTrack {
+  u8  number;
+  u8  format;
+  u16 sector_size;
+  u16 data_offset;
+  u16 reserved;
+  s32 begin;
+  s32 start;
+  s32 end;
+  s32 pregap;
+  u32 first_sector;
+};
+
+
+struct HunkEntry {
+  u64 offset;
+  u32 size;
+  u32 codec;
+};
+#pragma pack(pop)
+
+
+static inline u32 read32(const u8* p) {
+  u32 v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+
+// 长度超过 15 时按 255 累加
+static bool lz_read_len(const u8*& src, const u8* end, u32& len) {
+  if (len != 15) return true;
+  u8 b;
+  do {
+    if (src >= end) return false;
+    b = *src++;
+    len += b;
+  } while (b == 255);
+  return true;
+}
+
+
+static bool lz_decode(const u8* src, u32 slen, u8* dst, u32 dlen) {
+  const u8* se = src + slen;
+  u8* d = dst;
+  u8* de = dst + dlen;
+
+  while (src < se) {
+    const u8 token = *src++;
+    u32 lit = token >> 4;
+    if (!lz_read_len(src, se, lit)) return false;
+    if (lit > u32(se - src) || lit > u32(de - d)) return false;
+    memcpy(d, src, lit);
+    d += lit;
+    src += lit;
+
+    // 最后一段只有字面量
+    if (src >= se) break;
+    if (se - src < 2) return false;
+    const u32 off = src[0] | (src[1] << 8);
+    src += 2;
+    if (off == 0 || off > u32(d - dst)) return false;
+
+    u32 len = token & 0x0F;
+    if (!lz_read_len(src, se, len)) return false;
+    len += LZ_MIN_MATCH;
+    if (len > u32(de - d)) return false;
+
+    // 匹配可以与输出重叠, 逐字节复制
+    const u8* m = d - off;
+    while (len--) *d++ = *m++;
+  }
+  return d == de;
+}
+
+
+static bool lz_write_len(u8*& d, const u8* de, u32 len) {
+  if (len < 15) return true;
+  len -= 15;
+  while (len >= 255) {
+    if (d >= de) return false;
+    *d++ = 255;
+    len -= 255;
+  }
+  if (d >= de) return false;
+  *d++ = u8(len);
+  return true;
+}
+
+
+static bool lz_emit(u8*& d, const u8* de, const u8* lit, u32 nlit, u32 off, u32 mlen) {
+  if (d >= de) return false;
+  u8* token = d++;
+  const u32 ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+  *token = u8(((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15));
+
+  if (!lz_write_len(d, de, nlit)) return false;
+  if (nlit > u32(de - d)) return false;
+  memcpy(d, lit, nlit);
+  d += nlit;
+
+  if (mlen) {
+    if (de - d < 2) return false;
+    *d++ = u8(off);
+    *d++ = u8(off >> 8);
+    if (!lz_write_len(d, de, ml)) return false;
+  }
+  return true;
+}
+
+
+// 贪心匹配, 输出不小于输入时返回 0
+static u32 lz_encode(const u8* src, u32 n, u8* dst, u32 cap) {
+  u32 table[1 << LZ_HASH_BITS];
+  memset(table, 0xFF, sizeof(table));
+  u8* d = dst;
+  const u8* de = dst + cap;
+  u32 anchor = 0;
+  u32 i = 0;
+
+  while (i + LZ_MIN_MATCH <= n) {
+    const u32 seq = read32(src + i);
+    const u32 h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+    const u32 ref = table[h];
+    table[h] = i;
+
+    if (ref != 0xFFFF'FFFF && i - ref <= 0xFFFF && read32(src + ref) == seq) {
+      u32 len = LZ_MIN_MATCH;
+      while (i + len < n && src[ref + len] == src[i + len]) ++len;
+      if (!lz_emit(d, de, src + anchor, i - anchor, i - ref, len)) return 0;
+      i += len;
+      anchor = i;
+    } else {
+      ++i;
+    }
+  }
+
+  if (anchor < n && !lz_emit(d, de, src + anchor, n - anchor, 0, 0)) return 0;
+  return u32(d - dst);
+}
+
+
+// 左右声道分别对前一个采样差分
+static void delta_encode(u8* p, u32 bytes) {
+  s16* s = (s16*) p;
+  const u32 n = bytes / sizeof(s16);
+  for (u32 i = n - 1; i >= 2; --i) {
+    s[i] = s16(s[i] - s[i - 2]);
+  }
+}
+
+
+static void delta_decode(u8* p, u32 bytes) {
+  s16* s = (s16*) p;
+  const u32 n = bytes / sizeof(s16);
+  for (u32 i = 2; i < n; ++i) {
+    s[i] = s16(s[i] + s[i - 2]);
+  }
+}
+
+
+CdHunkReader::CdHunkReader() : base(0), size(0), index(0), num_hunks(0),
+    num_sectors(0), hunk_sectors(0), hunk_bytes(0), tick(0),
+    want(NO_HUNK), busy(NO_HUNK), running(true), th(0)
+{
+  memset(slots, 0, sizeof(slots));
+  lock  = new std::mutex();
+  wake  = new std::condition_variable();
+  ready = new std::condition_variable();
+}
+
+
+CdHunkReader::~CdHunkReader() {
+  if (th) {
+    {
+      std::lock_guard<std::mutex> _lk(*lock);
+      running = false;
+      wake->notify_one();
+    }
+    th->join();
+    delete th;
+  }
+  for (int i = 0; i < CACHE_SIZE; ++i) {
+    delete [] slots[i].data;
+  }
+  delete ready;
+  delete wake;
+  delete lock;
+}
+
+
+bool CdHunkReader::open(const u8* b, u64 sz, CdImageTrack* tracks, int& num_track) {
+  const HunkHeader* h = (const HunkHeader*) b;
+  if (sz < sizeof(HunkHeader) || memcmp(h->magic, HUNK_MAGIC, 8)) {
+    error("Not a hunk CD image\n");
+    return false;
+  }
+  if (h->version != HUNK_VERSION || h->hunk_sectors == 0
+      || h->num_tracks == 0 || h->num_tracks > CdImage::MAX_TRACK) {
+    error("Unsupported hunk CD image version %d\n", h->version);
+    return false;
+  }
+  const u64 table = sizeof(HunkHeader) + u64(h->num_tracks) * sizeof(HunkTrack)
+                  + u64(h->num_hunks) * sizeof(HunkEntry);
+  if (table > sz || u64(h->num_hunks) * h->hunk_sectors < h->num_sectors) {
+    error("Hunk CD image truncated\n");
+    return false;
+  }
+
+  base         = b;
+  size         = sz;
+  num_hunks    = h->num_hunks;
+  num_sectors  = h->num_sectors;
+  hunk_sectors = h->hunk_sectors;
+  hunk_bytes   = hunk_sectors * CdDrive::AUDIO_BUF_SIZE;
+
+  const HunkTrack* ht = (const HunkTrack*)(b + sizeof(HunkHeader));
+  for (u32 i = 0; i < h->num_tracks; ++i) {
+    CdImageTrack& t = tracks[i];
+    memset(&t, 0, sizeof(t));
+    t.number       = ht[i].number;
+    t.format       = ht[i].format;
+    t.sector_size  = ht[i].sector_size;
+    t.data_offset  = ht[i].data_offset;
+    t.begin        = ht[i].begin;
+    t.start        = ht[i].start;
+    t.end          = ht[i].end;
+    t.pregap       = ht[i].pregap;
+    t.first_sector = ht[i].first_sector;
+  }
+  num_track = h->num_tracks;
+  index = ht + h->num_tracks;
+
+  for (int i = 0; i < CACHE_SIZE; ++i) {
+    slots[i].hunk = NO_HUNK;
+    slots[i].tick = 0;
+    slots[i].data = new u8[hunk_bytes];
+  }
+  th = new std::thread(&CdHunkReader::worker, this);
+  return true;
+}
+
+
+bool CdHunkReader::decode(u32 hunk, u8* out) {
+  const HunkEntry& e = ((const HunkEntry*) index)[hunk];
+  if (e.offset + e.size > size) {
+    error("Hunk %d out of file\n", hunk);
+    return false;
+  }
+  const u8* src = base + e.offset;
+
+  switch (HunkCodec(e.codec)) {
+    case HunkCodec::store:
+      if (e.size != hunk_bytes) break;
+      memcpy(out, src, hunk_bytes);
+      return true;
+
+    case HunkCodec::lz:
+      if (!lz_decode(src, e.size, out, hunk_bytes)) break;
+      return true;
+
+    case HunkCodec::delta:
+      if (!lz_decode(src, e.size, out, hunk_bytes)) break;
+      delta_decode(out, hunk_bytes);
+      return true;
+  }
+  error("Bad hunk %d, codec %d\n", hunk, e.codec);
+  return false;
+}
+
+
+CdHunkReader::Slot* CdHunkReader::find(s32 hunk) {
+  for (int i = 0; i < CACHE_SIZE; ++i) {
+    if (slots[i].hunk == hunk) return &slots[i];
+  }
+  return 0;
+}
+
+
+// 最久没有使用的块, 不会选中正在解压的块
+CdHunkReader::Slot* CdHunkReader::victim() {
+  Slot* v = 0;
+  for (int i = 0; i < CACHE_SIZE; ++i) {
+    if (slots[i].hunk == BUSY_HUNK) continue;
+    if (!v || slots[i].tick < v->tick) v = &slots[i];
+  }
+  return v;
+}
+
+
+void CdHunkReader::worker() {
+  info("CD-ROM Hunk Thread ID: %x\n", this_thread_id());
+  std::unique_lock<std::mutex> lk(*lock);
+
+  while (running) {
+    if (want == NO_HUNK) {
+      wake->wait(lk);
+      continue;
+    }
+
+    const s32 h = want;
+    want = NO_HUNK;
+    if (find(h)) continue;
+
+    Slot* s = victim();
+    s->hunk = BUSY_HUNK;
+    busy = h;
+    lk.unlock();
+    const bool ok = decode(h, s->data);
+    lk.lock();
+
+    s->hunk = ok ? h : NO_HUNK;
+    // 预取的块还没有被使用, 排在当前块之前淘汰
+    s->tick = tick ? tick - 1 : 0;
+    busy = NO_HUNK;
+    ready->notify_all();
+  }
+}
+
+
+bool CdHunkReader::read(u32 n, u8* out, u32 len) {
+  if (n >= num_sectors || len > CdDrive::AUDIO_BUF_SIZE) return false;
+  const s32 h = s32(n / hunk_sectors);
+  std::unique_lock<std::mutex> lk(*lock);
+
+  // 后台线程正在解压这一块
+  ready->wait(lk, [&] { return busy != h; });
+  Slot* s = find(h);
+  if (!s) {
+    s = victim();
+    if (!decode(h, s->data)) {
+      s->hunk = NO_HUNK;
+      return false;
+    }
+    s->hunk = h;
+  }
+  s->tick = ++tick;
+
+  const s32 next = h + 1;
+  if (u32(next) < num_hunks && busy != next && !find(next)) {
+    want = next;
+    wake->notify_one();
+  }
+  // 返回指针时其他线程可能在使用期间替换这个块, 必须在锁内复制
+  memcpy(out, s->data + (n % hunk_sectors) * CdDrive::AUDIO_BUF_SIZE, len);
+  return true;
+}
+
+
+bool CdHunkReader::write(CdImage& src, const char* dst) {
+  const int ntrack = src.count();
+  HunkTrack ht[CdImage::MAX_TRACK];
+  u32 nsector = 0;
+
+  for (int i = 0; i < ntrack; ++i) {
+    const CdImageTrack* t = src.track(src.first() + i);
+    if (!t) return false;
+    memset(&ht[i], 0, sizeof(HunkTrack));
+    ht[i].number       = t->number;
+    ht[i].format       = u8(t->format);
+    ht[i].sector_size  = t->sector_size;
+    ht[i].data_offset  = t->data_offset;
+    ht[i].begin        = t->begin;
+    ht[i].start        = t->start;
+    ht[i].end          = t->end;
+    ht[i].pregap       = t->pregap;
+    ht[i].first_sector = nsector;
+    nsector += t->end - t->begin - t->pregap;
+  }
+
+  HunkHeader head;
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, HUNK_MAGIC, 8);
+  head.version      = HUNK_VERSION;
+  head.hunk_sectors = HUNK_SECTORS;
+  head.num_sectors  = nsector;
+  head.num_hunks    = (nsector + HUNK_SECTORS - 1) / HUNK_SECTORS;
+  head.num_tracks   = ntrack;
+
+  FILE* f = fopen(dst, "wb");
+  if (!f) {
+    error("Cannot create hunk image %s\n", dst);
+    return false;
+  }
+
+  const u32 hbytes = HUNK_SECTORS * CdDrive::AUDIO_BUF_SIZE;
+  HunkEntry* entry = new HunkEntry[head.num_hunks];
+  u8* raw   = new u8[hbytes];
+  u8* delta = new u8[hbytes];
+  u8* lz    = new u8[hbytes];
+  u8* lzd   = new u8[hbytes];
+  u64 offset = sizeof(head) + ntrack * sizeof(HunkTrack) + head.num_hunks * sizeof(HunkEntry);
+  bool ok = seek64(f, offset) == 0;
+
+  int ti = 0;
+  u32 si = 0;
+  for (u32 h = 0; ok && h < head.num_hunks; ++h) {
+    // 最后一块不足部分补 0
+    memset(raw, 0, hbytes);
+    for (u32 k = 0; k < HUNK_SECTORS && si < nsector; ++k, ++si) {
+      while (si >= ht[ti].first_sector + u32(ht[ti].end - ht[ti].begin - ht[ti].pregap)) ++ti;
+      const CdLsn lsn = ht[ti].begin + ht[ti].pregap + (si - ht[ti].first_sector);
+      if (!src.read(lsn, raw + k * CdDrive::AUDIO_BUF_SIZE)) {
+        ok = false;
+        break;
+      }
+    }
+
+    memcpy(delta, raw, hbytes);
+    delta_encode(delta, hbytes);
+    const u32 a = lz_encode(raw, hbytes, lz, hbytes);
+    const u32 b = lz_encode(delta, hbytes, lzd, hbytes);
+
+    const u8* out = raw;
+    entry[h].size  = hbytes;
+    entry[h].codec = u32(HunkCodec::store);
+    if (a && a <= entry[h].size) {
+      out = lz;
+      entry[h].size  = a;
+      entry[h].codec = u32(HunkCodec::lz);
+    }
+    if (b && b < entry[h].size) {
+      out = lzd;
+      entry[h].size  = b;
+      entry[h].codec = u32(HunkCodec::delta);
+    }
+    entry[h].offset = offset;
+    offset += entry[h].size;
+    ok = ok && fwrite(out, 1, entry[h].size, f) == entry[h].size;
+  }
+
+  if (ok) {
+    fseek(f, 0, SEEK_SET);
+    ok = fwrite(&head, sizeof(head), 1, f) == 1
+      && fwrite(ht, sizeof(HunkTrack), ntrack, f) == u32(ntrack)
+      && fwrite(entry, sizeof(HunkEntry), head.num_hunks, f) == head.num_hunks;
+  }
+  fclose(f);
+
+  if (ok) {
+    info("Hunk image %s, %d sectors, %d%% of raw size\n", dst, nsector,
+         int(offset * 100 / (u64(nsector) * CdDrive::AUDIO_BUF_SIZE + 1)));
+  } else {
+    error("Write hunk image %s failed\n", dst);
+  }
+
+  delete [] lzd;
+  delete [] lz;
+  delete [] delta;
+  delete [] raw;
+  delete [] entry;
+  return ok;
+}
+
+}
@@ -0,0 +1,424 @@
+﻿#include "cdrom.h"
+#include <cdio/cdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(LINUX) || defined(MACOS)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#elif defined(WIN_NT)
+#include <windows.h>
+#endif
+
+namespace ps1e {
+
+#define CD_FRAMES_PER_SEC   75
+// LSN 0 是光盘上的 00:02:00
+#define CD_MSF_LSN_OFFSET   150
+#define CD_PATH_MAX         1024
+
+// pregap 中不存在于文件的扇区
+static const u8 zero_sector[CdDrive::AUDIO_BUF_SIZE] = {0};
+
+
+static u8 to_bcd(u32 n) {
+  return u8(((n / 10) << 4) | (n % 10));
+}
+
+
+static bool parse_msf(const char* s, CdLsn& frames) {
+  u32 m, sec, f;
+  if (sscanf(s, "%u:%u:%u", &m, &sec, &f) != 3) return false;
+  frames = (m * 60 + sec) * CD_FRAMES_PER_SEC + f;
+  return true;
+}
+
+
+static const char* ext_name(const char* path) {
+  const char* dot = strrchr(path, '.');
+  return dot ? dot + 1 : "";
+}
+
+
+static bool ext_is(const char* path, const char* ext) {
+  const char* e = ext_name(path);
+  while (*e && *ext) {
+    if (tolower(*e++) != *ext++) return false;
+  }
+  return *e == 0 && *ext == 0;
+}
+
+
+static bool map_file(const char* path, CdMappedFile& f) {
+  memset(&f, 0, sizeof(f));
+#if defined(LINUX) || defined(MACOS)
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+  void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) return false;
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+  f.base = (const u8*) p;
+  f.size = st.st_size;
+  return true;
+#elif defined(WIN_NT)
+  HANDLE h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (h == INVALID_HANDLE_VALUE) return false;
+  LARGE_INTEGER sz;
+  if (!GetFileSizeEx(h, &sz) || sz.QuadPart <= 0) {
+    CloseHandle(h);
+    return false;
+  }
+  HANDLE m = CreateFileMappingA(h, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!m) {
+    CloseHandle(h);
+    return false;
+  }
+  void* p = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+  if (!p) {
+    CloseHandle(m);
+    CloseHandle(h);
+    return false;
+  }
+  f.base = (const u8*) p;
+  f.size = sz.QuadPart;
+  f.handle = h;
+  f.mapping = m;
+  return true;
+#else
+  #error "Cannot support this OS"
+#endif
+}
+
+
+static void unmap_file(CdMappedFile& f) {
+  if (!f.base) return;
+#if defined(LINUX) || defined(MACOS)
+  munmap((void*) f.base, f.size);
+#elif defined(WIN_NT)
+  UnmapViewOfFile(f.base);
+  CloseHandle(f.mapping);
+  CloseHandle(f.handle);
+#endif
+  memset(&f, 0, sizeof(f));
+}
+
+
+CdImage::CdImage() : num_file(0), num_track(0), hunks(0) {
+  memset(files, 0, sizeof(files));
+  memset(tracks, 0, sizeof(tracks));
+}
+
+
+CdImage::~CdImage() {
+  close();
+}
+
+
+void CdImage::close() {
+  delete hunks;
+  hunks = 0;
+  for (int i = 0; i < num_file; ++i) {
+    unmap_file(files[i]);
+  }
+  num_file = 0;
+  num_track = 0;
+}
+
+
+bool CdImage::isOpen() {
+  return num_track > 0;
+}
+
+
+bool CdImage::open(const char* path) {
+  close();
+  bool ok = false;
+
+  if (ext_is(path, "cue")) {
+    ok = parseCue(path);
+  } else if (ext_is(path, "iso")) {
+    ok = single(path, TRACK_FORMAT_DATA, CdDrive::DATA_BUF_SIZE);
+  } else if (ext_is(path, "bin") || ext_is(path, "img")) {
+    ok = single(path, TRACK_FORMAT_XA, CdDrive::AUDIO_BUF_SIZE);
+  } else if (ext_is(path, "hunk")) {
+    ok = openHunk(path);
+  }
+
+  if (!ok) {
+    close();
+    return false;
+  }
+  info("CD image %s, %d tracks, %d sectors\n", path, num_track, lastLsn() + 1);
+  return true;
+}
+
+
+const CdMappedFile* CdImage::map(const char* path) {
+  if (num_file >= MAX_TRACK) return 0;
+  CdMappedFile& f = files[num_file];
+  if (!map_file(path, f)) {
+    error("Cannot map CD image %s\n", path);
+    return 0;
+  }
+  ++num_file;
+  return &f;
+}
+
+
+bool CdImage::single(const char* path, int format, u16 sector_size) {
+  const CdMappedFile* f = map(path);
+  if (!f) return false;
+
+  CdImageTrack& t = tracks[0];
+  memset(&t, 0, sizeof(t));
+  t.number      = 1;
+  t.format      = format;
+  t.sector_size = sector_size;
+  t.data_offset = (sector_size == CdDrive::AUDIO_BUF_SIZE) ? 24 : 0;
+  t.begin       = 0;
+  t.start       = 0;
+  t.end         = CdLsn(f->size / sector_size);
+  t.data        = f->base;
+  num_track = 1;
+  return t.end > 0;
+}
+
+
+bool CdImage::openHunk(const char* path) {
+  const CdMappedFile* f = map(path);
+  if (!f) return false;
+  hunks = new CdHunkReader();
+  return hunks->open(f->base, f->size, tracks, num_track);
+}
+
+
+bool CdImage::addTrack(const CdMappedFile* f, CDTrack number, const char* mode) {
+  if (!f || num_track >= MAX_TRACK) return false;
+
+  CdImageTrack& t = tracks[num_track];
+  memset(&t, 0, sizeof(t));
+  t.number = number;
+  t.begin  = -1;
+  t.start  = -1;
+
+  if (strcmp(mode, "AUDIO") == 0) {
+    t.format = TRACK_FORMAT_AUDIO;
+    t.sector_size = 2352;
+  } else if (strcmp(mode, "MODE1/2048") == 0) {
+    t.format = TRACK_FORMAT_DATA;
+    t.sector_size = 2048;
+  } else if (strcmp(mode, "MODE1/2352") == 0) {
+    t.format = TRACK_FORMAT_DATA;
+    t.sector_size = 2352;
+    t.data_offset = 16;
+  } else if (strcmp(mode, "MODE2/2336") == 0) {
+    t.format = TRACK_FORMAT_XA;
+    t.sector_size = 2336;
+    t.data_offset = 8;
+  } else if (strcmp(mode, "MODE2/2352") == 0) {
+    t.format = TRACK_FORMAT_XA;
+    t.sector_size = 2352;
+    t.data_offset = 24;
+  } else if (strcmp(mode, "CDI/2352") == 0) {
+    t.format = TRACK_FORMAT_CDI;
+    t.sector_size = 2352;
+    t.data_offset = 24;
+  } else {
+    warn("CUE unsupported track mode %s\n", mode);
+    return false;
+  }
+  ++num_track;
+  return true;
+}
+
+
+// 解析时 begin/start 是文件中的帧位置, 文件结束后换算为光盘位置
+bool CdImage::finishFile(const CdMappedFile* f, int first, CdLsn& disc_lsn) {
+  u64 byte = 0;
+
+  for (int i = first; i < num_track; ++i) {
+    CdImageTrack& t = tracks[i];
+    if (t.start < t.begin || t.begin < 0) {
+      error("CUE track %d has no INDEX 01\n", t.number);
+      return false;
+    }
+    // 同一文件中轨道的扇区长度可能不同, 按轨道累加字节位置
+    if (i == first) {
+      byte = u64(t.begin) * t.sector_size;
+    }
+
+    CdLsn frames;
+    if (i + 1 < num_track) {
+      frames = tracks[i + 1].begin - t.begin;
+    } else {
+      frames = byte < f->size ? CdLsn((f->size - byte) / t.sector_size) : 0;
+    }
+    if (frames <= 0 || byte + u64(frames) * t.sector_size > f->size) {
+      error("CUE track %d out of file\n", t.number);
+      return false;
+    }
+
+    const CdLsn index1 = t.start - t.begin;
+    t.data  = f->base + byte;
+    t.begin = disc_lsn;
+    t.start = disc_lsn + t.pregap + index1;
+    t.end   = disc_lsn + t.pregap + frames;
+    disc_lsn = t.end;
+    byte += u64(frames) * t.sector_size;
+  }
+  return true;
+}
+
+
+bool CdImage::parseCue(const char* path) {
+  FILE* fp = fopen(path, "r");
+  if (!fp) return false;
+
+  // FILE 中的路径相对于 cue 文件
+  char dir[CD_PATH_MAX] = "";
+  const char* slash = strrchr(path, '/');
+  const char* bslash = strrchr(path, '\\');
+  if (bslash > slash) slash = bslash;
+  if (slash && size_t(slash - path + 1) < sizeof(dir)) {
+    memcpy(dir, path, slash - path + 1);
+    dir[slash - path + 1] = 0;
+  }
+
+  const CdMappedFile* file = 0;
+  int file_first = 0;
+  CdLsn disc_lsn = 0;
+  bool ok = true;
+  char line[CD_PATH_MAX];
+
+  while (ok && fgets(line, sizeof(line), fp)) {
+    char cmd[16] = "", arg1[32] = "", arg2[32] = "";
+    if (sscanf(line, " %15s %31s %31s", cmd, arg1, arg2) < 1) continue;
+
+    if (strcmp(cmd, "FILE") == 0) {
+      if (file) ok = finishFile(file, file_first, disc_lsn);
+      // 文件名可能带空格, 取引号之间的内容
+      char name[CD_PATH_MAX];
+      const char* q1 = strchr(line, '"');
+      const char* q2 = q1 ? strchr(q1 + 1, '"') : 0;
+      if (q1 && q2) {
+        snprintf(name, sizeof(name), "%s%.*s", dir, int(q2 - q1 - 1), q1 + 1);
+      } else {
+        snprintf(name, sizeof(name), "%s%s", dir, arg1);
+      }
+      file = map(name);
+      file_first = num_track;
+      ok = ok && file;
+    }
+    else if (strcmp(cmd, "TRACK") == 0) {
+      ok = addTrack(file, CDTrack(atoi(arg1)), arg2);
+    }
+    else if (strcmp(cmd, "INDEX") == 0 && num_track > file_first) {
+      CdImageTrack& t = tracks[num_track - 1];
+      CdLsn frames;
+      ok = parse_msf(arg2, frames);
+      if (atoi(arg1) == 0) {
+        t.begin = frames;
+      } else if (atoi(arg1) == 1) {
+        t.start = frames;
+        if (t.begin < 0) t.begin = frames;
+      }
+    }
+    else if (strcmp(cmd, "PREGAP") == 0 && num_track > file_first) {
+      ok = parse_msf(arg1, tracks[num_track - 1].pregap);
+    }
+  }
+  fclose(fp);
+
+  if (ok && file) ok = finishFile(file, file_first, disc_lsn);
+  return ok && num_track > 0;
+}
+
+
+CDTrack CdImage::first() {
+  return num_track ? tracks[0].number : 0;
+}
+
+
+CDTrack CdImage::count() {
+  return CDTrack(num_track);
+}
+
+
+CdLsn CdImage::lastLsn() {
+  return num_track ? tracks[num_track - 1].end - 1 : -1;
+}
+
+
+const CdImageTrack* CdImage::track(CDTrack n) {
+  for (int i = 0; i < num_track; ++i) {
+    if (tracks[i].number == n) return &tracks[i];
+  }
+  return 0;
+}
+
+
+const CdImageTrack* CdImage::find(CdLsn lsn) {
+  for (int i = 0; i < num_track; ++i) {
+    if (lsn >= tracks[i].begin && lsn < tracks[i].end) return &tracks[i];
+  }
+  return 0;
+}
+
+
+const u8* CdImage::sector(CdLsn lsn, const CdImageTrack** pt) {
+  const CdImageTrack* t = find(lsn);
+  if (!t) return 0;
+  if (pt) *pt = t;
+
+  const CdLsn i = lsn - t->begin - t->pregap;
+  if (i < 0) return zero_sector;
+  if (hunks) return 0;
+  return t->data + size_t(i) * t->sector_size;
+}
+
+
+bool CdImage::read(CdLsn lsn, u8* out, const CdImageTrack** pt) {
+  const CdImageTrack* t = find(lsn);
+  if (!t) return false;
+  if (pt) *pt = t;
+
+  const CdLsn i = lsn - t->begin - t->pregap;
+  if (i < 0) {
+    memset(out, 0, t->sector_size);
+    return true;
+  }
+  if (hunks) return hunks->read(t->first_sector + i, out, t->sector_size);
+  memcpy(out, t->data + size_t(i) * t->sector_size, t->sector_size);
+  return true;
+}
+
+
+const u8* CdImage::data(CdLsn lsn) {
+  const CdImageTrack* t;
+  const u8* p = sector(lsn, &t);
+  if (!p || t->format == TRACK_FORMAT_AUDIO) return 0;
+  return p + t->data_offset;
+}
+
+
+bool CdImage::trackMsf(CDTrack n, CdMsf* r) {
+  const CdImageTrack* t = track(n);
+  if (!t) return false;
+  const u32 f = t->start + CD_MSF_LSN_OFFSET;
+  r->m = to_bcd(f / (CD_FRAMES_PER_SEC * 60));
+  r->s = to_bcd((f / CD_FRAMES_PER_SEC) % 60);
+  r->f = to_bcd(f % CD_FRAMES_PER_SEC);
+  return true;
+}
+
+}
@@ -20,6 +20,16 @@ namespace ps1e {
   }
 #endif
 
+// 命令两个阶段之间的平均延迟, 约 1.5ms
+#define CD_STAGE_CYCLES     0xC4E1
+// 新命令或中断应答后, 控制器开始处理的延迟
+#define CD_KICK_CYCLES      0x400
+// 寻道至少 3ms, 从内圈到外圈约 1 秒
+#define CD_SEEK_CYCLES      (SYSTEM_CLOCK_FREQ / 300)
+#define CD_SEEK_PER_SECTOR  100
+// 快速模式下两个扇区的最小间隔, 中断应答之前不会发送下一个扇区
+#define CD_FAST_SECTOR      (SYSTEM_CLOCK_FREQ / 1200)
+
 static const u8 PARM_EMPTY    = 1;
 static const u8 PARM_NON_EMP  = 0;
 static const u8 PARM_FULL     = 0;
@@ -144,13 +154,178 @@ void CdMsf::next_section() {
 }
 
 
-CdDrive::CdDrive() : cd(0), first_track(0), num_track(0), offset(-1) {
+// 扇区预读缓存, 后台线程读取当前位置之后的扇区,
+// 光盘镜像在网络或压缩卷上时, 读取不会阻塞模拟器.
+class CdReadAhead {
+private:
+  static const int SLOTS    = 32;
+  static const int PREFETCH = 16;
+
+  struct Slot {
+    CdLsn lsn;
+    bool ok;
+    u8 data[CdDrive::DATA_BUF_SIZE];
+  };
+
+  CdDrive& drive;
+  Slot slots[SLOTS];
+  u8 tmp[CdDrive::DATA_BUF_SIZE];
+  // 预读从 target 开始, 每次 seek 跳出窗口时 generation 增加
+  CdLsn target;
+  u32 generation;
+  bool enabled;
+  bool running;
+
+  // 保护 slots 与预读位置
+  std::mutex lock;
+  // 同一时间只有一个线程访问 cdio
+  std::mutex io;
+  std::condition_variable wake;
+  std::condition_variable ready;
+  std::thread th;
+
+  Slot& slot(CdLsn lsn) {
+    return slots[lsn % SLOTS];
+  }
+
+  // 返回窗口中第一个没有缓存的扇区, 没有则返回 -1
+  CdLsn missing() {
+    if (!enabled || target < 0) return -1;
+    for (CdLsn i = target; i < target + PREFETCH; ++i) {
+      if (i > drive.last_lsn) break;
+      if (slot(i).lsn != i) return i;
+    }
+    return -1;
+  }
+
+  void invalidate() {
+    for (int i = 0; i < SLOTS; ++i) {
+      slots[i].lsn = -1;
+    }
+  }
+
+  void move_to(CdLsn lsn) {
+    // 顺序读取时窗口向前滑动, 否则放弃正在进行的读取
+    if (lsn < target || lsn >= target + PREFETCH) {
+      ++generation;
+    }
+    target = lsn;
+    wake.notify_one();
+  }
+
+  void worker() {
+    info("CD-ROM Read ahead Thread ID: %x\n", this_thread_id());
+    std::unique_lock<std::mutex> lk(lock);
+
+    while (running) {
+      CdLsn next = missing();
+      if (next < 0) {
+        wake.wait(lk);
+        continue;
+      }
+
+      const u32 gen = generation;
+      lk.unlock();
+      bool ok;
+      {
+        std::lock_guard<std::mutex> _io(io);
+        ok = enabled && drive.readSector(next, tmp);
+      }
+      lk.lock();
+
+      // seek 取消了这次读取
+      if (gen != generation || !enabled) continue;
+      Slot& s = slot(next);
+      s.lsn = next;
+      s.ok = ok;
+      memcpy(s.data, tmp, sizeof(tmp));
+      ready.notify_all();
+    }
+  }
+
+public:
+  CdReadAhead(CdDrive& d) : drive(d), target(-1), generation(0), 
+      enabled(false), running(true) 
+  {
+    invalidate();
+    th = std::thread(&CdReadAhead::worker, this);
+  }
+
+  ~CdReadAhead() {
+    {
+      std::lock_guard<std::mutex> _lk(lock);
+      running = false;
+      wake.notify_one();
+    }
+    th.join();
+  }
+
+  void start() {
+    std::lock_guard<std::mutex> _lk(lock);
+    invalidate();
+    target = -1;
+    enabled = true;
+  }
+
+  // 返回后不会再有线程访问光盘
+  void stop() {
+    {
+      std::lock_guard<std::mutex> _lk(lock);
+      enabled = false;
+      ++generation;
+      invalidate();
+      ready.notify_all();
+    }
+    std::lock_guard<std::mutex> _io(io);
+  }
+
+  void seek(CdLsn lsn) {
+    std::lock_guard<std::mutex> _lk(lock);
+    move_to(lsn);
+  }
+
+  // 其他线程直接访问光盘时持有
+  std::mutex& ioLock() {
+    return io;
+  }
+
+  bool read(CdLsn lsn, void* buf) {
+    // 超出光盘范围的扇区不会被预读
+    if (lsn < 0 || lsn > drive.last_lsn) {
+      std::lock_guard<std::mutex> _io(io);
+      return drive.readSector(lsn, buf);
+    }
+
+    std::unique_lock<std::mutex> lk(lock);
+    move_to(lsn);
+    Slot& s = slot(lsn);
+
+    if (s.lsn != lsn) {
+      cddbg("CD read ahead miss %d\n", lsn);
+      // 预读线程总是先读取 target, 等待它完成
+      ready.wait(lk, [&] { return s.lsn == lsn || !enabled; });
+      if (!enabled) return false;
+    }
+
+    memcpy(buf, s.data, sizeof(s.data));
+    const bool ok = s.ok;
+    // 失败的扇区下次重新读取
+    if (!ok) s.lsn = -1;
+    move_to(lsn + 1);
+    return ok;
+  }
+};
+
+
+CdDrive::CdDrive() : cd(0), first_track(0), num_track(0), offset(-1), last_lsn(-1), user(0) {
   cdio_loglevel_default = CDIO_LOG_DEBUG; 
+  ahead = new CdReadAhead(*this);
 }
 
 
 CdDrive::~CdDrive() {
   releaseDisk();
+  delete ahead;
 }
 
 
@@ -160,11 +335,13 @@ bool CdDrive::loadDisk(CDIO c) {
     cd = c;
     first_track = cdio_get_first_track_num(cd);
     num_track   = cdio_get_num_tracks(cd); 
+    last_lsn    = cdio_get_disc_last_lsn(cd);
 
     printf("CD-ROM Track (%i - %i)\n", first_track, num_track);
     for (CDTrack i = first_track; i <= num_track; ++i) {
       printf("\tTrack %d - %s\n", i, trackFormatStr(cdio_get_track_format(cd, i)));
     }
+    ahead->start();
     return true;
   }
   error("Cannot open CDROM\n");
@@ -173,15 +350,23 @@ bool CdDrive::loadDisk(CDIO c) {
 
 
 void CdDrive::releaseDisk() {
+  if (user) user->diskReleasing();
   if (cd) {
+    ahead->stop();
     cdio_destroy(cd);
     cd = 0;
   }
+  image.close();
+}
+
+
+void CdDrive::setUser(ICdDriveUser* u) {
+  user = u;
 }
 
 
 bool CdDrive::hasDisk() {
-  return cd != 0;
+  return cd != 0 || image.isOpen();
 }
 
 
@@ -192,14 +377,33 @@ bool CdDrive::loadPhysical(const char* src) {
 }
 
 
+// 优先直接映射镜像文件, 不支持的格式交给 libcdio
 bool CdDrive::loadImage(const char* path) {
   cddbg("Open virtual CDROM image from %s\n", path);
+  releaseDisk();
+
+  if (image.open(path)) {
+    first_track = image.first();
+    num_track   = image.count();
+    last_lsn    = image.lastLsn();
+
+    printf("CD-ROM Track (%i - %i)\n", first_track, num_track);
+    for (CDTrack i = first_track; i < end(); ++i) {
+      printf("\tTrack %d - %s\n", i, trackFormatStr(getTrackFormat(i)));
+    }
+    return true;
+  }
+
   ::CdIo_t *p_cdio = cdio_open_bincue(path);
   return loadDisk(p_cdio);
 }
 
 
 int CdDrive::getTrackFormat(CDTrack track) {
+  if (image.isOpen()) {
+    const CdImageTrack* t = image.track(track);
+    return t ? t->format : TRACK_FORMAT_ERROR;
+  }
   return cdio_get_track_format(cd, track);
 }
 
@@ -234,28 +438,176 @@ CDTrack CdDrive::end() {
 
 
 bool CdDrive::getTrackMsf(CDTrack t, CdMsf *r) {
+  if (image.isOpen()) {
+    return image.trackMsf(t, r);
+  }
   return cdio_get_track_msf(cd, t, reinterpret_cast<msf_t*>(r));
 }
 
 
+CdLsn CdDrive::position() {
+  return offset;
+}
+
+
 bool CdDrive::seek(const CdMsf* s) {
   // CDIO_INVALID_LSN
   offset = cdio_msf_to_lsn(reinterpret_cast<const msf_t*>(s));
-  return offset != CDIO_INVALID_LSN;
+  if (offset == CDIO_INVALID_LSN) return false;
+  // 预读跟随寻道目标
+  ahead->seek(offset);
+  return true;
 }
 
 
 bool CdDrive::readAudio(void* buf) {
-  driver_return_code_t r = cdio_read_audio_sector(cd, buf, offset);
+  return readAudio(offset, buf);
+}
+
+
+bool CdDrive::readAudio(CdLsn lsn, void* buf) {
+  if (image.isOpen()) {
+    const CdImageTrack* t;
+    return image.read(lsn, (u8*) buf, &t) && t->sector_size == AUDIO_BUF_SIZE;
+  }
+  if (!cd) return false;
+  std::lock_guard<std::mutex> _io(ahead->ioLock());
+  driver_return_code_t r = cdio_read_audio_sector(cd, buf, lsn);
   if (r) message("ReadAudio", r);
   return r == 0;
 }
 
 
-// mode2[true=M2RAW_SECTOR_SIZE(2336), false=CDIO_CD_FRAMESIZE(2048)]
+CdLsn CdDrive::trackEnd(CdLsn lsn) {
+  if (image.isOpen()) {
+    const CdImageTrack* t = image.find(lsn);
+    return t ? t->end : last_lsn + 1;
+  }
+  for (CDTrack i = first(); i < end(); ++i) {
+    CdMsf m;
+    if (!getTrackMsf(i, &m)) continue;
+    const CdLsn s = cdio_msf_to_lsn(reinterpret_cast<const msf_t*>(&m));
+    if (s > lsn) return s;
+  }
+  return last_lsn + 1;
+}
+
+
+bool CdDrive::trackOf(CdLsn lsn, CDTrack& track, u8& index, CdLsn& start) {
+  if (image.isOpen()) {
+    const CdImageTrack* t = image.find(lsn);
+    if (!t) return false;
+    track = t->number;
+    index = lsn < t->start ? 0 : 1;
+    start = t->start;
+    return true;
+  }
+  bool found = false;
+  for (CDTrack i = first(); i < end(); ++i) {
+    CdMsf m;
+    if (!getTrackMsf(i, &m)) continue;
+    const CdLsn s = cdio_msf_to_lsn(reinterpret_cast<const msf_t*>(&m));
+    if (s > lsn) break;
+    track = i;
+    start = s;
+    found = true;
+  }
+  index = 1;
+  return found;
+}
+
+
 bool CdDrive::readData(void* buf) {
   cddbg("CD READ data lsn %d\n", offset);
-  driver_return_code_t r = cdio_read_mode2_sector(cd, buf, offset, false);
+  if (image.isOpen()) {
+    const u8* p = image.data(offset);
+    const CdImageTrack* t;
+    // 压缩镜像没有映射, 复制整个扇区
+    if (!p && image.read(offset, sector_buf, &t) && t->format != TRACK_FORMAT_AUDIO) {
+      p = sector_buf + t->data_offset;
+    }
+    if (!p) {
+      error("CD-Drive ReadData: bad sector %d\n", offset);
+      return false;
+    }
+    memcpy(buf, p, DATA_BUF_SIZE);
+    return true;
+  }
+  if (!cd) return false;
+  return ahead->read(offset, buf);
+}
+
+
+const u8* CdDrive::mapData() {
+  return image.isOpen() ? image.data(offset) : 0;
+}
+
+
+const u8* CdDrive::mapSector(u16* size) {
+  const CdImageTrack* t;
+  const u8* p = image.isOpen() ? image.sector(offset, &t) : 0;
+  if (p) *size = t->sector_size;
+  return p;
+}
+
+
+const u8* CdDrive::subHeader() {
+  static const u8 sync[12] = { 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0 };
+  u16 size;
+  const u8* p = mapSector(&size);
+  const CdImageTrack* t;
+  if (!p && image.isOpen() && image.read(offset, sector_buf, &t)) {
+    p = sector_buf;
+    size = t->sector_size;
+  }
+  if (p) {
+    switch (size) {
+      case AUDIO_BUF_SIZE:
+        // 同步头之后的扇区头, 第 4 字节是模式
+        return (p[15] == 2 && memcmp(p, sync, sizeof(sync)) == 0) ? p + 16 : 0;
+      case MODE2_BUF_SIZE:
+        return p;
+    }
+    return 0;
+  }
+  if (!cd) return 0;
+  std::lock_guard<std::mutex> _io(ahead->ioLock());
+  if (cdio_read_mode2_sector(cd, mode2, offset, true)) return 0;
+  return mode2;
+}
+
+
+void CdDrive::sectorHeader(u8* out) {
+  // 2048 字节的镜像没有子头, 当作 form1 数据扇区
+  static const u8 form1[4] = { 0, 0, 0x08, 0 };
+  u16 size = 0;
+  const u8* p = mapSector(&size);
+  const CdImageTrack* t;
+  if (!p && image.isOpen() && image.read(offset, sector_buf, &t)) {
+    p = sector_buf;
+    size = t->sector_size;
+  }
+  // 原始扇区的 12 字节同步头之后是扇区头和子头
+  if (p && size == AUDIO_BUF_SIZE) {
+    memcpy(out, p + 12, 8);
+    return;
+  }
+
+  CdMsf m;
+  cdio_lsn_to_msf(offset, reinterpret_cast<msf_t*>(&m));
+  out[0] = m.m;
+  out[1] = m.s;
+  out[2] = m.f;
+  out[3] = 2;
+  // mode2 镜像的扇区从子头开始
+  const u8* sub = p ? (size == MODE2_BUF_SIZE ? p : 0) : subHeader();
+  memcpy(out + 4, sub ? sub : form1, 4);
+}
+
+
+// mode2[true=M2RAW_SECTOR_SIZE(2336), false=CDIO_CD_FRAMESIZE(2048)]
+bool CdDrive::readSector(CdLsn lsn, void* buf) {
+  driver_return_code_t r = cdio_read_mode2_sector(cd, buf, lsn, false);
   if (r) message("ReadData", r);
   return r == 0;
 }
@@ -310,10 +662,10 @@ public:
 };
 
 
-CdromFifo::CdromFifo(u8 len16bit) : len(0x10 * len16bit) {
-  reset();
+CdromFifo::CdromFifo(u8 len16bit) : pread(0), pwrite(0), len(0x10 * len16bit) {
   d = new u8[len];
   memset(d, 0, len);
+  reset();
 }
 
 
@@ -323,37 +675,94 @@ CdromFifo::~CdromFifo() {
 
 
 void CdromFifo::reset() {
-  pread = 0;
-  pwrite = 0;
+  ext = 0;
+  pread.store(0, std::memory_order_relaxed);
+  pwrite.store(0, std::memory_order_release);
 }
 
 
 u8 CdromFifo::read() {
-  u8 v = d[pread % len];
-  pread++;
+  const u8* p;
+  if (!peek(p, 1)) return 0;
+  const u8 v = *p;
+  consume(1);
   return v;
 }
 
 
+u32 CdromFifo::read(u8* out, u32 n) {
+  u32 total = 0;
+  const u8* p;
+  // 环形缓冲区回绕时最多分两段
+  while (total < n) {
+    const u32 c = peek(p, n - total);
+    if (!c) break;
+    memcpy(out + total, p, c);
+    consume(c);
+    total += c;
+  }
+  return total;
+}
+
+
+u32 CdromFifo::peek(const u8*& p, u32 max) {
+  const u32 r = pread.load(std::memory_order_relaxed);
+  const u32 w = pwrite.load(std::memory_order_acquire);
+  u32 n = w - r;
+  if (ext) {
+    p = ext + r;
+  } else {
+    const u32 i = r % len;
+    p = d + i;
+    if (n > len - i) n = len - i;
+  }
+  return n < max ? n : max;
+}
+
+
+void CdromFifo::consume(u32 n) {
+  pread.store(pread.load(std::memory_order_relaxed) + n, std::memory_order_release);
+}
+
+
 void CdromFifo::write(u8 v) {
-  d[pwrite % len] = v;
-  pwrite++;
+  const u32 w = pwrite.load(std::memory_order_relaxed);
+  if (w - pread.load(std::memory_order_acquire) >= len) return;
+  d[w % len] = v;
+  pwrite.store(w + 1, std::memory_order_release);
 }
 
 
 bool CdromFifo::isEmpty() {
-  return pread == pwrite;
+  return size() == 0;
 }
 
 
 bool CdromFifo::isFull() {
-  return (pread + len) == pwrite;
+  return size() >= len;
+}
+
+
+u32 CdromFifo::size() {
+  return pwrite.load(std::memory_order_acquire) - pread.load(std::memory_order_acquire);
 }
 
 
-volatile s32& CdromFifo::getWriter(u8*& p) {
-  p = d;
-  return pwrite;
+u8* CdromFifo::writer() {
+  reset();
+  return d;
+}
+
+
+void CdromFifo::commit(u32 n) {
+  pwrite.store(pwrite.load(std::memory_order_relaxed) + n, std::memory_order_release);
+}
+
+
+void CdromFifo::attach(const u8* p, u32 size) {
+  ext = p;
+  pread.store(0, std::memory_order_relaxed);
+  pwrite.store(size, std::memory_order_release);
 }
 
 
@@ -436,7 +845,7 @@ void CDROM_REG::write1(u8 v) {
       cddbg("CD-ROM w 1f801801(8) CMD %08x\n", v);
       p.cmdfifo->push(v);
       p.s_busy = 1;
-      p.recovery_processing->notify_all();
+      p.kick();
       break;
 
     case 1: // 声音映射数据输出
@@ -512,7 +921,7 @@ void CDROM_REG::write3(u8 v) {
         cddbg("CD-rom clear param fifo\n");
         p.clearParmFifo();
       }
-      p.recovery_processing->notify_all();
+      p.kick();
       break;
 
     case 2:
@@ -531,24 +940,25 @@ void CDROM_REG::write3(u8 v) {
 }
 
 
-CDrom::CDrom(Bus& b, CdDrive& d) 
-: DMADev(b, DeviceIOMapper::dma_cdrom_base), thread_running(true),
+CDrom::CDrom(Bus& b, CdDrive& d, TimerSystem& ts) 
+: DMADev(b, DeviceIOMapper::dma_cdrom_base), sched(ts.scheduler()),
   bus(b), drive(d), reg(*this, b), response(1), param(4), data(0x96),
-  th(0), irq_flag(0), cmdfifo(0), for_processor(0), recovery_processing(0)
+  irq_flag(0), cmdfifo(0), stage_due(0), speed(CdSpeed::native),
+  speed_multiple(1), saved_cycles(0), audio_out(0), player(*this, d, sched)
 {
-  th = new std::thread(&CDrom::command_processor, this);
   for_read = new std::mutex();
   cmdfifo = new CDCommandFifo();
-  for_processor = new std::mutex();
-  recovery_processing = new std::condition_variable();
   s_busy = 0;
+  drive.setUser(this);
 }
 
 
 CDrom::~CDrom() {
-  thread_running = false;
-  th->join();
-  delete th;
+  if (saved_cycles) {
+    info("CD-ROM speed policy saved %.2fs\n", double(saved_cycles) / SYSTEM_CLOCK_FREQ);
+  }
+  drive.setUser(0);
+  sched.cancel(this);
   delete for_read;
   delete cmdfifo;
 }
@@ -585,6 +995,7 @@ u8 CDrom::pop_param() {
 void CDrom::setFilter(u8 _file, u8 _channel) {
   file = _file;
   channel = _channel;
+  xa.reset();
 }
 
 
@@ -645,6 +1056,7 @@ void CDrom::setLoc(u8 m, u8 s, u8 f) {
 
 void CDrom::syncDriveLoc() {
   drive.seek(&loc);
+  xa.reset();
 }
 
 
@@ -672,17 +1084,68 @@ void CDrom::moveNextTrack() {
 
 void CDrom::readSectionData() {
   cddbg("\rCD LSF [%02x:%02x:%02x] ", loc.m, loc.s, loc.f);
-  //data.reset();
-  u8* writer;
-  volatile s32& wsize = data.getWriter(writer);
-  drive.readData(writer);
-  wsize = 2048;
-  //TODO: 正确读取扇区头
-  if (attr.read) {
-    memcpy(locL, writer, 8);
+  // 镜像已经映射到内存, 数据 FIFO 直接读取扇区
+  const u8* mapped = drive.mapData();
+  if (mapped) {
+    data.attach(mapped, CdDrive::DATA_BUF_SIZE);
   } else {
-    memcpy(locP, writer, 8);
+    u8* writer = data.writer();
+    if (drive.readData(writer)) {
+      data.commit(CdDrive::DATA_BUF_SIZE);
+    }
+  }
+  drive.sectorHeader(attr.read ? locL : locP);
+}
+
+
+// 镜像将被关闭, 数据 FIFO 不能继续引用映射的扇区
+void CDrom::diskReleasing() {
+  std::lock_guard<std::mutex> _lk(*for_read);
+  data.reset();
+}
+
+
+bool CDrom::playXaSector() {
+  if (!mode_to_spu) return false;
+  const u8* sub = drive.subHeader();
+  // 子模式 bit2:声音, bit6:实时
+  if (!sub || (sub[2] & 0x44) != 0x44) return false;
+  // 不匹配的声音扇区被丢弃, 也不发送给 CPU
+  if (mode_filter && (sub[0] != file || sub[1] != channel)) return true;
+  xa.decode(sub, apply, mute ? 0 : audio_out);
+  return true;
+}
+
+
+void CDrom::setAudioOutput(PcmRing* out) {
+  audio_out = out;
+}
+
+
+void CDrom::playAudio(CDTrack track) {
+  if (track) {
+    drive.getTrackMsf(track, &loc);
   }
+  syncDriveLoc();
+  player.play(drive.position());
+}
+
+
+void CDrom::scanAudio(s32 dir) {
+  player.scan(dir);
+}
+
+
+void CDrom::stopAudio() {
+  if (!player.isPlaying()) return;
+  cdio_lsn_to_msf(player.stop(), reinterpret_cast<msf_t*>(&loc));
+  drive.seek(&loc);
+  attr.play = 0;
+}
+
+
+bool CDrom::hasParam() {
+  return !param.isEmpty();
 }
 
 
@@ -706,49 +1169,92 @@ std::mutex* CDrom::readLock() {
 }
 
 
-void CDrom::command_processor() {
-  info("CD-ROM Thread ID: %x\n", this_thread_id());
-  std::unique_lock<std::mutex> lck(*for_processor);
-  CmdRef curr;
+void CDrom::setSpeed(CdSpeed s, u32 multiple) {
+  speed = s;
+  speed_multiple = multiple ? multiple : 1;
+}
 
-  while (thread_running) {
-    //TODO:待验证, 这里做了特殊处理... 没有响应 ReadN 的 irq1 而是直接发送 pause
-    // 用 nextCmdIsStop() 替换会导致异常读取
-    if (cmdfifo->nextIs(0x09)) {
-      curr.reset();
-      irq_flag = 0;
-    }
 
-    if (irq_flag) {
-      recovery_processing->wait_for(lck, std::chrono::milliseconds(1));
-      continue;
-    }
+u64 CDrom::savedCycles() {
+  return saved_cycles;
+}
 
-    if (curr) {
-      // 给 cpu 足够的周期检查 cdrom 状态, 当 cdrom 过快的响应命令, 
-      // cpu 甚至会认为 cdrom 没有变化! (导致重复发送 init 命令, 
-      // 或者 cpu 开始检测 cdrom 已经发送完成的事件)
-      //TODO: 相比固定时间, 最好等待某个信号, 或cpu周期, 等 cpu 启用中断?.
-      sleep(1);
 
-      s_busy = 1;
-      if (curr->docmd(*this)) {
-        curr.reset();
-      }
-      continue;
-    } else {
-      s_busy = 0;
-    }
+u32 CDrom::scale(u32 c, u32 fastest, bool count) {
+  u32 r = c;
+  switch (speed) {
+    case CdSpeed::native:
+      return c;
+    case CdSpeed::multiple:
+      r = c / speed_multiple;
+      break;
+    case CdSpeed::instant:
+      r = fastest;
+      break;
+  }
+  if (r < fastest) r = fastest;
+  if (count && r < c) saved_cycles += c - r;
+  return r;
+}
 
-    if (cmdfifo->has()) {
-      curr = cmdfifo->next();
-      s_busy = 1;
-      attr.clearerr();
-      continue;
-    } else {
-      recovery_processing->wait_for(lck, std::chrono::milliseconds(1));
+
+u32 CDrom::sectorCycles(bool delivered) {
+  return scale(SYSTEM_CLOCK_FREQ / (mode_speed ? 150 : 75), CD_FAST_SECTOR, delivered);
+}
+
+
+u32 CDrom::seekCycles() {
+  const CdLsn to = cdio_msf_to_lsn(reinterpret_cast<const msf_t*>(&loc));
+  const CdLsn from = drive.position();
+  if (to == CDIO_INVALID_LSN || from < 0) return scale(CD_SEEK_CYCLES, CD_KICK_CYCLES);
+  const u64 dist = to > from ? to - from : from - to;
+  const u64 c = CD_SEEK_CYCLES + dist * CD_SEEK_PER_SECTOR;
+  return scale(c < SYSTEM_CLOCK_FREQ ? u32(c) : SYSTEM_CLOCK_FREQ, CD_KICK_CYCLES);
+}
+
+
+void CDrom::kick() {
+  if (sched.pending(this)) return;
+  const u64 now = sched.cycles();
+  // 中断应答不会让下一阶段提前执行
+  sched.schedule(this, stage_due > now ? u32(stage_due - now) : CD_KICK_CYCLES);
+}
+
+
+u32 CDrom::onClock(u32 /*late*/) {
+  //TODO:待验证, 这里做了特殊处理... 没有响应 ReadN 的 irq1 而是直接发送 pause
+  // 用 nextCmdIsStop() 替换会导致异常读取
+  if (cmdfifo->nextIs(0x09)) {
+    curr.reset();
+    irq_flag = 0;
+  }
+
+  // 等待 CPU 应答中断, 应答时 kick() 重新调度
+  if (irq_flag) return 0;
+
+  if (curr) {
+    s_busy = 1;
+    curr->wait = CD_STAGE_CYCLES;
+    if (!curr->docmd(*this)) {
+      stage_due = sched.cycles() + curr->wait;
+      return curr->wait;
     }
+    curr.reset();
   }
+
+  if (cmdfifo->has()) {
+    curr = cmdfifo->next();
+    s_busy = 1;
+    attr.clearerr();
+    // 给 cpu 足够的周期检查 cdrom 状态, 当 cdrom 过快的响应命令, 
+    // cpu 甚至会认为 cdrom 没有变化! (导致重复发送 init 命令, 
+    // 或者 cpu 开始检测 cdrom 已经发送完成的事件)
+    stage_due = sched.cycles() + CD_STAGE_CYCLES;
+    return CD_STAGE_CYCLES;
+  }
+
+  s_busy = 0;
+  return 0;
 }
 
 
@@ -764,13 +1270,30 @@ void CDrom::dma_dev2ram_block(psmem addr, u32 bytesize, s32 inc) {
 
   u32 cnt = 0;
   do {
-    if (data.isEmpty()) readSectionData();
+    if (data.isEmpty()) {
+      readSectionData();
+      if (data.isEmpty()) {
+        error("CD-ROM DMA cannot read sector\n");
+        break;
+      }
+    }
 
-    while (cnt < bytesize && (!data.isEmpty())) {
-      bus.write8(addr, data.read());
+    // 一次取出 FIFO 中连续的数据, 对齐时按字写入内存
+    const u8* p;
+    const u32 n = data.peek(p, bytesize - cnt);
+    u32 i = 0;
+    if (inc > 0 && (addr & 3) == 0) {
+      for (; i + 4 <= n; i += 4) {
+        bus.write32(addr, p[i] | (p[i+1] << 8) | (p[i+2] << 16) | (u32(p[i+3]) << 24));
+        addr += 4;
+      }
+    }
+    for (; i < n; ++i) {
+      bus.write8(addr, p[i]);
       addr += inc;
-      ++cnt;
     }
+    data.consume(n);
+    cnt += n;
   } while(cnt < bytesize);
   //printf("CD rom DMA exit\n");
 }
@@ -1,6 +1,9 @@
 ﻿#pragma once 
 
 #include "bus.h"
+#include "time.h"
+#include "spu.h"
+#include <atomic>
 
 #define DEBUG_CDROM_INFO
 
@@ -11,6 +14,8 @@ namespace ps1e {
 
 class CDrom;
 class CDCommandFifo;
+class CdReadAhead;
+class CdImage;
 class ::std::thread;
 class ::std::mutex;
 class ::std::condition_variable;
@@ -75,6 +80,44 @@ union CdAudioCode {
 };
 
 
+// 光驱速度策略, 影响寻道和读取扇区的时间
+enum class CdSpeed {
+  native,     // 原始速度
+  multiple,   // N 倍速
+  instant,    // 立即完成寻道, 扇区以中断处理允许的最快速度到达
+};
+
+
+// XA-ADPCM 声音扇区解码器, 直接读取扇区, 不复制扇区数据.
+// 37800/18900Hz 的输出线性插值到 SPU_WORK_FREQ, 应用 CdSpuVol 后写入 SPU 的 CD 输入.
+class CdXaDecoder {
+public:
+  // 18 个声音组, 4bit 单声道时每组 8 个单元, 每单元 28 个采样
+  static const u32 GROUPS    = 18;
+  static const u32 MAX_FRAMES = GROUPS * 8 * 28;
+
+private:
+  // 每个声道前两个采样
+  s32 old[2];
+  s32 older[2];
+  // 插值位置, 以输入采样的 1/7 为单位
+  u32 phase;
+  // in[c][0] 是上一个扇区的最后一帧
+  s16 in[2][MAX_FRAMES + 1];
+  SmallBuf<PcmSample> out;
+
+  // 解码一个 128 字节的声音组, 采样追加到 in[c][1+n]
+  void decodeGroup(const u8* g, CdAudioCode code, u32& n);
+
+public:
+  CdXaDecoder();
+  void reset();
+  // sub 指向扇区的 8 字节子头, 之后是 18 个声音组. ring 为空只解码.
+  // 返回写入 ring 的帧数
+  u32 decode(const u8* sub, const CdSpuVol& vol, PcmRing* ring);
+};
+
+
 // 必须与 `struct msf_t` 二进制兼容
 struct CdMsf {
   u8 m, s, f;
@@ -135,24 +178,160 @@ union CdMode {
 #pragma pack(pop)
 
 
+// 只读映射的镜像文件
+struct CdMappedFile {
+  const u8* base;
+  u64 size;
+  void* handle;
+  void* mapping;
+};
+
+
+struct CdImageTrack {
+  CDTrack number;
+  int format;          // TRACK_FORMAT_*
+  u16 sector_size;     // 2352, 2336 或 2048
+  u16 data_offset;     // 2048 字节用户数据在扇区中的偏移
+  CdLsn begin;         // 轨道在光盘上的第一个扇区 (包括 INDEX 00)
+  CdLsn start;         // INDEX 01
+  CdLsn end;           // 轨道之后的第一个扇区
+  CdLsn pregap;        // [begin, begin+pregap) 不在文件中, 读出 0
+  const u8* data;      // begin+pregap 扇区在映射中的位置
+  u32 first_sector;    // 压缩镜像中 begin+pregap 扇区的序号
+};
+
+
+// 压缩镜像, 扇区按块 (hunk) 独立压缩, 每个扇区占 2352 字节.
+// 解压后的块保存在 LRU 缓存中, 后台线程预先解压下一块.
+class CdHunkReader {
+public:
+  static const int CACHE_SIZE   = 8;
+  static const u32 HUNK_SECTORS = 8;
+
+private:
+  struct Slot {
+    s32 hunk;
+    u32 tick;
+    u8* data;
+  };
+
+  const u8* base;
+  u64 size;
+  const void* index;
+  u32 num_hunks;
+  u32 num_sectors;
+  u32 hunk_sectors;
+  u32 hunk_bytes;
+  Slot slots[CACHE_SIZE];
+  u32 tick;
+  s32 want;
+  s32 busy;
+  bool running;
+  std::thread* th;
+  std::mutex* lock;
+  std::condition_variable* wake;
+  std::condition_variable* ready;
+
+  Slot* find(s32 hunk);
+  Slot* victim();
+  bool decode(u32 hunk, u8* out);
+  void worker();
+
+public:
+  CdHunkReader();
+  ~CdHunkReader();
+
+  // 解析压缩镜像头, 并填充轨道表
+  bool open(const u8* base, u64 size, CdImageTrack* tracks, int& num_track);
+  // 在锁内复制第 n 个扇区的前 len 字节到 out, 缓存块随后可以被其他线程替换
+  bool read(u32 n, u8* out, u32 len);
+  // 把 src 中所有轨道压缩到 dst 文件
+  static bool write(CdImage& src, const char* dst);
+};
+
+
+// 直接映射 BIN/CUE/ISO 镜像, 扇区以指针返回, 不经过 libcdio
+class CdImage {
+public:
+  static const int MAX_TRACK = 99;
+
+private:
+  CdMappedFile files[MAX_TRACK];
+  CdImageTrack tracks[MAX_TRACK];
+  int num_file;
+  int num_track;
+  CdHunkReader* hunks;
+
+  const CdMappedFile* map(const char* path);
+  bool parseCue(const char* path);
+  bool openHunk(const char* path);
+  bool single(const char* path, int format, u16 sector_size);
+  bool addTrack(const CdMappedFile*, CDTrack, const char* mode);
+  bool finishFile(const CdMappedFile*, int first, CdLsn& disc_lsn);
+
+public:
+  CdImage();
+  ~CdImage();
+
+  // 打开 .cue, .iso, .bin 或压缩的 .hunk, 失败返回 false
+  bool open(const char* path);
+  void close();
+  bool isOpen();
+  CDTrack first();
+  CDTrack count();
+  CdLsn lastLsn();
+  const CdImageTrack* track(CDTrack);
+  const CdImageTrack* find(CdLsn);
+  // 返回扇区数据, 长度是所在轨道的 sector_size, 失败或压缩镜像返回 NULL
+  const u8* sector(CdLsn, const CdImageTrack** t = 0);
+  // 复制扇区数据到 out, 长度是所在轨道的 sector_size, 支持所有镜像
+  bool read(CdLsn, u8* out, const CdImageTrack** t = 0);
+  // 返回扇区中 2048 字节的用户数据
+  const u8* data(CdLsn);
+  // 返回 BCD 格式的 INDEX 01 位置
+  bool trackMsf(CDTrack, CdMsf*);
+};
+
+
+// 光盘释放前通知使用者, 丢弃指向镜像内存的引用
+class ICdDriveUser {
+public:
+  virtual ~ICdDriveUser() {}
+  virtual void diskReleasing() = 0;
+};
+
+
 class CdDrive {
 public:
   static const int AUDIO_BUF_SIZE = 2352;
   static const int DATA_BUF_SIZE  = 2048;
+  static const int MODE2_BUF_SIZE = 2336;
 
 private:
   CDIO cd;
   CDTrack first_track;
   CDTrack num_track;
   CdLsn offset;
+  CdLsn last_lsn;
+  CdReadAhead* ahead;
+  CdImage image;
+  ICdDriveUser* user;
+  // 不是镜像时, 读取 mode2 扇区的缓冲区
+  u8 mode2[MODE2_BUF_SIZE];
+  // 压缩镜像不能映射, 读取子头时复制扇区的缓冲区
+  u8 sector_buf[AUDIO_BUF_SIZE];
 
   bool loadDisk(CDIO);
+  // 直接从光盘读取, 只由预读线程或缓存未命中时调用
+  bool readSector(CdLsn, void *buf);
 
 public:
   CdDrive();
   virtual ~CdDrive();
 
   void releaseDisk();
+  // 设置为 NULL 取消通知
+  void setUser(ICdDriveUser*);
   bool loadPhysical(const char* src);
   bool loadImage(const char* filepath);
   int getTrackFormat(CDTrack track);
@@ -161,11 +340,89 @@ public:
   CDTrack end();
   bool getTrackMsf(CDTrack, CdMsf*);
   bool seek(const CdMsf*);
+  // 当前读取位置
+  CdLsn position();
   // buf[AUDIO_BUF_SIZE]
   bool readAudio(void *buf);
+  // 读取任意位置的音频扇区, 不改变当前位置, 可以在其他线程调用
+  bool readAudio(CdLsn, void *buf);
+  // lsn 所在轨道之后的第一个扇区
+  CdLsn trackEnd(CdLsn);
+  // lsn 所在的轨道, 索引 (pregap 中为 0) 和轨道 INDEX 01 的位置, 不在任何轨道返回 false
+  bool trackOf(CdLsn lsn, CDTrack& track, u8& index, CdLsn& start);
   // buf[DATA_BUF_SIZE]
   bool readData(void *buf);
+  // 直接返回镜像中当前扇区的用户数据, 不支持时返回 NULL
+  const u8* mapData();
+  // 直接返回镜像中当前扇区, size 是扇区长度, 不支持时返回 NULL
+  const u8* mapSector(u16* size);
+  // 返回当前 mode2 扇区的子头, 之后是扇区数据, 不是 mode2 扇区返回 NULL
+  const u8* subHeader();
+  // 当前扇区的 8 字节扇区头 (BCD 位置, 模式, 子头), 镜像中没有时合成
+  void sectorHeader(u8* out);
   bool hasDisk();
+
+friend class CdReadAhead;
+};
+
+
+// CD-DA 播放. 后台线程把原始音频扇区预读到环形缓冲区, 主机 IO 缓慢时约有 1 秒的余量.
+// 模拟时钟每 1/75 秒取出一个扇区, 应用 CdSpuVol 后写入 SPU 的 CD 输入.
+class CdDaPlayer : public ClockEvent, public NonCopy {
+public:
+  static const u32 RING_SECTORS = 64;
+  // 每个扇区 588 帧 44100Hz 立体声
+  static const u32 FRAMES = 588;
+  // 快进/快退时每个扇区跳过的扇区数
+  static const s32 SCAN_STRIDE = 8;
+
+private:
+  CDrom& p;
+  CdDrive& drive;
+  ClockScheduler& sched;
+  u8* ring;
+  CdLsn lsns[RING_SECTORS];
+  // 下一个预读的扇区, 每次预读后加上 stride
+  CdLsn fetch;
+  s32 stride;
+  // 下一个播放的扇区
+  CdLsn pos;
+  CdLsn track_end;
+  u32 head;
+  u32 filled;
+  // restart() 放弃正在进行的预读
+  u32 generation;
+  bool active;
+  // 预读到达光盘边界
+  bool ended;
+  bool running;
+  // 播放时预读还没有完成, 输出静音的次数
+  u32 starve;
+  std::thread* th;
+  std::mutex* lock;
+  std::condition_variable* wake;
+  SmallBuf<PcmSample> out;
+
+  void worker();
+  void restart(CdLsn lsn, s32 stride);
+  void mix(const u8* sector);
+  void silence();
+  // 到达轨道或光盘结束, 停止并发送 INT4
+  u32 finish();
+  // Report 模式下每 10 个扇区发送一次 INT1
+  void report(CdLsn lsn, const u8* sector);
+
+public:
+  CdDaPlayer(CDrom&, CdDrive&, ClockScheduler&);
+  ~CdDaPlayer();
+
+  u32 onClock(u32 late) override;
+  void play(CdLsn from);
+  // 快进 dir=1, 快退 dir=-1
+  void scan(s32 dir);
+  // 返回下一个播放的扇区
+  CdLsn stop();
+  bool isPlaying();
 };
 
 
@@ -188,24 +445,39 @@ public:
 };
 
 
-//TODO: fix 当 pwrite 回绕到 0 逻辑错误
+// 单生产者/单消费者的无锁 FIFO, 写入者以 release 发布数据, 读取者以 acquire 获取.
+// reset/writer/attach 会移动读取位置, 只能在没有并发读取时调用.
 class CdromFifo {
 private:
   u8 *d;
-  volatile s32 pread;
-  volatile s32 pwrite;
-  const s32 len;
+  // 不为空时从外部缓冲区读取, 避免复制扇区
+  const u8 *ext;
+  std::atomic<u32> pread;
+  std::atomic<u32> pwrite;
+  const u32 len;
 
 public:
   // len16bit - 16字节的倍数
   CdromFifo(u8 len16bit);
   ~CdromFifo();
   void reset();
+  // 空时返回 0
   u8 read();
+  // 读取最多 n 字节, 返回读取的字节数
+  u32 read(u8* out, u32 n);
+  // 返回连续可读的字节数 (不超过 max), p 指向这些字节, 读取后调用 consume
+  u32 peek(const u8*& p, u32 max);
+  void consume(u32 n);
+  // 满时丢弃
   void write(u8);
   bool isEmpty();
   bool isFull();
-  volatile s32& getWriter(u8*&);
+  u32 size();
+  // 清空后返回写入缓冲区, 写入 n 字节后调用 commit(n)
+  u8* writer();
+  void commit(u32 n);
+  // 读取 p[0..size), 在 reset() 之前 p 必须有效
+  void attach(const u8* p, u32 size);
 };
 
 
@@ -214,6 +486,8 @@ class ICDCommand {
 protected:
   u8 id = 0;
   int stage = 0;
+  // 距离执行下一阶段的系统时钟, 默认为 CD_STAGE_CYCLES
+  u32 wait = 0;
   void setID(u8 _id) { id = _id; }
 
 public:
@@ -223,13 +497,16 @@ public:
   bool is(u8 _id) { return _id == id; }
 
 friend class CDCommandFifo;
+friend class CDrom;
 };
 
 
-class CDrom : public DMADev, public NonCopy {
+// 命令的各个阶段由 ClockScheduler 按模拟时钟推进, 在 CPU 线程上执行
+class CDrom : public DMADev, public ClockEvent, public ICdDriveUser, public NonCopy {
 private:
   Bus& bus;
   CdDrive& drive;
+  ClockScheduler& sched;
   CdSpuVol change;
   CdSpuVol apply;
 
@@ -246,7 +523,6 @@ private:
   u8 mode_to_spu;
   u8 mode_speed;
 
-  // 解决多线程冲突
   u8 s_index;
   u8 s_busy;
 
@@ -262,18 +538,28 @@ private:
   // 索引整个光盘, 绝对位置; 对于轨道/会话, 软件通过 GetTD 确定绝对位置.
   CdMsf loc;
 
-  bool thread_running;
-  std::thread* th;
+  // DMA 在自己的线程上读取扇区
   std::mutex* for_read;
-  std::mutex* for_processor;
-  std::condition_variable* recovery_processing;
-
   CDCommandFifo* cmdfifo;
+  std::shared_ptr<ICDCommand> curr;
+  // 当前阶段最早的执行时间
+  u64 stage_due;
+  CdSpeed speed;
+  u32 speed_multiple;
+  // 相比原始速度节省的系统时钟
+  u64 saved_cycles;
   CdromFifo response;
   CdromFifo param;
   CdromFifo data;
+  CdXaDecoder xa;
+  // SPU 的 CD 输入
+  PcmRing* audio_out;
+  CdDaPlayer player;
 
-  void command_processor();
+  // 有新命令或中断被应答, 继续推进命令
+  void kick();
+  // 按速度策略缩放原始时间, 不小于 fastest; count 为 false 不计入节省的时钟
+  u32 scale(u32 native, u32 fastest, bool count = true);
 
 protected:
   void dma_ram2dev_block(psmem addr, u32 bytesize, s32 inc) override;
@@ -289,9 +575,20 @@ public:
   u8 locP[8];
 
 public:
-  CDrom(Bus&, CdDrive&);
+  CDrom(Bus&, CdDrive&, TimerSystem&);
   ~CDrom();
 
+  u32 onClock(u32 late) override;
+  void diskReleasing() override;
+  // 按 setMode 的速度, 读取一个扇区的时钟 (75 或 150 扇区/秒),
+  // delivered 为 false 时没有送出扇区, 不计入节省的时钟
+  u32 sectorCycles(bool delivered = true);
+  // 从当前位置寻道到 setLoc 位置的时钟
+  u32 seekCycles();
+  // multiple 只在 CdSpeed::multiple 时使用
+  void setSpeed(CdSpeed s, u32 multiple = 2);
+  u64 savedCycles();
+
   bool nextCmdIsStop();
   void updateStatus();
   
@@ -312,6 +609,17 @@ public:
   void syncDriveLoc();
   void moveToFirstTrack();
   void readSectionData();
+  // 当前扇区是 XA-ADPCM 声音扇区时送到 SPU, 返回 true 则该扇区不作为数据发送
+  bool playXaSector();
+  // 连接 SPU 的 CD 输入
+  void setAudioOutput(PcmRing*);
+  // 播放 CD-DA, track 为 0 则从 setLoc 位置开始
+  void playAudio(CDTrack track);
+  // 快进 dir=1, 快退 dir=-1
+  void scanAudio(s32 dir);
+  // 停止播放, 读取位置移动到播放位置
+  void stopAudio();
+  bool hasParam();
   void moveNextTrack();
   bool dataIsEmpty();
   std::mutex* readLock();
@@ -320,6 +628,7 @@ public:
   bool hasDisk();
 
 friend class CDROM_REG;
+friend class CdDaPlayer;
 };
 
 }
\ No newline at end of file
@@ -18,8 +18,9 @@ DMADev::DMADev(Bus& _bus, DeviceIOMapper type0, bool ut) :
   bus.bind_io(type0 + 2, &ctrl_io);
   bus.set_dma_dev(this);
   for_work = new std::mutex();
-  work = new std::thread(&DMADev::transport_on_thread, this);
+  // 线程启动后立即等待 working_alert, 必须先创建
   working_alert = new std::condition_variable();
+  work = new std::thread(&DMADev::transport_on_thread, this);
 }
 
 
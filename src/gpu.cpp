@@ -1,8 +1,10 @@
 #include <stdexcept>
+#include <algorithm>
 #include <GLFW/glfw3.h>
 #include <thread>
 #include "gpu.h"
 #include "gpu_shader.h"
+#include "gpu_soft.h"
 
 namespace ps1e {
 
@@ -16,12 +18,18 @@ u32 textureAttr(GpuStatus& st, GpuTextFlip& flip) {
 }
 
 
-GPU::GPU(Bus& bus, TimerSystem& ts) : 
+GPU::GPU(Bus& bus, TimerSystem& ts, int scale) : 
     DMADev(bus, DeviceIOMapper::dma_gpu_base), status{0}, screen{0}, display{0},
-    gp0(*this), gp1(*this), cmd_respons(0), vram(1), ds(0), disp_hori{0},
+    gp0(*this), gp1(*this), cmd_respons(0), vram(scale), ds(0), disp_hori{0},
     disp_veri{0}, text_win{0}, draw_offset{0}, draw_tp_lf{0}, draw_bm_rt{0},
-    status_change_count(0), timer(ts)
+    status_change_count(0), timer(ts), soft(0), draw_seq(0), scanline(0), line_frac(0), clock_stopped(false),
+    field(0), pacing(false), skipping(false), skipped(0), max_skip(0),
+    pace_cycles(0), emu_frames(0), drawn_frame(0), shown_area{0}, shown_rgb24(false), realtime(true),
+    present(GpuPresent::vsync)
 {
+  if (scale < 1 || scale > 8) {
+    throw std::runtime_error("GPU scale must be 1~8");
+  }
   initOpenGL();
   reset();
 
@@ -29,6 +37,7 @@ GPU::GPU(Bus& bus, TimerSystem& ts) :
   bus.bind_io(DeviceIOMapper::gpu_gp1, &gp1);
 
   work = new std::thread(&GPU::gpu_thread, this);
+  timer.scheduler().schedule(this, onClock(0));
 }
 
 
@@ -52,25 +61,65 @@ void GPU::initOpenGL() {
   ds.setBlend(true);
 
   vram.init(screen);
-  frame = vram.size();
+  // 着色器按照原始分辨率计算坐标
+  frame = { 0, 0, VirtualFrameBuffer::Width, VirtualFrameBuffer::Height };
 
   // 必须释放 gl 上下文, 另一个线程才能绑定.
   glfwMakeContextCurrent(NULL);
 }
 
 
+// 调度器只能在 CPU 线程上访问, 析构可能在其他线程
 GPU::~GPU() {
+  if (!clock_stopped) {
+    error("GPU destroyed without stopClock()\n");
+  }
   glfwSetWindowShouldClose(glwindow, true);
   work->join();
   glfwDestroyWindow(glwindow);
   delete work;
+  delete soft;
   debug("GPU Destoryed\n");
 }
 
 
 void GPU::send(IDrawShape* s) {
+  if (skipping && s->primitive()) {
+    delete s;
+    return;
+  }
+  s->seq = ++draw_seq;
+  s->updateShadow(*this, shadow);
+
+  GpuCommandRecord r;
+  r.cmd = 0;
+  r.length = 0;
+  r.seq = s->seq;
+  r.shape = s;
+  r.written = s->written;
+  r.readback = s->readback;
+  push(r);
+}
+
+
+void GPU::send(GpuCommandRecord& r) {
+  if (skipping && GP0::primitive(r.cmd)) {
+    return;
+  }
+  r.seq = ++draw_seq;
+  r.shape = 0;
+  GP0::range(*this, r);
+  push(r);
+}
+
+
+void GPU::push(GpuCommandRecord& r) {
+  if (r.readback) {
+    shadow.touch(r.written, r.seq);
+  }
   std::lock_guard<std::recursive_mutex> guard(for_draw_queue);
-  draw_queue.push_back(s);
+  draw_queue.push_back(r);
+  gpu_wake.notify_one();
 }
 
 
@@ -80,58 +129,274 @@ void GPU::add(IGpuReadData* r) {
 }
 
 
-IDrawShape* GPU::pop_drawer() {
+// 交换后两个队列的容量都被保留, 稳定运行时不再分配内存
+void GPU::takeQueue(std::vector<GpuCommandRecord>& out) {
   std::lock_guard<std::recursive_mutex> guard(for_draw_queue);
-  if (draw_queue.size() == 0) {
-    return 0;
+  draw_queue.swap(out);
+}
+
+
+void GPU::drawQueue(GLVertexArrays& vao) {
+  takeQueue(drawing);
+  for (GpuCommandRecord& r : drawing) {
+    IDrawShape* sp = r.shape;
+    if (!(sp && sp->vramUpload())) {
+      upload.flush(vram);
+    }
+    enableDrawScope(true);
+    if (sp) {
+      sp->draw(*this, vao);
+      delete sp;
+    } else {
+      GP0::render(*this, vao, r);
+    }
+    shadow.drawn(r);
+    tcache.invalidate(r.written);
+    if (r.readback) {
+      vram.rendered(r.written);
+    }
   }
-  IDrawShape *sp = draw_queue.front();
-  draw_queue.pop_front();
-  return sp;
+  drawing.clear();
 }
 
 
+// 绘制不等待 vblank, 读显存的命令才能及时完成; 
+// 每个模拟帧结束后最多显示一次, 落后的帧被跳过.
 void GPU::gpu_thread() {
-  u32 frames = 0;
   glfwMakeContextCurrent(glwindow);
   GLVertexArrays vao;
+  stream_vbo.init(vao);
+  shadow.init();
+  vram.frameCapture().init();
+  tcache.init();
+  upload.init();
   info("GPU Thread ID:%x\n", this_thread_id());
 
+  u32 shown = emu_frames;
+  GpuPresent swap_mode = GpuPresent::none;
+
   while (!glfwWindowShouldClose(glwindow)) {
     vram.drawShape();
     ds.setSemiMode(status.abr);
-
-    IDrawShape *sp = pop_drawer();
-    while (sp) {
-      enableDrawScope(true);
-      sp->draw(*this, vao);
-      delete sp;
-      sp = pop_drawer();
+    drawQueue(vao);
+
+    if (emu_frames == shown) {
+      std::unique_lock<std::recursive_mutex> lk(for_draw_queue);
+      gpu_wake.wait_for(lk, std::chrono::milliseconds(16), [&] {
+        return draw_queue.size() || emu_frames != shown;
+      });
+      continue;
     }
+    shown = emu_frames;
     
+    upload.flush(vram);
     enableDrawScope(false);
+    vram.bindRead();
+    shadow.readback();
+    GpuDataRange disp;
+    bool rgb24;
+    {
+      std::lock_guard<std::recursive_mutex> lk(for_draw_queue);
+      disp  = shown_area;
+      rgb24 = shown_rgb24;
+    }
+    vram.capture(shown, disp, rgb24);
+
+    // 跳过的帧保留上一帧的画面
+    const GpuPresent mode = present;
+    if (mode == GpuPresent::none || drawn_frame != shown) {
+      continue;
+    }
+    if (mode != swap_mode) {
+      swap_mode = mode;
+      glfwSwapInterval(mode == GpuPresent::vsync ? 1 : 0);
+    }
     if (status.display == 0) {
       ds.viewport(&screen);
       vram.drawScreen();
     }
+    glfwSwapBuffers(glwindow);
+  }
+  upload.release();
+  tcache.release();
+  vram.frameCapture().release();
+  shadow.release();
+  stream_vbo.release();
+}
 
-    bus.send_irq(IrqDevMask::vblank);
-    //debug("SEND vblank\r");
 
-    // 480 模式每帧修改
-    if (status.height) {
-      status.lcf = ~status.lcf;
-    }
-    
+u32 GPU::onClock(u32 /*late*/) {
+  const bool pal = status.video;
+  const bool inter = status.isinter && status.height;
+  const u32 lines = (pal ? GPU_PAL_LINES : GPU_NTSC_LINES) - (inter ? field : 0);
+
+  timer.hblank(false);
+  timer.hblank(true);
+
+  if (++scanline >= lines) {
+    scanline = 0;
+  }
+
+  // 显示范围之外是 vblank, 范围无效时使用默认值
+  u32 top = disp_veri.x;
+  u32 bottom = disp_veri.y;
+  if (bottom <= top || bottom >= lines) {
+    top = 16;
+    bottom = pal ? 16 + 288 : 16 + 240;
+  }
+  if (scanline == bottom) {
+    vblankBegin();
+  } else if (scanline == top) {
     timer.vblank(false);
-    glfwSwapBuffers(glwindow);
-    timer.vblank(true);
-    //debug("\r\t\t\t\t\t\t%d, %f\r", ++frames, glfwGetTime());
+  }
+
+  // 交错时表示当前场, 否则每条扫描线切换
+  status.lcf = inter ? field : (scanline & 1);
+
+  // 按视频时钟与系统时钟的实际比例换算, 小数部分累积到下一行
+  const u64 freq = u64(pal ? GPU_PAL_VIDEO_FREQ : GPU_NTSC_VIDEO_FREQ) * 2;
+  line_frac += u64(pal ? GPU_PAL_LINE_HALF_VCLK : GPU_NTSC_LINE_HALF_VCLK) * SYSTEM_CLOCK_FREQ;
+  const u32 clk = u32(line_frac / freq);
+  line_frac %= freq;
+  return clk;
+}
 
-    if (s_irq && s_r_dma && s_r_cpu) {
-      bus.send_irq(IrqDevMask::gpu);
+
+void GPU::stopClock() {
+  timer.scheduler().cancel(this);
+  clock_stopped = true;
+}
+
+
+void GPU::vblankBegin() {
+  bus.send_irq(IrqDevMask::vblank);
+  timer.vblank(true);
+  field ^= 1;
+
+  if (s_irq && s_r_dma && s_r_cpu) {
+    bus.send_irq(IrqDevMask::gpu);
+  }
+
+  // 软件光栅化的显存只上传修改过的 tile, 按 tile 行合并
+  if (soft && !skipping) {
+    const u16* v = soft->vram();
+    for (u32 row = 0; row < SoftGpu::TileY; ++row) {
+      u32 x, w;
+      if (!soft->takeDirty(row, x, w)) continue;
+      const u32 y = row * SoftGpu::TileSize;
+      GP0::upload(*this, x, y, w, SoftGpu::TileSize, v + y * SoftGpu::Width + x, SoftGpu::Width);
     }
   }
+
+  if (!skipping) {
+    drawn_frame = emu_frames + 1;
+  }
+  {
+    // 显示寄存器由 cpu 线程写入, 在这里为 gpu 线程保存这一帧的副本
+    std::lock_guard<std::recursive_mutex> guard(for_draw_queue);
+    displayArea(status, display, disp_hori, disp_veri, shown_area);
+    shown_rgb24 = status.isrgb24;
+    ++emu_frames;
+    gpu_wake.notify_one();
+  }
+
+  u32 behind = 0;
+  if (realtime) {
+    behind = throttle();
+  } else {
+    pacing = false;
+  }
+
+  // 决定下一帧是否丢弃图元, 连续跳帧有上限, 画面不会停止更新
+  if (behind > GPU_SKIP_BEHIND_MS && skipped < max_skip) {
+    skipping = true;
+    ++skipped;
+  } else {
+    skipping = false;
+    skipped = 0;
+  }
+}
+
+
+u32 GPU::throttle() {
+  using namespace std::chrono;
+  const u64 cycles = timer.scheduler().cycles();
+  const auto now = steady_clock::now();
+  if (!pacing) {
+    pacing = true;
+    pace_cycles = cycles;
+    pace_wall = now;
+    return 0;
+  }
+
+  const auto emu = duration<double>(double(cycles - pace_cycles) / SYSTEM_CLOCK_FREQ);
+  const auto target = pace_wall + duration_cast<steady_clock::duration>(emu);
+  if (target > now) {
+    std::this_thread::sleep_until(target);
+    return 0;
+  }
+
+  const u32 behind = u32(duration_cast<milliseconds>(now - target).count());
+  if (behind > 100) {
+    // 落后太多时不再追赶, 从当前时间重新计时
+    pace_cycles = cycles;
+    pace_wall = now;
+  }
+  return behind;
+}
+
+
+void GPU::setRealtime(bool r) {
+  realtime = r;
+}
+
+
+void GPU::setPresent(GpuPresent p) {
+  present = p;
+}
+
+
+// 水平范围是视频时钟, 按点时钟分频换算为像素, 宽度按 4 像素对齐;
+// 范围无效时使用标准分辨率
+void GPU::displayArea(const GpuStatus& st, GpuRange10 display, GpuRange12 hori,
+                      GpuRange10 veri, GpuDataRange& r) {
+  static const u32 divider[4] = { 10, 8, 5, 4 };
+  static const u32 width[4]   = { 256, 320, 512, 640 };
+  const u32 div = st.width1 ? 7 : divider[st.width0];
+
+  u32 w = 0;
+  if (hori.y > hori.x) {
+    w = ((hori.y - hori.x) / div + 2) & ~3u;
+  }
+  if (w == 0) {
+    w = st.width1 ? 368 : width[st.width0];
+  }
+  u32 h = st.video ? 288 : 240;
+  if (veri.y > veri.x) {
+    h = veri.y - veri.x;
+  }
+  if (st.height && st.isinter) {
+    h <<= 1;
+  }
+  if (st.isrgb24) {
+    w = w * 3 / 2;
+  }
+
+  r.offx   = display.x;
+  r.offy   = display.y & (VirtualFrameBuffer::Height - 1);
+  r.width  = std::min(w, VirtualFrameBuffer::Width - r.offx) & ~1u;
+  r.height = std::min(h, VirtualFrameBuffer::Height - r.offy);
+}
+
+
+void GPU::setFrameSkip(u32 frames) {
+  max_skip = frames;
+}
+
+
+void GPU::useSoftware(bool enable, u32 threads) {
+  delete soft;
+  soft = enable ? new SoftGpu(threads) : 0;
 }
 
 
@@ -212,12 +477,30 @@ void GPU::updateDrawScope() {
   u32 y = draw_tp_lf.y;
   u32 w = draw_bm_rt.x - x;
   u32 h = draw_bm_rt.y - y;
-  ds.setScissor(x, y, w, h);
+  const int m = vram.scale();
+  ds.setScissor(x * m, y * m, w * m, h * m);
   ps1e_t::ext_stop = 1;
   printf("draw scope: %d,%d %d,%d", x, y, w, h);
 }
 
 
+void GPU::bindDrawTarget() {
+  vram.bindTarget();
+}
+
+
+void GPU::drawArea(GpuDataRange& r) {
+  if (draw_bm_rt.x < draw_tp_lf.x || draw_bm_rt.y < draw_tp_lf.y) {
+    r = { 0, 0, ShadowVram::Width, ShadowVram::Height };
+    return;
+  }
+  r.offx   = draw_tp_lf.x;
+  r.offy   = draw_tp_lf.y;
+  r.width  = draw_bm_rt.x - draw_tp_lf.x + 1;
+  r.height = draw_bm_rt.y - draw_tp_lf.y + 1;
+}
+
+
 //TODO: test
 void GPU::enableDrawScope(bool enable) {
   ds.setScissorEnable(enable);
@@ -225,7 +508,8 @@ void GPU::enableDrawScope(bool enable) {
 
 
 VirtualFrameBuffer::VirtualFrameBuffer(int _mul) : 
-    multiple(_mul), gsize{0, 0, Width * _mul, Height * _mul}, ds(0.03f), shader(0)
+    multiple(_mul), gsize{0, 0, Width * _mul, Height * _mul}, ds(0.03f), shader(0),
+    stale{0}
 {
 }
 
@@ -245,6 +529,14 @@ void VirtualFrameBuffer::init(GpuDataRange& screen) {
   frame_buffer.check();
   ds.clear(0, 0, 0);
 
+  if (multiple > 1) {
+    native_buffer.init(Width, Height);
+    native_screen.init(native_buffer);
+    native_buffer.check();
+    ds.clear(0, 0, 0);
+    frame_buffer.bind();
+  }
+
   shader = new VirtualScreenShader();
 }
 
@@ -291,11 +583,16 @@ VirtualFrameBuffer::~VirtualFrameBuffer() {
 }
 
 
-void VirtualFrameBuffer::drawShape() {
+void VirtualFrameBuffer::bindTarget() {
   frame_buffer.bind();
+  ds.viewport(&gsize);
+}
+
+
+void VirtualFrameBuffer::drawShape() {
+  bindTarget();
   ds.clearDepth();
   ds.setDepthTest(false);
-  ds.viewport(&gsize);
   ds.setBlend(true);
 }
 
@@ -318,7 +615,101 @@ GpuDataRange& VirtualFrameBuffer::size() {
 
 
 GLTexture* VirtualFrameBuffer::useTexture() {
-  return &virtual_screen;
+  return multiple > 1 ? &native_screen : &virtual_screen;
+}
+
+
+// 1 倍分辨率时两者是同一个显存, 什么都不做
+void VirtualFrameBuffer::rendered(const GpuDataRange& r) {
+  if (multiple == 1 || r.width == 0 || r.height == 0) {
+    return;
+  }
+  u32 x1 = std::min(r.offx + r.width,  Width);
+  u32 y1 = std::min(r.offy + r.height, Height);
+  if (stale.width) {
+    x1 = std::max(x1, stale.offx + stale.width);
+    y1 = std::max(y1, stale.offy + stale.height);
+    stale.offx = std::min(stale.offx, r.offx);
+    stale.offy = std::min(stale.offy, r.offy);
+  } else {
+    stale.offx = r.offx;
+    stale.offy = r.offy;
+  }
+  stale.width  = x1 - stale.offx;
+  stale.height = y1 - stale.offy;
+}
+
+
+void VirtualFrameBuffer::sync(const GpuDataRange& r) {
+  if (stale.width == 0) {
+    return;
+  }
+  if (r.offx >= stale.offx + stale.width  || stale.offx >= r.offx + r.width ||
+      r.offy >= stale.offy + stale.height || stale.offy >= r.offy + r.height) {
+    return;
+  }
+  const int m = multiple;
+  const bool scissor = ds.isScissorEnable();
+  ds.setScissorEnable(false);
+  frame_buffer.blitTo(native_buffer, 
+      stale.offx * m, stale.offy * m, stale.width * m, stale.height * m,
+      stale.offx, stale.offy, stale.width, stale.height);
+  frame_buffer.bind();
+  ds.setScissorEnable(scissor);
+  stale = {0};
+}
+
+
+void VirtualFrameBuffer::bindRead() {
+  if (multiple == 1) {
+    frame_buffer.bindRead();
+    return;
+  }
+  GpuDataRange all = { 0, 0, Width, Height };
+  sync(all);
+  native_buffer.bindRead();
+}
+
+
+// 最近点放大, 4/8bit 纹理的索引在放大后保持不变
+void VirtualFrameBuffer::uploaded(int x, int y, int w, int h) {
+  if (multiple == 1) {
+    return;
+  }
+  const int m = multiple;
+  const bool scissor = ds.isScissorEnable();
+  ds.setScissorEnable(false);
+  native_buffer.blitTo(frame_buffer, x, y, w, h, x * m, y * m, w * m, h * m);
+  frame_buffer.bind();
+  ds.setScissorEnable(scissor);
+}
+
+
+// 读取帧缓冲必须已经绑定
+void VirtualFrameBuffer::capture(u32 frame, const GpuDataRange& display, bool rgb24) {
+  capturer.poll();
+  GpuCaptureArea a;
+  if (!capturer.want(frame, a)) {
+    return;
+  }
+  if (a == GpuCaptureArea::vram) {
+    GpuDataRange all = { 0, 0, Width, Height };
+    capturer.read(frame, all, false);
+  } else {
+    capturer.read(frame, display, rgb24);
+  }
+}
+
+
+void VirtualFrameBuffer::copy(int sx, int sy, int dx, int dy, int w, int h) {
+  if (multiple > 1) {
+    GpuDataRange src = { (u32) sx, (u32) sy, (u32) w, (u32) h };
+    sync(src);
+    const int m = multiple;
+    virtual_screen.copyTo(&virtual_screen, sx * m, sy * m, dx * m, dy * m, w * m, h * m);
+  }
+  GLTexture* t = useTexture();
+  t->copyTo(t, sx, sy, dx, dy, w, h);
 }
 
 
@@ -1,7 +1,13 @@
 #pragma once
 
 #include <list>
+#include <deque>
+#include <string>
 #include <mutex>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 
 #include "util.h"
 #include "dma.h"
@@ -11,6 +17,17 @@
 #include "time.h"
 
 #define GPU_DEBUG_INFO
+// 每帧扫描线数量, 交错模式下奇数场少一行
+#define GPU_NTSC_LINES      263
+#define GPU_PAL_LINES       314
+// 每条扫描线视频时钟的 2 倍, NTSC 是 3412.5
+#define GPU_NTSC_LINE_HALF_VCLK  6825
+#define GPU_PAL_LINE_HALF_VCLK   6812
+// 视频时钟频率, 刷新率 NTSC 59.826Hz, PAL 49.747Hz
+#define GPU_NTSC_VIDEO_FREQ 53'693'175
+#define GPU_PAL_VIDEO_FREQ  53'203'425
+// 模拟时间落后实际时间超过该毫秒数时开始跳帧
+#define GPU_SKIP_BEHIND_MS  20
 struct GLFWwindow;
 
 namespace std {
@@ -20,7 +37,10 @@ namespace std {
 namespace ps1e {
 
 class GPU;
+class ShadowVram;
+class SoftGpu;
 class MonoColorShader;
+class ClutDecodeShader;
 class VirtualScreenShader;
 
 #ifdef GPU_DEBUG_INFO
@@ -157,22 +177,71 @@ enum class GpuGp1CommandDef {
 };
 
 
+// 模拟帧的显示方式, 与模拟的 vblank 时序无关
+enum class GpuPresent {
+  vsync,     // 等待主机垂直同步, 主机较慢时只显示最新的帧
+  immediate, // 不等待垂直同步
+  none,      // 只绘制到显存, 不显示, 用于批处理
+};
+
+
+// 截图的范围
+enum class GpuCaptureArea {
+  display, // 显存中映射到屏幕的区域
+  vram,    // 整个 1024x512 显存
+};
+
+
+enum class GpuCaptureFormat {
+  png,
+  raw, // 显存原始像素, 15bit 或 24bit, 尺寸在文件名中
+};
+
+
 enum class ShapeDataStage {
   read_command,
   read_data,
+  read_record,
 };
 
 
 class IDrawShape {
-protected:
-  GLVerticesBuffer vbo;
-
 public:
+  // 进入绘制队列的序号, 由 GPU::send 设置
+  u32 seq = 0;
+  // 绘制会修改的显存范围, 宽度为 0 则不修改显存
+  GpuDataRange written = {0};
+  // 修改的范围需要从 gpu 回读到影子显存
+  bool readback = false;
+
   virtual ~IDrawShape() {}
   // 写入命令数据(包含第一次的命令数据), 如果形状已经读取全部数据则返回 false
   virtual bool write(const u32 c) = 0;
   // 绘制图像
   virtual void draw(GPU&, GLVertexArrays& vao) = 0;
+  // 进入绘制队列前在 cpu 线程上调用, 设置 written, 直接更新影子显存或设置 readback
+  virtual void updateShadow(GPU&, ShadowVram&) {}
+  // 写显存命令, 连续的写显存会合并上传
+  virtual bool vramUpload() { return false; }
+  // 图元绘制, 跳帧时可以丢弃; 填充/复制/读写显存不能丢弃
+  virtual bool primitive() { return false; }
+};
+
+
+// 绘制队列中的一条 GP0 命令.
+// 定长的绘图命令(多边形/线/矩形/填充)只复制命令字, 由 gpu 线程按命令表绘制;
+// 不定长或需要状态的命令(读写显存, 多段线)由 shape 对象处理.
+struct GpuCommandRecord {
+  static const u32 MaxWords = 12;
+
+  u8  cmd;      // GP0 命令
+  u8  length;   // words 中有效的数量
+  u8  readback; // 修改的范围需要从 gpu 回读到影子显存
+  u8  _;
+  u32 seq;      // 进入绘制队列的序号
+  IDrawShape* shape;
+  GpuDataRange written;
+  u32 words[MaxWords]; // 包含第一个命令字
 };
 
 
@@ -186,6 +255,78 @@ public:
 };
 
 
+// 截图和逐帧转储: PBO 双缓冲异步回读原始分辨率显存, 在后台线程编码写入文件.
+// gpu 线程不等待回读和编码, 回读缓冲区全部在使用或编码队列已满时丢弃这一帧.
+class FrameCapture : public NonCopy {
+public:
+  static const u32 Slots    = 2;
+  static const u32 MaxQueue = 8;
+
+private:
+  struct Job {
+    std::string path;
+    u32 w, h;
+    bool rgb24;
+    GpuCaptureFormat format;
+    std::vector<u16> pixels;
+  };
+
+  struct Slot {
+    GLPixelBuffer pbo;
+    GLFence fence;
+    Job job;
+    bool pending = false;
+  };
+
+  // 设置, 任意线程修改
+  std::mutex lock;
+  std::string dir;
+  u32 every;
+  bool shot;
+  GpuCaptureArea area;
+  GpuCaptureFormat format;
+
+  // 以下只在 gpu 线程上使用
+  Slot slot[Slots];
+  u32 slot_next;
+  u32 dropped;
+
+  // 编码线程
+  std::thread* encoder;
+  std::deque<Job> jobs;
+  std::condition_variable wake;
+  bool running;
+
+  void encode_thread();
+  void finish(Slot& s);
+  void post(Job& j);
+
+public:
+  FrameCapture();
+  ~FrameCapture();
+
+  // gpu 线程: 创建/释放 PBO 和编码线程, 释放时完成所有等待的截图
+  void init();
+  void release();
+
+  // 任意线程: 每 every 帧保存一次到目录 dir, every 为 0 则停止
+  void start(const char* dir, u32 every, GpuCaptureArea area, GpuCaptureFormat f);
+  void stop();
+  // 任意线程: 保存下一帧
+  void screenshot(const char* dir, GpuCaptureArea area, GpuCaptureFormat f);
+
+  // gpu 线程: 第 frame 帧需要截图时返回 true 和截图范围
+  bool want(u32 frame, GpuCaptureArea& a);
+  // gpu 线程: 开始回读当前读取帧缓冲的区域 r, 立即返回
+  void read(u32 frame, const GpuDataRange& r, bool rgb24);
+  // gpu 线程: 完成的回读交给编码线程
+  void poll();
+
+  // 将 15bit 显存像素或 24bit 字节流编码为 PNG
+  static bool writePng(const char* path, const u16* pixels, u32 w, u32 h, bool rgb24);
+};
+
+
 // 所有图形都绘制到虚拟缓冲区, 然后再绘制到物理屏幕上
 class VirtualFrameBuffer {
 public:
@@ -198,37 +339,234 @@ private:
   GLFrameBuffer frame_buffer;
   GLTexture virtual_screen;
   GLRenderBuffer rbo;
+  // multiple > 1 时保存原始分辨率的显存, 用于纹理采样和读取
+  GLFrameBuffer native_buffer;
+  GLTexture native_screen;
+  // 原始分辨率显存中还没有同步渲染结果的范围
+  GpuDataRange stale;
   VirtualScreenShader* shader;
   GLDrawState ds;
   GpuDataRange gsize;
   int multiple;
+  FrameCapture capturer;
 
 public:
+  // _multiple 是内部分辨率的倍数, 绘制坐标不变, 只有视口被放大
   VirtualFrameBuffer(int _multiple =1);
   ~VirtualFrameBuffer();
   void init(GpuDataRange& screen);
   // 设置显示范围和屏幕分辨率
   void setSize(GpuDataRange& screen, GpuDataRange& scope);
+  // 绑定虚拟缓冲区为绘制目标
+  void bindTarget();
   void drawShape();
   void drawScreen();
   GpuDataRange& size();
+  // 返回原始分辨率的显存纹理
   GLTexture* useTexture();
+  int scale() { return multiple; }
+
+  // 渲染修改了范围 r, 原始分辨率显存过时
+  void rendered(const GpuDataRange& r);
+  // 与 r 重叠时, 将过时的范围缩小复制到原始分辨率显存
+  void sync(const GpuDataRange& r);
+  // 同步后将原始分辨率显存绑定为读取帧缓冲
+  void bindRead();
+  // 原始分辨率显存的范围已经被写入, 放大到内部分辨率
+  void uploaded(int x, int y, int w, int h);
+  // 显存内复制, 坐标都是原始分辨率
+  void copy(int sx, int sy, int dx, int dy, int w, int h);
+
+  // 截图设置
+  FrameCapture& frameCapture() { return capturer; }
+  // gpu 线程: 每帧结束时调用, 按设置截取显示区域 display 或整个显存
+  void capture(u32 frame, const GpuDataRange& display, bool rgb24);
+};
+
+
+// 显存在 cpu 端的副本, 读显存命令可以不经过 gpu 线程直接返回.
+// 写显存/复制显存直接修改副本, 渲染修改的区域在每帧结束时用 PBO 异步回读.
+// 按 tile 记录命令序号, 回读的序号不小于最后渲染的序号时 tile 才是一致的.
+class ShadowVram : public NonCopy {
+public:
+  static const u32 Width     = VirtualFrameBuffer::Width;
+  static const u32 Height    = VirtualFrameBuffer::Height;
+  static const u32 TileBit   = 5;
+  static const u32 TileSize  = 1 << TileBit;
+  static const u32 TileX     = Width  >> TileBit;
+  static const u32 TileY     = Height >> TileBit;
+  static const u32 TileCount = TileX * TileY;
+  // 同时进行的回读数量
+  static const u32 Frames    = 3;
+
+private:
+  struct Region {
+    u32 x, y, w, h;
+    u32 offset;
+  };
+
+  struct Readback {
+    GLPixelBuffer pbo;
+    GLFence fence;
+    std::vector<Region> regions;
+    u32 seq = 0;
+    bool pending = false;
+  };
+
+  u16* pixels;
+  std::mutex lock;
+  u32 write_seq[TileCount];  // 最后一次渲染
+  u32 synced_seq[TileCount]; // 最后一次回读
+  u32 direct_seq[TileCount]; // 最后一次直接写入
+
+  // 以下只在 gpu 线程上使用
+  bool dirty[TileCount];
+  u32 drawn_seq;
+  Readback rb[Frames];
+  u32 rb_next;
+
+  bool coherent(u32 x, u32 y, u32 w, u32 h);
+  void markDirect(u32 x, u32 y, u32 w, u32 h, u32 seq);
+  void issue(Readback& r);
+  void finish(Readback& r);
+
+public:
+  ShadowVram();
+  ~ShadowVram();
+
+  // gpu 线程: 创建/释放 PBO
+  void init();
+  void release();
+  // gpu 线程: 图形绘制后调用
+  void drawn(const GpuCommandRecord& r);
+  // gpu 线程: 回收完成的回读, 然后开始回读脏区域, 显存帧缓冲必须已经绑定
+  void readback();
+
+  // cpu 线程: 渲染命令进入队列
+  void touch(const GpuDataRange& r, u32 seq);
+  // cpu 线程: 写显存命令直接写入副本
+  void write(u32 x, u32 y, u32 w, u32 h, const u16* data, u32 seq);
+  // cpu 线程: 源区域一致则在副本中复制并返回 true
+  bool copy(u32 sx, u32 sy, u32 dx, u32 dy, u32 w, u32 h, u32 seq);
+  // cpu 线程: 区域一致则复制到 out 并返回 true, out 长度 w*h
+  bool read(u32 x, u32 y, u32 w, u32 h, u16* out);
 };
 
 
-class GPU : public DMADev, public NonCopy {
+// 4/8bit 纹理页按 (纹理页, 颜色深度, CLUT) 预先解码为 RGBA 纹理,
+// 绘制时只需要一次采样. 纹理页或 CLUT 所在的显存被修改时缓存失效.
+// 16bit 纹理页本身只需要一次采样, 不缓存.
+class TextureCache : public NonCopy {
+public:
+  static const u32 Size     = 256;
+  static const u32 Capacity = 32;
+
+private:
+  struct Entry {
+    GLTexture text;
+    u32 key = 0;
+    u32 used = 0;
+    bool valid = false;
+    GpuDataRange page_range;
+    GpuDataRange clut_range;
+  };
+
+  Entry entries[Capacity];
+  GLFrameBuffer fbo;
+  GLVertexArrays vao;
+  ClutDecodeShader* shader;
+  GLDrawState ds;
+  u32 tick;
+
+  void decode(GPU& gpu, Entry& e, u32 page, u32 clut);
+
+public:
+  TextureCache();
+  ~TextureCache();
+
+  // gpu 线程: 创建/释放缓存纹理
+  void init();
+  void release();
+  // gpu 线程: 返回解码后的纹理, 16bit 纹理页返回 NULL
+  GLTexture* use(GPU& gpu, u32 page, u32 clut);
+  // gpu 线程: 显存被修改
+  void invalidate(const GpuDataRange& r);
+};
+
+
+// 写显存(A0h)的上传流. cpu 线程将像素写入回收的缓冲区, gpu 线程把连续相邻的
+// 上传合并, 复制到 PBO 环中, 再用 glTexSubImage2D 直接写入显存纹理.
+class UploadStream : public NonCopy {
+public:
+  typedef std::vector<u32> Buffer;
+  static const u32 RingSize = 4 << 20;
+  static const u32 Chunks   = 4;
+  static const u32 PoolSize = 64;
+  // 超过这个长度的缓冲区不回收
+  static const u32 PoolMaxLen = 0x10000;
+
+private:
+  struct Pending {
+    u32 x, y, w, h;
+    Buffer* data;
+  };
+
+  std::mutex lock;
+  std::vector<Buffer*> pool;
+
+  // 以下只在 gpu 线程上使用
+  std::vector<Pending> pending;
+  GLUploadBuffer ring;
+  GLFence fence[Chunks];
+  u32 head;
+  u32 used;
+
+  // 在环中分配 size 字节, 等待 gpu 读取完成
+  u32 alloc(u32 size);
+  void fenceUsed();
+
+public:
+  UploadStream();
+  ~UploadStream();
+
+  // gpu 线程: 创建/释放 PBO 环
+  void init();
+  void release();
+  // gpu 线程: 加入等待上传的像素, 取得 data 的所有权
+  void push(u32 x, u32 y, u32 w, u32 h, Buffer* data);
+  // gpu 线程: 上传所有等待的像素, 读写显存的命令之前必须调用
+  void flush(VirtualFrameBuffer& vram);
+
+  // 任意线程: 取得/归还像素缓冲区, 长度是 32bit 的数量
+  Buffer* acquire(u32 len);
+  void recycle(Buffer* b);
+};
+
+
+class GPU : public DMADev, public ClockEvent, public NonCopy {
 private:
   class GP0 : public DeviceIO {
     GPU &p;
     ShapeDataStage stage;
     IDrawShape *shape;
+    GpuCommandRecord rec;
+    u32 rec_count;
     u32 last_read;
+    // 软件光栅化时的命令流
+    void writeSoft(u32 value);
   public:
     GP0(GPU &_p);
     bool parseCommand(const GpuCommand c);
     void write(u32 value);
     u32 read();
     void reset_fifo();
+
+    // 命令表: 定长命令是否为图元, 设置修改范围, 在 gpu 线程上绘制
+    static bool primitive(u8 cmd);
+    static void range(GPU&, GpuCommandRecord&);
+    static void render(GPU&, GLVertexArrays&, const GpuCommandRecord&);
+    // 将 cpu 端的像素写入显存纹理, stride 是 src 一行的像素数
+    static void upload(GPU&, u32 x, u32 y, u32 w, u32 h, const u16* src, u32 stride);
   };
 
 
@@ -267,18 +605,59 @@ private:
   std::thread* work;
 
   VirtualFrameBuffer vram;
-  std::list<IDrawShape*> draw_queue;
+  ShadowVram shadow;
+  TextureCache tcache;
+  UploadStream upload;
+  // 不为空则由软件光栅化绘制, 只在 CPU 线程上使用
+  SoftGpu* soft;
+  u32 draw_seq;
+  // cpu 线程追加, gpu 线程整体交换出去后按顺序绘制
+  std::vector<GpuCommandRecord> draw_queue;
+  std::vector<GpuCommandRecord> drawing;
   std::recursive_mutex for_draw_queue;
+  // 所有图形共用的顶点缓冲区, 只在 gpu 线程上使用
+  GLVerticesBuffer stream_vbo;
   // 从插入的对象中读取数据, 只要对象存在必须至少能读取一次
   std::list<IGpuReadData*> read_queue;
   std::recursive_mutex for_read_queue;
   GLDrawState ds;
   u32 status_change_count;
   TimerSystem& timer;
+
+  // 视频时序, 只在 CPU 线程上修改
+  u32 scanline;
+  // 换算为系统时钟的余数, 单位是 1/(2*视频时钟频率)
+  u64 line_frac;
+  bool clock_stopped;
+  u8 field;
+  bool pacing;
+  // 当前帧的图元被丢弃, 已经连续跳过的帧
+  bool skipping;
+  u32 skipped;
+  std::atomic<u32> max_skip;
+  u64 pace_cycles;
+  std::chrono::steady_clock::time_point pace_wall;
+  // 模拟的 vblank 次数, gpu 线程据此显示帧
+  std::atomic<u32> emu_frames;
+  // 最后一个没有跳过的帧
+  std::atomic<u32> drawn_frame;
+  // vblank 时在 cpu 线程上计算的显示区域, 在 for_draw_queue 锁内读写
+  GpuDataRange shown_area;
+  bool shown_rgb24;
+  std::atomic<bool> realtime;
+  std::atomic<GpuPresent> present;
+  std::condition_variable_any gpu_wake;
     
   // 这是gpu线程函数, 不要调用
   void gpu_thread();
   void initOpenGL();
+  // 绘制队列中的图形, 直到队列为空
+  void drawQueue(GLVertexArrays& vao);
+  void push(GpuCommandRecord& r);
+  // 进入 vblank, 在 CPU 线程上调用
+  void vblankBegin();
+  // 模拟时间快于实际时间则等待, 返回落后的毫秒数
+  u32 throttle();
 
   // 在修改 draw_tp_lf/draw_bm_rt 后应用绘制范围
   void updateDrawScope();
@@ -289,18 +668,33 @@ protected:
   // 按照链表顺序加载绘制的命令
   void dma_order_list(psmem addr) override;
   void dma_dev2ram_block(psmem addr, u32 bytesize, s32 inc) override;
+  // 每条扫描线结束时调用
+  u32 onClock(u32 late) override;
 
 public:
-  GPU(Bus& bus, TimerSystem&);
+  // scale 是内部分辨率的倍数 1~8
+  GPU(Bus& bus, TimerSystem&, int scale = 1);
   ~GPU();
 
   void reset();
+  // 在 CPU 线程上停止扫描线事件, 销毁之前必须调用
+  void stopClock();
+
+  // true: 模拟速度与实际时间同步, false: 尽可能快的运行
+  void setRealtime(bool r);
+  void setPresent(GpuPresent p);
+  // 落后时最多连续跳过的帧, 0 则不跳帧; 只在 realtime 时生效
+  void setFrameSkip(u32 frames);
+  // 使用软件光栅化, threads 是额外的绘制线程; 必须在运行之前调用
+  void useSoftware(bool enable, u32 threads = 0);
 
   // 发送可绘制图形
   void send(IDrawShape* s);
+  // 发送定长的绘图命令
+  void send(GpuCommandRecord& r);
 
-  // 弹出待绘制图形对象, 没有返回 NULL
-  IDrawShape* pop_drawer();
+  // 取出全部待绘制的命令, out 必须是空的
+  void takeQueue(std::vector<GpuCommandRecord>& out);
 
   // 将一个数据读取器插入队列, 稍后由总线读出.
   void add(IGpuReadData* r);
@@ -331,6 +725,52 @@ public:
     return vram.useTexture();
   }
 
+  // 软件光栅化, 没有启用返回 NULL
+  inline SoftGpu* software() {
+    return soft;
+  }
+
+  // 读显存命令使用的影子显存
+  inline ShadowVram& shadowVram() {
+    return shadow;
+  }
+
+  // 纹理采样使用的纹理页缓存
+  inline TextureCache& textureCache() {
+    return tcache;
+  }
+
+  // 写显存命令的上传流
+  inline UploadStream& uploadStream() {
+    return upload;
+  }
+
+  // 将绘制目标恢复为显存
+  void bindDrawTarget();
+
+  // 绘制时使用的顶点缓冲区
+  inline GLVerticesBuffer& streamBuffer() {
+    return stream_vbo;
+  }
+
+  // 显存帧缓冲, 处理内部分辨率与原始分辨率之间的复制
+  inline VirtualFrameBuffer& frameBuffer() {
+    return vram;
+  }
+
+  // 截图和逐帧转储
+  inline FrameCapture& frameCapture() {
+    return vram.frameCapture();
+  }
+
+  // 显存中显示在屏幕上的区域, 由 display/disp_hori/disp_veri 计算;
+  // 24bit 模式的宽度是 16bit 像素的数量
+  static void displayArea(const GpuStatus& st, GpuRange10 display, GpuRange12 hori,
+                          GpuRange10 veri, GpuDataRange& r);
+
+  // 返回绘图区域(E3h/E4h), 区域无效时返回整个显存
+  void drawArea(GpuDataRange& r);
+
   // 启用/禁用绘制区域限制, 默认限制总是启用的, 
   void enableDrawScope(bool enableLimit);
 };
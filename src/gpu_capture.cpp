@@ -0,0 +1,302 @@
+﻿#include "gpu.h"
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+namespace ps1e {
+
+struct CrcTable {
+  u32 v[256];
+
+  CrcTable() {
+    for (u32 n = 0; n < 256; ++n) {
+      u32 c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? 0xEDB8'8320 ^ (c >> 1) : c >> 1;
+      }
+      v[n] = c;
+    }
+  }
+};
+
+
+static u32 png_crc(u32 crc, const u8* p, u32 len) {
+  static const CrcTable table;
+  crc = ~crc;
+  for (u32 i = 0; i < len; ++i) {
+    crc = table.v[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+
+static void put_be32(std::vector<u8>& out, u32 v) {
+  out.push_back(v >> 24);
+  out.push_back(v >> 16);
+  out.push_back(v >> 8);
+  out.push_back(v);
+}
+
+
+static void png_chunk(FILE* f, const char* type, const std::vector<u8>& data) {
+  std::vector<u8> head;
+  put_be32(head, u32(data.size()));
+  head.insert(head.end(), type, type + 4);
+  u32 crc = png_crc(0, head.data() + 4, 4);
+  crc = png_crc(crc, data.data(), u32(data.size()));
+  std::vector<u8> tail;
+  put_be32(tail, crc);
+
+  fwrite(head.data(), 1, head.size(), f);
+  if (data.size()) fwrite(data.data(), 1, data.size(), f);
+  fwrite(tail.data(), 1, tail.size(), f);
+}
+
+
+// 不压缩的 deflate 块, 截图只用于比较, 不需要更小的文件
+bool FrameCapture::writePng(const char* path, const u16* pixels, u32 w, u32 h, bool rgb24) {
+  const u32 pw = rgb24 ? w * 2 / 3 : w;
+  if (pw == 0 || h == 0) return false;
+
+  std::vector<u8> raw;
+  raw.reserve((pw * 3 + 1) * h);
+  for (u32 y = 0; y < h; ++y) {
+    raw.push_back(0);
+    if (rgb24) {
+      const u8* row = (const u8*)(pixels + y * w);
+      raw.insert(raw.end(), row, row + pw * 3);
+      continue;
+    }
+    const u16* row = pixels + y * w;
+    for (u32 x = 0; x < pw; ++x) {
+      const u16 c = row[x];
+      const u8 r = c & 0x1F, g = (c >> 5) & 0x1F, b = (c >> 10) & 0x1F;
+      raw.push_back((r << 3) | (r >> 2));
+      raw.push_back((g << 3) | (g >> 2));
+      raw.push_back((b << 3) | (b >> 2));
+    }
+  }
+
+  std::vector<u8> z;
+  z.reserve(raw.size() + raw.size() / 0xFFFF * 5 + 16);
+  z.push_back(0x78);
+  z.push_back(0x01);
+  u32 a = 1, b = 0;
+  for (size_t off = 0; off < raw.size(); ) {
+    const u32 n = u32(std::min(raw.size() - off, size_t(0xFFFF)));
+    z.push_back(off + n >= raw.size() ? 1 : 0);
+    z.push_back(n);
+    z.push_back(n >> 8);
+    z.push_back(~n);
+    z.push_back(~n >> 8);
+    z.insert(z.end(), raw.begin() + off, raw.begin() + off + n);
+    for (u32 i = 0; i < n; ++i) {
+      a = (a + raw[off + i]) % 65521;
+      b = (b + a) % 65521;
+    }
+    off += n;
+  }
+  put_be32(z, (b << 16) | a);
+
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+  static const u8 sign[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  fwrite(sign, 1, sizeof(sign), f);
+
+  std::vector<u8> ihdr;
+  put_be32(ihdr, pw);
+  put_be32(ihdr, h);
+  const u8 fmt[5] = { 8, 2, 0, 0, 0 }; // 8bit RGB
+  ihdr.insert(ihdr.end(), fmt, fmt + 5);
+  png_chunk(f, "IHDR", ihdr);
+  png_chunk(f, "IDAT", z);
+  png_chunk(f, "IEND", std::vector<u8>());
+  fclose(f);
+  return true;
+}
+
+
+FrameCapture::FrameCapture() : every(0), shot(false), area(GpuCaptureArea::display),
+    format(GpuCaptureFormat::png), slot_next(0), dropped(0), encoder(0), running(false) {
+}
+
+
+FrameCapture::~FrameCapture() {
+  release();
+}
+
+
+void FrameCapture::init() {
+  for (u32 i = 0; i < Slots; ++i) {
+    slot[i].pbo.init(VirtualFrameBuffer::Width * VirtualFrameBuffer::Height * sizeof(u16));
+    slot[i].pending = false;
+  }
+  running = true;
+  encoder = new std::thread(&FrameCapture::encode_thread, this);
+}
+
+
+void FrameCapture::release() {
+  if (!encoder) return;
+  // 退出前完成已经发起的回读
+  for (u32 i = 0; i < Slots; ++i) {
+    Slot& s = slot[(slot_next + i) % Slots];
+    if (!s.pending) continue;
+    s.fence.wait();
+    finish(s);
+  }
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    running = false;
+    wake.notify_all();
+  }
+  encoder->join();
+  delete encoder;
+  encoder = 0;
+
+  for (u32 i = 0; i < Slots; ++i) {
+    slot[i].fence.release();
+    slot[i].pbo.release();
+  }
+  if (dropped) {
+    warn("Frame capture dropped %u frames\n", dropped);
+  }
+}
+
+
+void FrameCapture::start(const char* d, u32 n, GpuCaptureArea a, GpuCaptureFormat f) {
+  std::lock_guard<std::mutex> lk(lock);
+  dir    = d;
+  every  = n;
+  area   = a;
+  format = f;
+}
+
+
+void FrameCapture::stop() {
+  std::lock_guard<std::mutex> lk(lock);
+  every = 0;
+}
+
+
+void FrameCapture::screenshot(const char* d, GpuCaptureArea a, GpuCaptureFormat f) {
+  std::lock_guard<std::mutex> lk(lock);
+  dir    = d;
+  area   = a;
+  format = f;
+  shot   = true;
+}
+
+
+bool FrameCapture::want(u32 frame, GpuCaptureArea& a) {
+  std::lock_guard<std::mutex> lk(lock);
+  if (!shot && (every == 0 || frame % every)) {
+    return false;
+  }
+  a = area;
+  return true;
+}
+
+
+void FrameCapture::read(u32 frame, const GpuDataRange& r, bool rgb24) {
+  Slot& s = slot[slot_next];
+  if (s.pending || r.width == 0 || r.height == 0) {
+    ++dropped;
+    return;
+  }
+
+  Job& j = s.job;
+  char name[64];
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    shot = false;
+    j.format = format;
+    j.path = dir;
+  }
+  if (j.format == GpuCaptureFormat::png) {
+    snprintf(name, sizeof(name), "/frame_%06u.png", frame);
+  } else {
+    snprintf(name, sizeof(name), "/frame_%06u_%ux%u%s.raw", frame, r.width, r.height,
+             rgb24 ? "_24" : "");
+  }
+  j.path += name;
+  j.w = r.width;
+  j.h = r.height;
+  j.rgb24 = rgb24;
+
+  s.pbo.bind();
+  s.pbo.readPsinnerPixel(r.offx, r.offy, r.width, r.height, 0);
+  s.pbo.unbind();
+  s.fence.insert();
+  s.pending = true;
+  slot_next = (slot_next + 1) % Slots;
+}
+
+
+// 按发起顺序回收
+void FrameCapture::poll() {
+  for (u32 i = 0; i < Slots; ++i) {
+    Slot& s = slot[(slot_next + i) % Slots];
+    if (!s.pending) continue;
+    if (!s.fence.signaled()) break;
+    finish(s);
+  }
+}
+
+
+void FrameCapture::finish(Slot& s) {
+  s.pending = false;
+  Job& j = s.job;
+  s.pbo.bind();
+  const void* p = s.pbo.map();
+  if (p) {
+    j.pixels.resize(j.w * j.h);
+    memcpy(j.pixels.data(), p, j.w * j.h * sizeof(u16));
+    s.pbo.unmap();
+  }
+  s.pbo.unbind();
+  if (!p) {
+    ++dropped;
+    return;
+  }
+  post(j);
+}
+
+
+void FrameCapture::post(Job& j) {
+  std::lock_guard<std::mutex> lk(lock);
+  if (jobs.size() >= MaxQueue) {
+    ++dropped;
+    return;
+  }
+  jobs.push_back(std::move(j));
+  wake.notify_one();
+}
+
+
+void FrameCapture::encode_thread() {
+  std::unique_lock<std::mutex> lk(lock);
+  for (;;) {
+    wake.wait(lk, [this] { return jobs.size() || !running; });
+    if (jobs.empty()) return;
+    Job j = std::move(jobs.front());
+    jobs.pop_front();
+    lk.unlock();
+
+    bool ok;
+    if (j.format == GpuCaptureFormat::png) {
+      ok = writePng(j.path.c_str(), j.pixels.data(), j.w, j.h, j.rgb24);
+    } else {
+      FILE* f = fopen(j.path.c_str(), "wb");
+      ok = f && fwrite(j.pixels.data(), sizeof(u16), j.pixels.size(), f) == j.pixels.size();
+      if (f) fclose(f);
+    }
+    if (!ok) {
+      warn("Cannot write frame capture %s\n", j.path.c_str());
+    }
+    lk.lock();
+  }
+}
+
+}
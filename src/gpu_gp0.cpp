@@ -1,9 +1,11 @@
 ﻿#include "gpu.h"
 #include "gpu_shader.h"
+#include "gpu_soft.h"
 #include <functional>
 #include <stdexcept>
 #include <condition_variable>
 #include <mutex>
+#include <cstring>
 
 namespace ps1e {
 
@@ -18,11 +20,6 @@ static const u32 Y_SUB   = 0x0001'0000;
 static const u32 offset_limit_x10 = 0x01FF'03F0;
 
 
-// 实际上 mirror_case 的定义与对应的 case 在渲染上有出入
-// 可以用恶魔城进行测试, 进一步确定渲染方式.
-#define mirror_case(x)  case x
-
-
 // w*h 表示 16bit 像素的数量, 返回的长度表示 32bit 缓冲区长度
 // 如果像素位奇数, 则缓冲区长度会多出一个 16bit
 template<class T> static T get_buffer_len(T w, T h) {
@@ -49,6 +46,7 @@ protected:
 
 public:
   static const bool DisableDrawScopeLimit = false;
+  static const bool Primitive = true;
 
   VerticesBase(int ele, int st = 0) : step(st), element(ele) {}
   virtual ~VerticesBase() {}
@@ -63,6 +61,11 @@ public:
   }
 
   void updateTextureInfo(GPU& gpu) {}
+
+  // 绘制可能修改的显存范围
+  void vramRange(GPU& gpu, GpuDataRange& r) {
+    gpu.drawArea(r);
+  }
 };
 
 
@@ -226,6 +229,7 @@ public:
 class MultipleVertices {
 public:
   static const bool DisableDrawScopeLimit = false;
+  static const bool Primitive = true;
 
   const u32 END = 0x50005000;
   const int InitBufSize = 0x10;
@@ -275,6 +279,10 @@ public:
 
   void updateTextureInfo(GPU& gpu) {}
 
+  void vramRange(GPU& gpu, GpuDataRange& r) {
+    gpu.drawArea(r);
+  }
+
   bool write(const u32 c) {
     // 55555555h ? 50005000h ??
     if ((count >= mincount) && (c & 0xF000F000)==END) {
@@ -552,6 +560,21 @@ private:
 
 public:
   static const bool DisableDrawScopeLimit = true;
+  static const bool Primitive = false;
+
+  // 填充不受绘图区域限制
+  void vramRange(GPU& gpu, GpuDataRange& r) {
+    int w = int(vertices[3] & 0xFFFF) - int(vertices[0] & 0xFFFF) + 1;
+    int h = int(vertices[3] >> 16) - int(vertices[0] >> 16) + 1;
+    // 坐标在显存边界回绕, 无法确定范围
+    if (w <= 0 || h <= 0) {
+      r = { 0, 0, ShadowVram::Width, ShadowVram::Height };
+      return;
+    }
+    get_xy32(vertices[0], r.offx, r.offy);
+    r.width  = w;
+    r.height = h;
+  }
 
   bool write(const u32 c) {
     //printf("fv %08x\n", c);
@@ -577,40 +600,50 @@ public:
 
 class FillTexture : public IDrawShape {
 private:
-  u32* buf;
+  GPU& gpu;
+  UploadStream::Buffer* buf;
+  u32* data;
   int buf_length;
-  GLTexture text;
   u32 w, h;
   u32 x, y;
   int step;
 
 public:
-  FillTexture() : step(-3), buf(0) {
+  FillTexture(GPU& g) : gpu(g), buf(0), data(0), buf_length(0), step(-3) {
+  }
+
+  // 直接从 cpu 端的像素创建, stride 是 src 一行的像素数
+  FillTexture(GPU& g, u32 _x, u32 _y, u32 _w, u32 _h, const u16* src, u32 stride)
+  : gpu(g), w(_w), h(_h), x(_x), y(_y), step(0) {
+    buf_length = get_buffer_len(w, h);
+    buf = gpu.uploadStream().acquire(buf_length);
+    data = buf->data();
+    u16* d = (u16*) data;
+    for (u32 j = 0; j < h; ++j) {
+      memcpy(d + j * w, src + j * stride, w * sizeof(u16));
+    }
   }
 
   ~FillTexture() {
     if (buf) {
-      delete [] buf;
+      gpu.uploadStream().recycle(buf);
       buf = 0;
     }
   }
 
+  // 缓冲区交给上传流, 稍后与相邻的写显存一起上传
   void draw(GPU& gpu, GLVertexArrays& vao) {
-    gpu.enableDrawScope(false);
-    text.init2px(w, h, buf);
-    text.bind();
-    text.copyTo(gpu.useTexture(), 0, 0, x, y, w, h);
-
-    // 能读数据与原始字节相同
-    //printf("SRC TXT %d %d %d %d\n", x, y, w, h);
-    //print_hex("", (u8*)buf, buf_length * 4);
-    /*
-    u32* out = new u32[buf_length];
-    gpu.useTexture()->bind();
-    GLDrawState::readPsinnerPixel(x, y, w, h, out);
-    print_hex("\nOUT TXT", (u8*)out, buf_length * 4);
-    delete [] out;
-    */
+    gpu.uploadStream().push(x, y, w, h, buf);
+    buf = 0;
+  }
+
+  bool vramUpload() {
+    return true;
+  }
+
+  void updateShadow(GPU& gpu, ShadowVram& shadow) {
+    written = { x, y, w, h };
+    shadow.write(x, y, w, h, (u16*) data, seq);
   }
   
   //
@@ -635,12 +668,13 @@ public:
         w = ((w-1) & 0x3ff) +1;
         h = ((h-1) & 0x1FF) +1;
         buf_length = get_buffer_len(w, h);
-        buf = new u32[buf_length];
+        buf = gpu.uploadStream().acquire(buf_length);
+        data = buf->data();
         break;
 
       default:
         //每次写入两个像素的数据
-        buf[step] = c;
+        data[step] = c;
         break;
     }
     return ++step < buf_length;
@@ -666,6 +700,35 @@ public:
 };
 
 
+// 所有图形共用 gpu 线程上的顶点缓冲区
+template< class Vertices, 
+          void (*Draw)(GLVertexArrays&, int),
+          class Shader
+          >
+static void draw_vertices(GPU& gpu, GLVertexArrays& vao, Vertices& vertices, float transparent) {
+  vertices.updateTextureInfo(gpu);
+  // 解码纹理页会切换绘制目标, 必须在绑定顶点之前
+  GLTexture* text = Shader::prepareTexture(vertices, gpu);
+
+  gl_scope(vao);
+  GLVerticesBuffer& vbo = gpu.streamBuffer();
+  gl_scope(vbo);
+  vertices.setAttr(vbo);
+
+  auto prog = gpu.useProgram<Shader>();
+  prog->setShaderUni(vertices, gpu, transparent);
+
+  if (text) {
+    prog->setCached(text != gpu.useTexture());
+    text->bind();
+  }
+  //if (Vertices::DisableDrawScopeLimit) gpu.enableDrawScope(false);
+  Draw(vao, vertices.elementCount());
+  if (text) text->unbind();
+}
+
+
+// 不定长的多段线, 定长的命令使用 GpuCommandRecord
 template< class Vertices, 
           void (*Draw)(GLVertexArrays&, int),
           class Shader = MonoColorShader
@@ -686,20 +749,17 @@ public:
     return vertices.write(c);
   }
 
-  virtual void draw(GPU& gpu, GLVertexArrays& vao) {
-    gl_scope(vao);
-    vbo.init(vao);
-    gl_scope(vbo);
-    vertices.setAttr(vbo);
-    vertices.updateTextureInfo(gpu);
+  virtual void updateShadow(GPU& gpu, ShadowVram& shadow) {
+    vertices.vramRange(gpu, written);
+    readback = true;
+  }
 
-    auto prog = gpu.useProgram<Shader>();
-    prog->setShaderUni(vertices, gpu, transparent);
+  virtual bool primitive() {
+    return Vertices::Primitive;
+  }
 
-    if (Shader::Texture) gpu.useTexture()->bind();
-    //if (Vertices::DisableDrawScopeLimit) gpu.enableDrawScope(false);
-    Draw(vao, vertices.elementCount());
-    if (Shader::Texture) gpu.useTexture()->unbind();
+  virtual void draw(GPU& gpu, GLVertexArrays& vao) {
+    draw_vertices<Vertices, Draw, Shader>(gpu, vao, vertices, transparent);
   }
 };
 
@@ -730,7 +790,7 @@ public:
   u32 read() {
     if (lock) {
       std::unique_lock<std::mutex> lk(m);
-      cv.wait(lk);
+      cv.wait(lk, [this] { return !lock; });
     }
     //printf("Cpu read vram %d[%d]:%x\n", p, len, data[p]);
     return data[p++];
@@ -759,18 +819,30 @@ private:
   int state = 0;
   int x, y;
   int w, h;
+  // 已经从影子显存得到数据, 不需要等待 gpu 线程
+  bool served = false;
 
   void installReader() {
     reader = new ReadVram(w, h);
+    if (gpu.software()) {
+      gpu.software()->read(x, y, w, h, (u16*) reader->getDataPoint());
+      served = true;
+    } else {
+      served = gpu.shadowVram().read(x, y, w, h, (u16*) reader->getDataPoint());
+    }
+    if (served) {
+      reader->unlock();
+    }
     gpu.add(reader);
     //printf("install vram reader w_%d h_%d | %d %d\n", w, h, x, y);
     //ps1e_t::ext_stop = 1;
   }
 
   void dataReady() {
-    gpu.useTexture()->bind();
+    gpu.frameBuffer().bindRead();
     //const int reverse_y = VirtualFrameBuffer::Height-1 -y;
     GLDrawState::readPsinnerPixel(x, y, w, h, reader->getDataPoint());
+    gpu.bindDrawTarget();
     reader->unlock();
   }
 
@@ -788,6 +860,8 @@ public:
 
       case 2:
         get_xy32(c, w, h);
+        w = ((w-1) & 0x3ff) +1;
+        h = ((h-1) & 0x1FF) +1;
         installReader();
         // no break
       default:
@@ -796,6 +870,7 @@ public:
   }
 
   void draw(GPU& gpu, GLVertexArrays& vao) {
+    if (served) return;
     gl_scope(vao);
     gpu.enableDrawScope(false);
     dataReady();
@@ -805,7 +880,7 @@ public:
 
 class CopyVramToVram : public IDrawShape {
 private:
-  int step;
+  int step = 0;
   u32 srcX, srcY;
   u32 dstX, dstY;
   u32 w, h;
@@ -826,6 +901,8 @@ public:
 
       case 3:
         get_xy32(c, w, h);
+        w = ((w-1) & 0x3ff) +1;
+        h = ((h-1) & 0x1FF) +1;
         // no break
 
       default:
@@ -833,11 +910,16 @@ public:
     }
   }
 
+  // 源区域不一致时, 目标区域在绘制后回读
+  void updateShadow(GPU& gpu, ShadowVram& shadow) {
+    written = { dstX, dstY, w, h };
+    readback = !shadow.copy(srcX, srcY, dstX, dstY, w, h, seq);
+  }
+
   void draw(GPU& gpu, GLVertexArrays& vao) {
     gl_scope(vao);
     gpu.enableDrawScope(false);
-    GLTexture* t = gpu.useTexture();
-    t->copyTo(t, srcX, srcY, dstX, dstY, w, h);
+    gpu.frameBuffer().copy(srcX, srcY, dstX, dstY, w, h);
   }
 };
 
@@ -870,7 +952,268 @@ void drawLines(GLVertexArrays& vao, int elementCount) {
 void drawPoints(GLVertexArrays& vao, int elementCount) {
   vao.drawPoints(elementCount);
 }
- 
+
+
+template<class Vertices> 
+static void load_record(Vertices& vertices, const GpuCommandRecord& r) {
+  for (u32 i = 0; i < r.length; ++i) {
+    vertices.write(r.words[i]);
+  }
+}
+
+
+template< class Vertices, 
+          void (*Draw)(GLVertexArrays&, int),
+          class Shader,
+          bool Semi
+          >
+static void render_record(GPU& gpu, GLVertexArrays& vao, const GpuCommandRecord& r) {
+  Vertices vertices;
+  load_record(vertices, r);
+  draw_vertices<Vertices, Draw, Shader>(gpu, vao, vertices, Semi ? 0.5 : 1);
+}
+
+
+template<class Vertices> 
+static void record_range(GPU& gpu, const GpuCommandRecord& r, GpuDataRange& w) {
+  // 图元的范围只与绘图区域有关, 不需要解码
+  if (Vertices::Primitive) {
+    gpu.drawArea(w);
+    return;
+  }
+  Vertices vertices;
+  load_record(vertices, r);
+  vertices.vramRange(gpu, w);
+}
+
+
+// 定长绘图命令表, 由命令字的高 8 位索引
+struct Gp0Command {
+  // 命令的字数(含命令字), 0 则不是定长绘图命令
+  u8 words;
+  bool primitive;
+  void (*render)(GPU&, GLVertexArrays&, const GpuCommandRecord&);
+  void (*range)(GPU&, const GpuCommandRecord&, GpuDataRange&);
+};
+
+
+class Gp0CommandTable {
+private:
+  Gp0Command cmd[256];
+
+  // 字数从顶点解码器得到, 与解码保持一致.
+  // mirror 与 op 的定义在渲染上有出入, 可以用恶魔城进行测试, 进一步确定渲染方式.
+  template< class Vertices, 
+            void (*Draw)(GLVertexArrays&, int),
+            class Shader,
+            bool Semi
+            >
+  void def(u8 op, u8 mirror = 0) {
+    Vertices v;
+    u32 words = 1;
+    while (v.write(0)) ++words;
+    if (words > GpuCommandRecord::MaxWords) {
+      throw std::runtime_error("GP0 command too long");
+    }
+
+    Gp0Command& c = cmd[op];
+    c.words     = words;
+    c.primitive = Vertices::Primitive;
+    c.render    = &render_record<Vertices, Draw, Shader, Semi>;
+    c.range     = &record_range<Vertices>;
+    if (mirror) {
+      cmd[mirror] = c;
+    }
+  }
+
+public:
+  Gp0CommandTable();
+
+  inline const Gp0Command& operator[](u8 op) const {
+    return cmd[op];
+  }
+};
+
+
+Gp0CommandTable::Gp0CommandTable() {
+  memset(cmd, 0, sizeof(cmd));
+
+  // 在VRAM中填充矩形
+  def<FillVertices, drawTriStrip, FillRectShader, false>(0x02);
+
+  // 单色三点多边形，不透明
+  def<PolygonVertices<3>, drawTriangles, MonoColorShader, false>(0x20, 0x21);
+
+  // 单色三点多边形，半透明
+  def<PolygonVertices<3>, drawTriangles, MonoColorShader, true>(0x22, 0x23);
+
+  // 单色四点多边形，不透明
+  def<PolygonVertices<4>, drawTriStrip, MonoColorShader, false>(0x28, 0x29);
+
+  // 单色四点多边形，半透明
+  def<PolygonVertices<4>, drawTriStrip, MonoColorShader, true>(0x2A, 0x2B);
+
+  // 带纹理的三点多边形，不透明，混合纹理
+  def<PolyTextureVertices<3>, drawTriangles, MonoColorTextureMixShader, false>(0x24);
+
+  // 带纹理的三点多边形，不透明，原始纹理
+  def<PolyTextureVertices<3>, drawTriangles, TextureOnlyShader, false>(0x25);
+
+  // 带纹理的三点多边形，半透明，混合纹理
+  def<PolyTextureVertices<3>, drawTriangles, MonoColorTextureMixShader, true>(0x26);
+
+  // 带纹理的三点多边形，半透明，原始纹理
+  def<PolyTextureVertices<3>, drawTriangles, TextureOnlyShader, true>(0x27);
+
+  // 带纹理的四点多边形，不透明，混合纹理
+  def<PolyTextureVertices<4>, drawTriStrip, MonoColorTextureMixShader, false>(0x2C);
+
+  // 带纹理的四点多边形，不透明，原始纹理
+  def<PolyTextureVertices<4>, drawTriStrip, TextureOnlyShader, false>(0x2D);
+
+  // 带纹理的四点多边形，半透明，混合纹理
+  def<PolyTextureVertices<4>, drawTriStrip, MonoColorTextureMixShader, true>(0x2E);
+
+  // 带纹理的四点多边形，半透明，原始纹理
+  def<PolyTextureVertices<4>, drawTriStrip, TextureOnlyShader, true>(0x2F);
+
+  // 阴影三点多边形，不透明
+  def<ShadedPolyVertices<3>, drawTriangles, ShadedColorShader, false>(0x30, 0x31);
+
+  // 阴影三点多边形，半透明
+  def<ShadedPolyVertices<3>, drawTriangles, ShadedColorShader, true>(0x32, 0x33);
+
+  // 阴影四点多边形，不透明
+  def<ShadedPolyVertices<4>, drawTriStrip, ShadedColorShader, false>(0x38, 0x39);
+
+  // 阴影四点多边形，半透明
+  def<ShadedPolyVertices<4>, drawTriStrip, ShadedColorShader, true>(0x3A, 0x3B);
+
+  // 带阴影的纹理三点多边形，不透明，纹理混合
+  def<ShadedPolyWithTextureVertices<3>, drawTriangles, ShadedColorTextureMixShader, false>(0x34, 0x35);
+
+  // 带阴影的纹理三点多边形，半透明，纹理混合
+  def<ShadedPolyWithTextureVertices<3>, drawTriangles, ShadedColorTextureMixShader, true>(0x36, 0x37);
+
+  // 带阴影的纹理四点多边形，不透明，纹理混合
+  def<ShadedPolyWithTextureVertices<4>, drawTriStrip, ShadedColorTextureMixShader, false>(0x3C, 0x3D);
+
+  // 着色纹理四点多边形，半透明，纹理混合
+  def<ShadedPolyWithTextureVertices<4>, drawTriStrip, ShadedColorTextureMixShader, true>(0x3E, 0x3F);
+
+  // 单色线，不透明
+  def<MonoLineFixVertices, drawLines, MonoColorShader, false>(0x40);
+
+  // 单色线，半透明
+  def<MonoLineFixVertices, drawLines, MonoColorShader, true>(0x42);
+
+  // 阴影线，不透明
+  def<ShadedPolyVertices<2>, drawLines, ShadedColorShader, false>(0x50);
+
+  // 阴影线，半透明
+  def<ShadedPolyVertices<2>, drawLines, ShadedColorShader, true>(0x52);
+
+  // 单色矩形（可变大小）（不透明）
+  def<SquareVertices<0>, drawTriStrip, MonoColorShader, false>(0x60);
+
+  // 单色矩形（可变大小）（半透明）
+  def<SquareVertices<0>, drawTriStrip, MonoColorShader, true>(0x62);
+
+  // 单色矩形（1x1）（点）（不透明）
+  def<PointVertices, drawPoints, MonoColorShader, false>(0x68);
+
+  // 单色矩形（1x1）（点）（半透明）
+  def<PointVertices, drawPoints, MonoColorShader, true>(0x6A);
+
+  // 单色矩形（8x8）（不透明）
+  def<SquareVertices<7>, drawTriStrip, MonoColorShader, false>(0x70);
+
+  // 单色矩形（8x8）（半透明）
+  def<SquareVertices<7>, drawTriStrip, MonoColorShader, true>(0x72);
+
+  // 单色矩形（ 16x16）（不透明）
+  def<SquareVertices<15>, drawTriStrip, MonoColorShader, false>(0x78);
+
+  // 单色矩形（16x16）（半透明）
+  def<SquareVertices<15>, drawTriStrip, MonoColorShader, true>(0x7A);
+
+  // 纹理矩形，可变大小，不透明，纹理混合
+  def<SquareWithTextureVertices<0>, drawTriStrip, MonoColorTextureMixShader, false>(0x64);
+
+  // 纹理矩形，可变大小，不透明，原始纹理
+  def<SquareWithTextureVertices<0>, drawTriStrip, TextureOnlyShader, false>(0x65);
+
+  // 纹理矩形，可变大小，半透明，纹理混合
+  def<SquareWithTextureVertices<0>, drawTriStrip, MonoColorTextureMixShader, true>(0x66);
+
+  // 纹理矩形，可变大小，半透明，原始纹理
+  def<SquareWithTextureVertices<0>, drawTriStrip, TextureOnlyShader, true>(0x67);
+
+  // 纹理矩形，1x1（无意义?），不透明，纹理混合
+  def<PointTextVertices, drawPoints, MonoColorTextureMixShader, false>(0x6C);
+
+  // 纹理矩形，1x1（无意义），不透明，原始纹理
+  def<PointTextVertices, drawPoints, TextureOnlyShader, false>(0x6D);
+
+  // 纹理矩形，1x1（无意义），半透明，纹理混合
+  def<PointTextVertices, drawPoints, MonoColorTextureMixShader, true>(0x6E);
+
+  // 纹理矩形，1x1（无意义），半透明，原始纹理
+  def<PointTextVertices, drawPoints, TextureOnlyShader, true>(0x6F);
+
+  // 纹理矩形，8x8，不透明，混合纹理
+  def<SquareWithTextureVertices<7>, drawTriStrip, MonoColorTextureMixShader, false>(0x74);
+
+  // 纹理矩形，8x8，不透明，原始纹理
+  def<SquareWithTextureVertices<7>, drawTriStrip, TextureOnlyShader, false>(0x75);
+
+  // 带纹理的矩形，8x8，半透明，纹理混合
+  def<SquareWithTextureVertices<7>, drawTriStrip, MonoColorTextureMixShader, true>(0x76);
+
+  // 带纹理的矩形，8x8，半透明，原始纹理
+  def<SquareWithTextureVertices<7>, drawTriStrip, TextureOnlyShader, true>(0x77);
+
+  // 带纹理的矩形，16x16，不透明，带纹理混合
+  def<SquareWithTextureVertices<15>, drawTriStrip, MonoColorTextureMixShader, false>(0x7C);
+
+  // 带纹理的矩形，16x16，不透明, 原始纹理
+  def<SquareWithTextureVertices<15>, drawTriStrip, TextureOnlyShader, false>(0x7D);
+
+  // 带纹理的矩形，16x16，半透明，混合纹理
+  def<SquareWithTextureVertices<15>, drawTriStrip, MonoColorTextureMixShader, true>(0x7E);
+
+  // 带纹理的矩形，16x16，半透明，原始纹理
+  def<SquareWithTextureVertices<15>, drawTriStrip, TextureOnlyShader, true>(0x7F);
+}
+
+
+static const Gp0CommandTable& gp0_commands() {
+  static Gp0CommandTable table;
+  return table;
+}
+
+
+bool GPU::GP0::primitive(u8 cmd) {
+  return gp0_commands()[cmd].primitive;
+}
+
+
+// 填充和图元都在 gpu 上绘制, 总是需要回读
+void GPU::GP0::range(GPU& gpu, GpuCommandRecord& r) {
+  gp0_commands()[r.cmd].range(gpu, r, r.written);
+  r.readback = true;
+}
+
+
+void GPU::GP0::render(GPU& gpu, GLVertexArrays& vao, const GpuCommandRecord& r) {
+  gp0_commands()[r.cmd].render(gpu, vao, r);
+}
+
+
+void GPU::GP0::upload(GPU& gpu, u32 x, u32 y, u32 w, u32 h, const u16* src, u32 stride) {
+  gpu.send(new FillTexture(gpu, x, y, w, h, src, stride));
+}
+
 
  //TODO: 启用绘制范围
 bool GPU::GP0::parseCommand(const GpuCommand c) {
@@ -885,14 +1228,9 @@ bool GPU::GP0::parseCommand(const GpuCommand c) {
       //debug("Clear Cache\n");
       return false;
 
-    // 在VRAM中填充矩形
-    case 0x02:
-      shape = new Polygon<FillVertices, drawTriStrip, FillRectShader>(1);
-      break;
-
     // 写显存
     case 0xA0:
-      shape = new FillTexture();
+      shape = new FillTexture(p);
       break;
 
     // 读显存
@@ -958,132 +1296,6 @@ bool GPU::GP0::parseCommand(const GpuCommand c) {
       gpudbg("\nGPU E6 lock:%d mask:%d\n", p.status.enb_msk, p.status.mask);
       return false;
       
-    // 单色三点多边形，不透明
-    case 0x20: mirror_case(0x21):
-      shape = new Polygon<PolygonVertices<3>, drawTriangles>(1);
-      break;
-
-    // 单色三点多边形，半透明
-    case 0x22: mirror_case(0x23):
-      shape = new Polygon<PolygonVertices<3>, drawTriangles>(0.5);
-      break;
-       
-    // 单色四点多边形，不透明
-    case 0x28: mirror_case(0x29):
-      shape = new Polygon<PolygonVertices<4>, drawTriStrip>(1);
-      break;
-
-    // 单色四点多边形，半透明
-    case 0x2A: mirror_case(0x2B):
-      shape = new Polygon<PolygonVertices<4>, drawTriStrip>(0.5);
-      break;
-
-    // 带纹理的三点多边形，不透明，混合纹理
-    case 0x24:
-      shape = new Polygon<PolyTextureVertices<3>, 
-                  drawTriangles, MonoColorTextureMixShader>(1);
-      break;
-
-    // 带纹理的三点多边形，不透明，原始纹理
-    case 0x25:
-      shape = new Polygon<PolyTextureVertices<3>, 
-                  drawTriangles, TextureOnlyShader>(1);
-      break;
-
-    // 带纹理的三点多边形，半透明，混合纹理
-    case 0x26:
-      shape = new Polygon<PolyTextureVertices<3>, 
-                  drawTriangles, MonoColorTextureMixShader>(0.5);
-      break;
-
-    // 带纹理的三点多边形，半透明，原始纹理
-    case 0x27:
-      shape = new Polygon<PolyTextureVertices<3>, 
-                  drawTriangles, TextureOnlyShader>(0.5);
-      break;
-
-    // 带纹理的四点多边形，不透明，混合纹理
-    case 0x2C:
-      shape = new Polygon<PolyTextureVertices<4>, 
-                  drawTriStrip, MonoColorTextureMixShader>(1);
-      break;
-
-    // 带纹理的四点多边形，不透明，原始纹理
-    case 0x2D:
-      shape = new Polygon<PolyTextureVertices<4>, 
-                  drawTriStrip, TextureOnlyShader>(1);
-      break;
-
-    // 带纹理的四点多边形，半透明，混合纹理
-    case 0x2E:
-      shape = new Polygon<PolyTextureVertices<4>, 
-                  drawTriStrip, MonoColorTextureMixShader>(0.5);
-      break;
-
-    // 带纹理的四点多边形，半透明，原始纹理
-    case 0x2F:
-      shape = new Polygon<PolyTextureVertices<4>, 
-                  drawTriStrip, TextureOnlyShader>(0.5);
-      break;
-
-    // 阴影三点多边形，不透明
-    case 0x30: mirror_case(0x31):
-      shape = new Polygon<ShadedPolyVertices<3>, 
-                  drawTriangles, ShadedColorShader>(1);
-      break;
-
-    // 阴影三点多边形，半透明
-    case 0x32: mirror_case(0x33):
-      shape = new Polygon<ShadedPolyVertices<3>, 
-                  drawTriangles, ShadedColorShader>(0.5);
-      break;
-
-    // 阴影四点多边形，不透明
-    case 0x38: mirror_case(0x39):
-      shape = new Polygon<ShadedPolyVertices<4>, 
-                  drawTriStrip, ShadedColorShader>(1);
-      break;
-
-    // 阴影四点多边形，半透明
-    case 0x3A: mirror_case(0x3B):
-      shape = new Polygon<ShadedPolyVertices<4>, 
-                  drawTriStrip, ShadedColorShader>(0.5);
-      break;
-
-    // 带阴影的纹理三点多边形，不透明，纹理混合
-    case 0x34: mirror_case(0x35):
-      shape = new Polygon<ShadedPolyWithTextureVertices<3>,
-                  drawTriangles, ShadedColorTextureMixShader>(1);
-      break;
-
-    // 带阴影的纹理三点多边形，半透明，纹理混合
-    case 0x36: mirror_case(0x37):
-      shape = new Polygon<ShadedPolyWithTextureVertices<3>,
-                  drawTriangles, ShadedColorTextureMixShader>(0.5);
-      break;
-
-    // 带阴影的纹理四点多边形，不透明，纹理混合
-    case 0x3C: mirror_case(0x3D):
-      shape = new Polygon<ShadedPolyWithTextureVertices<4>,
-                  drawTriStrip, ShadedColorTextureMixShader>(1);
-      break;
-
-    // 着色纹理四点多边形，半透明，纹理混合
-    case 0x3E: mirror_case(0x3F):
-      shape = new Polygon<ShadedPolyWithTextureVertices<4>,
-                  drawTriStrip, ShadedColorTextureMixShader>(0.5);
-      break;
-
-    // 单色线，不透明
-    case 0x40:
-      shape = new Polygon<MonoLineFixVertices, drawLines, MonoColorShader>(1);
-      break;
-
-    // 单色线，半透明
-    case 0x42:
-      shape = new Polygon<MonoLineFixVertices, drawLines, MonoColorShader>(0.5);
-      break;
-
     // 单色多线，不透明
     case 0x48:
       shape = new Polygon<MonoLineMulVertices, drawLines, MonoColorShader>(1);
@@ -1094,16 +1306,6 @@ bool GPU::GP0::parseCommand(const GpuCommand c) {
       shape = new Polygon<MonoLineMulVertices, drawLines, MonoColorShader>(0.5);
       break;
 
-    // 阴影线，不透明
-    case 0x50: 
-      shape = new Polygon<ShadedPolyVertices<2>, drawLines, ShadedColorShader>(1);
-      break;
-
-    // 阴影线，半透明
-    case 0x52: 
-      shape = new Polygon<ShadedPolyVertices<2>, drawLines, ShadedColorShader>(0.5);
-      break;
-
     // 阴影多段线，不透明
     case 0x58:
       shape = new Polygon<ShadedLineMulVertices, drawLines, ShadedColorShader>(1);
@@ -1114,142 +1316,6 @@ bool GPU::GP0::parseCommand(const GpuCommand c) {
       shape = new Polygon<ShadedLineMulVertices, drawLines, ShadedColorShader>(0.5);
       break;
 
-    // 单色矩形（可变大小）（不透明）
-    case 0x60:
-      shape = new Polygon<SquareVertices<0>, drawTriStrip, MonoColorShader>(1);
-      break;
-
-    // 单色矩形（可变大小）（半透明）
-    case 0x62:
-      shape = new Polygon<SquareVertices<0>, drawTriStrip, MonoColorShader>(0.5);
-      break;
-
-    // 单色矩形（1x1）（点）（不透明）
-    case 0x68:
-      shape = new Polygon<PointVertices, drawPoints, MonoColorShader>(1);
-      break;
-
-    // 单色矩形（1x1）（点）（半透明）
-    case 0x6A:
-      shape = new Polygon<PointVertices, drawPoints, MonoColorShader>(0.5);
-      break;
-
-    // 单色矩形（8x8）（不透明）
-    case 0x70:
-      shape = new Polygon<SquareVertices<7>, drawTriStrip, MonoColorShader>(1);
-      break;
-
-    // 单色矩形（8x8）（半透明）
-    case 0x72:
-      shape = new Polygon<SquareVertices<7>, drawTriStrip, MonoColorShader>(0.5);
-      break;
-
-    // 单色矩形（ 16x16）（不透明）
-    case 0x78:
-      shape = new Polygon<SquareVertices<15>, drawTriStrip, MonoColorShader>(1);
-      break;
-
-    // 单色矩形（16x16）（半透明）
-    case 0x7A:
-      shape = new Polygon<SquareVertices<15>, drawTriStrip, MonoColorShader>(0.5);
-      break;
-
-    // 纹理矩形，可变大小，不透明，纹理混合
-    case 0x64:
-      shape = new Polygon<SquareWithTextureVertices<0>,
-                  drawTriStrip, MonoColorTextureMixShader>(1);
-      break;
-
-    // 纹理矩形，可变大小，不透明，原始纹理
-    case 0x65:
-      shape = new Polygon<SquareWithTextureVertices<0>,
-                  drawTriStrip, TextureOnlyShader>(1);
-      break;
-
-    // 纹理矩形，可变大小，半透明，纹理混合
-    case 0x66:
-      shape = new Polygon<SquareWithTextureVertices<0>,
-                  drawTriStrip, MonoColorTextureMixShader>(0.5);
-      break;
-
-    // 纹理矩形，可变大小，半透明，原始纹理
-    case 0x67:
-      shape = new Polygon<SquareWithTextureVertices<0>,
-                  drawTriStrip, TextureOnlyShader>(0.5);
-      break;
-
-    // 纹理矩形，1x1（无意义?），不透明，纹理混合
-    case 0x6C:
-      shape = new Polygon<PointTextVertices,
-                  drawPoints, MonoColorTextureMixShader>(1);
-      break;
-
-    // 纹理矩形，1x1（无意义），不透明，原始纹理
-    case 0x6D:
-      shape = new Polygon<PointTextVertices,
-                  drawPoints, TextureOnlyShader>(1);
-      break;
-
-    // 纹理矩形，1x1（无意义），半透明，纹理混合
-    case 0x6E:
-      shape = new Polygon<PointTextVertices,
-                  drawPoints, MonoColorTextureMixShader>(0.5);
-      break;
-
-    // 纹理矩形，1x1（无意义），半透明，原始纹理
-    case 0x6F:
-      shape = new Polygon<PointTextVertices,
-                  drawPoints, TextureOnlyShader>(0.5);
-      break;
-
-    // 纹理矩形，8x8，不透明，混合纹理
-    case 0x74:
-      shape = new Polygon<SquareWithTextureVertices<7>,
-                  drawTriStrip, MonoColorTextureMixShader>(1);
-      break;
-
-    // 纹理矩形，8x8，不透明，原始纹理
-    case 0x75:
-      shape = new Polygon<SquareWithTextureVertices<7>,
-                  drawTriStrip, TextureOnlyShader>(1);
-      break;
-
-    // 带纹理的矩形，8x8，半透明，纹理混合
-    case 0x76:
-      shape = new Polygon<SquareWithTextureVertices<7>,
-                  drawTriStrip, MonoColorTextureMixShader>(0.5);
-      break;
-
-    // 带纹理的矩形，8x8，半透明，原始纹理
-    case 0x77:
-      shape = new Polygon<SquareWithTextureVertices<7>,
-                  drawTriStrip, TextureOnlyShader>(0.5);
-      break;
-
-    // 带纹理的矩形，16x16，不透明，带纹理混合
-    case 0x7C:
-      shape = new Polygon<SquareWithTextureVertices<15>,
-                  drawTriStrip, MonoColorTextureMixShader>(1);
-      break;
-
-    // 带纹理的矩形，16x16，不透明, 原始纹理
-    case 0x7D:
-      shape = new Polygon<SquareWithTextureVertices<15>,
-                  drawTriStrip, TextureOnlyShader>(1);
-      break;
-
-    // 带纹理的矩形，16x16，半透明，混合纹理
-    case 0x7E:
-      shape = new Polygon<SquareWithTextureVertices<15>,
-                  drawTriStrip, MonoColorTextureMixShader>(0.5);
-      break;
-
-    // 带纹理的矩形，16x16，半透明，原始纹理
-    case 0x7F:
-      shape = new Polygon<SquareWithTextureVertices<15>,
-                  drawTriStrip, TextureOnlyShader>(0.5);
-      break;
-
     default:
       error("Invaild GP0 Command %x %x\n", c.cmd, c.v);
       return false;
@@ -1275,13 +1341,29 @@ u32 GPU::GP0::read() {
 
 void GPU::GP0::write(u32 v) {
   //gpudbg("GP0 Write 0x%08x\n", v);
+  if (p.soft) {
+    writeSoft(v);
+    return;
+  }
   switch (stage) {
-    case ShapeDataStage::read_command:
+    case ShapeDataStage::read_command: {
+      // 定长的绘图命令只复制命令字, 不创建对象
+      const u8 op = v >> 24;
+      const Gp0Command& c = gp0_commands()[op];
+      if (c.words) {
+        rec.cmd = op;
+        rec.length = c.words;
+        rec.words[0] = v;
+        rec_count = 1;
+        stage = ShapeDataStage::read_record;
+        break;
+      }
       if (!parseCommand(v)) {
         break;
       }
       gpudbg("command gpu %08x, color %dbit\n", v, p.status.isrgb24 ? 24 : 15);
       stage = ShapeDataStage::read_data;
+    }
       // do not break
 
     case ShapeDataStage::read_data:
@@ -1293,11 +1375,50 @@ void GPU::GP0::write(u32 v) {
         gpudbg("\nGpu cmd over\n");
       }
       break;
+
+    case ShapeDataStage::read_record:
+      rec.words[rec_count] = v;
+      if (++rec_count >= rec.length) {
+        p.send(rec);
+        stage = ShapeDataStage::read_command;
+      }
+      break;
+  }
+}
+
+
+// 所有命令字都由 SoftGpu 绘制, 这里只更新状态寄存器和处理读显存
+void GPU::GP0::writeSoft(u32 v) {
+  const bool command = stage == ShapeDataStage::read_command && p.soft->idle();
+  p.soft->write(v);
+
+  if (stage == ShapeDataStage::read_data) {
+    if (!shape->write(v)) {
+      p.send(shape);
+      shape = NULL;
+      stage = ShapeDataStage::read_command;
+    }
+    return;
+  }
+  if (!command) {
+    return;
+  }
+
+  const u8 op = v >> 24;
+  if (op != 0xC0 && op != 0x1F && (op < 0xE1 || op > 0xE6)) {
+    return;
+  }
+  if (parseCommand(v)) {
+    shape->write(v);
+    stage = ShapeDataStage::read_data;
   }
 }
 
 
 void GPU::GP0::reset_fifo() {
+  if (p.soft) {
+    p.soft->reset();
+  }
   stage = ShapeDataStage::read_command;
   if (shape) {
     delete shape;
@@ -1306,7 +1427,8 @@ void GPU::GP0::reset_fifo() {
 }
 
 
-GPU::GP0::GP0(GPU &_p) : p(_p), stage(ShapeDataStage::read_command), shape(0), last_read(0) {
+GPU::GP0::GP0(GPU &_p) : 
+    p(_p), stage(ShapeDataStage::read_command), shape(0), rec_count(0), last_read(0) {
 }
 
 
@@ -66,6 +66,7 @@ vec2 to_textcoord(uint coord, uint page, uint textwin) {
 #define TextureFragShaderHeader  GSGL_VERSION R"shader(
 uniform uint page;
 uniform uint clut;
+uniform uint cached;
 uniform float transparent;
 uniform uint frame_width;
 uniform uint frame_height;
@@ -133,6 +134,14 @@ vec2 get_clut_coord(uint clut_index) {
 }
 
 vec4 texture_mode(sampler2D text, vec2 coord) {
+  // text 是已经解码的 256x256 纹理页缓存
+  if (cached != 0u) {
+    uint pagey = (1u & (page >> 4)) << 8;
+    uint u = uint(coord.x * frame_width) & 0xFFu;
+    uint v = (uint(coord.y * frame_height) - pagey) & 0xFFu;
+    return texelFetch(text, ivec2(u, v), 0);
+  }
+
   switch (int(page >> 7) & 0x03) {
     case 0: // 4bit
       uint index4 = get_clut_index(text, coord, 0xFFFCu, 2, 2) & 0xFu;
@@ -285,6 +294,51 @@ void main() {
 }
 )shader";
 
+// ---------- ---------- Decode 4/8bit texture page with clut
+
+static ShaderSrc clut_decode_v = GSGL_VERSION R"shader(
+void main() {
+  vec2 p = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1));
+  gl_Position = vec4(p * 2 - 1, 0, 1.0);
+}
+)shader";
+
+
+static ShaderSrc clut_decode_f = GSGL_VERSION R"shader(
+out vec4 FragColor;
+uniform sampler2D text;
+uniform uint page;
+uniform uint clut;
+
+uint vram_word(uint x, uint y) {
+  vec4 c = texelFetch(text, ivec2(x & 0x3FFu, y & 0x1FFu), 0);
+  return  uint(round(c.r * 31.0))
+       | (uint(round(c.g * 31.0)) << 5)
+       | (uint(round(c.b * 31.0)) << 10)
+       | ((c.a > 0 ? 1u : 0u) << 15);
+}
+
+void main() {
+  uint u = uint(gl_FragCoord.x);
+  uint v = uint(gl_FragCoord.y);
+  uint pagex = (0x0Fu & page) << 6;
+  uint pagey = (1u & (page >> 4)) << 8;
+  uint index;
+
+  if (((page >> 7) & 0x03u) == 0u) { // 4bit
+    index = (vram_word(pagex + (u >> 2), pagey + v) >> ((u & 3u) << 2)) & 0xFu;
+  } else { // 8bit
+    index = (vram_word(pagex + (u >> 1), pagey + v) >> ((u & 1u) << 3)) & 0xFFu;
+  }
+
+  uint clut_x = ((clut & 0x3fu) << 4) + index;
+  uint clut_y = ((clut >> 6) & 0x1ffu);
+  vec4 pix = texelFetch(text, ivec2(clut_x & 0x3FFu, clut_y), 0);
+  pix.a = (pix.rgb == vec3(0)) ? 0 : 1;
+  FragColor = pix;
+}
+)shader";
+
 // ---------- ---------- Shader for virtual ps ram (frame buffer)
 
 static ShaderSrc draw_virtual_screen_vertex = GSGL_VERSION R"shader(
@@ -332,5 +386,8 @@ ShaderSrc FillRectShader::frag = color_direct_frag;
 ShaderSrc CopyTextureShader::vertex = copy_texture_v;
 ShaderSrc CopyTextureShader::frag = draw_texture_frag;
 
+ShaderSrc ClutDecodeShader::vertex = clut_decode_v;
+ShaderSrc ClutDecodeShader::frag = clut_decode_f;
+
 
 }
\ No newline at end of file
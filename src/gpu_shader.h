@@ -38,7 +38,7 @@ protected:
 public:
   virtual ~PSShaderBase() {}
 
-  PSShaderBase(ShaderSrc v, ShaderSrc f) : OpenGLShader(v, f) {
+  PSShaderBase(ShaderSrc v, ShaderSrc f) : OpenGLShader(v, f), update_flag(~0u) {
     use();
     x  = getUniform("offx");
     y  = getUniform("offy");
@@ -57,6 +57,15 @@ public:
     }
   }
 
+  // 纹理着色器返回绘制时采样的纹理
+  template<class Vertices>
+  static GLTexture* prepareTexture(Vertices&, GPU&) {
+    return 0;
+  }
+
+  // 纹理着色器从纹理页缓存采样
+  void setCached(bool) {}
+
   void printClut(u32 clut) {
     u32 x = ((clut & 0x3fu) << 4);
     u32 y = (clut >> 6) & 0x1ffu;
@@ -128,6 +137,7 @@ private:
   GLUniform page;
   GLUniform clut;
   GLUniform textwin;
+  GLUniform cached;
 
 public:
   static const bool Texture = true;
@@ -140,6 +150,17 @@ public:
     page    = getUniform("page");
     clut    = getUniform("clut");
     textwin = getUniform("textwin");
+    cached  = getUniform("cached");
+  }
+
+  template<class Vertices>
+  static GLTexture* prepareTexture(Vertices& v, GPU& gpu) {
+    GLTexture* t = gpu.textureCache().use(gpu, v.page, v.clut);
+    return t ? t : gpu.useTexture();
+  }
+
+  void setCached(bool c) {
+    cached.setUint(c);
   }
 
   template<class Vertices>
@@ -186,6 +207,7 @@ private:
   GLUniform page;
   GLUniform clut;
   GLUniform textwin;
+  GLUniform cached;
 
 public:
   static const bool Texture = true;
@@ -195,6 +217,17 @@ public:
     page    = getUniform("page");
     clut    = getUniform("clut");
     textwin = getUniform("textwin");
+    cached  = getUniform("cached");
+  }
+
+  template<class Vertices>
+  static GLTexture* prepareTexture(Vertices& v, GPU& gpu) {
+    GLTexture* t = gpu.textureCache().use(gpu, v.page, v.clut);
+    return t ? t : gpu.useTexture();
+  }
+
+  void setCached(bool c) {
+    cached.setUint(c);
   }
 
   template<class Vertices>
@@ -245,6 +278,29 @@ public:
 };
 
 
+// 通过 CLUT 将 4/8bit 纹理页解码为 RGBA, 用于纹理页缓存
+class ClutDecodeShader : public OpenGLShader {
+private:
+  static ShaderSrc vertex;
+  static ShaderSrc frag;
+
+  GLUniform page;
+  GLUniform clut;
+
+public:
+  ClutDecodeShader() : OpenGLShader(vertex, frag) {
+    use();
+    page = getUniform("page");
+    clut = getUniform("clut");
+  }
+
+  void setPage(u32 p, u32 c) {
+    page.setUint(p);
+    clut.setUint(c);
+  }
+};
+
+
 class VirtualScreenShader : public OpenGLShader {
 private:
   static ShaderSrc vertex;
@@ -0,0 +1,919 @@
+﻿#include "gpu_soft.h"
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+namespace ps1e {
+
+// 4x4 抖动矩阵, 加到 8bit 颜色上
+static const s32 dither_table[4][4] = {
+  { -4,  0, -3,  1 },
+  {  2, -2,  3, -1 },
+  { -3,  1, -4,  0 },
+  {  3, -1,  2, -2 },
+};
+
+
+// 命令的字数(含命令字), 多段线不定长不使用这个值
+static u32 command_words(u32 op) {
+  switch (op >> 5) {
+    case 1: { // 多边形
+      const u32 n     = (op & 0x08) ? 4 : 3;
+      const u32 tex   = (op & 0x04) ? 1 : 0;
+      const u32 shade = (op & 0x10) ? 1 : 0;
+      return 1 + n * (1 + tex) + shade * (n - 1);
+    }
+    case 2: // 线
+      return (op & 0x10) ? 4 : 3;
+    case 3: // 矩形
+      return 2 + ((op & 0x04) ? 1 : 0) + (((op >> 3) & 3) == 0 ? 1 : 0);
+    case 4: // 复制显存
+      return 4;
+    case 5: // 写显存, 不含数据
+    case 6: // 读显存
+      return 3;
+  }
+  return op == 0x02 ? 3 : 1;
+}
+
+
+static inline s32 sign11(u32 v) {
+  return s32(v << 21) >> 21;
+}
+
+
+static inline u32 clamp8(s32 v) {
+  return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+
+static inline u32 channel(u32 c, u32 shift) {
+  return (c >> shift) & 0xFF;
+}
+
+
+void SoftGpu::TileMask::clear() {
+  memset(b, 0, sizeof(b));
+}
+
+
+bool SoftGpu::TileMask::any(const TileMask& o) const {
+  for (u32 i = 0; i < Tiles / 64; ++i) {
+    if (b[i] & o.b[i]) return true;
+  }
+  return false;
+}
+
+
+void SoftGpu::TileMask::add(const TileMask& o) {
+  for (u32 i = 0; i < Tiles / 64; ++i) {
+    b[i] |= o.b[i];
+  }
+}
+
+
+SoftGpu::SoftGpu(u32 threads) : serial(false), workers(0), stage(Stage::command),
+    count(0), need(0), line_last{0, 0, 0, 0, 0}, line_count(0),
+    up_x(0), up_y(0), up_w(0), up_h(0), up_pos(0)
+{
+  pixels = new u16[Width * Height];
+  memset(pixels, 0, Width * Height * sizeof(u16));
+  memset(&st, 0, sizeof(st));
+  st.clip_x2 = Width - 1;
+  st.clip_y2 = Height - 1;
+  written.clear();
+  texread.clear();
+  // 第一帧上传整个显存
+  memset(dirty.b, 0xFF, sizeof(dirty.b));
+  if (threads) {
+    workers = new WorkerPool(threads);
+  }
+}
+
+
+SoftGpu::~SoftGpu() {
+  delete workers;
+  delete [] pixels;
+}
+
+
+bool SoftGpu::idle() {
+  return stage == Stage::command;
+}
+
+
+void SoftGpu::reset() {
+  stage = Stage::command;
+  count = 0;
+}
+
+
+void SoftGpu::write(u32 w) {
+  switch (stage) {
+    case Stage::command:
+      command(w);
+      break;
+
+    case Stage::words:
+      words[count++] = w;
+      if (count >= need) {
+        stage = Stage::command;
+        execute();
+      }
+      break;
+
+    case Stage::polyline:
+      polyline(w);
+      break;
+
+    case Stage::upload:
+      upload(w);
+      break;
+  }
+}
+
+
+void SoftGpu::command(u32 w) {
+  const u32 op = w >> 24;
+  words[0] = w;
+  count = 1;
+
+  if ((op >> 5) == 2 && (op & 0x08)) {
+    stage = Stage::polyline;
+    line_count = 0;
+    return;
+  }
+  need = command_words(op);
+  if (need > 1) {
+    stage = Stage::words;
+    return;
+  }
+  execute();
+}
+
+
+void SoftGpu::execute() {
+  const u32 op = words[0] >> 24;
+  switch (op >> 5) {
+    case 1:
+      polygon();
+      return;
+
+    case 2:
+      line();
+      return;
+
+    case 3:
+      rect();
+      return;
+
+    case 4:
+      copy();
+      return;
+
+    case 5:
+      // 之前的图元必须先完成
+      flush();
+      up_x   = words[1] & 0x3FF;
+      up_y   = (words[1] >> 16) & 0x1FF;
+      up_w   = (((words[2] & 0xFFFF) - 1) & 0x3FF) + 1;
+      up_h   = (((words[2] >> 16) - 1) & 0x1FF) + 1;
+      up_pos = 0;
+      stage  = Stage::upload;
+      markDirty(up_x, up_y, up_w, up_h);
+      return;
+
+    case 6:
+      // 读显存由调用者通过 read() 完成
+      return;
+  }
+
+  if (op == 0x02) {
+    fill();
+  } else if (op >= 0xE1 && op <= 0xE6) {
+    setState(words[0]);
+  }
+}
+
+
+void SoftGpu::setState(u32 w) {
+  switch (w >> 24) {
+    case 0xE1:
+      st.page   = w & 0x1FF;
+      st.dither = (w >> 9) & 1;
+      st.flip_x = (w >> 12) & 1;
+      st.flip_y = (w >> 13) & 1;
+      break;
+
+    case 0xE2:
+      st.win_mask_x = w & 0x1F;
+      st.win_mask_y = (w >> 5) & 0x1F;
+      st.win_off_x  = (w >> 10) & 0x1F;
+      st.win_off_y  = (w >> 15) & 0x1F;
+      break;
+
+    case 0xE3:
+      st.clip_x1 = w & 0x3FF;
+      st.clip_y1 = (w >> 10) & 0x1FF;
+      break;
+
+    case 0xE4:
+      st.clip_x2 = w & 0x3FF;
+      st.clip_y2 = (w >> 10) & 0x1FF;
+      break;
+
+    case 0xE5:
+      st.off_x = sign11(w & 0x7FF);
+      st.off_y = sign11((w >> 11) & 0x7FF);
+      break;
+
+    case 0xE6:
+      st.set_mask   = w & 1;
+      st.check_mask = (w >> 1) & 1;
+      break;
+  }
+}
+
+
+void SoftGpu::vertex(SoftVertex& v, u32 w) {
+  v.x = sign11(w & 0x7FF) + st.off_x;
+  v.y = sign11((w >> 16) & 0x7FF) + st.off_y;
+  v.u = 0;
+  v.v = 0;
+}
+
+
+// 纹理多边形的纹理页同时修改当前状态
+void SoftGpu::texpage(SoftPrim& p, u32 page) {
+  p.tex_x = (page & 0xF) * 64;
+  p.tex_y = ((page >> 4) & 1) * 256;
+  p.abr   = (page >> 5) & 3;
+  p.tp    = (page >> 7) & 3;
+  st.page = page & 0x1FF;
+}
+
+
+void SoftGpu::clut(SoftPrim& p, u32 c) {
+  p.clut_x = (c & 0x3F) * 16;
+  p.clut_y = (c >> 6) & 0x1FF;
+}
+
+
+static void init_prim(SoftPrim& p, SoftPrimType t, const SoftDrawState& st, u32 op) {
+  memset(&p, 0, sizeof(p));
+  p.type     = t;
+  p.textured = (op & 0x04) != 0;
+  p.raw      = p.textured && (op & 0x01);
+  p.semi     = (op & 0x02) != 0;
+  p.st       = st;
+  p.tex_x    = (st.page & 0xF) * 64;
+  p.tex_y    = ((st.page >> 4) & 1) * 256;
+  p.abr      = (st.page >> 5) & 3;
+  p.tp       = (st.page >> 7) & 3;
+}
+
+
+void SoftGpu::polygon() {
+  const u32 op = words[0] >> 24;
+  const u32 n = (op & 0x08) ? 4 : 3;
+  SoftPrim p;
+  init_prim(p, SoftPrimType::triangle, st, op);
+  p.shaded = (op & 0x10) != 0;
+
+  SoftVertex v[4];
+  u32 color = words[0] & 0xFF'FFFF;
+  u32 k = 1;
+  for (u32 j = 0; j < n; ++j) {
+    if (p.shaded && j > 0) {
+      color = words[k++] & 0xFF'FFFF;
+    }
+    vertex(v[j], words[k++]);
+    v[j].color = color;
+    if (p.textured) {
+      const u32 uv = words[k++];
+      v[j].u = uv & 0xFF;
+      v[j].v = (uv >> 8) & 0xFF;
+      if (j == 0) clut(p, uv >> 16);
+      if (j == 1) texpage(p, uv >> 16);
+    }
+  }
+  p.st = st;
+  p.dither = st.dither && (p.shaded || (p.textured && !p.raw));
+
+  triangle(p, v[0], v[1], v[2]);
+  if (n == 4) {
+    triangle(p, v[1], v[2], v[3]);
+  }
+}
+
+
+void SoftGpu::triangle(SoftPrim& p, const SoftVertex& a, const SoftVertex& b, const SoftVertex& c) {
+  const s32 x0 = std::min(a.x, std::min(b.x, c.x));
+  const s32 x1 = std::max(a.x, std::max(b.x, c.x));
+  const s32 y0 = std::min(a.y, std::min(b.y, c.y));
+  const s32 y1 = std::max(a.y, std::max(b.y, c.y));
+  // 太大的多边形不绘制
+  if (x1 - x0 >= 1024 || y1 - y0 >= 512) return;
+
+  s64 area = s64(b.x - a.x) * (c.y - a.y) - s64(b.y - a.y) * (c.x - a.x);
+  if (area == 0) return;
+
+  p.v[0] = a;
+  if (area > 0) {
+    p.v[1] = b;
+    p.v[2] = c;
+  } else {
+    p.v[1] = c;
+    p.v[2] = b;
+    area = -area;
+  }
+  p.area = area;
+  p.x0 = x0;
+  p.y0 = y0;
+  p.x1 = x1;
+  p.y1 = y1;
+  bin(p);
+}
+
+
+void SoftGpu::rect() {
+  const u32 op = words[0] >> 24;
+  SoftPrim p;
+  init_prim(p, SoftPrimType::rect, st, op);
+
+  u32 k = 1;
+  SoftVertex& v = p.v[0];
+  vertex(v, words[k++]);
+  v.color = words[0] & 0xFF'FFFF;
+  if (p.textured) {
+    const u32 uv = words[k++];
+    v.u = uv & 0xFF;
+    v.v = (uv >> 8) & 0xFF;
+    clut(p, uv >> 16);
+  }
+
+  s32 w, h;
+  switch ((op >> 3) & 3) {
+    case 0:
+      w = words[k] & 0x3FF;
+      h = (words[k] >> 16) & 0x1FF;
+      break;
+    case 1: w = h = 1;  break;
+    case 2: w = h = 8;  break;
+    default: w = h = 16; break;
+  }
+  if (w == 0 || h == 0) return;
+
+  p.v[1].x = w;
+  p.v[1].y = h;
+  p.x0 = v.x;
+  p.y0 = v.y;
+  p.x1 = v.x + w - 1;
+  p.y1 = v.y + h - 1;
+  bin(p);
+}
+
+
+void SoftGpu::addLine(const SoftVertex& a, const SoftVertex& b, u32 op) {
+  if (abs(b.x - a.x) >= 1024 || abs(b.y - a.y) >= 512) return;
+  SoftPrim p;
+  init_prim(p, SoftPrimType::line, st, op & ~0x04);
+  p.shaded = (op & 0x10) != 0;
+  p.dither = st.dither && p.shaded;
+  p.v[0] = a;
+  p.v[1] = b;
+  p.x0 = std::min(a.x, b.x);
+  p.x1 = std::max(a.x, b.x);
+  p.y0 = std::min(a.y, b.y);
+  p.y1 = std::max(a.y, b.y);
+  bin(p);
+}
+
+
+void SoftGpu::line() {
+  const u32 op = words[0] >> 24;
+  SoftVertex a, b;
+  vertex(a, words[1]);
+  a.color = words[0] & 0xFF'FFFF;
+  if (op & 0x10) {
+    b.color = words[2] & 0xFF'FFFF;
+    vertex(b, words[3]);
+  } else {
+    b.color = a.color;
+    vertex(b, words[2]);
+  }
+  addLine(a, b, op);
+}
+
+
+// 单色: 顶点...; 渐变: 顶点, (颜色, 顶点)...
+void SoftGpu::polyline(u32 w) {
+  const u32 op = words[0] >> 24;
+  // 至少两个顶点之后才检查结束标志
+  if (line_count >= 2 && (w & 0xF000'F000) == 0x5000'5000) {
+    stage = Stage::command;
+    return;
+  }
+  const bool shaded = (op & 0x10) != 0;
+  if (shaded && (count & 1) == 0) {
+    words[1] = w;
+    ++count;
+    return;
+  }
+
+  SoftVertex v;
+  vertex(v, w);
+  v.color = (shaded && count > 1 ? words[1] : words[0]) & 0xFF'FFFF;
+  ++count;
+  if (line_count) {
+    addLine(line_last, v, op);
+  }
+  line_last = v;
+  ++line_count;
+}
+
+
+// 填充不受绘图区域和遮罩影响, 在显存边界回绕
+void SoftGpu::fill() {
+  const u32 x = words[1] & 0x3F0;
+  const u32 y = (words[1] >> 16) & 0x1FF;
+  const u32 w = ((words[2] & 0x3FF) + 0xF) & ~0xF;
+  const u32 h = (words[2] >> 16) & 0x1FF;
+  if (w == 0 || h == 0) return;
+
+  SoftPrim p;
+  init_prim(p, SoftPrimType::fill, st, 0);
+  p.v[0].color = words[0] & 0xFF'FFFF;
+
+  const u32 xe = x + w - 1;
+  const u32 ye = y + h - 1;
+  for (u32 py = 0; py < 2; ++py) {
+    if (py && ye < Height) break;
+    for (u32 px = 0; px < 2; ++px) {
+      if (px && xe < Width) break;
+      p.x0 = px ? 0 : x;
+      p.x1 = px ? xe - Width : std::min(xe, Width - 1);
+      p.y0 = py ? 0 : y;
+      p.y1 = py ? ye - Height : std::min(ye, Height - 1);
+      bin(p);
+    }
+  }
+}
+
+
+void SoftGpu::copy() {
+  flush();
+  const u32 sx = words[1] & 0x3FF;
+  const u32 sy = (words[1] >> 16) & 0x1FF;
+  const u32 dx = words[2] & 0x3FF;
+  const u32 dy = (words[2] >> 16) & 0x1FF;
+  const u32 w  = (((words[3] & 0xFFFF) - 1) & 0x3FF) + 1;
+  const u32 h  = (((words[3] >> 16) - 1) & 0x1FF) + 1;
+
+  // 源和目标可能重叠, 先复制出来
+  copy_buf.resize(w * h);
+  read(sx, sy, w, h, copy_buf.data());
+
+  markDirty(dx, dy, w, h);
+  const u16* src = copy_buf.data();
+  const u16 set = st.set_mask ? 0x8000 : 0;
+  for (u32 j = 0; j < h; ++j) {
+    u16* row = pixels + ((dy + j) & (Height - 1)) * Width;
+    for (u32 i = 0; i < w; ++i) {
+      u16& d = row[(dx + i) & (Width - 1)];
+      const u16 c = *src++;
+      if (st.check_mask && (d & 0x8000)) continue;
+      d = c | set;
+    }
+  }
+}
+
+
+void SoftGpu::writeUpload(u16 c) {
+  const u32 x = (up_x + up_pos % up_w) & (Width - 1);
+  const u32 y = (up_y + up_pos / up_w) & (Height - 1);
+  u16& d = pixels[y * Width + x];
+  if (!(st.check_mask && (d & 0x8000))) {
+    d = c | (st.set_mask ? 0x8000 : 0);
+  }
+  ++up_pos;
+}
+
+
+void SoftGpu::upload(u32 w) {
+  const u32 total = up_w * up_h;
+  writeUpload(w & 0xFFFF);
+  if (up_pos < total) {
+    writeUpload(w >> 16);
+  }
+  if (up_pos >= total) {
+    stage = Stage::command;
+  }
+}
+
+
+void SoftGpu::markDirty(u32 x, u32 y, u32 w, u32 h) {
+  const u32 xe = x + w - 1;
+  const u32 ye = y + h - 1;
+  for (u32 py = 0; py < 2; ++py) {
+    if (py && ye < Height) break;
+    for (u32 px = 0; px < 2; ++px) {
+      if (px && xe < Width) break;
+      tileMask(dirty, px ? 0 : x, py ? 0 : y, px ? xe - Width : xe, py ? ye - Height : ye);
+    }
+  }
+}
+
+
+void SoftGpu::tileMask(TileMask& m, s32 x0, s32 y0, s32 x1, s32 y1) {
+  x0 = std::max(x0, 0);
+  y0 = std::max(y0, 0);
+  x1 = std::min(x1, s32(Width - 1));
+  y1 = std::min(y1, s32(Height - 1));
+  for (s32 ty = y0 / TileSize; ty <= y1 / s32(TileSize); ++ty) {
+    for (s32 tx = x0 / TileSize; tx <= x1 / s32(TileSize); ++tx) {
+      const u32 t = ty * TileX + tx;
+      m.b[t >> 6] |= u64(1) << (t & 63);
+    }
+  }
+}
+
+
+// 纹理页和调色板所在的 tile, 纹理页在 x 方向回绕
+void SoftGpu::textureMask(TileMask& m, const SoftPrim& p) {
+  const s32 w = p.tp == 0 ? 64 : (p.tp == 1 ? 128 : 256);
+  const s32 x = p.tex_x;
+  const s32 y = p.tex_y;
+  tileMask(m, x, y, x + w - 1, y + 255);
+  if (x + w > s32(Width)) {
+    tileMask(m, 0, y, x + w - 1 - Width, y + 255);
+  }
+  if (p.tp < 2) {
+    const s32 n = p.tp == 0 ? 16 : 256;
+    const s32 cx = p.clut_x;
+    tileMask(m, cx, p.clut_y, cx + n - 1, p.clut_y);
+    if (cx + n > s32(Width)) {
+      tileMask(m, 0, p.clut_y, cx + n - 1 - Width, p.clut_y);
+    }
+  }
+}
+
+
+bool SoftGpu::bin(SoftPrim& p) {
+  if (p.type != SoftPrimType::fill) {
+    p.x0 = std::max(p.x0, p.st.clip_x1);
+    p.y0 = std::max(p.y0, p.st.clip_y1);
+    p.x1 = std::min(p.x1, p.st.clip_x2);
+    p.y1 = std::min(p.y1, p.st.clip_y2);
+  }
+  p.x0 = std::max(p.x0, 0);
+  p.y0 = std::max(p.y0, 0);
+  p.x1 = std::min(p.x1, s32(Width - 1));
+  p.y1 = std::min(p.y1, s32(Height - 1));
+  if (p.x0 > p.x1 || p.y0 > p.y1) return false;
+
+  TileMask m, t;
+  m.clear();
+  t.clear();
+  tileMask(m, p.x0, p.y0, p.x1, p.y1);
+  if (p.textured) {
+    textureMask(t, p);
+  }
+
+  // 读取本批已经绘制的纹理, 或覆盖本批作为纹理读取的区域, 都要等待之前的图元
+  if (written.any(t) || texread.any(m) || prims.size() >= MaxBatch) {
+    flush();
+  }
+  // 图元读取自己绘制的区域, 不同 tile 之间有依赖
+  if (m.any(t)) {
+    serial = true;
+  }
+
+  const u32 idx = u32(prims.size());
+  prims.push_back(p);
+  for (u32 i = 0; i < Tiles; ++i) {
+    if (m.b[i >> 6] & (u64(1) << (i & 63))) {
+      bins[i].push_back(idx);
+    }
+  }
+  written.add(m);
+  texread.add(t);
+  return true;
+}
+
+
+void SoftGpu::flush() {
+  if (prims.empty()) return;
+  active.clear();
+  for (u32 t = 0; t < Tiles; ++t) {
+    if (bins[t].size()) active.push_back(t);
+  }
+
+  if (workers && !serial) {
+    workers->run(this, u32(active.size()));
+  } else {
+    for (u32 t : active) rasterTile(t);
+  }
+
+  for (u32 t : active) {
+    bins[t].clear();
+  }
+  prims.clear();
+  dirty.add(written);
+  written.clear();
+  texread.clear();
+  serial = false;
+}
+
+
+void SoftGpu::runTask(u32 i) {
+  rasterTile(active[i]);
+}
+
+
+void SoftGpu::read(u32 x, u32 y, u32 w, u32 h, u16* out) {
+  flush();
+  for (u32 j = 0; j < h; ++j) {
+    const u16* row = pixels + ((y + j) & (Height - 1)) * Width;
+    for (u32 i = 0; i < w; ++i) {
+      *out++ = row[(x + i) & (Width - 1)];
+    }
+  }
+}
+
+
+const u16* SoftGpu::vram() {
+  flush();
+  return pixels;
+}
+
+
+bool SoftGpu::takeDirty(u32 row, u32& x, u32& w) {
+  const u32 t = row * TileX;
+  const u64 m = (dirty.b[t >> 6] >> (t & 63)) & ((u64(1) << TileX) - 1);
+  if (!m) return false;
+  dirty.b[t >> 6] &= ~(m << (t & 63));
+
+  u32 first = 0, last = TileX - 1;
+  while (!(m & (u64(1) << first))) ++first;
+  while (!(m & (u64(1) << last))) --last;
+  x = first * TileSize;
+  w = (last - first + 1) * TileSize;
+  return true;
+}
+
+
+void SoftGpu::rasterTile(u32 t) {
+  const s32 tx0 = (t % TileX) * TileSize;
+  const s32 ty0 = (t / TileX) * TileSize;
+  const s32 tx1 = tx0 + TileSize;
+  const s32 ty1 = ty0 + TileSize;
+
+  for (u32 i : bins[t]) {
+    const SoftPrim& p = prims[i];
+    switch (p.type) {
+      case SoftPrimType::triangle:
+        rasterTriangle(p, tx0, ty0, tx1, ty1);
+        break;
+      case SoftPrimType::rect:
+        rasterRect(p, tx0, ty0, tx1, ty1);
+        break;
+      case SoftPrimType::line:
+        rasterLine(p, tx0, ty0, tx1, ty1);
+        break;
+      case SoftPrimType::fill:
+        rasterFill(p, tx0, ty0, tx1, ty1);
+        break;
+    }
+  }
+}
+
+
+u16 SoftGpu::texel(const SoftPrim& p, u32 u, u32 v) {
+  const u32 mx = p.st.win_mask_x << 3;
+  const u32 my = p.st.win_mask_y << 3;
+  u = ((u & 0xFF) & ~mx) | ((p.st.win_off_x << 3) & mx);
+  v = ((v & 0xFF) & ~my) | ((p.st.win_off_y << 3) & my);
+
+  const u16* row = pixels + ((p.tex_y + v) & (Height - 1)) * Width;
+  const u16* clut = pixels + p.clut_y * Width;
+  switch (p.tp) {
+    case 0: {
+      const u16 w = row[(p.tex_x + (u >> 2)) & (Width - 1)];
+      return clut[(p.clut_x + ((w >> ((u & 3) << 2)) & 0xF)) & (Width - 1)];
+    }
+    case 1: {
+      const u16 w = row[(p.tex_x + (u >> 1)) & (Width - 1)];
+      return clut[(p.clut_x + ((w >> ((u & 1) << 3)) & 0xFF)) & (Width - 1)];
+    }
+    default:
+      return row[(p.tex_x + u) & (Width - 1)];
+  }
+}
+
+
+void SoftGpu::plot(const SoftPrim& p, s32 x, s32 y, u32 r, u32 g, u32 b, u16 tex) {
+  u16& d = pixels[y * Width + x];
+  if (p.st.check_mask && (d & 0x8000)) return;
+
+  if (p.textured) {
+    const u32 tr = (tex & 0x1F) << 3;
+    const u32 tg = ((tex >> 5) & 0x1F) << 3;
+    const u32 tb = ((tex >> 10) & 0x1F) << 3;
+    if (p.raw) {
+      r = tr; g = tg; b = tb;
+    } else {
+      r = std::min((tr * r) >> 7, 255u);
+      g = std::min((tg * g) >> 7, 255u);
+      b = std::min((tb * b) >> 7, 255u);
+    }
+  }
+  if (p.dither) {
+    const s32 dv = dither_table[y & 3][x & 3];
+    r = clamp8(s32(r) + dv);
+    g = clamp8(s32(g) + dv);
+    b = clamp8(s32(b) + dv);
+  }
+
+  s32 r5 = r >> 3;
+  s32 g5 = g >> 3;
+  s32 b5 = b >> 3;
+
+  // 纹理像素 bit15 决定是否半透明
+  if (p.semi && (!p.textured || (tex & 0x8000))) {
+    const s32 br = d & 0x1F;
+    const s32 bg = (d >> 5) & 0x1F;
+    const s32 bb = (d >> 10) & 0x1F;
+    switch (p.abr) {
+      case 0:
+        r5 = (br + r5) >> 1;
+        g5 = (bg + g5) >> 1;
+        b5 = (bb + b5) >> 1;
+        break;
+      case 1:
+        r5 = std::min(br + r5, 31);
+        g5 = std::min(bg + g5, 31);
+        b5 = std::min(bb + b5, 31);
+        break;
+      case 2:
+        r5 = std::max(br - r5, 0);
+        g5 = std::max(bg - g5, 0);
+        b5 = std::max(bb - b5, 0);
+        break;
+      case 3:
+        r5 = std::min(br + (r5 >> 2), 31);
+        g5 = std::min(bg + (g5 >> 2), 31);
+        b5 = std::min(bb + (b5 >> 2), 31);
+        break;
+    }
+  }
+
+  const u16 mask = (p.textured ? (tex & 0x8000) : 0) | (p.st.set_mask ? 0x8000 : 0);
+  d = u16(r5 | (g5 << 5) | (b5 << 10)) | mask;
+}
+
+
+// 边函数逐像素判断, 属性用重心坐标插值, 与 tile 的划分无关.
+// 左上规则: 右边和下边上的像素不属于三角形.
+void SoftGpu::rasterTriangle(const SoftPrim& p, s32 tx0, s32 ty0, s32 tx1, s32 ty1) {
+  const s32 xs = std::max(p.x0, tx0);
+  const s32 xe = std::min(p.x1, tx1 - 1);
+  const s32 ys = std::max(p.y0, ty0);
+  const s32 ye = std::min(p.y1, ty1 - 1);
+  if (xs > xe || ys > ye) return;
+
+  const SoftVertex* v = p.v;
+  s64 ax[3], by[3], w0[3];
+  s32 bias[3];
+  for (int e = 0; e < 3; ++e) {
+    // 边 e 与顶点 e 相对
+    const SoftVertex& s = v[(e + 1) % 3];
+    const SoftVertex& t = v[(e + 2) % 3];
+    const s32 dx = t.x - s.x;
+    const s32 dy = t.y - s.y;
+    ax[e] = -dy;
+    by[e] = dx;
+    w0[e] = s64(dx) * (ys - s.y) - s64(dy) * (xs - s.x);
+    bias[e] = (dy < 0 || (dy == 0 && dx > 0)) ? 0 : 1;
+  }
+
+  const s64 area = p.area;
+  for (s32 y = ys; y <= ye; ++y) {
+    s64 w[3] = { w0[0], w0[1], w0[2] };
+    for (s32 x = xs; x <= xe; ++x) {
+      if (w[0] >= bias[0] && w[1] >= bias[1] && w[2] >= bias[2]) {
+        u32 r, g, b;
+        if (p.shaded) {
+          r = u32((w[0] * channel(v[0].color, 0)  + w[1] * channel(v[1].color, 0)
+                 + w[2] * channel(v[2].color, 0))  / area);
+          g = u32((w[0] * channel(v[0].color, 8)  + w[1] * channel(v[1].color, 8)
+                 + w[2] * channel(v[2].color, 8))  / area);
+          b = u32((w[0] * channel(v[0].color, 16) + w[1] * channel(v[1].color, 16)
+                 + w[2] * channel(v[2].color, 16)) / area);
+        } else {
+          r = channel(v[0].color, 0);
+          g = channel(v[0].color, 8);
+          b = channel(v[0].color, 16);
+        }
+
+        u16 tex = 0;
+        if (p.textured) {
+          const u32 u  = u32((w[0] * v[0].u + w[1] * v[1].u + w[2] * v[2].u) / area);
+          const u32 tv = u32((w[0] * v[0].v + w[1] * v[1].v + w[2] * v[2].v) / area);
+          tex = texel(p, u, tv);
+        }
+        if (!p.textured || tex) {
+          plot(p, x, y, r, g, b, tex);
+        }
+      }
+      w[0] += ax[0];
+      w[1] += ax[1];
+      w[2] += ax[2];
+    }
+    w0[0] += by[0];
+    w0[1] += by[1];
+    w0[2] += by[2];
+  }
+}
+
+
+void SoftGpu::rasterRect(const SoftPrim& p, s32 tx0, s32 ty0, s32 tx1, s32 ty1) {
+  const s32 xs = std::max(p.x0, tx0);
+  const s32 xe = std::min(p.x1, tx1 - 1);
+  const s32 ys = std::max(p.y0, ty0);
+  const s32 ye = std::min(p.y1, ty1 - 1);
+  const SoftVertex& o = p.v[0];
+  const u32 r = channel(o.color, 0);
+  const u32 g = channel(o.color, 8);
+  const u32 b = channel(o.color, 16);
+
+  for (s32 y = ys; y <= ye; ++y) {
+    const s32 dv = y - o.y;
+    const u32 tv = p.st.flip_y ? o.v - dv : o.v + dv;
+    for (s32 x = xs; x <= xe; ++x) {
+      u16 tex = 0;
+      if (p.textured) {
+        const s32 du = x - o.x;
+        tex = texel(p, p.st.flip_x ? o.u - du : o.u + du, tv);
+        if (!tex) continue;
+      }
+      plot(p, x, y, r, g, b, tex);
+    }
+  }
+}
+
+
+// 包含两个端点, 每个 tile 都遍历整条线, 只绘制落在自己范围内的像素
+void SoftGpu::rasterLine(const SoftPrim& p, s32 tx0, s32 ty0, s32 tx1, s32 ty1) {
+  const s32 xs = std::max(p.x0, tx0);
+  const s32 xe = std::min(p.x1, tx1 - 1);
+  const s32 ys = std::max(p.y0, ty0);
+  const s32 ye = std::min(p.y1, ty1 - 1);
+  if (xs > xe || ys > ye) return;
+
+  const SoftVertex& a = p.v[0];
+  const SoftVertex& b = p.v[1];
+  const s32 dx = b.x - a.x;
+  const s32 dy = b.y - a.y;
+  const s32 steps = std::max(abs(dx), abs(dy));
+
+  for (s32 i = 0; i <= steps; ++i) {
+    s32 x = a.x, y = a.y;
+    if (steps) {
+      // 四舍五入到最近的像素
+      x += s32((s64(dx) * i * 2 + (dx < 0 ? -steps : steps)) / (2 * steps));
+      y += s32((s64(dy) * i * 2 + (dy < 0 ? -steps : steps)) / (2 * steps));
+    }
+    if (x < xs || x > xe || y < ys || y > ye) continue;
+
+    u32 r = channel(a.color, 0);
+    u32 g = channel(a.color, 8);
+    u32 c = channel(a.color, 16);
+    if (p.shaded && steps) {
+      r += s32(channel(b.color, 0)  - r) * i / steps;
+      g += s32(channel(b.color, 8)  - g) * i / steps;
+      c += s32(channel(b.color, 16) - c) * i / steps;
+    }
+    plot(p, x, y, r, g, c, 0);
+  }
+}
+
+
+void SoftGpu::rasterFill(const SoftPrim& p, s32 tx0, s32 ty0, s32 tx1, s32 ty1) {
+  const s32 xs = std::max(p.x0, tx0);
+  const s32 xe = std::min(p.x1, tx1 - 1);
+  const s32 ys = std::max(p.y0, ty0);
+  const s32 ye = std::min(p.y1, ty1 - 1);
+  const u32 c = p.v[0].color;
+  const u16 d = u16((channel(c, 0) >> 3) | ((channel(c, 8) >> 3) << 5)
+                  | ((channel(c, 16) >> 3) << 10));
+
+  for (s32 y = ys; y <= ye; ++y) {
+    u16* row = pixels + y * Width;
+    for (s32 x = xs; x <= xe; ++x) {
+      row[x] = d;
+    }
+  }
+}
+
+}
@@ -0,0 +1,169 @@
+﻿#pragma once
+
+#include "util.h"
+#include <vector>
+
+namespace ps1e {
+
+
+// 图元保存的绘图状态, GP0(E1h~E6h) 在解析时立即生效
+struct SoftDrawState {
+  s32 off_x, off_y;   // E5 绘图偏移
+  s32 clip_x1, clip_y1, clip_x2, clip_y2; // E3/E4 绘图区域, 包含边界
+  u32 page;           // E1 bit0-8, 纹理页与半透明模式
+  u8  dither;         // E1 bit9
+  u8  flip_x, flip_y; // E1 bit12/13, 只用于矩形
+  u8  set_mask;       // E6 bit0
+  u8  check_mask;     // E6 bit1
+  u8  win_mask_x, win_mask_y, win_off_x, win_off_y; // E2 纹理窗口, 8 像素为单位
+};
+
+
+struct SoftVertex {
+  s32 x, y;
+  u32 color;
+  u32 u, v;
+};
+
+
+enum class SoftPrimType : u8 {
+  triangle,
+  rect,
+  line,
+  fill,
+};
+
+
+// 一个图元, 四边形拆成两个三角形;
+// 矩形的 v[0] 是左上角, v[1].x/y 是宽高
+struct SoftPrim {
+  SoftPrimType type;
+  u8 textured;
+  u8 raw;     // 不与颜色混合的纹理
+  u8 semi;
+  u8 shaded;
+  u8 abr;
+  u8 tp;
+  u8 dither;
+  u32 tex_x, tex_y;
+  u32 clut_x, clut_y;
+  // 包围盒, 已经裁剪到绘图区域, 包含边界
+  s32 x0, y0, x1, y1;
+  s64 area;
+  SoftVertex v[3];
+  SoftDrawState st;
+};
+
+
+//
+// 软件光栅化, 解析 GP0 命令流并绘制到自己的显存.
+// 图元按 64x64 的 tile 分组, 每个 tile 中的图元保持命令顺序,
+// 不同 tile 在线程池上并行绘制; 读写/复制显存, 以及读取本批已绘制区域的纹理
+// 之前先完成已经分组的图元.
+//
+class SoftGpu : public IParallelTask, public NonCopy {
+public:
+  static const u32 Width    = 1024;
+  static const u32 Height   = 512;
+  static const u32 TileSize = 64;
+  static const u32 TileX    = Width / TileSize;
+  static const u32 TileY    = Height / TileSize;
+  static const u32 Tiles    = TileX * TileY;
+  // 一批图元的上限, 超过后立即光栅化
+  static const u32 MaxBatch = 0x2000;
+
+private:
+  enum class Stage { command, words, polyline, upload };
+
+  // tile 的位图
+  struct TileMask {
+    u64 b[Tiles / 64];
+    void clear();
+    bool any(const TileMask& o) const;
+    void add(const TileMask& o);
+  };
+
+  u16* pixels;
+  SoftDrawState st;
+  std::vector<SoftPrim> prims;
+  std::vector<u32> bins[Tiles];
+  std::vector<u32> active;
+  // 本批图元写入/作为纹理读取的 tile
+  TileMask written;
+  TileMask texread;
+  // 上次 takeDirty 之后修改的 tile
+  TileMask dirty;
+  // 本批有图元读取自己写入的区域, 只能在一个线程上绘制
+  bool serial;
+  WorkerPool* workers;
+  std::vector<u16> copy_buf;
+
+  Stage stage;
+  u32 words[16];
+  u32 count;
+  u32 need;
+  // 多段线
+  SoftVertex line_last;
+  u32 line_count;
+  // 写显存
+  u32 up_x, up_y, up_w, up_h, up_pos;
+
+  void command(u32 w);
+  void execute();
+  void setState(u32 w);
+  void polygon();
+  void rect();
+  void line();
+  void polyline(u32 w);
+  void fill();
+  void copy();
+  void upload(u32 w);
+  void writeUpload(u16 c);
+
+  void vertex(SoftVertex& v, u32 w);
+  void texpage(SoftPrim& p, u32 page);
+  void clut(SoftPrim& p, u32 c);
+  void triangle(SoftPrim& p, const SoftVertex& a, const SoftVertex& b, const SoftVertex& c);
+  void addLine(const SoftVertex& a, const SoftVertex& b, u32 op);
+  // 裁剪包围盒后放入覆盖的 tile, 完全被裁剪返回 false
+  bool bin(SoftPrim& p);
+  void tileMask(TileMask& m, s32 x0, s32 y0, s32 x1, s32 y1);
+  // 在显存边界回绕
+  void markDirty(u32 x, u32 y, u32 w, u32 h);
+  void textureMask(TileMask& m, const SoftPrim& p);
+
+  void rasterTile(u32 t);
+  void rasterTriangle(const SoftPrim& p, s32 tx0, s32 ty0, s32 tx1, s32 ty1);
+  void rasterRect(const SoftPrim& p, s32 tx0, s32 ty0, s32 tx1, s32 ty1);
+  void rasterLine(const SoftPrim& p, s32 tx0, s32 ty0, s32 tx1, s32 ty1);
+  void rasterFill(const SoftPrim& p, s32 tx0, s32 ty0, s32 tx1, s32 ty1);
+  // 取纹理像素, 0 是透明
+  u16 texel(const SoftPrim& p, u32 u, u32 v);
+  // 8bit 颜色写入像素, 处理抖动/半透明/遮罩
+  void plot(const SoftPrim& p, s32 x, s32 y, u32 r, u32 g, u32 b, u16 tex);
+
+public:
+  // threads 是额外的光栅化线程, 0 则只在调用线程上绘制
+  SoftGpu(u32 threads = 0);
+  ~SoftGpu();
+
+  // 写入一个 GP0 命令字
+  void write(u32 w);
+  // 等待命令字时返回 true
+  bool idle();
+  // 丢弃未完成的命令
+  void reset();
+  // 光栅化已经分组的图元
+  void flush();
+  // 读取显存, 坐标在边界回绕
+  void read(u32 x, u32 y, u32 w, u32 h, u16* out);
+  // 完成已经分组的图元, 返回整个显存
+  const u16* vram();
+  // 取出第 row 行 tile 中修改过的列范围 [x, x+w) 并清除标记, 没有修改返回 false.
+  // 调用之前先用 vram() 完成图元.
+  bool takeDirty(u32 row, u32& x, u32& w);
+  // 绘制 active 中的第 i 个 tile, tile 之间没有共享的像素
+  void runTask(u32 i) override;
+};
+
+}
@@ -0,0 +1,502 @@
+﻿#include "gpu.h"
+#include "gpu_shader.h"
+#include <cstring>
+
+namespace ps1e {
+
+static const u32 X_WRAP = ShadowVram::Width - 1;
+static const u32 Y_WRAP = ShadowVram::Height - 1;
+
+
+// 对区域覆盖的每个 tile 调用 f(index), 坐标超出显存时回绕
+template<class F> static void each_tile(u32 x, u32 y, u32 w, u32 h, F f) {
+  if (w == 0 || h == 0) return;
+  if (w > ShadowVram::Width)  w = ShadowVram::Width;
+  if (h > ShadowVram::Height) h = ShadowVram::Height;
+  const u32 tx0 = x >> ShadowVram::TileBit;
+  const u32 tx1 = (x + w - 1) >> ShadowVram::TileBit;
+  const u32 ty0 = y >> ShadowVram::TileBit;
+  const u32 ty1 = (y + h - 1) >> ShadowVram::TileBit;
+
+  for (u32 ty = ty0; ty <= ty1; ++ty) {
+    const u32 row = (ty & (ShadowVram::TileY - 1)) * ShadowVram::TileX;
+    for (u32 tx = tx0; tx <= tx1; ++tx) {
+      f(row + (tx & (ShadowVram::TileX - 1)));
+    }
+  }
+}
+
+
+ShadowVram::ShadowVram() : drawn_seq(0), rb_next(0) {
+  pixels = new u16[Width * Height];
+  memset(pixels, 0, Width * Height * sizeof(u16));
+  memset(write_seq, 0, sizeof(write_seq));
+  memset(synced_seq, 0, sizeof(synced_seq));
+  memset(direct_seq, 0, sizeof(direct_seq));
+  memset(dirty, 0, sizeof(dirty));
+}
+
+
+ShadowVram::~ShadowVram() {
+  delete [] pixels;
+}
+
+
+void ShadowVram::init() {
+  for (u32 i = 0; i < Frames; ++i) {
+    rb[i].pbo.init(Width * Height * sizeof(u16));
+    rb[i].pending = false;
+  }
+}
+
+
+void ShadowVram::release() {
+  for (u32 i = 0; i < Frames; ++i) {
+    rb[i].fence.release();
+    rb[i].pbo.release();
+    rb[i].pending = false;
+  }
+}
+
+
+void ShadowVram::drawn(const GpuCommandRecord& s) {
+  drawn_seq = s.seq;
+  if (!s.readback) return;
+  const GpuDataRange& r = s.written;
+  each_tile(r.offx, r.offy, r.width, r.height, [this] (u32 t) {
+    dirty[t] = true;
+  });
+}
+
+
+void ShadowVram::readback() {
+  // 按发起顺序回收, 旧数据不能覆盖新数据
+  for (u32 i = 0; i < Frames; ++i) {
+    Readback& r = rb[(rb_next + i) % Frames];
+    if (!r.pending) continue;
+    if (!r.fence.signaled()) break;
+    finish(r);
+  }
+
+  Readback& r = rb[rb_next];
+  if (!r.pending) {
+    issue(r);
+    if (r.pending) {
+      rb_next = (rb_next + 1) % Frames;
+    }
+  }
+}
+
+
+// 每行连续的脏 tile 合并为一个区域
+void ShadowVram::issue(Readback& r) {
+  u32 offset = 0;
+  r.regions.clear();
+  r.pbo.bind();
+
+  for (u32 ty = 0; ty < TileY; ++ty) {
+    bool* row = dirty + ty * TileX;
+    u32 tx = 0;
+    while (tx < TileX) {
+      if (!row[tx]) {
+        ++tx;
+        continue;
+      }
+      u32 begin = tx;
+      while (tx < TileX && row[tx]) {
+        row[tx++] = false;
+      }
+      Region g = { begin << TileBit, ty << TileBit, 
+                   (tx - begin) << TileBit, TileSize, offset };
+      r.pbo.readPsinnerPixel(g.x, g.y, g.w, g.h, g.offset);
+      r.regions.push_back(g);
+      offset += g.w * g.h * sizeof(u16);
+    }
+  }
+
+  r.pbo.unbind();
+  if (r.regions.size()) {
+    r.seq = drawn_seq;
+    r.fence.insert();
+    r.pending = true;
+  }
+}
+
+
+void ShadowVram::finish(Readback& r) {
+  r.pending = false;
+  r.pbo.bind();
+  const u8* src = (const u8*) r.pbo.map();
+
+  if (!src) {
+    warn("Cannot map vram readback buffer\n");
+    for (auto& g : r.regions) {
+      each_tile(g.x, g.y, g.w, g.h, [this] (u32 t) { dirty[t] = true; });
+    }
+    r.pbo.unbind();
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto& g : r.regions) {
+    const u16* data = (const u16*)(src + g.offset);
+    const u32 ty = g.y >> TileBit;
+
+    for (u32 tx = g.x >> TileBit; tx < (g.x + g.w) >> TileBit; ++tx) {
+      const u32 t = ty * TileX + tx;
+      // 回读发起后 cpu 又直接写入了该 tile, 等待下一次回读
+      if (direct_seq[t] > r.seq) {
+        dirty[t] = true;
+        continue;
+      }
+      const u32 col = (tx << TileBit) - g.x;
+      for (u32 y = 0; y < TileSize; ++y) {
+        memcpy(pixels + (g.y + y) * Width + (tx << TileBit), 
+               data + y * g.w + col, TileSize * sizeof(u16));
+      }
+      if (synced_seq[t] < r.seq) {
+        synced_seq[t] = r.seq;
+      }
+    }
+  }
+
+  r.pbo.unmap();
+  r.pbo.unbind();
+}
+
+
+bool ShadowVram::coherent(u32 x, u32 y, u32 w, u32 h) {
+  bool ok = true;
+  each_tile(x, y, w, h, [this, &ok] (u32 t) {
+    if (synced_seq[t] < write_seq[t]) ok = false;
+  });
+  return ok;
+}
+
+
+void ShadowVram::markDirect(u32 x, u32 y, u32 w, u32 h, u32 seq) {
+  each_tile(x, y, w, h, [this, seq] (u32 t) {
+    direct_seq[t] = seq;
+  });
+}
+
+
+void ShadowVram::touch(const GpuDataRange& r, u32 seq) {
+  std::lock_guard<std::mutex> guard(lock);
+  each_tile(r.offx, r.offy, r.width, r.height, [this, seq] (u32 t) {
+    write_seq[t] = seq;
+  });
+}
+
+
+void ShadowVram::write(u32 x, u32 y, u32 w, u32 h, const u16* data, u32 seq) {
+  std::lock_guard<std::mutex> guard(lock);
+  for (u32 j = 0; j < h; ++j) {
+    u16* row = pixels + ((y + j) & Y_WRAP) * Width;
+    for (u32 i = 0; i < w; ++i) {
+      row[(x + i) & X_WRAP] = *data++;
+    }
+  }
+  markDirect(x, y, w, h, seq);
+}
+
+
+// 与硬件相同, 逐行从左到右复制, 区域重叠时的结果一致
+bool ShadowVram::copy(u32 sx, u32 sy, u32 dx, u32 dy, u32 w, u32 h, u32 seq) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (!coherent(sx, sy, w, h)) {
+    return false;
+  }
+  for (u32 j = 0; j < h; ++j) {
+    const u16* src = pixels + ((sy + j) & Y_WRAP) * Width;
+    u16* dst = pixels + ((dy + j) & Y_WRAP) * Width;
+    for (u32 i = 0; i < w; ++i) {
+      dst[(dx + i) & X_WRAP] = src[(sx + i) & X_WRAP];
+    }
+  }
+  markDirect(dx, dy, w, h, seq);
+  return true;
+}
+
+
+bool ShadowVram::read(u32 x, u32 y, u32 w, u32 h, u16* out) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (!coherent(x, y, w, h)) {
+    return false;
+  }
+  for (u32 j = 0; j < h; ++j) {
+    const u16* row = pixels + ((y + j) & Y_WRAP) * Width;
+    for (u32 i = 0; i < w; ++i) {
+      *out++ = row[(x + i) & X_WRAP];
+    }
+  }
+  return true;
+}
+
+
+UploadStream::UploadStream() : head(0), used(0) {
+}
+
+
+UploadStream::~UploadStream() {
+  for (auto& p : pending) {
+    delete p.data;
+  }
+  for (auto b : pool) {
+    delete b;
+  }
+}
+
+
+void UploadStream::init() {
+  ring.init(RingSize);
+  head = 0;
+  used = 0;
+}
+
+
+void UploadStream::release() {
+  for (u32 i = 0; i < Chunks; ++i) {
+    fence[i].release();
+  }
+  ring.release();
+}
+
+
+UploadStream::Buffer* UploadStream::acquire(u32 len) {
+  Buffer* b = 0;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (pool.size()) {
+      b = pool.back();
+      pool.pop_back();
+    }
+  }
+  if (!b) {
+    b = new Buffer();
+  }
+  // 回收的缓冲区通常有足够的容量, 不会重新分配
+  b->resize(len);
+  return b;
+}
+
+
+void UploadStream::recycle(Buffer* b) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (pool.size() < PoolSize && b->capacity() <= PoolMaxLen) {
+    pool.push_back(b);
+  } else {
+    delete b;
+  }
+}
+
+
+void UploadStream::push(u32 x, u32 y, u32 w, u32 h, Buffer* data) {
+  pending.push_back({ x, y, w, h, data });
+}
+
+
+void UploadStream::fenceUsed() {
+  for (u32 c = 0; c < Chunks; ++c) {
+    if (used & (1 << c)) {
+      fence[c].insert();
+    }
+  }
+  used = 0;
+}
+
+
+// 第一次使用某一块时等待上一次使用它的上传完成
+u32 UploadStream::alloc(u32 size) {
+  if (head + size > RingSize) {
+    // 回绕后可能覆盖本次还没有执行的上传
+    fenceUsed();
+    head = 0;
+  }
+  const u32 chunk = RingSize / Chunks;
+  for (u32 c = head / chunk; c <= (head + size - 1) / chunk; ++c) {
+    if (!(used & (1 << c))) {
+      fence[c].wait();
+      used |= 1 << c;
+    }
+  }
+  u32 offset = head;
+  head += size;
+  return offset;
+}
+
+
+// 连续的上传在同一行上左右相邻, 或在同一列上下相邻时合并
+void UploadStream::flush(VirtualFrameBuffer& vram) {
+  if (pending.empty()) {
+    return;
+  }
+  GLTexture* text = vram.useTexture();
+  text->bind();
+  ring.bind();
+
+  size_t i = 0;
+  while (i < pending.size()) {
+    u32 gx = pending[i].x, gy = pending[i].y;
+    u32 gw = pending[i].w, gh = pending[i].h;
+    size_t j = i + 1;
+
+    for (; j < pending.size(); ++j) {
+      const Pending& p = pending[j];
+      if (p.y == gy && p.h == gh && p.x == gx + gw && gw + p.w <= ShadowVram::Width) {
+        gw += p.w;
+      } else if (p.x == gx && p.w == gw && p.y == gy + gh && gh + p.h <= ShadowVram::Height) {
+        gh += p.h;
+      } else {
+        break;
+      }
+    }
+
+    const u32 size = gw * gh * sizeof(u16);
+    const u32 offset = alloc(size);
+    u8* dst = ring.map(offset, size);
+
+    for (size_t k = i; k < j; ++k) {
+      const Pending& p = pending[k];
+      const u16* src = (const u16*) p.data->data();
+      for (u32 r = 0; dst && r < p.h; ++r) {
+        memcpy(dst + ((p.y - gy + r) * gw + (p.x - gx)) * sizeof(u16), 
+               src + r * p.w, p.w * sizeof(u16));
+      }
+      recycle(p.data);
+    }
+
+    if (dst) {
+      ring.unmap();
+      text->subImage2px(gx, gy, gw, gh, offset);
+      vram.uploaded(gx, gy, gw, gh);
+    } else {
+      warn("Cannot map vram upload buffer\n");
+    }
+    i = j;
+  }
+
+  ring.unbind();
+  text->unbind();
+  fenceUsed();
+  pending.clear();
+}
+
+
+// 显存坐标回绕, a/b 长度都不为 0
+static bool wrap_overlap(u32 a, u32 alen, u32 b, u32 blen, u32 size) {
+  return ((a - b) & (size - 1)) < blen || ((b - a) & (size - 1)) < alen;
+}
+
+
+static bool range_overlap(const GpuDataRange& a, const GpuDataRange& b) {
+  return wrap_overlap(a.offx, a.width,  b.offx, b.width,  ShadowVram::Width)
+      && wrap_overlap(a.offy, a.height, b.offy, b.height, ShadowVram::Height);
+}
+
+
+TextureCache::TextureCache() : shader(0), ds(0), tick(0) {
+}
+
+
+TextureCache::~TextureCache() {
+  delete shader;
+}
+
+
+void TextureCache::init() {
+  fbo.init(Size, Size);
+  vao.init();
+  for (u32 i = 0; i < Capacity; ++i) {
+    entries[i].text.init(Size, Size, 0);
+    entries[i].valid = false;
+  }
+  shader = new ClutDecodeShader();
+}
+
+
+void TextureCache::release() {
+  for (u32 i = 0; i < Capacity; ++i) {
+    entries[i].text.release();
+    entries[i].valid = false;
+  }
+  delete shader;
+  shader = 0;
+  vao.release();
+  fbo.release();
+}
+
+
+GLTexture* TextureCache::use(GPU& gpu, u32 page, u32 clut) {
+  const u32 mode = (page >> 7) & 0x03;
+  if (mode >= 2) {
+    GpuDataRange direct = { (page & 0xF) << 6, ((page >> 4) & 1) << 8, 256, 256 };
+    gpu.frameBuffer().sync(direct);
+    return 0;
+  }
+
+  // 纹理页 x/y 与颜色深度, CLUT 的 x/y
+  const u32 key = (page & 0x19F) | ((clut & 0x7FFF) << 16);
+  Entry* victim = &entries[0];
+
+  for (u32 i = 0; i < Capacity; ++i) {
+    Entry& e = entries[i];
+    if (e.valid && e.key == key) {
+      e.used = ++tick;
+      return &e.text;
+    }
+    if (!victim->valid) continue;
+    if (!e.valid || e.used < victim->used) {
+      victim = &e;
+    }
+  }
+
+  Entry& e = *victim;
+  e.key   = key;
+  e.used  = ++tick;
+  e.valid = true;
+  e.page_range = { (page & 0xF) << 6, ((page >> 4) & 1) << 8, mode ? 128u : 64u, 256 };
+  e.clut_range = { (clut & 0x3F) << 4, (clut >> 6) & 0x1FF, mode ? 256u : 16u, 1 };
+  gpu.frameBuffer().sync(e.page_range);
+  gpu.frameBuffer().sync(e.clut_range);
+  decode(gpu, e, page, clut);
+  return &e.text;
+}
+
+
+void TextureCache::decode(GPU& gpu, Entry& e, u32 page, u32 clut) {
+  e.text.attach(fbo);
+  ds.viewport(0, 0, Size, Size);
+  ds.setBlend(false);
+  gpu.enableDrawScope(false);
+
+  shader->use();
+  shader->setPage(page, clut);
+  gpu.useTexture()->bind();
+  {
+    gl_scope(vao);
+    vao.drawTriangleStrip(4);
+  }
+  gpu.useTexture()->unbind();
+
+  gpu.bindDrawTarget();
+  ds.setBlend(true);
+  gpu.enableDrawScope(true);
+}
+
+
+void TextureCache::invalidate(const GpuDataRange& r) {
+  if (r.width == 0 || r.height == 0) {
+    return;
+  }
+  for (u32 i = 0; i < Capacity; ++i) {
+    Entry& e = entries[i];
+    if (!e.valid) continue;
+    if (range_overlap(r, e.page_range) || range_overlap(r, e.clut_range)) {
+      e.valid = false;
+    }
+  }
+}
+
+
+}
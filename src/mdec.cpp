@@ -0,0 +1,623 @@
+﻿#include "mdec.h"
+#include "bus.h"
+#include <mutex>
+#include <condition_variable>
+
+#ifdef MDEC_USE_SSE
+#include <emmintrin.h>
+#endif
+
+namespace ps1e {
+
+// 第一次 IDCT 后保留 1 位小数, 两次共右移 32 位
+#define MDEC_IDCT_SHIFT1  15
+#define MDEC_IDCT_SHIFT2  17
+// 输出 DMA 一次从 FIFO 取出的最大字数
+#define MDEC_PULL_WORDS   0x80
+
+
+static const u8 zigzag[MDEC_BLOCK_SIZE] = {
+   0,  1,  5,  6, 14, 15, 27, 28,
+   2,  4,  7, 13, 16, 26, 29, 42,
+   3,  8, 12, 17, 25, 30, 41, 43,
+   9, 11, 18, 24, 31, 40, 44, 53,
+  10, 19, 23, 32, 39, 45, 52, 54,
+  20, 22, 33, 38, 46, 51, 55, 60,
+  21, 34, 37, 47, 50, 56, 59, 61,
+  35, 36, 48, 49, 57, 58, 62, 63,
+};
+
+
+// zigzag 的逆表
+struct MdecZagzig {
+  u8 v[MDEC_BLOCK_SIZE];
+
+  MdecZagzig() {
+    for (u32 i = 0; i < MDEC_BLOCK_SIZE; ++i) {
+      v[zigzag[i]] = i;
+    }
+  }
+};
+static const MdecZagzig zagzig;
+
+
+static inline s32 signed10(u16 n) {
+  return s32(u32(n) << 22) >> 22;
+}
+
+
+static inline s32 clamp(s32 v, s32 min, s32 max) {
+  return v < min ? min : (v > max ? max : v);
+}
+
+
+// r[y][x] = Σu a[y][u] * m[u][x]
+static void mat_mul(const s16* a, const s16* m, s32* r) {
+#ifdef MDEC_USE_SSE
+  // m 的相邻两行交错, _mm_madd_epi16 一次完成两项乘加
+  __m128i lo[4], hi[4];
+  for (u32 u = 0; u < 4; ++u) {
+    const __m128i r0 = _mm_loadu_si128((const __m128i*)(m + u*16));
+    const __m128i r1 = _mm_loadu_si128((const __m128i*)(m + u*16 + 8));
+    lo[u] = _mm_unpacklo_epi16(r0, r1);
+    hi[u] = _mm_unpackhi_epi16(r0, r1);
+  }
+  for (u32 y = 0; y < 8; ++y) {
+    __m128i s0 = _mm_setzero_si128();
+    __m128i s1 = _mm_setzero_si128();
+    for (u32 u = 0; u < 4; ++u) {
+      s32 pair;
+      memcpy(&pair, a + y*8 + u*2, sizeof(pair));
+      const __m128i k = _mm_set1_epi32(pair);
+      s0 = _mm_add_epi32(s0, _mm_madd_epi16(lo[u], k));
+      s1 = _mm_add_epi32(s1, _mm_madd_epi16(hi[u], k));
+    }
+    _mm_storeu_si128((__m128i*)(r + y*8), s0);
+    _mm_storeu_si128((__m128i*)(r + y*8 + 4), s1);
+  }
+#else
+  for (u32 y = 0; y < 8; ++y) {
+    for (u32 x = 0; x < 8; ++x) {
+      s32 sum = 0;
+      for (u32 u = 0; u < 8; ++u) {
+        sum += s32(a[y*8 + u]) * s32(m[u*8 + x]);
+      }
+      r[y*8 + x] = sum;
+    }
+  }
+#endif
+}
+
+
+// 加上 chroma 后限制在 -128..127, unsigned 输出转换到 0..255
+static inline void add_chroma(const s16* y, const s16* c, s16* d, bool sign) {
+#ifdef MDEC_USE_SSE
+  __m128i vc = _mm_loadl_epi64((const __m128i*) c);
+  vc = _mm_unpacklo_epi16(vc, vc);
+  __m128i v = _mm_adds_epi16(_mm_loadu_si128((const __m128i*) y), vc);
+  v = _mm_max_epi16(_mm_min_epi16(v, _mm_set1_epi16(127)), _mm_set1_epi16(-128));
+  if (!sign) v = _mm_add_epi16(v, _mm_set1_epi16(128));
+  _mm_storeu_si128((__m128i*) d, v);
+#else
+  for (u32 i = 0; i < 8; ++i) {
+    s32 v = clamp(y[i] + c[i >> 1], -128, 127);
+    d[i] = sign ? v : v + 128;
+  }
+#endif
+}
+
+
+MdecDecoder::MdecDecoder() {
+  memset(quant, 0, sizeof(quant));
+  memset(scale, 0, sizeof(scale));
+  memset(scale_t, 0, sizeof(scale_t));
+}
+
+
+void MdecDecoder::setQuant(const u8* q, bool color) {
+  memcpy(quant, q, color ? sizeof(quant) : MDEC_BLOCK_SIZE);
+}
+
+
+void MdecDecoder::setScale(const s16* s) {
+  for (u32 y = 0; y < 8; ++y) {
+    for (u32 x = 0; x < 8; ++x) {
+      scale[y*8 + x] = s[y*8 + x];
+      scale_t[x*8 + y] = s[y*8 + x];
+    }
+  }
+}
+
+
+u32 MdecDecoder::outputSize(MdecCommand c) {
+  static const u32 size[] = { 32, 64, 16*16*3, 16*16*2 };
+  return size[c.depth];
+}
+
+
+u32 MdecDecoder::scan(const u16* src, u32 n, MdecCommand c) {
+  const u32 blocks = c.depth >= 2 ? MDEC_COLOR_BLOCKS : 1;
+  u32 i = 0;
+  for (u32 b = 0; b < blocks; ++b) {
+    while (i < n && src[i] == MDEC_PADDING) ++i;
+    // DC
+    if (i++ >= n) return 0;
+    u32 k = 0;
+    do {
+      if (i >= n) return 0;
+      k += (src[i++] >> 10) + 1;
+    } while (k <= 63);
+  }
+  return i;
+}
+
+
+u32 MdecDecoder::rle(const u16* src, const u8* qt, s16* blk) const {
+  u32 i = 0;
+  memset(blk, 0, sizeof(s16) * MDEC_BLOCK_SIZE);
+  while (src[i] == MDEC_PADDING) ++i;
+
+  u16 n = src[i++];
+  const s32 q_scale = n >> 10;
+  s32 val = signed10(n) * qt[0];
+  u32 k = 0;
+
+  for (;;) {
+    if (q_scale == 0) val = signed10(n) * 2;
+    val = clamp(val, -0x400, 0x3FF);
+    blk[q_scale > 0 ? zagzig.v[k] : k] = val;
+
+    n = src[i++];
+    k += (n >> 10) + 1;
+    if (k > 63) break;
+    val = (signed10(n) * qt[k] * q_scale + 4) / 8;
+  }
+  return i;
+}
+
+
+void MdecDecoder::idct(s16* blk, bool mono) const {
+  alignas(16) s32 t[MDEC_BLOCK_SIZE];
+  alignas(16) s16 h[MDEC_BLOCK_SIZE];
+  mat_mul(scale_t, blk, t);
+
+  u32 i = 0;
+#ifdef MDEC_USE_SSE
+  const __m128i r1 = _mm_set1_epi32(1 << (MDEC_IDCT_SHIFT1 - 1));
+  for (; i < MDEC_BLOCK_SIZE; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(t + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(t + i + 4));
+    a = _mm_srai_epi32(_mm_add_epi32(a, r1), MDEC_IDCT_SHIFT1);
+    b = _mm_srai_epi32(_mm_add_epi32(b, r1), MDEC_IDCT_SHIFT1);
+    _mm_storeu_si128((__m128i*)(h + i), _mm_packs_epi32(a, b));
+  }
+#endif
+  for (; i < MDEC_BLOCK_SIZE; ++i) {
+    h[i] = clamp((t[i] + (1 << (MDEC_IDCT_SHIFT1 - 1))) >> MDEC_IDCT_SHIFT1, -0x8000, 0x7FFF);
+  }
+
+  mat_mul(h, scale, t);
+
+  // 单色输出截断为 9 位有符号数, 再限制在 -128..127
+  i = 0;
+#ifdef MDEC_USE_SSE
+  const __m128i r2 = _mm_set1_epi32(1 << (MDEC_IDCT_SHIFT2 - 1));
+  const __m128i lo = _mm_set1_epi16(-128);
+  const __m128i hi = _mm_set1_epi16(127);
+  for (; i < MDEC_BLOCK_SIZE; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(t + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(t + i + 4));
+    a = _mm_srai_epi32(_mm_add_epi32(a, r2), MDEC_IDCT_SHIFT2);
+    b = _mm_srai_epi32(_mm_add_epi32(b, r2), MDEC_IDCT_SHIFT2);
+    if (mono) {
+      a = _mm_srai_epi32(_mm_slli_epi32(a, 23), 23);
+      b = _mm_srai_epi32(_mm_slli_epi32(b, 23), 23);
+    }
+    __m128i v = _mm_packs_epi32(a, b);
+    v = _mm_max_epi16(_mm_min_epi16(v, hi), lo);
+    _mm_storeu_si128((__m128i*)(blk + i), v);
+  }
+#endif
+  for (; i < MDEC_BLOCK_SIZE; ++i) {
+    s32 v = (t[i] + (1 << (MDEC_IDCT_SHIFT2 - 1))) >> MDEC_IDCT_SHIFT2;
+    if (mono) v = s32(u32(v) << 23) >> 23;
+    blk[i] = clamp(v, -128, 127);
+  }
+}
+
+
+// blk: Cr, Cb, Y1, Y2, Y3, Y4
+void MdecDecoder::yuv(const s16* blk, u8* dst, MdecCommand c) const {
+  alignas(16) s16 rc[MDEC_BLOCK_SIZE];
+  alignas(16) s16 gc[MDEC_BLOCK_SIZE];
+  alignas(16) s16 bc[MDEC_BLOCK_SIZE];
+  const s16* cr = blk;
+  const s16* cb = blk + MDEC_BLOCK_SIZE;
+
+  // R=1.402*Cr, G=-0.3437*Cb-0.7143*Cr, B=1.772*Cb, 8 位小数
+  u32 i = 0;
+#ifdef MDEC_USE_SSE
+  for (; i < MDEC_BLOCK_SIZE; i += 8) {
+    // (x<<7) * (k<<1) >> 16 == x * k >> 8
+    const __m128i vr = _mm_slli_epi16(_mm_loadu_si128((const __m128i*)(cr + i)), 7);
+    const __m128i vb = _mm_slli_epi16(_mm_loadu_si128((const __m128i*)(cb + i)), 7);
+    _mm_storeu_si128((__m128i*)(rc + i), _mm_mulhi_epi16(vr, _mm_set1_epi16(359 << 1)));
+    _mm_storeu_si128((__m128i*)(gc + i), _mm_add_epi16(
+        _mm_mulhi_epi16(vb, _mm_set1_epi16(-88 << 1)),
+        _mm_mulhi_epi16(vr, _mm_set1_epi16(-183 << 1))));
+    _mm_storeu_si128((__m128i*)(bc + i), _mm_mulhi_epi16(vb, _mm_set1_epi16(454 << 1)));
+  }
+#endif
+  for (; i < MDEC_BLOCK_SIZE; ++i) {
+    rc[i] = (cr[i] * 359) >> 8;
+    gc[i] = ((cb[i] * -88) >> 8) + ((cr[i] * -183) >> 8);
+    bc[i] = (cb[i] * 454) >> 8;
+  }
+
+  const bool sign = c.sign;
+  const bool rgb24 = c.depth == 2;
+  const u16 bit15 = c.bit15 ? 0x8000 : 0;
+  alignas(16) s16 r[16], g[16], b[16];
+
+  for (u32 y = 0; y < 16; ++y) {
+    const s16* y1 = blk + MDEC_BLOCK_SIZE * ((y < 8 ? 2 : 4)) + (y & 7) * 8;
+    const s16* y2 = y1 + MDEC_BLOCK_SIZE;
+    const u32 crow = (y >> 1) * 8;
+    add_chroma(y1, rc + crow,     r,     sign);
+    add_chroma(y2, rc + crow + 4, r + 8, sign);
+    add_chroma(y1, gc + crow,     g,     sign);
+    add_chroma(y2, gc + crow + 4, g + 8, sign);
+    add_chroma(y1, bc + crow,     b,     sign);
+    add_chroma(y2, bc + crow + 4, b + 8, sign);
+
+    if (rgb24) {
+      u8* d = dst + y * 16 * 3;
+      for (u32 x = 0; x < 16; ++x) {
+        d[x*3 + 0] = u8(r[x]);
+        d[x*3 + 1] = u8(g[x]);
+        d[x*3 + 2] = u8(b[x]);
+      }
+      continue;
+    }
+
+    u16* d = (u16*)(dst + y * 16 * 2);
+    u32 x = 0;
+#ifdef MDEC_USE_SSE
+    const __m128i mask = _mm_set1_epi16(0xFF);
+    const __m128i vbit = _mm_set1_epi16(bit15);
+    for (; x < 16; x += 8) {
+      const __m128i vr = _mm_srli_epi16(_mm_and_si128(_mm_loadu_si128((const __m128i*)(r + x)), mask), 3);
+      const __m128i vg = _mm_srli_epi16(_mm_and_si128(_mm_loadu_si128((const __m128i*)(g + x)), mask), 3);
+      const __m128i vb = _mm_srli_epi16(_mm_and_si128(_mm_loadu_si128((const __m128i*)(b + x)), mask), 3);
+      __m128i v = _mm_or_si128(vr, _mm_slli_epi16(vg, 5));
+      v = _mm_or_si128(v, _mm_slli_epi16(vb, 10));
+      _mm_storeu_si128((__m128i*)(d + x), _mm_or_si128(v, vbit));
+    }
+#endif
+    for (; x < 16; ++x) {
+      d[x] = ((r[x] & 0xFF) >> 3) | (((g[x] & 0xFF) >> 3) << 5)
+           | (((b[x] & 0xFF) >> 3) << 10) | bit15;
+    }
+  }
+}
+
+
+void MdecDecoder::mono(const s16* blk, u8* dst, MdecCommand c) const {
+  alignas(16) u8 p[MDEC_BLOCK_SIZE];
+  const u8 flip = c.sign ? 0 : 0x80;
+  u32 i = 0;
+#ifdef MDEC_USE_SSE
+  const __m128i vflip = _mm_set1_epi8(flip);
+  for (; i < MDEC_BLOCK_SIZE; i += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i*)(blk + i));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(blk + i + 8));
+    _mm_storeu_si128((__m128i*)(p + i), _mm_xor_si128(_mm_packs_epi16(a, b), vflip));
+  }
+#endif
+  for (; i < MDEC_BLOCK_SIZE; ++i) {
+    p[i] = u8(blk[i]) ^ flip;
+  }
+
+  if (c.depth == 1) {
+    memcpy(dst, p, MDEC_BLOCK_SIZE);
+    return;
+  }
+  // 4bit 低半字节在前
+  for (i = 0; i < MDEC_BLOCK_SIZE; i += 2) {
+    dst[i >> 1] = (p[i] >> 4) | (p[i + 1] & 0xF0);
+  }
+}
+
+
+void MdecDecoder::decode(const u16* src, u8* dst, MdecCommand c) const {
+  alignas(16) s16 blk[MDEC_BLOCK_SIZE * MDEC_COLOR_BLOCKS];
+
+  if (c.depth < 2) {
+    rle(src, quant, blk);
+    idct(blk, true);
+    mono(blk, dst, c);
+    return;
+  }
+
+  u32 i = 0;
+  for (u32 b = 0; b < MDEC_COLOR_BLOCKS; ++b) {
+    s16* p = blk + b * MDEC_BLOCK_SIZE;
+    // Cr, Cb 使用色度量化表
+    i += rle(src + i, b < 2 ? quant + MDEC_BLOCK_SIZE : quant, p);
+    idct(p, false);
+  }
+  yuv(blk, dst, c);
+}
+
+
+MdecWorkers::MdecWorkers(u32 n) : pool(n), dec(0), src(0), offsets(0), dst(0), cmd{0} {
+}
+
+
+MdecWorkers::~MdecWorkers() {
+}
+
+
+u32 MdecWorkers::size() {
+  return pool.size();
+}
+
+
+// 每个线程逐个领取宏块, 直到这一批领完
+void MdecWorkers::runTask(u32 i) {
+  dec->decode(src + offsets[i], dst + i * MdecDecoder::outputSize(cmd), cmd);
+}
+
+
+// 参数在 pool.run 加锁唤醒线程之前写入
+void MdecWorkers::decode(const MdecDecoder& d, const u16* _src, const u32* _offsets, 
+                         u32 count, u8* _dst, MdecCommand c) {
+  dec     = &d;
+  src     = _src;
+  offsets = _offsets;
+  dst     = _dst;
+  cmd     = c;
+  pool.run(this, count);
+}
+
+
+MDEC::MDEC(Bus& b) : bus(b), cmd_io(*this), ctrl_io(*this),
+    din(*this, b), dout(*this, b), workers(0), cmd{0}, stage(Stage::Idle), 
+    remain(0), scanned(0), out_read(0), enable_in(false), enable_out(false), 
+    closing(false)
+{
+  b.bind_io(DeviceIOMapper::mdec_cmd_data_parm, &cmd_io);
+  b.bind_io(DeviceIOMapper::mdec_ctrl_status, &ctrl_io);
+}
+
+
+MDEC::~MDEC() {
+  delete workers;
+  std::lock_guard<std::mutex> lk(lock);
+  closing = true;
+  ready.notify_all();
+}
+
+
+void MDEC::setThreads(u32 n) {
+  delete workers;
+  workers = n ? new MdecWorkers(n) : 0;
+}
+
+
+void MDEC::clearInput() {
+  in.clear();
+  offsets.clear();
+  scanned = 0;
+}
+
+
+void MDEC::reset() {
+  std::lock_guard<std::mutex> lk(lock);
+  stage = Stage::Idle;
+  remain = 0;
+  cmd.v = 0;
+  clearInput();
+  out.clear();
+  out_read = 0;
+}
+
+
+void MDEC::command(u32 word) {
+  cmd.v = word;
+  clearInput();
+  switch (cmd.cmd) {
+    case 1:
+      stage = Stage::Decode;
+      remain = cmd.size;
+      break;
+
+    case 2:
+      stage = Stage::Quant;
+      remain = (word & 1) ? 32 : 16;
+      break;
+
+    case 3:
+      stage = Stage::Scale;
+      remain = 32;
+      break;
+
+    default:
+      warn("MDEC unknow command %x\n", word);
+      stage = Stage::Idle;
+      remain = 0;
+      return;
+  }
+  if (remain == 0) finishCommand();
+}
+
+
+void MDEC::push(u32 word) {
+  if (stage == Stage::Idle) {
+    command(word);
+    return;
+  }
+  in.push_back(u16(word));
+  in.push_back(u16(word >> 16));
+  if (--remain == 0) finishCommand();
+}
+
+
+void MDEC::finishCommand() {
+  switch (stage) {
+    case Stage::Decode:
+      decodeAvailable(true);
+      break;
+
+    case Stage::Quant:
+      dec.setQuant((const u8*) in.data(), cmd.v & 1);
+      break;
+
+    case Stage::Scale:
+      dec.setScale((const s16*) in.data());
+      break;
+  }
+  // 最后一个宏块之后的填充
+  clearInput();
+  stage = Stage::Idle;
+}
+
+
+void MDEC::decodeAvailable(bool flush) {
+  if (stage != Stage::Decode) return;
+  const u32 n = u32(in.size());
+  while (u32 used = MdecDecoder::scan(in.data() + scanned, n - scanned, cmd)) {
+    offsets.push_back(scanned);
+    scanned += used;
+  }
+
+  const u32 count = u32(offsets.size());
+  if (!count) return;
+  const u32 nthread = workers ? workers->size() + 1 : 1;
+  const bool parallel = count >= nthread * MDEC_BATCH_PER_THREAD;
+  if (workers && !parallel && !flush) return;
+
+  const u32 size = MdecDecoder::outputSize(cmd);
+  if (staging.size() < count * size) staging.resize(count * size);
+  u8* p = staging.data();
+  if (workers && parallel) {
+    workers->decode(dec, in.data(), offsets.data(), count, p, cmd);
+  } else {
+    for (u32 i = 0; i < count; ++i) {
+      dec.decode(in.data() + offsets[i], p + i * size, cmd);
+    }
+  }
+  in.erase(in.begin(), in.begin() + scanned);
+  offsets.clear();
+  scanned = 0;
+
+  std::lock_guard<std::mutex> lk(lock);
+  out.insert(out.end(), p, p + count * size);
+  ready.notify_all();
+}
+
+
+u32 MDEC::pull(u32* dst, u32 n, bool wait) {
+  std::unique_lock<std::mutex> lk(lock);
+  if (wait) {
+    ready.wait(lk, [&] { return out_read < out.size() || closing; });
+  }
+  if (closing) return 0;
+
+  const u32 words = std::min(n, u32(out.size() - out_read) >> 2);
+  memcpy(dst, out.data() + out_read, words << 2);
+  out_read += words << 2;
+  if (out_read == out.size()) {
+    out.clear();
+    out_read = 0;
+  }
+  return words;
+}
+
+
+u32 MDEC::status() {
+  MdecStatus s{0};
+  const Stage st = stage;
+  s.remain = st == Stage::Idle ? 0xFFFF : remain - 1;
+  s.block  = 4;
+  s.bit15  = cmd.bit15;
+  s.sign   = cmd.sign;
+  s.depth  = cmd.depth;
+
+  std::lock_guard<std::mutex> lk(lock);
+  const bool empty = out_read >= out.size();
+  s.out_empty = empty;
+  s.busy      = st != Stage::Idle || !empty;
+  s.in_req    = enable_in;
+  s.out_req   = enable_out && !empty;
+  return s.v;
+}
+
+
+void MDEC::CmdReg::write(u32 v) {
+  p.push(v);
+  p.decodeAvailable(true);
+}
+
+
+u32 MDEC::CmdReg::read() {
+  u32 v = 0;
+  p.pull(&v, 1, false);
+  return v;
+}
+
+
+void MDEC::CtrlReg::write(u32 v) {
+  if (v & (1u << 31)) p.reset();
+  p.enable_in  = v & (1 << 30);
+  p.enable_out = v & (1 << 29);
+}
+
+
+u32 MDEC::CtrlReg::read() {
+  return p.status();
+}
+
+
+MDEC::DmaIn::DmaIn(MDEC& _p, Bus& b) 
+: DMADev(b, DeviceIOMapper::dma_mdec_in_base), p(_p), left(0) {
+}
+
+
+void MDEC::DmaIn::dma_ram2dev_block(psmem addr, u32 bytesize, s32 inc) {
+  if (left == 0) {
+    left = ctrl_io.chcr.mode == ChcrMode::Stream ? blocks_io.blocks : 1;
+  }
+  const s32 step = inc << 2;
+  for (u32 n = bytesize >> 2; n > 0; --n) {
+    p.push(bus.read32(addr));
+    addr += step;
+  }
+  p.decodeAvailable(--left == 0);
+}
+
+
+MDEC::DmaOut::DmaOut(MDEC& _p, Bus& b) 
+: DMADev(b, DeviceIOMapper::dma_mdec_out_base, true), p(_p) {
+}
+
+
+// 输出 DMA 常常在输入之前启动, 在 DMA 线程上等待解码完成,
+// 和硬件一样 reset 不会结束等待.
+void MDEC::DmaOut::dma_dev2ram_block(psmem addr, u32 bytesize, s32 inc) {
+  const s32 step = inc << 2;
+  u32 buf[MDEC_PULL_WORDS];
+  u32 n = bytesize >> 2;
+
+  while (n) {
+    const u32 got = p.pull(buf, std::min(n, u32(MDEC_PULL_WORDS)), true);
+    if (!got) return;
+    for (u32 i = 0; i < got; ++i) {
+      bus.write32(addr, buf[i]);
+      addr += step;
+    }
+    n -= got;
+  }
+}
+
+}
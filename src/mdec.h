@@ -0,0 +1,200 @@
+﻿#pragma once
+
+#include "util.h"
+#include "io.h"
+#include "dma.h"
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+
+namespace ps1e {
+
+class MDEC;
+
+// IDCT 和颜色转换使用 SSE2 指令
+#define MDEC_USE_SSE
+// 开启线程池后, 每个线程至少积累这么多宏块才开始并行解码
+#define MDEC_BATCH_PER_THREAD 4
+
+#define MDEC_BLOCK_SIZE   64
+// 块之间的填充
+#define MDEC_PADDING      0xFE00
+// 一个彩色宏块 6 个块: Cr, Cb, Y1, Y2, Y3, Y4
+#define MDEC_COLOR_BLOCKS 6
+
+
+// 0x1F80'1820 写入的命令字
+union MdecCommand {
+  u32 v;
+  struct {
+    u32 size  : 16; //0-15 参数字数量 (解码命令)
+    u32 _0    : 9;  //16-24
+    u32 bit15 : 1;  //25 15bit 输出时设置 bit15
+    u32 sign  : 1;  //26 (0=unsigned, 1=signed)
+    u32 depth : 2;  //27-28 (0=4bit, 1=8bit, 2=24bit, 3=15bit)
+    u32 cmd   : 3;  //29-31 (1=解码, 2=量化表, 3=IDCT 表)
+  };
+};
+
+
+// 0x1F80'1824 读取
+union MdecStatus {
+  u32 v;
+  struct {
+    u32 remain    : 16; //0-15 剩余参数字数量-1
+    u32 block     : 3;  //16-18 当前块 (0..3=Y1..Y4, 4=Cr, 5=Cb)
+    u32 _0        : 4;  //19-22
+    u32 bit15     : 1;  //23
+    u32 sign      : 1;  //24
+    u32 depth     : 2;  //25-26
+    u32 out_req   : 1;  //27 Data-Out Request (DMA1)
+    u32 in_req    : 1;  //28 Data-In Request (DMA0)
+    u32 busy      : 1;  //29
+    u32 in_full   : 1;  //30
+    u32 out_empty : 1;  //31
+  };
+};
+
+
+// 运行长度解码后的宏块, 解码命令的参数流被切分为宏块
+class MdecDecoder {
+private:
+  // 量化表 [0..63] 亮度, [64..127] 色度, zigzag 顺序
+  u8 quant[MDEC_BLOCK_SIZE * 2];
+  // IDCT 矩阵和它的转置
+  s16 scale[MDEC_BLOCK_SIZE];
+  s16 scale_t[MDEC_BLOCK_SIZE];
+
+  // 解码一个块到 blk, 返回使用的半字数
+  u32 rle(const u16* src, const u8* qt, s16* blk) const;
+  // mono 为 true 时结果先截断为 9 位有符号数, 色度和彩色输出只限制范围
+  void idct(s16* blk, bool mono) const;
+  void yuv(const s16* blk, u8* dst, MdecCommand c) const;
+  void mono(const s16* blk, u8* dst, MdecCommand c) const;
+
+public:
+  MdecDecoder();
+  void setQuant(const u8* q, bool color);
+  void setScale(const s16* s);
+
+  // 宏块完整返回使用的半字数, 数据不足返回 0
+  static u32 scan(const u16* src, u32 n, MdecCommand c);
+  // 宏块输出的字节数
+  static u32 outputSize(MdecCommand c);
+  // 解码一个 scan() 确认完整的宏块到 dst, 可以在多个线程上同时调用
+  void decode(const u16* src, u8* dst, MdecCommand c) const;
+};
+
+
+// 并行解码一批宏块的线程池, 每个宏块写入 dst 中自己的位置, 保持顺序
+class MdecWorkers : public IParallelTask, public NonCopy {
+private:
+  WorkerPool pool;
+  const MdecDecoder* dec;
+  const u16* src;
+  const u32* offsets;
+  u8* dst;
+  MdecCommand cmd;
+
+public:
+  MdecWorkers(u32 nthread);
+  ~MdecWorkers();
+  // 调用线程也参与解码, 全部完成后返回
+  void decode(const MdecDecoder& d, const u16* src, const u32* offsets, 
+              u32 count, u8* dst, MdecCommand c);
+  void runTask(u32 i) override;
+  u32 size();
+};
+
+
+class MDEC : public NonCopy {
+private:
+  class CmdReg : public DeviceIO {
+    MDEC& p;
+  public:
+    CmdReg(MDEC& _p) : p(_p) {}
+    void write(u32 value);
+    u32 read();
+  };
+
+  class CtrlReg : public DeviceIO {
+    MDEC& p;
+  public:
+    CtrlReg(MDEC& _p) : p(_p) {}
+    void write(u32 value);
+    u32 read();
+  };
+
+  class DmaIn : public DMADev {
+    MDEC& p;
+    // 当前传输剩余的块, 最后一块之后立即解码
+    u32 left;
+  protected:
+    void dma_ram2dev_block(psmem addr, u32 bytesize, s32 inc) override;
+  public:
+    DmaIn(MDEC& _p, Bus& b);
+  };
+
+  // 输出 DMA 在自己的线程上等待宏块
+  class DmaOut : public DMADev {
+    MDEC& p;
+  protected:
+    void dma_dev2ram_block(psmem addr, u32 bytesize, s32 inc) override;
+  public:
+    DmaOut(MDEC& _p, Bus& b);
+  };
+
+  enum class Stage { Idle, Decode, Quant, Scale };
+
+  Bus& bus;
+  // 先于 dout 构造, dout 析构时等待 DMA 线程退出
+  std::mutex lock;
+  std::condition_variable ready;
+  CmdReg cmd_io;
+  CtrlReg ctrl_io;
+  DmaIn din;
+  DmaOut dout;
+  MdecDecoder dec;
+  MdecWorkers* workers;
+
+  MdecCommand cmd;
+  // 写入线程修改, status() 可能在其他线程读取
+  std::atomic<Stage> stage;
+  // 当前命令剩余的参数字数量
+  std::atomic<u32> remain;
+  // 还没有组成完整宏块的参数半字 / 表参数
+  std::vector<u16> in;
+  // 已经确认完整的宏块在 in 中的偏移, scanned 之后还没有检查
+  std::vector<u32> offsets;
+  u32 scanned;
+  std::vector<u8> staging;
+  // 解码完成的输出, out_read 之前的数据已经读出
+  std::vector<u8> out;
+  u32 out_read;
+  bool enable_in;
+  bool enable_out;
+  // 析构时使等待中的输出 DMA 放弃
+  bool closing;
+
+  void reset();
+  void push(u32 word);
+  void command(u32 word);
+  void finishCommand();
+  // 解码 in 中完整的宏块, 开启线程池时积累到一批或 flush 才解码
+  void decodeAvailable(bool flush);
+  void clearInput();
+  // 最多读取 n 个输出字, wait 则等待到有数据, 关闭时返回 0
+  u32 pull(u32* dst, u32 n, bool wait);
+  u32 status();
+
+public:
+  MDEC(Bus& b);
+  ~MDEC();
+
+  // 使用 n 个额外的线程并行解码宏块, 0 则在调用线程上解码
+  void setThreads(u32 n);
+};
+
+}
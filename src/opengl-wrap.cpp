@@ -2,6 +2,7 @@
 #include <GLFW/glfw3.h> 
 #include <stdexcept>
 #include <chrono>
+#include <cstring>
 
 #include "opengl-wrap.h"
 #include "gpu.h"
@@ -190,6 +191,20 @@ void GLFrameBuffer::unbind() {
 }
 
 
+void GLFrameBuffer::bindRead() {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+}
+
+
+void GLFrameBuffer::blitTo(GLFrameBuffer& dst, int sx, int sy, int sw, int sh, 
+                           int dx, int dy, int dw, int dh) {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dst.fbo);
+  glBlitFramebuffer(sx, sy, sx + sw, sy + sh, dx, dy, dx + dw, dy + dh, 
+                    GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+
 void GLFrameBuffer::check() {
   if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
 	  throw std::runtime_error("Framebuffer is not complete!");
@@ -274,6 +289,21 @@ void GLTexture::init2px(int w, int h, void* pixeldata) {
 }
 
 
+void GLTexture::attach(GLFrameBuffer& fb) {
+  fb.bind();
+  glFramebufferTexture2D(GL_FRAMEBUFFER, 
+      GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, text, 0);
+}
+
+
+void GLTexture::subImage2px(int x, int y, int w, int h, u32 offset) {
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, 
+      GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV, (void*)(size_t) offset);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+
 void GLTexture::release() {
   if (text) {
     glDeleteTextures(1, &text);
@@ -323,6 +353,160 @@ void GLTexture::copyTo(GLTexture* dst, int srcX, int srcY, int dstX, int dstY, i
 }
 
 
+GLPixelBuffer::GLPixelBuffer() : pbo(0), len(0) {
+}
+
+
+GLPixelBuffer::~GLPixelBuffer() {
+  release();
+}
+
+
+void GLPixelBuffer::init(u32 bytesize) {
+  release();
+  glGenBuffers(1, &pbo);
+  len = bytesize;
+  bind();
+  glBufferData(GL_PIXEL_PACK_BUFFER, len, 0, GL_STREAM_READ);
+  unbind();
+}
+
+
+void GLPixelBuffer::release() {
+  if (pbo) {
+    glDeleteBuffers(1, &pbo);
+    pbo = 0;
+  }
+}
+
+
+void GLPixelBuffer::bind() {
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+}
+
+
+void GLPixelBuffer::unbind() {
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+
+void GLPixelBuffer::readPsinnerPixel(int x, int y, int w, int h, u32 offset) {
+  glReadPixels(x, y, w, h, GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV, (void*)(size_t) offset);
+}
+
+
+const void* GLPixelBuffer::map() {
+  return glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, len, GL_MAP_READ_BIT);
+}
+
+
+void GLPixelBuffer::unmap() {
+  glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+}
+
+
+GLUploadBuffer::GLUploadBuffer() : pbo(0), len(0), persistent(0) {
+}
+
+
+GLUploadBuffer::~GLUploadBuffer() {
+  release();
+}
+
+
+void GLUploadBuffer::init(u32 bytesize) {
+  release();
+  glGenBuffers(1, &pbo);
+  len = bytesize;
+  bind();
+  if (GLAD_GL_ARB_buffer_storage) {
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, len, 0, flags);
+    persistent = (u8*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, len, flags);
+  } else {
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, len, 0, GL_STREAM_DRAW);
+  }
+  unbind();
+}
+
+
+void GLUploadBuffer::release() {
+  if (pbo) {
+    if (persistent) {
+      bind();
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      unbind();
+      persistent = 0;
+    }
+    glDeleteBuffers(1, &pbo);
+    pbo = 0;
+  }
+}
+
+
+void GLUploadBuffer::bind() {
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+}
+
+
+void GLUploadBuffer::unbind() {
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+
+u8* GLUploadBuffer::map(u32 offset, u32 size) {
+  if (persistent) {
+    return persistent + offset;
+  }
+  return (u8*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, size, 
+      GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+}
+
+
+void GLUploadBuffer::unmap() {
+  if (!persistent) {
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  }
+}
+
+
+GLFence::GLFence() : sync(0) {
+}
+
+
+GLFence::~GLFence() {
+  release();
+}
+
+
+void GLFence::insert() {
+  release();
+  sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+
+bool GLFence::signaled() {
+  if (!sync) return true;
+  GLenum r = glClientWaitSync((GLsync) sync, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+  return r == GL_ALREADY_SIGNALED || r == GL_CONDITION_SATISFIED;
+}
+
+
+void GLFence::wait() {
+  if (!sync) return;
+  while (glClientWaitSync((GLsync) sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000'000) 
+         == GL_TIMEOUT_EXPIRED);
+}
+
+
+void GLFence::release() {
+  if (sync) {
+    glDeleteSync((GLsync) sync);
+    sync = 0;
+  }
+}
+
+
 GLRenderBuffer::GLRenderBuffer() : rb(0) {
 }
 
@@ -400,13 +584,22 @@ GLHANDLE OpenGLShader::createShader(ShaderSrc src, u32 shader_flag) {
 }
 
 
+GLHANDLE OpenGLShader::current = 0;
+
+
 OpenGLShader::~OpenGLShader() {
+  if (current == program) {
+    current = 0;
+  }
   glDeleteProgram(program);
 }
 
 
 void OpenGLShader::use() {
-  glUseProgram(program);
+  if (current != program) {
+    glUseProgram(program);
+    current = program;
+  }
 }
 
 
@@ -428,23 +621,36 @@ GLUniform OpenGLShader::getUniform(const char* name) {
 }
 
 
+bool GLUniform::changed(u32 a, u32 b) {
+  if (valid && last[0] == a && last[1] == b) {
+    return false;
+  }
+  last[0] = a;
+  last[1] = b;
+  valid = true;
+  return true;
+}
+
+
 void GLUniform::setUint(u32 v) {
-  glUniform1ui(uni, v);
+  if (changed(v)) glUniform1ui(uni, v);
 }
 
 
 void GLUniform::setUint2(u32 a, u32 b) {
-  glUniform2ui(uni, a, b);
+  if (changed(a, b)) glUniform2ui(uni, a, b);
 }
 
 
 void GLUniform::setInt(s32 v) {
-  glUniform1i(uni, v);
+  if (changed(u32(v))) glUniform1i(uni, v);
 }
 
 
 void GLUniform::setFloat(float v) {
-  glUniform1f(uni, v);
+  u32 bits;
+  memcpy(&bits, &v, sizeof(bits));
+  if (changed(bits)) glUniform1f(uni, v);
 }
 
 
@@ -555,6 +761,11 @@ void GLDrawState::setScissorEnable(bool enable) {
 }
 
 
+bool GLDrawState::isScissorEnable() {
+  return glIsEnabled(GL_SCISSOR_TEST);
+}
+
+
 void LocalEvents::systemEvents() {
   static auto SEC_1 = 
     std::chrono::duration_cast<std::chrono::steady_clock::duration>
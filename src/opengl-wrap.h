@@ -107,6 +107,11 @@ public:
   void release();
   void bind();
   void unbind();
+  // 只绑定为读取帧缓冲
+  void bindRead();
+  // 缩放复制像素到 dst, 使用最近点采样, 之后两个帧缓冲保持绑定
+  void blitTo(GLFrameBuffer& dst, int sx, int sy, int sw, int sh, 
+              int dx, int dy, int dw, int dh);
   int width() { return w; }
   int height() { return h; }
   void check();
@@ -142,6 +147,10 @@ public:
   void init(int w, int h, void* pixeldata);
   // pixeldata 应使用 GL_UNSIGNED_SHORT_5_6_5 格式, 这是 ps 的纹理格式
   void init2px(int w, int h, void* pixeldata);
+  // 作为帧缓冲的颜色附件, 帧缓冲保持绑定
+  void attach(GLFrameBuffer&);
+  // 从已经绑定的上传缓冲区 offset 处更新 ps 像素, 纹理必须已经绑定
+  void subImage2px(int x, int y, int w, int h, u32 offset);
   void release();
   void bind();
   void unbind();
@@ -152,6 +161,64 @@ public:
 };
 
 
+// 像素缓冲区(PBO), 用于异步读取帧缓冲
+class GLPixelBuffer : public NonCopy {
+private:
+  GLHANDLE pbo;
+  u32 len;
+public:
+  GLPixelBuffer();
+  ~GLPixelBuffer();
+  void init(u32 bytesize);
+  void release();
+  void bind();
+  void unbind();
+  // 读取当前帧缓冲的 ps 像素到缓冲区 offset 处, 函数立即返回, 必须已经绑定
+  void readPsinnerPixel(int x, int y, int w, int h, u32 offset);
+  // 只读映射缓冲区, 失败返回 NULL, 必须已经绑定
+  const void* map();
+  void unmap();
+};
+
+
+// 像素上传缓冲区(GL_PIXEL_UNPACK_BUFFER), 支持时持久映射
+class GLUploadBuffer : public NonCopy {
+private:
+  GLHANDLE pbo;
+  u32 len;
+  u8* persistent;
+public:
+  GLUploadBuffer();
+  ~GLUploadBuffer();
+  void init(u32 bytesize);
+  void release();
+  void bind();
+  void unbind();
+  // 返回 [offset, offset+size) 的可写内存, 必须已经绑定, 
+  // 调用者负责用同步点保证 gpu 不再读取这段内存.
+  u8* map(u32 offset, u32 size);
+  // 写入完成, 非持久映射时解除映射
+  void unmap();
+};
+
+
+// 命令流中的同步点
+class GLFence : public NonCopy {
+private:
+  void* sync;
+public:
+  GLFence();
+  ~GLFence();
+  // 在命令流中插入同步点, 替换之前的同步点
+  void insert();
+  // 同步点之前的命令全部完成返回 true, 不会等待
+  bool signaled();
+  // 等待同步点之前的命令全部完成
+  void wait();
+  void release();
+};
+
+
 class GLRenderBuffer : public NonCopy {
 private:
   GLHANDLE rb;
@@ -167,10 +234,14 @@ public:
 class GLUniform {
 private:
   int uni;
-  GLUniform(int id) : uni(id) {}
+  // 最后提交的值, 值相同时不再调用 glUniform
+  u32 last[2];
+  bool valid;
+  GLUniform(int id) : uni(id), last{0}, valid(false) {}
+  bool changed(u32 a, u32 b = 0);
 
 public:
-  GLUniform() : uni(0) {}
+  GLUniform() : uni(0), last{0}, valid(false) {}
   void setUint(u32 v);
   void setFloat(float v);
   void setInt(s32 v);
@@ -182,6 +253,8 @@ friend class OpenGLShader;
 
 class OpenGLShader : public NonCopy {
 private:
+  // 当前绑定的程序, 只有 gpu 线程使用 gl 上下文
+  static GLHANDLE current;
   GLHANDLE program;
   GLHANDLE createShader(ShaderSrc src, u32 shader_flag);
   int _getUniform(const char* name);
@@ -215,6 +288,7 @@ public:
   void initGlad();
   void setScissor(int x, int y, int w, int h);
   void setScissorEnable(bool enable);
+  bool isScissorEnable();
   
   // 读取 gl 显存到缓冲区, 缓冲区是 32bit RGBA 格式, 长度 w*h
   static void readPsinnerPixel(int x, int y, int w, int h, u32* data);
@@ -1,13 +1,17 @@
 ﻿#include <rtaudio/RtAudio.h>
 #include <libsamplerate/include/samplerate.h>
-#include <iir1/Iir.h>
 #include "spu.h"
 #include "spu.inl"
+#include <cmath>
+#ifdef SPU_MIX_SSE
+#include <emmintrin.h>
+#endif
 
 namespace ps1e {
 
 #define SPU_INIT_CHANNEL(name, n)  name ## n(*this, b),
 #define SPU_II(name) name(*this, b)
+#define SPU_IR(name) name(*this, b, &SoundProcessing::reverb_changed)
 #define SET_TO_STREAM_ARR(name, n)  channel_stream[n] = &name ## n;
 
 #ifdef SPU_DEBUG_INFO
@@ -20,41 +24,134 @@ namespace ps1e {
 
 
 static s8 nibble_dict[16] = {0,1,2,3,4,5,6,7,-8,-7,-6,-5,-4,-3,-2,-1};
-static const PcmSample adpcm_coefs_dict[16][2] = {
-    { 0.0       ,  0.0       }, //{   0.0        ,   0.0        },
-    { 0.9375    ,  0.0       }, //{  60.0 / 64.0 ,   0.0        },
-    { 1.796875  , -0.8125    }, //{ 115.0 / 64.0 , -52.0 / 64.0 },
-    { 1.53125   , -0.859375  }, //{  98.0 / 64.0 , -55.0 / 64.0 },
-    { 1.90625   , -0.9375    }, //{ 122.0 / 64.0 , -60.0 / 64.0 },
-    /* extended table used in few PS3 games, found in ELFs, NOT PSX ? */
-    { 0.46875   , -0.0       }, //{  30.0 / 64.0 ,  -0.0 / 64.0 },
-    { 0.8984375 , -0.40625   }, //{  57.5 / 64.0 , -26.0 / 64.0 },
-    { 0.765625  , -0.4296875 }, //{  49.0 / 64.0 , -27.5 / 64.0 },
-    { 0.953125  , -0.46875   }, //{  61.0 / 64.0 , -30.0 / 64.0 },
-    { 0.234375  , -0.0       }, //{  15.0 / 64.0 ,  -0.0 / 64.0 },
-    { 0.44921875, -0.203125  }, //{  28.75/ 64.0 , -13.0 / 64.0 },
-    { 0.3828125 , -0.21484375}, //{  24.5 / 64.0 , -13.75/ 64.0 },
-    { 0.4765625 , -0.234375  }, //{  30.5 / 64.0 , -15.0 / 64.0 },
-    { 0.5       , -0.9375    }, //{  32.0 / 64.0 , -60.0 / 64.0 },
-    { 0.234375  , -0.9375    }, //{  15.0 / 64.0 , -60.0 / 64.0 },
-    { 0.109375  , -0.9375    }, //{   7.0 / 64.0 , -60.0 / 64.0 },
+// 系数 * 64
+static const s32 adpcm_coefs_dict[5][2] = {
+    {   0,   0 },
+    {  60,   0 },
+    { 115, -52 },
+    {  98, -55 },
+    { 122, -60 },
 };
 
-static PcmSample fix_volume_overload = 0.8;
+// 4 点高斯插值表, 来自 nocash 文档
+const s16 spu_gauss_table[0x200] = {
+  -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001,
+  -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001,
+   0x0000,  0x0000,  0x0000,  0x0000,  0x0000,  0x0000,  0x0000,  0x0001,
+   0x0001,  0x0001,  0x0001,  0x0002,  0x0002,  0x0002,  0x0003,  0x0003,
+   0x0003,  0x0004,  0x0004,  0x0005,  0x0005,  0x0006,  0x0007,  0x0007,
+   0x0008,  0x0009,  0x0009,  0x000A,  0x000B,  0x000C,  0x000D,  0x000E,
+   0x000F,  0x0010,  0x0011,  0x0012,  0x0013,  0x0015,  0x0016,  0x0018,
+   0x0019,  0x001B,  0x001C,  0x001E,  0x0020,  0x0021,  0x0023,  0x0025,
+   0x0027,  0x0029,  0x002C,  0x002E,  0x0030,  0x0033,  0x0035,  0x0038,
+   0x003A,  0x003D,  0x0040,  0x0043,  0x0046,  0x0049,  0x004D,  0x0050,
+   0x0054,  0x0057,  0x005B,  0x005F,  0x0063,  0x0067,  0x006B,  0x006F,
+   0x0074,  0x0078,  0x007D,  0x0082,  0x0087,  0x008C,  0x0091,  0x0096,
+   0x009C,  0x00A1,  0x00A7,  0x00AD,  0x00B3,  0x00BA,  0x00C0,  0x00C7,
+   0x00CD,  0x00D4,  0x00DB,  0x00E3,  0x00EA,  0x00F2,  0x00FA,  0x0101,
+   0x010A,  0x0112,  0x011B,  0x0123,  0x012C,  0x0135,  0x013F,  0x0148,
+   0x0152,  0x015C,  0x0166,  0x0171,  0x017B,  0x0186,  0x0191,  0x019C,
+   0x01A8,  0x01B4,  0x01C0,  0x01CC,  0x01D9,  0x01E5,  0x01F2,  0x0200,
+   0x020D,  0x021B,  0x0229,  0x0237,  0x0246,  0x0255,  0x0264,  0x0273,
+   0x0283,  0x0293,  0x02A3,  0x02B4,  0x02C4,  0x02D6,  0x02E7,  0x02F9,
+   0x030B,  0x031D,  0x0330,  0x0343,  0x0356,  0x036A,  0x037E,  0x0392,
+   0x03A7,  0x03BC,  0x03D1,  0x03E7,  0x03FC,  0x0413,  0x042A,  0x0441,
+   0x0458,  0x0470,  0x0488,  0x04A0,  0x04B9,  0x04D2,  0x04EC,  0x0506,
+   0x0520,  0x053B,  0x0556,  0x0572,  0x058E,  0x05AA,  0x05C7,  0x05E4,
+   0x0601,  0x061F,  0x063E,  0x065C,  0x067C,  0x069B,  0x06BB,  0x06DC,
+   0x06FD,  0x071E,  0x0740,  0x0762,  0x0784,  0x07A7,  0x07CB,  0x07EF,
+   0x0813,  0x0838,  0x085D,  0x0883,  0x08A9,  0x08D0,  0x08F7,  0x091E,
+   0x0946,  0x096F,  0x0998,  0x09C1,  0x09EB,  0x0A16,  0x0A40,  0x0A6C,
+   0x0A98,  0x0AC4,  0x0AF1,  0x0B1E,  0x0B4C,  0x0B7A,  0x0BA9,  0x0BD8,
+   0x0C07,  0x0C38,  0x0C68,  0x0C99,  0x0CCB,  0x0CFD,  0x0D30,  0x0D63,
+   0x0D97,  0x0DCB,  0x0E00,  0x0E35,  0x0E6B,  0x0EA1,  0x0ED7,  0x0F0F,
+   0x0F46,  0x0F7F,  0x0FB7,  0x0FF1,  0x102A,  0x1065,  0x109F,  0x10DB,
+   0x1116,  0x1153,  0x118F,  0x11CD,  0x120B,  0x1249,  0x1288,  0x12C7,
+   0x1307,  0x1347,  0x1388,  0x13C9,  0x140B,  0x144D,  0x1490,  0x14D4,
+   0x1517,  0x155C,  0x15A0,  0x15E6,  0x162C,  0x1672,  0x16B9,  0x1700,
+   0x1747,  0x1790,  0x17D8,  0x1821,  0x186B,  0x18B5,  0x1900,  0x194B,
+   0x1996,  0x19E2,  0x1A2E,  0x1A7B,  0x1AC8,  0x1B16,  0x1B64,  0x1BB3,
+   0x1C02,  0x1C51,  0x1CA1,  0x1CF1,  0x1D42,  0x1D93,  0x1DE5,  0x1E37,
+   0x1E89,  0x1EDC,  0x1F2F,  0x1F82,  0x1FD6,  0x202A,  0x207F,  0x20D4,
+   0x2129,  0x217F,  0x21D5,  0x222C,  0x2282,  0x22DA,  0x2331,  0x2389,
+   0x23E1,  0x2439,  0x2492,  0x24EB,  0x2545,  0x259E,  0x25F8,  0x2653,
+   0x26AD,  0x2708,  0x2763,  0x27BE,  0x281A,  0x2876,  0x28D2,  0x292E,
+   0x298B,  0x29E7,  0x2A44,  0x2AA1,  0x2AFF,  0x2B5C,  0x2BBA,  0x2C18,
+   0x2C76,  0x2CD4,  0x2D33,  0x2D91,  0x2DF0,  0x2E4F,  0x2EAE,  0x2F0D,
+   0x2F6C,  0x2FCC,  0x302B,  0x308B,  0x30EA,  0x314A,  0x31AA,  0x3209,
+   0x3269,  0x32C9,  0x3329,  0x3389,  0x33E9,  0x3449,  0x34A9,  0x3509,
+   0x3569,  0x35C9,  0x3629,  0x3689,  0x36E8,  0x3748,  0x37A8,  0x3807,
+   0x3867,  0x38C6,  0x3926,  0x3985,  0x39E4,  0x3A43,  0x3AA2,  0x3B00,
+   0x3B5F,  0x3BBD,  0x3C1B,  0x3C79,  0x3CD7,  0x3D35,  0x3D92,  0x3DEF,
+   0x3E4C,  0x3EA9,  0x3F05,  0x3F62,  0x3FBD,  0x4019,  0x4074,  0x40D0,
+   0x412A,  0x4185,  0x41DF,  0x4239,  0x4292,  0x42EB,  0x4344,  0x439C,
+   0x43F4,  0x444C,  0x44A3,  0x44FA,  0x4550,  0x45A6,  0x45FC,  0x4651,
+   0x46A6,  0x46FA,  0x474E,  0x47A1,  0x47F4,  0x4846,  0x4898,  0x48E9,
+   0x493A,  0x498A,  0x49D9,  0x4A29,  0x4A77,  0x4AC5,  0x4B13,  0x4B5F,
+   0x4BAC,  0x4BF7,  0x4C42,  0x4C8D,  0x4CD7,  0x4D20,  0x4D68,  0x4DB0,
+   0x4DF7,  0x4E3E,  0x4E84,  0x4EC9,  0x4F0E,  0x4F52,  0x4F95,  0x4FD7,
+   0x5019,  0x505A,  0x509A,  0x50DA,  0x5118,  0x5156,  0x5194,  0x51D0,
+   0x520C,  0x5247,  0x5281,  0x52BA,  0x52F3,  0x532A,  0x5361,  0x5397,
+   0x53CC,  0x5401,  0x5434,  0x5467,  0x5499,  0x54CA,  0x54FA,  0x5529,
+   0x5558,  0x5585,  0x55B2,  0x55DE,  0x5609,  0x5632,  0x565B,  0x5684,
+   0x56AB,  0x56D1,  0x56F6,  0x571B,  0x573E,  0x5761,  0x5782,  0x57A3,
+   0x57C3,  0x57E2,  0x57FF,  0x581C,  0x5838,  0x5853,  0x586D,  0x5886,
+   0x589E,  0x58B5,  0x58CB,  0x58E0,  0x58F4,  0x5907,  0x5919,  0x592A,
+   0x593A,  0x5949,  0x5958,  0x5965,  0x5971,  0x597C,  0x5986,  0x598F,
+   0x5997,  0x599E,  0x59A4,  0x59A9,  0x59AD,  0x59B0,  0x59B2,  0x59B3,
+};
 
-// 混音算法 
-// int32: C = A + B - (A * B >> 0x10)
-// float: C = A + B - (A * B)
-static inline PcmSample mixer(PcmSample a, PcmSample b) {
-  //return (a + b) - (a * b);
-  PcmSample r = a + b * fix_volume_overload;
-#ifdef SPU_AUTO_LIMIT_VOLUME
-  if (r >= 1.0 || r <= -1.0) {
-    fix_volume_overload -= (1.0/44100.0);
-    warn("\rVolume overload %f ", fix_volume_overload);
+#define SPU_TAP_REVERB  (SPU_CHANNEL_COUNT + 0)
+#define SPU_TAP_MIX     (SPU_CHANNEL_COUNT + 1)
+
+
+// dl[i] += src[i] * gl; dr[i] += src[i] * gr
+static inline void mix_voice(PcmSample* dl, PcmSample* dr, const PcmSample* src, 
+                             PcmSample gl, PcmSample gr, u32 n) {
+  u32 i = 0;
+#ifdef SPU_MIX_SSE
+  const __m128 vl = _mm_set1_ps(gl);
+  const __m128 vr = _mm_set1_ps(gr);
+  for (; i + 4 <= n; i += 4) {
+    __m128 s = _mm_loadu_ps(src + i);
+    _mm_storeu_ps(dl + i, _mm_add_ps(_mm_loadu_ps(dl + i), _mm_mul_ps(s, vl)));
+    _mm_storeu_ps(dr + i, _mm_add_ps(_mm_loadu_ps(dr + i), _mm_mul_ps(s, vr)));
   }
 #endif
-  return r;
+  for (; i < n; ++i) {
+    dl[i] += src[i] * gl;
+    dr[i] += src[i] * gr;
+  }
+}
+
+
+// 返回 l/r 中的最大绝对值
+static inline PcmSample peak_value(const PcmSample* l, const PcmSample* r, u32 n) {
+  PcmSample peak = 0;
+  u32 i = 0;
+#ifdef SPU_MIX_SSE
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFF'FFFF));
+  __m128 vp = _mm_setzero_ps();
+  for (; i + 4 <= n; i += 4) {
+    vp = _mm_max_ps(vp, _mm_and_ps(_mm_loadu_ps(l + i), abs_mask));
+    vp = _mm_max_ps(vp, _mm_and_ps(_mm_loadu_ps(r + i), abs_mask));
+  }
+  float t[4];
+  _mm_storeu_ps(t, vp);
+  peak = MaxT(MaxT(t[0], t[1]), MaxT(t[2], t[3]));
+#endif
+  for (; i < n; ++i) {
+    peak = MaxT(peak, MaxT(std::abs(l[i]), std::abs(r[i])));
+  }
+  return peak;
+}
+
+
+static void interleave(PcmSample* dst, const PcmSample* l, const PcmSample* r, u32 nframe) {
+  for (u32 i = 0; i < nframe; ++i) {
+    dst[(i<<1) + 0] = l[i];
+    dst[(i<<1) + 1] = r[i];
+  }
 }
 
 
@@ -79,36 +176,45 @@ void SpuRtErrorCallback(RtAudioError::Type type, const std::string &txt) {
 }
   
 
-SoundProcessing::SoundProcessing(Bus& b) : 
+SoundProcessing::SoundProcessing(Bus& b, TimerSystem* ts, bool use_dac) : 
   DMADev(b, DeviceIOMapper::dma_spu_base), bus(b), dac(0), mem(0),
+  clock(ts), outRing(SPU_RING_FRAMES), cdRing(SPU_CD_RING_FRAMES),
   SPU_II(mainVol),  SPU_II(cdVol),    SPU_II(reverbVol),
   SPU_II(externVol),                  SPU_II(mainCurrVol),
   SPU_II(nKeyOff),  SPU_II(nFM),      SPU_II(nNoise),
   SPU_II(nReverb),  SPU_II(endx),     SPU_II(status),
-  SPU_II(dAPF1),    SPU_II(dAPF2),    SPU_II(vIIR),
-  SPU_II(vCOMB1),   SPU_II(vCOMB2),   SPU_II(vCOMB3),
-  SPU_II(vCOMB4),   SPU_II(vWALL),    SPU_II(vAPF1),
-  SPU_II(vAPF2),    SPU_II(mRSAME),   SPU_II(mRCOMB1),
-                    SPU_II(mLSAME),   SPU_II(mLCOMB1),
-  SPU_II(mRCOMB2),  SPU_II(dRSAME),   SPU_II(mRDIFF),
-  SPU_II(mLCOMB2),  SPU_II(dLSAME),   SPU_II(mLDIFF),
-  SPU_II(mRCOMB3),  SPU_II(mRCOMB4),  SPU_II(dRDIFF),
-  SPU_II(mLCOMB3),  SPU_II(mLCOMB4),  SPU_II(dLDIFF),
-  SPU_II(mRAPF1),   SPU_II(mRAPF2),   SPU_II(vRIN),
-  SPU_II(mLAPF1),   SPU_II(mLAPF2),   SPU_II(vLIN),
+  SPU_IR(dAPF1),    SPU_IR(dAPF2),    SPU_IR(vIIR),
+  SPU_IR(vCOMB1),   SPU_IR(vCOMB2),   SPU_IR(vCOMB3),
+  SPU_IR(vCOMB4),   SPU_IR(vWALL),    SPU_IR(vAPF1),
+  SPU_IR(vAPF2),    SPU_IR(mRSAME),   SPU_IR(mRCOMB1),
+                    SPU_IR(mLSAME),   SPU_IR(mLCOMB1),
+  SPU_IR(mRCOMB2),  SPU_IR(dRSAME),   SPU_IR(mRDIFF),
+  SPU_IR(mLCOMB2),  SPU_IR(dLSAME),   SPU_IR(mLDIFF),
+  SPU_IR(mRCOMB3),  SPU_IR(mRCOMB4),  SPU_IR(dRDIFF),
+  SPU_IR(mLCOMB3),  SPU_IR(mLCOMB4),  SPU_IR(dLDIFF),
+  SPU_IR(mRAPF1),   SPU_IR(mRAPF2),   SPU_IR(vRIN),
+  SPU_IR(mLAPF1),   SPU_IR(mLAPF2),   SPU_IR(vLIN),
   SPU_DEF_ALL_CHANNELS(ch, SPU_INIT_CHANNEL) _un1(*this, b), _un2(*this, b),
-  SPU_II(reverbBegin), SPU_II(ramIrqAdress), SPU_II(ramTransferCtrl),
+  SPU_II(ramIrqAdress), SPU_II(ramTransferCtrl),
+  reverbBegin(*this, b, &SoundProcessing::set_reverb_base),
   ramTransferFifo(*this, b, &SoundProcessing::push_fifo),
   ramTransferAddress(*this, b, &SoundProcessing::set_transfer_address),
   ctrl(*this, b, &SoundProcessing::set_ctrl_req),
-  nKeyOn(*this, b, &SoundProcessing::key_on_changed)
+  nKeyOn(*this, b, &SoundProcessing::key_on_changed),
+  outResample(this)
 {
   reverbBegin.r.v = SPU_MEM_ECHO_MASK;
   mem = new u8[SPU_MEM_SIZE];
   memset(mem, 0, SPU_MEM_SIZE);
   memset(fifo, 0, SPU_FIFO_SIZE << 1);
   SPU_DEF_ALL_CHANNELS(ch, SET_TO_STREAM_ARR);
-  init_dac();
+  memset(sinks, 0, sizeof(sinks));
+  if (clock) {
+    clock->scheduler().schedule(this, SPU_CLOCK_BATCH * SPU_CLOCK_PER_SAMPLE);
+  }
+  if (use_dac) {
+    init_dac();
+  }
 }
 
 
@@ -122,7 +228,9 @@ void SoundProcessing::init_dac() {
 
     RtAudio::DeviceInfo di = dac->getDeviceInfo(parameters.deviceId);
     info("Audio Device: %s - %dHz\n", di.name.c_str(), di.preferredSampleRate);
-    //devSampleRate = di.preferredSampleRate;
+    if (di.preferredSampleRate) {
+      devSampleRate = di.preferredSampleRate;
+    }
 
     const RtAudioFormat raf = sizeof(PcmSample)==4 ? RTAUDIO_FLOAT32 : RTAUDIO_FLOAT64;
     dac->openStream(&parameters, NULL, raf, devSampleRate, &bufferFrames, 
@@ -142,6 +250,9 @@ SoundProcessing::~SoundProcessing() {
     dac->closeStream();
     delete dac;
   }
+  if (clock) {
+    clock->scheduler().cancel(this);
+  }
   delete [] mem;
 }
 
@@ -153,35 +264,51 @@ static void setzero(PcmSample *buf, u32 nframe) {
 }
 
 
-void SoundProcessing::process_channel(int cn, 
-                                      PcmSample *dst, 
-                                      PcmSample *median, 
-                                      PcmSample* channelout, 
-                                      u32 nframe, 
-                                      PcmSample* echo_out) 
-{
-  PcmStreamer* ps = channel_stream[cn];
-  if (ps->readSampleBlocks(median, channelout, nframe)) {
-    VolumeEnvelope* lve = ps->getVolumeEnvelope(true);
-    VolumeEnvelope* rve = ps->getVolumeEnvelope(false);
-    PcmSample left, right;
-
-    for (u32 i=0; i < (nframe << 1); i += 2) {
-      left  = channelout[i>>1];
-      right = channelout[i>>1];
-      lve->apply(left);
-      rve->apply(right);
-      dst[i+0] = mixer(dst[i+0], left);
-      dst[i+1] = mixer(dst[i+1], right);
-
-      if (isEnableEcho(cn)) {
-        echo_out[i+0] = mixer(echo_out[i+0], left);
-        echo_out[i+1] = mixer(echo_out[i+1], left);
+void SoundProcessing::render_voices(PcmSample* rows, u32 nframe) {
+  const PcmSample* mod = NULL;
+  for (int v = 0; v < SPU_CHANNEL_COUNT; ++v) {
+    PcmSample* row = rows + v * nframe;
+    voices.active[v] = channel_stream[v]->readSampleBlocks(mod, row, nframe);
+    if (!voices.active[v]) {
+      setzero(row, nframe);
+    }
+    mod = row;
+  }
+}
+
+
+void SoundProcessing::mix_voices(const PcmSample* rows, PcmSample* mix, u32 nframe) {
+  PcmSample* const ml = mix;
+  PcmSample* const mr = mix + nframe;
+  PcmSample* const el = mix + nframe * 2;
+  PcmSample* const er = mix + nframe * 3;
+
+  const bool master_echo = ctrl.r.mst_rev;
+  for (int v = 0; v < SPU_CHANNEL_COUNT; ++v) {
+    voices.echo[v] = master_echo && nReverb.get(v);
+  }
+
+  for (u32 b = 0; b < nframe; b += SPU_MIX_BATCH) {
+    const u32 n = MinT(u32(SPU_MIX_BATCH), nframe - b);
+
+    for (int v = 0; v < SPU_CHANNEL_COUNT; ++v) {
+      if (!voices.active[v]) continue;
+      const PcmSample gl  = voices.vol_l[v].step(n) * fix_volume_overload;
+      const PcmSample gr  = voices.vol_r[v].step(n) * fix_volume_overload;
+      const PcmSample* in = rows + v * nframe + b;
+
+      mix_voice(ml + b, mr + b, in, gl, gr, n);
+      if (voices.echo[v]) {
+        mix_voice(el + b, er + b, in, gl, gr, n);
       }
     }
-    ps->syncVol(lve, rve);
-  } else {
-    setzero(channelout, nframe);
+
+#ifdef SPU_AUTO_LIMIT_VOLUME
+    if (peak_value(ml + b, mr + b, n) >= 1.0) {
+      fix_volume_overload -= (PcmSample(n) / 44100.0f);
+      warn("\rVolume overload %f ", fix_volume_overload);
+    }
+#endif
   }
 }
 
@@ -189,58 +316,151 @@ void SoundProcessing::process_channel(int cn,
 // buf 实际长度 = 通道 * nframe, 通道数据交错存放
 void SoundProcessing::requestAudioData(PcmSample *buf, u32 nframe, double time) {
   //spudbg("\r\t\t\t\tReQ audio data %d %f", nframe, time);
+  if (!clock && devSampleRate == SPU_WORK_FREQ) {
+    render(buf, nframe);
+    return;
+  }
+  double ratio = double(devSampleRate) / double(SPU_WORK_FREQ);
+  if (clock) {
+    ratio *= rate_control();
+  }
+  if (!outResample.read(buf, nframe, ratio)) {
+    setzero(buf, nframe << 1);
+  }
+}
+
+
+void SoundProcessing::pull_frames(PcmSample* buf, u32 nframe) {
+  if (!clock) {
+    render(buf, nframe);
+    return;
+  }
+  const u32 n = outRing.pop(buf, nframe);
+  if (n < nframe) {
+    // 模拟速度跟不上, 用静音填充
+    setzero(buf + (n << 1), (nframe - n) << 1);
+    ++underrun;
+    spudbg("\rSPU output underrun %d ", underrun);
+  }
+}
+
+
+// 填充量高于目标时稍快消耗, 低于目标时稍慢, 最多调整 0.5%
+double SoundProcessing::rate_control() {
+  double fill = double(outRing.size()) / double(SPU_RING_TARGET) - 1.0;
+  fill = MaxT(-1.0, MinT(1.0, fill));
+  return 1.0 - fill * 0.005;
+}
+
+
+u32 SoundProcessing::onClock(u32 /*late*/) {
+  render(clockBuf, SPU_CLOCK_BATCH);
+  outRing.push(clockBuf, SPU_CLOCK_BATCH);
+  return SPU_CLOCK_BATCH * SPU_CLOCK_PER_SAMPLE;
+}
+
+
+void SoundProcessing::render(PcmSample *buf, u32 nframe) {
   noiseTimer -= nframe;
   setzero(buf, nframe << 1);
 
   if (ctrl.r.mute == 0) {
+    // 丢弃静音期间的 CD 音频, 保持与光驱同步
+    pull_cd(0, nframe);
+    if (sinks[SPU_TAP_MIX]) sinks[SPU_TAP_MIX]->write(buf, nframe, 2);
     return;
   }
 
-  PcmSample* ec = echoOutSwap.get(nframe << 1);
-  PcmSample* p1 = swap1.get(nframe);
-  PcmSample* p2 = swap2.get(nframe);
-  setzero(p1, nframe);
-  setzero(ec, nframe << 1);
-
-  process_channel( 0, buf, p1, p2, nframe, ec);
-  process_channel( 1, buf, p2, p1, nframe, ec);
-  process_channel( 2, buf, p1, p2, nframe, ec);
-  process_channel( 3, buf, p2, p1, nframe, ec);
-  process_channel( 4, buf, p1, p2, nframe, ec);
-  process_channel( 5, buf, p2, p1, nframe, ec);
-  process_channel( 6, buf, p1, p2, nframe, ec);
-  process_channel( 7, buf, p2, p1, nframe, ec);
-
-  process_channel( 8, buf, p1, p2, nframe, ec);
-  process_channel( 9, buf, p2, p1, nframe, ec);
-  process_channel(10, buf, p1, p2, nframe, ec);
-  process_channel(11, buf, p2, p1, nframe, ec);
-  process_channel(12, buf, p1, p2, nframe, ec);
-  process_channel(13, buf, p2, p1, nframe, ec);
-  process_channel(14, buf, p1, p2, nframe, ec);
-  process_channel(15, buf, p2, p1, nframe, ec);
-
-  process_channel(16, buf, p1, p2, nframe, ec);
-  process_channel(17, buf, p2, p1, nframe, ec);
-  process_channel(18, buf, p1, p2, nframe, ec);
-  process_channel(19, buf, p2, p1, nframe, ec);
-  process_channel(20, buf, p1, p2, nframe, ec);
-  process_channel(21, buf, p2, p1, nframe, ec);
-  process_channel(22, buf, p1, p2, nframe, ec);
-  process_channel(23, buf, p2, p1, nframe, ec);
+  PcmSample* ec   = echoOutSwap.get(nframe << 1);
+  PcmSample* rows = voiceRows.get(nframe * SPU_CHANNEL_COUNT);
+  PcmSample* mix  = mixPlanes.get(nframe << 2);
+  setzero(mix, nframe << 2);
+
+  render_voices(rows, nframe);
+  if (voice_sink_count) {
+    for (int v = 0; v < SPU_CHANNEL_COUNT; ++v) {
+      if (sinks[v]) sinks[v]->write(rows + v * nframe, nframe, 1);
+    }
+  }
+  mix_voices(rows, mix, nframe);
+  interleave(buf, mix, mix + nframe, nframe);
+  interleave(ec, mix + nframe * 2, mix + nframe * 3, nframe);
+  pull_cd(ec, nframe);
+  if (sinks[SPU_TAP_REVERB]) sinks[SPU_TAP_REVERB]->write(ec, nframe, 2);
 
   apply_reverb(ec, nframe);
   mix_end(buf, ec, nframe);
+  if (sinks[SPU_TAP_MIX]) sinks[SPU_TAP_MIX]->write(buf, nframe, 2);
+}
+
+
+void SoundProcessing::setOutputSink(SpuTap tap, SpuOutputSink* sink, u8 channel) {
+  switch (tap) {
+    case SpuTap::Voice:
+      if (channel >= SPU_CHANNEL_COUNT) {
+        error("Bad SPU channel %d\n", channel);
+        return;
+      }
+      if (sinks[channel] && !sink) --voice_sink_count;
+      if (!sinks[channel] && sink) ++voice_sink_count;
+      sinks[channel] = sink;
+      break;
+
+    case SpuTap::Reverb:
+      sinks[SPU_TAP_REVERB] = sink;
+      break;
+
+    case SpuTap::Mix:
+      sinks[SPU_TAP_MIX] = sink;
+      break;
+  }
 }
 
 
-  //TODO 混合CD/混响/外部音源
+PcmRing& SoundProcessing::cdInput() {
+  return cdRing;
+}
+
+
+void SoundProcessing::pull_cd(PcmSample* echo, u32 nframe) {
+  PcmSample* cd = cdBuf.get(nframe << 1);
+  cd_frames = cdRing.pop(cd, nframe);
+  if (!echo || !cd_frames) return;
+
+  if (!isEnableCDVolume()) {
+    cd_frames = 0;
+    return;
+  }
+  const PcmSample left  = SPU_F_VOLUME(cdVol.r.v & 0xFFFF);
+  const PcmSample right = SPU_F_VOLUME(cdVol.r.v >> 16);
+  const u32 n = cd_frames << 1;
+  for (u32 i = 0; i < n; i += 2) {
+    cd[i+0] *= left;
+    cd[i+1] *= right;
+  }
+
+  if (isEnableCDEcho()) {
+    for (u32 i = 0; i < n; ++i) {
+      echo[i] += cd[i];
+    }
+  }
+}
+
+
+  //TODO 混合外部音源
 void SoundProcessing::mix_end(PcmSample* buf, PcmSample* echo, u32 nframe) {
   PcmSample main_left  = SPU_F_VOLUME(mainVol.r.v & 0xFFFF);
   PcmSample main_right = SPU_F_VOLUME(mainVol.r.v >> 16);
   PcmSample echo_left  = SPU_F_VOLUME(reverbVol.r.v & 0xFFFF);
   PcmSample echo_right = SPU_F_VOLUME(reverbVol.r.v >> 16);
 
+  // CD 音频在主音量之前混合, 光驱供应不足时只混合已有的帧
+  const PcmSample* cd = cdBuf.get(nframe << 1);
+  const u32 ncd = cd_frames << 1;
+  for (u32 i = 0; i < ncd; ++i) {
+    buf[i] += cd[i];
+  }
+
   for (u32 i = 0; i < (nframe<<1); i+=2) {
     buf[i+0] = buf[i+0] * main_left  + echo[i+0] * echo_left;
     buf[i+1] = buf[i+1] * main_right + echo[i+1] * echo_right;
@@ -248,102 +468,56 @@ void SoundProcessing::mix_end(PcmSample* buf, PcmSample* echo, u32 nframe) {
 }
 
 
-void SoundProcessing::apply_reverb(PcmSample* echo, u32 nframe) {
-#define A(reg)    s16(reg->address()>>1)
-#define V(reg)    s16(reg->sl)
-#define T         double
-  const s16 mLSAME = A(this->mLSAME);
-  const s16 mRSAME = A(this->mRSAME);
-  const s16 dLSAME = A(this->dLSAME);
-  const s16 dRSAME = A(this->dRSAME);
-  const T   vWALL  = V(this->vWALL);
-  const T   vIIR   = V(this->vIIR);
-  const s16 mLDIFF = A(this->mLDIFF);
-  const s16 mRDIFF = A(this->mRDIFF);
-  const s16 dRDIFF = A(this->dRDIFF);
-  const s16 dLDIFF = A(this->dLDIFF);
-  const T   vCOMB1 = V(this->vCOMB1);
-  const T   vCOMB2 = V(this->vCOMB2);
-  const T   vCOMB3 = V(this->vCOMB3);
-  const T   vCOMB4 = V(this->vCOMB4);
-  const s16 mLCOMB1= A(this->mLCOMB1);
-  const s16 mLCOMB2= A(this->mLCOMB2);
-  const s16 mLCOMB3= A(this->mLCOMB3);
-  const s16 mLCOMB4= A(this->mLCOMB4);
-  const s16 mRCOMB1= A(this->mRCOMB1);
-  const s16 mRCOMB2= A(this->mRCOMB2);
-  const s16 mRCOMB3= A(this->mRCOMB3);
-  const s16 mRCOMB4= A(this->mRCOMB4);
-  const s16 mLAPF1 = A(this->mLAPF1);
-  const s16 mLAPF2 = A(this->mLAPF2);
-  const s16 mRAPF1 = A(this->mRAPF1);
-  const s16 mRAPF2 = A(this->mRAPF2);
-  const s16 dAPF1  = A(this->dAPF1);
-  const s16 dAPF2  = A(this->dAPF2);
-  const T   vAPF1  = V(this->vAPF1);
-  const T   vAPF2  = V(this->vAPF2);
-
-  const PcmSample maxVol = 0x8000;
-  const bool masterEchoEnable = ctrl.r.mst_rev;
-  const u32 begin = reverbBegin.r.address() & SPU_MEM_ECHO_MASK;
-  const u32 len   = SPU_MEM_ECHO_MASK - begin;
-  const s32 hwlen = len >> 1;
-  s16 *base = (s16*)(mem + begin);
-
-#define L(addr)     base[(echo_addr_offset + ((addr)>>1)) % hwlen]
-#define R(addr)     L(addr + hwlen)
-#define MUL(a, b)   ((T(a)*T(b)) / maxVol)
-#define LIMIT(x)    ((x)>0x7FFF ? 0x7FFF : ((x)<-0x7FFF ? -0x7FFF : x))
-
-  for (u32 i = 0; i < (nframe<<1); i+=2) {
-    if (masterEchoEnable) {
-      T Lin = T(vLIN.r.sl) * echo[i+0];
-      T Rin = T(vRIN.r.sl) * echo[i+1];
-      T swap;
-
-      swap = MUL((Lin + MUL(L(dLSAME), vWALL) - L(mLSAME -2)), vIIR) + L(mLSAME -2);
-      L(mLSAME) = LIMIT(swap);
-      swap = MUL((Rin + MUL(R(dRSAME), vWALL) - R(mRSAME -2)), vIIR) + R(mRSAME -2);
-      R(mRSAME) = LIMIT(swap);
-
-      swap = MUL((Lin + MUL(L(dRDIFF), vWALL) - L(mLDIFF -2)), vIIR) + L(mLDIFF -2);
-      L(mLDIFF) = LIMIT(swap);
-      swap = MUL((Rin + MUL(R(dLDIFF), vWALL) - R(mRDIFF -2)), vIIR) + R(mRDIFF -2);
-      R(mRDIFF) = LIMIT(swap);
-    }
-
-    T Lout = MUL(vCOMB1, L(mLCOMB1)) +MUL(vCOMB2, L(mLCOMB2)) +MUL(vCOMB3, L(mLCOMB3)) +MUL(vCOMB4, L(mLCOMB4));
-    T Rout = MUL(vCOMB1, R(mRCOMB1)) +MUL(vCOMB2, R(mRCOMB2)) +MUL(vCOMB3, R(mRCOMB3)) +MUL(vCOMB4, R(mRCOMB4));
+void SoundProcessing::reverb_changed(u32, u32) {
+  reverb_dirty = true;
+}
 
-    T o1 = Lout - MUL(vAPF1, L(mLAPF1 - dAPF1));
-    Lout = MUL(o1, vAPF1) + L(mLAPF1 - dAPF1);
 
-    T o2 = Rout - MUL(vAPF1, R(mRAPF1 - dAPF1));
-    Rout = MUL(o2, vAPF1) + R(mRAPF1 - dAPF1);
+void SoundProcessing::set_reverb_base(u32, u32) {
+  reverb_reset = true;
+  reverb_dirty = true;
+}
 
-    T o3 = Lout - MUL(vAPF2, L(mLAPF2 - dAPF2));
-    Lout = MUL(o3, vAPF2) + L(mLAPF2 - dAPF2);
 
-    T o4 = Rout - MUL(vAPF2, R(mRAPF2 - dAPF2));
-    Rout = MUL(o4, vAPF2) + R(mRAPF2 - dAPF2);
+void SoundProcessing::sync_reverb() {
+#define TAP(n, a)   reverb.setTap(SpuReverb::n, this->n.r.address(), a)
+#define VOL(n)      reverb.setVolume(SpuReverb::n, this->n.r.sl)
+  reverb_dirty = false;
+  reverb.setBase(mem, reverbBegin.r.address(), reverb_reset);
+  reverb_reset = false;
+
+  TAP(dLSAME, 0);   TAP(dRSAME, 0);   TAP(dLDIFF, 0);   TAP(dRDIFF, 0);
+  TAP(mLSAME, 0);   TAP(mRSAME, 0);   TAP(mLDIFF, 0);   TAP(mRDIFF, 0);
+  TAP(mLCOMB1, 0);  TAP(mLCOMB2, 0);  TAP(mLCOMB3, 0);  TAP(mLCOMB4, 0);
+  TAP(mRCOMB1, 0);  TAP(mRCOMB2, 0);  TAP(mRCOMB3, 0);  TAP(mRCOMB4, 0);
+  TAP(mLAPF1, 0);   TAP(mRAPF1, 0);   TAP(mLAPF2, 0);   TAP(mRAPF2, 0);
+
+  // 前一个半字
+  reverb.setTap(SpuReverb::mLSAME2, mLSAME.r.address(), -1);
+  reverb.setTap(SpuReverb::mRSAME2, mRSAME.r.address(), -1);
+  reverb.setTap(SpuReverb::mLDIFF2, mLDIFF.r.address(), -1);
+  reverb.setTap(SpuReverb::mRDIFF2, mRDIFF.r.address(), -1);
+
+  const s32 d1 = s32(dAPF1.r.address() >> 1);
+  const s32 d2 = s32(dAPF2.r.address() >> 1);
+  reverb.setTap(SpuReverb::mLAPF1d, mLAPF1.r.address(), -d1);
+  reverb.setTap(SpuReverb::mRAPF1d, mRAPF1.r.address(), -d1);
+  reverb.setTap(SpuReverb::mLAPF2d, mLAPF2.r.address(), -d2);
+  reverb.setTap(SpuReverb::mRAPF2d, mRAPF2.r.address(), -d2);
+
+  VOL(vIIR);    VOL(vWALL);   VOL(vAPF1);   VOL(vAPF2);
+  VOL(vCOMB1);  VOL(vCOMB2);  VOL(vCOMB3);  VOL(vCOMB4);
+  VOL(vLIN);    VOL(vRIN);
+#undef TAP
+#undef VOL
+}
 
-    if (masterEchoEnable) {
-      L(mLAPF1) = LIMIT(o1);
-      R(mRAPF1) = LIMIT(o2);
-      L(mLAPF2) = LIMIT(o3);
-      R(mRAPF2) = LIMIT(o4);
-    }
 
-    echo[i+0] = T(Lout) / maxVol;
-    echo[i+1] = T(Rout) / maxVol;
-    ++echo_addr_offset;
+void SoundProcessing::apply_reverb(PcmSample* echo, u32 nframe) {
+  if (reverb_dirty) {
+    sync_reverb();
   }
-#undef A
-#undef V
-#undef L
-#undef R
-#undef MUL
-#undef T
+  reverb.process(echo, nframe, ctrl.r.mst_rev);
 }
 
 
@@ -488,7 +662,7 @@ bool SoundProcessing::check_irq(u32 beginAddr, u32 offset) {
 }
 
 
-AdpcmFlag SoundProcessing::readAdpcmBlock(PcmSample *buf, PcmHeader& h) {
+AdpcmFlag SoundProcessing::readAdpcmBlock(s16 *buf, PcmHeader& h) {
   const u32 readAddr = h.addr & SPU_MEM_MASK & 0xFFFF'FFF0;
   check_irq(readAddr, SPU_MEM_SIZE);
   AdpcmBlock* af = (AdpcmBlock*) &mem[readAddr];
@@ -497,11 +671,12 @@ AdpcmFlag SoundProcessing::readAdpcmBlock(PcmSample *buf, PcmHeader& h) {
   u8 shift_factor = (af->filter >> 0) & 0xf;
   u8 nbit = 0;
   s32 nibble;
-  PcmSample sp;
+  s32 sp;
 
   if (shift_factor > 12) shift_factor = 9; //?
-  if (coef_index > 5) coef_index = 0; //?
-  shift_factor = 20 - shift_factor;
+  if (coef_index > 4) coef_index = 0; //?
+  const s32 f0 = adpcm_coefs_dict[coef_index][0];
+  const s32 f1 = adpcm_coefs_dict[coef_index][1];
 
   for (int i=0; i<SPU_PCM_BLK_SZ; ++i) {
     u8 niindex = af->data[nbit].v;
@@ -512,16 +687,14 @@ AdpcmFlag SoundProcessing::readAdpcmBlock(PcmSample *buf, PcmHeader& h) {
       nibble = nibble_dict[niindex & 0x0F];
     }
 
-    sp = nibble << shift_factor;
-    sp += ((adpcm_coefs_dict[coef_index][0]* h.hist1 
-          + adpcm_coefs_dict[coef_index][1]* h.hist2) * 256.0f);
-    sp = sp / 256.0f;
+    sp = (nibble << 12) >> shift_factor;
+    sp += (f0 * h.hist1 + f1 * h.hist2 + 32) >> 6;
 
     // 一般很少出现
     if (sp > 32767) sp = 32767;
     else if (sp < -32768) sp = -32768;
 
-    buf[i] = sp / 32768.0f;
+    buf[i] = s16(sp);
     h.hist2 = h.hist1;
     h.hist1 = sp;
   }
@@ -669,7 +842,7 @@ void SoundProcessing::key_on_changed() {
   for (int i=0; i<SPU_CHANNEL_COUNT; ++i) {
     if (nKeyOn.f[i]) {
       endx.f[i] = 0;
-      channel_stream[i]->copyStartToRepeat();
+      channel_stream[i]->keyOn();
     }
   }
 }
@@ -706,7 +879,7 @@ void SpuAdsr::next(s32& level, u32& cycles) {
 }
 
 
-void PcmHeader::set(u32 a, PcmSample h1, PcmSample h2, bool c) {
+void PcmHeader::set(u32 a, s32 h1, s32 h2, bool c) {
   addr = a;
   hist1 = h1;
   hist2 = h2;
@@ -725,12 +898,12 @@ static long resample_src_callback(void *cb_data, float **data) {
 }
 
 
-PcmResample::PcmResample(PcmStreamer *p) : stage(0), stream(p) {
+PcmResample::PcmResample(SoundProcessing *p) : stage(0), spu(p) {
   // SRC_SINC_MEDIUM_QUALITY SRC_SINC_FASTEST
   int error;
-  stage = src_callback_new(resample_src_callback, SRC_SINC_FASTEST, 1, &error, this);
+  stage = src_callback_new(resample_src_callback, SRC_SINC_FASTEST, 2, &error, this);
   check_error(error);
-  buf = new float[buf_size];
+  buf = new PcmSample[buf_frames << 1];
 }
 
 
@@ -753,8 +926,7 @@ void PcmResample::check_error(int error, bool throwErr) {
 }
 
 
-bool PcmResample::read(float* out, long frames, double ratio) {
-  //src_set_ratio(static_cast<SRC_STATE*>(stage), ratio);
+bool PcmResample::read(PcmSample* out, long frames, double ratio) {
   if (0 == src_callback_read(stage, ratio, frames, out)) {
     check_error(src_error(stage));
     return 0;
@@ -764,132 +936,121 @@ bool PcmResample::read(float* out, long frames, double ratio) {
 
 
 long PcmResample::readSrc(float **out) {
-  for (u32 i=0; i<buf_size; ++i) {
-    buf[i] = stream->readPcmSample();
-  }
+  spu->pull_frames(buf, buf_frames);
   *out = buf;
-  return buf_size;
+  return buf_frames;
 }
 
 
-class PcmLowpassInner {
-public:
-  static const int order = 1;
-  static const int cutoff_frequency = 4;
-
-  Iir::ChebyshevI::LowPass<order> f1;
-  Iir::ChebyshevI::LowPass<order> f2;
-
-  PcmLowpassInner(float samplingrate) {
-    f1.setup(samplingrate, 6000, cutoff_frequency);
-    f2.setup(samplingrate, 3000, cutoff_frequency);
-  }
-};
-
-
-PcmLowpass::PcmLowpass(float samplingrate) : inner(0) {
-  inner = new PcmLowpassInner(samplingrate);
+PcmRing::PcmRing(u32 frames) : mask(frames - 1), wpos(0), rpos(0) {
+  buf = new PcmSample[frames << 1];
 }
 
 
-PcmLowpass::~PcmLowpass() {
-  delete inner;
+PcmRing::~PcmRing() {
+  delete [] buf;
 }
 
 
-void PcmLowpass::filter(PcmSample *data, u32 frame, double freq) {
-  if (freq < 20000) {
-    for (u32 i = 0; i < frame; ++i) {
-      data[i] = inner->f2.filter(data[i]);
-    }
-  } else if (freq < 40000) {
-    for (u32 i = 0; i < frame; ++i) {
-      data[i] = inner->f1.filter(data[i]);
-    }
+u32 PcmRing::push(const PcmSample* in, u32 nframe) {
+  const u32 w = wpos.load(std::memory_order_relaxed);
+  const u32 r = rpos.load(std::memory_order_acquire);
+  const u32 n = MinT(nframe, (mask + 1) - (w - r));
+
+  for (u32 i = 0; i < n; ++i) {
+    const u32 p = ((w + i) & mask) << 1;
+    buf[p+0] = in[(i<<1) + 0];
+    buf[p+1] = in[(i<<1) + 1];
   }
+  wpos.store(w + n, std::memory_order_release);
+  return n;
 }
 
 
-VolumeEnvelope* VolumeEnvelopeSet::get(bool left, VolData& vd, s32 clevel) {
-  if (vd.mode == 0) {
-    if (vd.vol == 0) {
-      return left ? &lz : &rz;
-    } else {
-      FixVol* f = left ? &lf : &rf;
-      f->reset(vd);
-      return f;
-    }
-  }
+u32 PcmRing::pop(PcmSample* out, u32 nframe) {
+  const u32 r = rpos.load(std::memory_order_relaxed);
+  const u32 w = wpos.load(std::memory_order_acquire);
+  const u32 n = MinT(nframe, w - r);
 
-  Sweep* s = left ? &ls : &rs;
-  s->reset(vd, clevel);
-  return s;
+  for (u32 i = 0; i < n; ++i) {
+    const u32 p = ((r + i) & mask) << 1;
+    out[(i<<1) + 0] = buf[p+0];
+    out[(i<<1) + 1] = buf[p+1];
+  }
+  rpos.store(r + n, std::memory_order_release);
+  return n;
 }
 
 
-void VolumeEnvelopeSet::Sweep::apply(PcmSample& v) {
-  if (cycles <= 0) {
-    if (dir == 0 && level > 0x7fff) {
-      dir = 1;
-      level = 0x7fff;
-      filter.reset(arg.mode, dir, arg.shift, arg.step);
-    }
-    else if (dir == 1 && level < 0) {
-      dir = 0;
-      level = 0;
-      filter.reset(arg.mode, dir, arg.shift, arg.step);  
-    }
-    filter.next(level, cycles);
-  }
-  --cycles;
-  //当前音量将增加到+ 7FFFh，或减少到0000h
-  v *= (float(level) / float(0x8000)) * phase;
+u32 PcmRing::size() {
+  return wpos.load(std::memory_order_acquire) - rpos.load(std::memory_order_acquire);
 }
 
 
-void VolumeEnvelopeSet::Sweep::reset(VolData& vd, s32 clevel) {
-  if (vd.v != arg.v) {
+void SpuVolSweep::reset(VolData vd, s32 clevel) {
+  if (vd.type == 0) {
+    sweep = false;
+    arg   = vd;
+    vol   = SPU_F_VOLUME(vd.vol << 1);
+    level = s16(vd.vol << 1);
+    return;
+  }
+
+  if (!sweep || vd.v != arg.v) {
     filter.reset(vd.mode, vd.dir, vd.shift, vd.step);
+    sweep  = true;
     arg    = vd;
     dir    = vd.dir;
     cycles = 0;
     level  = clevel;
-
-    if (vd.phase == 0 || vd.mode == 0) {
-      phase = 1;
-    } else if (vd.phase == 1) {
-      phase = -1;
-    }
+    phase  = vd.phase ? -1 : 1;
   }
 }
 
-s16 VolumeEnvelopeSet::Sweep::getVol() {
-  return u16(level & 0xffff);
-}
-
-
-void VolumeEnvelopeSet::FixVol::apply(PcmSample& v) {
-  v *= vol;
-}
-
-
-void VolumeEnvelopeSet::FixVol::reset(VolData& vd) {
-  vol = SPU_F_VOLUME(vd.vol << 1);
-}
-
 
-s16 VolumeEnvelopeSet::FixVol::getVol() {
-  return u16(vol);
+PcmSample SpuVolSweep::step(u32 n) {
+  if (!sweep) return vol;
+  //当前音量将增加到+ 7FFFh，或减少到0000h
+  const PcmSample v = (PcmSample(level) / PcmSample(0x8000)) * phase;
+
+  while (n > 0) {
+    if (cycles == 0) {
+      if (dir == 0 && level > 0x7fff) {
+        dir = 1;
+        level = 0x7fff;
+        filter.reset(arg.mode, dir, arg.shift, arg.step);
+      }
+      else if (dir == 1 && level < 0) {
+        dir = 0;
+        level = 0;
+        filter.reset(arg.mode, dir, arg.shift, arg.step);  
+      }
+      filter.next(level, cycles);
+      if (cycles == 0) cycles = 1;
+    }
+    const u32 run = MinT(cycles, n);
+    cycles -= run;
+    n -= run;
+  }
+  return v;
 }
 
 
-void VolumeEnvelopeSet::DoZero::apply(PcmSample& v) {
-  v = 0;
+s16 SpuVolSweep::getVol() {
+  return s16(level & 0xffff);
 }
 
 
-s16 VolumeEnvelopeSet::DoZero::getVol() {
-  return 0;
+SpuVoices::SpuVoices() {
+  for (int i = 0; i < SPU_CHANNEL_COUNT; ++i) {
+    active[i]        = 0;
+    echo[i]          = 0;
+    adsr_state[i]    = SpuAdsrState::Wait;
+    adsr_level[i]    = 0;
+    adsr_cycles[i]   = 0;
+    pitch[i]         = 0;
+    pitch_counter[i] = SPU_PCM_BLK_SZ << SPU_PITCH_SHIFT;
+  }
 }
 
 }
\ No newline at end of file
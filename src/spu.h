@@ -3,7 +3,9 @@
 #include "util.h"
 #include "io.h"
 #include "bus.h"
+#include "time.h"
 #include <mutex>
+#include <atomic>
 
 class RtAudio;
 extern "C" struct SRC_STATE_tag;
@@ -14,6 +16,10 @@ namespace ps1e {
 #define SPU_DEBUG_INFO
 // 自动压限会影响性能
 #define SPU_AUTO_LIMIT_VOLUME
+// 混音使用 SSE 指令, 要求 PcmSample 是 float
+#define SPU_MIX_SSE
+// 混音批次的帧数量, 通道音量包络在一个批次内保持不变
+#define SPU_MIX_BATCH       32
 // 512K
 #define SPU_MEM_SIZE        0x8'0000
 #define SPU_MEM_MASK        (SPU_MEM_SIZE-1)
@@ -27,6 +33,19 @@ namespace ps1e {
 #define SPU_CHANNEL_COUNT   24
 #define SPU_WORK_FREQ       44100
 #define SPU_ADPCM_RETE      22050
+// 音高计数器 bit12 以上是块内采样索引, bit4-11 是高斯插值索引
+#define SPU_PITCH_SHIFT     12
+#define SPU_PITCH_MAX       0x4000
+// 一个 44100Hz 采样的系统时钟数 (33.8688MHz / 44100)
+#define SPU_CLOCK_PER_SAMPLE  768
+// 由 CPU 时钟驱动时, 每次生成的帧数
+#define SPU_CLOCK_BATCH     32
+// 输出环形缓冲区的帧数, 必须是 2 的幂
+#define SPU_RING_FRAMES     8192
+// 动态速率控制的目标填充帧数, 约 46ms
+#define SPU_RING_TARGET     2048
+// CD 音频输入环形缓冲区的帧数, 必须是 2 的幂, 可以容纳约 7 个 XA 扇区
+#define SPU_CD_RING_FRAMES  0x4000
 // 转换 spu 整数音量到浮点值 x[-8000h..+7FFEh] 输出 -n ~ +n 倍, x==0 则没有变化
 //#define SPU_F_VOLUME(x)     (1 + s16(x)/float(0x8000) * 2)
 // 这个音量策略, 允许音量为负值, 使声音反相.
@@ -55,7 +74,6 @@ namespace ps1e {
 
 typedef float PcmSample;
 class SoundProcessing;
-class PcmLowpassInner;
 
 
 enum class SpuDmaDir : u8 {
@@ -431,118 +449,231 @@ public:
 
 
 struct PcmHeader {
-  PcmSample hist1 = 0;
-  PcmSample hist2 = 0;
+  s32 hist1 = 0;
+  s32 hist2 = 0;
   u32 addr = 0;
   bool changed = 0;
 
-  void set(u32 a, PcmSample h1, PcmSample h2, bool c = 0);
+  void set(u32 a, s32 h1, s32 h2, bool c = 0);
   bool sameAddr(PcmHeader& o);
 };
 
 
-// 可以安全的复制, 抽象类
-class VolumeEnvelope {
+// 通道音量, 固定音量或扫频音量; 非虚类, 状态保存在 SpuVoices 中.
+// 混音按批次进行, 一个批次内音量保持不变, 包络步进在批次之间完成.
+struct SpuVolSweep {
+  SpuAdsr filter;
+  VolData arg;
+  s32 level = 0;
+  u32 cycles = 0;
+  PcmSample vol = 0;
+  PcmSample phase = 1;
+  u8 dir = 0;
+  bool sweep = false;
+
+  // 寄存器写入时调用, clevel 是扫频模式的起始音量
+  void reset(VolData vd, s32 clevel);
+  // 返回当前批次的音量, 然后使包络前进 n 个采样
+  PcmSample step(u32 n);
+  // 同步到 currVolume 寄存器的值
+  s16 getVol();
+};
+
+
+enum class SpuAdsrState : u8 {
+  Wait    = 0,
+  Attack  = 1,
+  Decay   = 2,
+  Sustain = 3,
+  Release = 4,
+};
+
+
+//
+// 24 个通道的工作状态, 每个字段是一个按通道号索引的数组 (SoA),
+// 混音时按字段连续遍历全部通道. 通道对象只保存寄存器与 ADPCM 读取状态.
+//
+struct SpuVoices {
+  // 通道在本次请求中有输出, 没有输出的通道不参与混音
+  u8           active[SPU_CHANNEL_COUNT];
+  // 通道混响开关, 每次混音开始时从寄存器同步一次
+  u8           echo[SPU_CHANNEL_COUNT];
+  SpuAdsrState adsr_state[SPU_CHANNEL_COUNT];
+  s32          adsr_level[SPU_CHANNEL_COUNT];
+  u32          adsr_cycles[SPU_CHANNEL_COUNT];
+  SpuAdsr      adsr[SPU_CHANNEL_COUNT];
+  SpuVolSweep  vol_l[SPU_CHANNEL_COUNT];
+  SpuVolSweep  vol_r[SPU_CHANNEL_COUNT];
+  // 音高寄存器的值, 0 则通道停止工作
+  u16          pitch[SPU_CHANNEL_COUNT];
+  // 音高计数器, 每个 44100Hz 采样加上 pitch
+  u32          pitch_counter[SPU_CHANNEL_COUNT];
+
+  SpuVoices();
+};
+
+
+class PcmStreamer {
 public:
-  VolumeEnvelope() {}
-  virtual ~VolumeEnvelope() {};
-  // 应用音量包络
-  virtual void apply(PcmSample& v) = 0;
-  // 同步音量, 在 apply 的时候音量可能更改, 将更改的音量同步回寄存器
-  virtual s16 getVol() = 0;
+  virtual ~PcmStreamer() {}
+  // 读取 44100Hz 的采样块, 经过音高插值/adsr, 如果因为某种原因块被忽略(0采样等)返回 false.
+  // mod 是前一个通道的输出 (FM 调制器), 通道 0 为 NULL.
+  virtual bool readSampleBlocks(const PcmSample *mod, PcmSample *_out, u32 sample_count) = 0;
+  // 复制开始地址到重复地址, 并从开始地址重新播放
+  virtual void keyOn() = 0;
+  // 用于测试目的, 返回内部变量的值
+  virtual u32 getVar(SpuChVarFlag) = 0;
 };
 
 
-class VolumeEnvelopeSet : public NonCopy {
+// 最终输出的重采样, 将 SPU_WORK_FREQ 的立体声转换到设备采样率,
+// 通道的音高变换由音高计数器完成, 这里只有一次重采样.
+class PcmResample {
 private:
-
-  class DoZero : public VolumeEnvelope {
-  public:
-    void apply(PcmSample& v);
-    s16 getVol();
-  };
+  static const u32 buf_frames = 128;
+  SoundProcessing* spu;
+  SRC_STATE_tag *stage;
+  PcmSample *buf;
+  void check_error(int e, bool throwErr = false);
+public:
+  PcmResample(SoundProcessing*);
+  ~PcmResample();
+  // 读取重采样后的音频帧(左右交错), 输出到 out 中
+  bool read(PcmSample* out, long frames, double ratio);
+  // 不要调用, 读取原始音频帧
+  long readSrc(float **data);
+};
 
 
-  class FixVol : public VolumeEnvelope {
-   public:
-    PcmSample vol;
+//
+// 混响引擎, 与硬件一样以 22050Hz 工作, 使用 s16/s32 整数运算, 写入工作区时饱和.
+// 寄存器中的地址在写入后转换为相对当前缓冲区地址的偏移, 每次访问只需一次比较回绕.
+//
+class SpuReverb {
+public:
+  enum Tap {
+    dLSAME, dRSAME, dLDIFF, dRDIFF,
+    mLSAME, mRSAME, mLDIFF, mRDIFF,
+    // [mXSAME-2] [mXDIFF-2]
+    mLSAME2, mRSAME2, mLDIFF2, mRDIFF2,
+    mLCOMB1, mLCOMB2, mLCOMB3, mLCOMB4,
+    mRCOMB1, mRCOMB2, mRCOMB3, mRCOMB4,
+    mLAPF1, mRAPF1, mLAPF2, mRAPF2,
+    // [mXAPFn-dAPFn]
+    mLAPF1d, mRAPF1d, mLAPF2d, mRAPF2d,
+    TapCount,
+  };
 
-    void apply(PcmSample& v);
-    void reset(VolData& vd);
-    s16 getVol();
+  enum Vol {
+    vIIR, vWALL, vCOMB1, vCOMB2, vCOMB3, vCOMB4, 
+    vAPF1, vAPF2, vLIN, vRIN,
+    VolCount,
   };
 
+private:
+  // 工作区从 ring 开始到 SPU 内存结束, len 个半字
+  s16 *ring;
+  u32 len;
+  // 当前缓冲区地址, 相对于 ring
+  u32 cur;
+  u32 tap[TapCount];
+  s32 vol[VolCount];
+  // 44100Hz -> 22050Hz, 两个输入帧合并为一个
+  s32 pendL, pendR;
+  bool half;
+  // 前一个和当前的输出, 输出 44100Hz 时在两者之间插值
+  s32 prevL, prevR, outL, outR;
+
+  inline s16& at(Tap t);
+  // 运行一个 22050Hz 周期
+  void step(s32 inl, s32 inr, bool write);
 
-  class Sweep : public VolumeEnvelope {
-   public:
-    SpuAdsr filter;
-    float phase;
-    s32 level;
-    u32 cycles;
-    VolData arg;
-    u8 dir;
+public:
+  SpuReverb();
+  // base 是工作区开始地址(字节), 工作区结束于 7FFFEh, resetAddr 则缓冲区地址回到 base
+  void setBase(u8* mem, u32 base, bool resetAddr);
+  // addr 是寄存器中的字节地址, adj 是附加的半字偏移, 必须在 setBase 之后调用
+  void setTap(Tap t, u32 addr, s32 adj = 0);
+  void setVolume(Vol v, s16 x);
+  // echo 是 SPU_WORK_FREQ 左右交错的混响输入, 处理后输出混响结果(未应用混响输出音量).
+  // write 为 false 时不写入工作区, 但仍然从工作区读取输出.
+  void process(PcmSample* echo, u32 nframe, bool write);
+};
 
-    void apply(PcmSample& v);
-    void reset(VolData& vd, s32 nlevel);
-    s16 getVol();
-  };
 
+// 单生产者/单消费者的无锁立体声环形缓冲区, 模拟线程写入, 音频线程读取
+class PcmRing {
 private:
-  DoZero lz, rz;
-  FixVol lf, rf;
-  Sweep  ls, rs;
+  PcmSample *buf;
+  const u32 mask;
+  std::atomic<u32> wpos;
+  std::atomic<u32> rpos;
 
 public:
-  // 返回的 VolumeEnvelope 由 VolumeEnvelopeSet 管理
-  VolumeEnvelope* get(bool left, VolData& vd, s32 clevel);
+  PcmRing(u32 frames);
+  ~PcmRing();
+  // 写入左右交错的帧, 缓冲区满时丢弃多余的帧, 返回写入的帧数
+  u32 push(const PcmSample* in, u32 nframe);
+  // 读取左右交错的帧, 返回读取的帧数
+  u32 pop(PcmSample* out, u32 nframe);
+  // 可读取的帧数
+  u32 size();
 };
 
 
-class PcmStreamer {
+// 输出捕获点
+enum class SpuTap : u8 {
+  Voice  = 0, // 单个通道, 单声道, 已应用 ADSR, 未应用通道音量
+  Reverb = 1, // 混响发送, 进入混响单元之前的立体声
+  Mix    = 2, // 最终输出的立体声
+};
+
+
+// SPU 输出捕获, 采样率总是 SPU_WORK_FREQ, 在生成音频的线程上调用
+class SpuOutputSink {
 public:
-  virtual ~PcmStreamer() {}
-  // 读取一个原始采样
-  virtual PcmSample readPcmSample() = 0;
-  // 读取一个采样块, 经过 adsr/过滤器/重采样, 如果因为某种原因块被忽略(0采样等)返回 false.
-  virtual bool readSampleBlocks(PcmSample *_in, PcmSample *_out, u32 sample_count) = 0;
-  // 返回的 VolumeEnvelope 由当前 PcmStreamer 对象管理
-  virtual VolumeEnvelope* getVolumeEnvelope(bool left) = 0;
-  virtual void copyStartToRepeat() = 0;
-  // 同步音量, 在 apply 的时候音量可能更改, 将更改的音量同步回寄存器
-  virtual void syncVol(VolumeEnvelope* left, VolumeEnvelope *right) = 0;
-  // 用于测试目的, 返回内部变量的值
-  virtual u32 getVar(SpuChVarFlag) = 0;
+  virtual ~SpuOutputSink() {}
+  // samples 包含 nframe * channels 个交错采样
+  virtual void write(const PcmSample* samples, u32 nframe, u32 channels) = 0;
 };
 
 
-class PcmResample {
+// 写入 16 位 PCM wav 文件, 关闭时更新文件头中的长度
+class SpuWavSink : public SpuOutputSink, public NonCopy {
 private:
-  static const u32 buf_size = 64;
-  PcmStreamer* stream;
-  SRC_STATE_tag *stage;
-  float *buf;
-  void check_error(int e, bool throwErr = false);
+  FILE* f;
+  u32 channels;
+  u32 frames;
+  SmallBuf<s16> conv;
+  void write_header();
+
 public:
-  PcmResample(PcmStreamer*);
-  ~PcmResample();
-  // 读取采样后的音频帧, 输出到 out 中
-  bool read(float* out, long frames, double ratio);
-  // 不要调用, 读取原始音频帧
-  long readSrc(float **data);
+  SpuWavSink(const char* filename);
+  ~SpuWavSink();
+  bool isOpen();
+  void close();
+  void write(const PcmSample* samples, u32 nframe, u32 channels) override;
 };
 
 
-//if (pitch < 32640) then
-//低通滤波 3000.0 6bB
-//if (pitch < 20000) then
-//低通滤波 500.0 6bB
-class PcmLowpass {
+// 写入内存, 缓冲区在构造时一次分配, 满了之后丢弃多余的帧
+class SpuMemorySink : public SpuOutputSink, public NonCopy {
 private:
-  PcmLowpassInner* inner;
+  s16* buf;
+  const u32 channels;
+  const u32 capacity;
+  u32 used;
+
 public:
-  PcmLowpass(float samplingrate = SPU_WORK_FREQ);
-  ~PcmLowpass();
-  void filter(PcmSample *data, u32 frame, double freq);
+  SpuMemorySink(u32 maxFrames, u32 channels);
+  ~SpuMemorySink();
+  void write(const PcmSample* samples, u32 nframe, u32 channels) override;
+  void clear();
+  // 已写入的帧数
+  u32 frames();
+  const s16* data();
+  // FNV-1a, 用于对比两次输出是否相同
+  u32 checksum();
 };
 
 
@@ -562,39 +693,30 @@ private:
   SpuIOFunction<SPUChannel, t_sa, AddrReg> pcmStartAddr;
   // 0x1F801Cn8
   SpuIO<SPUChannel, ADSRReg, t_adsr> adsr;
-  // 0x1F801CnC
-  SpuIO<SPUChannel, SpuReg, t_acv> adsrVol;
+  // 0x1F801CnC 当前 ADSR 音量, 值保存在 SpuVoices::adsr_level
+  SpuIOFunction<SPUChannel, t_acv, SpuReg> adsrVol;
   // 0x1F801CnE 声音重复地址, 播放时被adpcm数据更新
   SpuIOFunction<SPUChannel, t_ra, AddrReg> pcmRepeatAddr;
   // 0x1F801E0n These are internal registers, normally not used by software
-  SpuIO<SPUChannel, SpuReg, t_cv> currVolume;
+  // 值来自 SpuVoices::vol_l/vol_r
+  SpuIOFunction<SPUChannel, t_cv, SpuReg, true> currVolume;
 
   SoundProcessing& spu;
   PcmHeader currentReadAddr;
   PcmHeader repeatAddr;
-  SpuAdsr adsr_filter;
-  u32 adsr_cycles_remaining = 0;
-  // 在缓冲区中存储一整块采样, 然后读取单个采样点
-  PcmSample pcm_read_buf[SPU_PCM_BLK_SZ];
-  s32 pcm_buf_remaining = 0;
-  double play_rate = 0;
-  PcmResample resample;
-  PcmLowpass lowpass;
-  VolumeEnvelopeSet sweet_ve;
-
-  enum class AdsrState : u8 {
-    Wait    = 0,
-    Attack  = 1,
-    Decay   = 2,
-    Sustain = 3,
-    Release = 4,
-  } adsr_state = AdsrState::Wait;
+  // 前 3 个是上一块的最后 3 个采样, 之后是当前块, 高斯插值需要 4 个连续采样
+  s16 pcm_read_buf[SPU_PCM_BLK_SZ + 3];
+
+  // 解码下一个块, 处理循环标记
+  void decode_next_block();
 
   void set_start_address(u32, u32);
   void set_repeat_addr(u32, u32);
   void set_sample_rate(u32, u32);
   void set_volume_l(u32, u32);
   void set_volume_r(u32, u32);
+  void set_adsr_volume(u32, u32);
+  u32 read_adsr_volume();
   u32 read_curr_volume();
 
 public:
@@ -602,15 +724,12 @@ public:
 
   // 从指定的通道中读取并解码采样数据到 buf, 读取结束会修改通道的声音地址,
   // 必要时读取会触发 irq, 读取会检测出数据循环标记并修改循环地址,
-  // 如果进入了循环地址, 则执行循环; 应用全部音量包络.
-  // _in 通常是前一个通道的输出(FM模式使用) 该缓冲区不会用作其他, 可以随意写入.
-  bool readSampleBlocks(PcmSample *_in, PcmSample *_out, u32 sample_count);
+  // 如果进入了循环地址, 则执行循环; 应用 ADSR 包络, 不应用通道音量.
+  // mod 是前一个通道的输出(FM模式使用), 只读.
+  bool readSampleBlocks(const PcmSample *mod, PcmSample *_out, u32 sample_count);
+  // _in 和 out 可以是同一个缓冲区
   void applyADSR(PcmSample *_in, PcmSample *out, u32 sample_count);
-  void copyStartToRepeat();
-  // 从 pcm 缓冲区读取一个采样, 保证效率
-  PcmSample readPcmSample();
-  VolumeEnvelope* getVolumeEnvelope(bool left);
-  void syncVol(VolumeEnvelope* left, VolumeEnvelope *right);
+  void keyOn();
   u32 getVar(SpuChVarFlag);
 };
 
@@ -626,7 +745,7 @@ public:
         func(name, 16) func(name, 17) func(name, 18) func(name, 19) \
         func(name, 20) func(name, 21) func(name, 22) func(name, 23) \
 
-class SoundProcessing : public NonCopy, public DMADev {
+class SoundProcessing : public NonCopy, public DMADev, public ClockEvent {
 private:
   // 0x1F80'1D80 主音量
   SpuIO<SoundProcessing, VolumnReg, DeviceIOMapper::spu_main_vol> mainVol;
@@ -679,43 +798,44 @@ private:
   // 0x1F80'1D84 混响输出音量
   SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_reverb_vol> reverbVol;
   // 0x1F80'1DA2 混响工作内存起始地址
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_ram_rev_addr> reverbBegin;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_ram_rev_addr, AddrReg> reverbBegin;
 
   SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_unknow1> _un1;
   SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_unknow2> _un2;
 
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_apf_off1>    dAPF1;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_apf_off2>    dAPF2;
-  SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_rb_ref_vol1>     vIIR;
-  SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_rb_comb_vol1>    vCOMB1;
-  SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_rb_comb_vol2>    vCOMB2;
-  SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_rb_comb_vol3>    vCOMB3;
-  SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_rb_comb_vol4>    vCOMB4;
-  SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_rb_ref_vol2>     vWALL;
-  SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_rb_apf_vol1>     vAPF1;
-  SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_rb_apf_vol2>     vAPF2;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_same_ref1l>  mLSAME;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_same_ref1r>  mRSAME;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_comb1l>      mLCOMB1;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_comb1r>      mRCOMB1;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_comb2l>      mLCOMB2;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_comb2r>      mRCOMB2;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_same_ref2l>  dLSAME;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_same_ref2r>  dRSAME;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_diff_ref1l>  mLDIFF;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_diff_ref1r>  mRDIFF;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_comb3l>      mLCOMB3;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_comb3r>      mRCOMB3;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_comb4l>      mLCOMB4;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_comb4r>      mRCOMB4;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_diff_ref2l>  dLDIFF;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_diff_ref2r>  dRDIFF;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_apf_addr1l>  mLAPF1;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_apf_addr1r>  mRAPF1;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_apf_addr2l>  mLAPF2;
-  SpuIO<SoundProcessing, AddrReg, DeviceIOMapper::spu_rb_apf_addr2r>  mRAPF2;
-  SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_rb_in_voll>      vLIN;
-  SpuIO<SoundProcessing, SpuReg, DeviceIOMapper::spu_rb_in_volr>      vRIN;
+  // 混响寄存器, 写入后在下一次混响处理前重新计算偏移
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_apf_off1, AddrReg>   dAPF1;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_apf_off2, AddrReg>   dAPF2;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_ref_vol1, SpuReg>    vIIR;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb_vol1, SpuReg>   vCOMB1;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb_vol2, SpuReg>   vCOMB2;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb_vol3, SpuReg>   vCOMB3;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb_vol4, SpuReg>   vCOMB4;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_ref_vol2, SpuReg>    vWALL;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_apf_vol1, SpuReg>    vAPF1;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_apf_vol2, SpuReg>    vAPF2;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_same_ref1l, AddrReg> mLSAME;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_same_ref1r, AddrReg> mRSAME;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb1l, AddrReg>     mLCOMB1;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb1r, AddrReg>     mRCOMB1;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb2l, AddrReg>     mLCOMB2;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb2r, AddrReg>     mRCOMB2;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_same_ref2l, AddrReg> dLSAME;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_same_ref2r, AddrReg> dRSAME;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_diff_ref1l, AddrReg> mLDIFF;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_diff_ref1r, AddrReg> mRDIFF;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb3l, AddrReg>     mLCOMB3;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb3r, AddrReg>     mRCOMB3;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb4l, AddrReg>     mLCOMB4;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_comb4r, AddrReg>     mRCOMB4;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_diff_ref2l, AddrReg> dLDIFF;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_diff_ref2r, AddrReg> dRDIFF;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_apf_addr1l, AddrReg> mLAPF1;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_apf_addr1r, AddrReg> mRAPF1;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_apf_addr2l, AddrReg> mLAPF2;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_apf_addr2r, AddrReg> mRAPF2;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_in_voll, SpuReg>     vLIN;
+  SpuIOFunction<SoundProcessing, DeviceIOMapper::spu_rb_in_volr, SpuReg>     vRIN;
 
   // ch0 ... ch23
   SPU_DEF_ALL_CHANNELS(ch, SPU_DEF_VAL)
@@ -734,16 +854,41 @@ private:
   RtAudio* dac;
   s32 noiseTimer;
   s16 nsLevel;
-  SmallBuf<PcmSample> swap1;
-  SmallBuf<PcmSample> swap2;
+  // 24 个通道的输出, 每个通道一行, 每行 nframe 个采样
+  SmallBuf<PcmSample> voiceRows;
+  // 平面格式的混音缓冲区: 左, 右, 混响左, 混响右
+  SmallBuf<PcmSample> mixPlanes;
   SmallBuf<PcmSample> echoOutSwap;
-  s32 echo_addr_offset;
+  PcmResample outResample;
+  // 不为空则 SPU 由 CPU 时钟驱动, 输出写入 outRing
+  TimerSystem* clock;
+  PcmRing outRing;
+  PcmSample clockBuf[SPU_CLOCK_BATCH << 1];
+  // CD 音频输入 (XA-ADPCM/CD-DA), 光驱写入, 生成音频的线程读取
+  PcmRing cdRing;
+  SmallBuf<PcmSample> cdBuf;
+  // 本次生成从 cdRing 读取的帧数
+  u32 cd_frames = 0;
+  // 音频线程读取时 outRing 中没有足够数据的次数
+  u32 underrun = 0;
+  // 通道音量的缩放, 混音溢出时逐渐减小
+  PcmSample fix_volume_overload = 0.8f;
+  // 输出捕获, 0-23 是通道, 之后是混响发送和最终输出
+  SpuOutputSink* sinks[SPU_CHANNEL_COUNT + 2];
+  u8 voice_sink_count = 0;
+  SpuReverb reverb;
+  // 混响寄存器被修改
+  bool reverb_dirty = true;
+  // 写入了混响工作区开始地址
+  bool reverb_reset = true;
 
   // 寄存器函数
   void set_transfer_address(u32 a, u32);
   void push_fifo(u32 a, u32);
   void set_ctrl_req(u32 a, u32);
   void key_on_changed();
+  void reverb_changed(u32, u32);
+  void set_reverb_base(u32, u32);
 
   // dma/fifo 数据处理
   void copy_fifo_to_mem();
@@ -754,8 +899,12 @@ private:
   // 'beginAddr+偏移'(不包含) 之间, 则发送中断并返回 true
   bool check_irq(u32 beginAddr, u32 offset);
   void init_dac();
+  // 将混响寄存器同步到混响引擎
+  void sync_reverb();
   // echo 收集所有通道必要的混响数据, 处理后将混响数据输出到 echo
   void apply_reverb(PcmSample* echo, u32 nframe);
+  // 从 cdRing 读取 nframe 帧到 cdBuf, 应用 CD 音量, 启用 CD 混响时加入 echo
+  void pull_cd(PcmSample* echo, u32 nframe);
 
   //
   // 进行最后的混合, 对buf 进行主音量包络, 并将混响/CD/外部音源混合到输出
@@ -767,29 +916,46 @@ private:
   void mix_end(PcmSample* buf, PcmSample* echo, u32 nframe);
 
   //
-  // 将通道中的所有帧混合到输出缓冲区
-  // cn         -- 通道号
-  // dst        -- 音频输出缓冲区, 将通道数据混合到其中, 左右格式
-  // median     -- 前一通道的输出数据, 未经过通道音量包络, 单通道
-  // channelout -- 当前通道的输出数据, 未经过通道音量包络, 单通道
-  // nframe     -- 一个声道的输出帧数量
-  // echoOut    -- 混响输出缓冲区, 必要时将通道数据混合到其中, 左右格式
+  // 所有通道读取 nframe 个采样到 rows, 每个通道一行, 前一行是后一行的 FM 调制器.
+  // 没有输出的通道该行为 0, 并且 voices.active 为 0.
+  //
+  void render_voices(PcmSample* rows, u32 nframe);
+
+  //
+  // 按批次将 rows 中的所有通道混合到平面缓冲区, 应用通道音量包络.
+  // mix    -- 4 个平面: 左, 右, 混响左, 混响右, 每个平面 nframe 个采样
+  // nframe -- 一个声道的输出帧数量
   //
-  void process_channel(int cn, PcmSample *dst, PcmSample *median, PcmSample* channelout, 
-                       u32 nframe, PcmSample* echoOut);
+  void mix_voices(const PcmSample* rows, PcmSample* mix, u32 nframe);
+
+  // 为最终重采样读取 SPU_WORK_FREQ 的帧, 时钟驱动时从 outRing 读取, 否则直接生成
+  void pull_frames(PcmSample* buf, u32 nframe);
+  // 按 outRing 的填充量微调重采样比率, 吸收模拟速度与声卡时钟的偏差
+  double rate_control();
 
 protected:
   void dma_ram2dev_block(psmem addr, u32 bytesize, s32 inc) override;
   void dma_dev2ram_block(psmem addr, u32 bytesize, s32 inc) override;
 
 public:
-  SoundProcessing(Bus&);
+  // clock 为空时由音频设备请求数据驱动,
+  // use_dac 为 false 则不打开音频设备, 通过 render() 或 clock 生成音频, 配合 SpuOutputSink 使用
+  SoundProcessing(Bus&, TimerSystem* clock = NULL, bool use_dac = true);
   ~SoundProcessing();
 
-  // 通常为 true 用于对比测试
-  bool use_low_pass = true;
+  // 由 CPU 时钟调度, 生成 SPU_CLOCK_BATCH 帧到 outRing
+  u32 onClock(u32 late) override;
+
+  // 通道工作状态, 由通道对象和混音器共享
+  SpuVoices voices;
+  // CD 音频输入, 写入 SPU_WORK_FREQ 左右交错的帧, 只能有一个写入者
+  PcmRing& cdInput();
+
   void print_fifo();
   u8 *get_spu_mem();
+  // 设置输出捕获, sink 为空则移除, 不拥有 sink 对象. channel 只用于 SpuTap::Voice.
+  // 应在没有生成音频时调用.
+  void setOutputSink(SpuTap tap, SpuOutputSink* sink, u8 channel = 0);
   u32 get_var(SpuChVarFlag, int c);
 
   void setEndxFlag(u8 channelIndex);
@@ -804,10 +970,15 @@ public:
   // 从 spu 内存中的 readAddr 开始, 读取 1 个 SPU-ADPCM 块并解码(块总是 16 字节对齐的).
   // 必要时读取会触发 irq, 返回当前块的 flag, 解码后一个块长度为 28 个采样.
   // 应用混音算法, 将采样与缓冲区中的声音快进行混音.
-  AdpcmFlag readAdpcmBlock(PcmSample *buf, PcmHeader& ph);
+  AdpcmFlag readAdpcmBlock(s16 *buf, PcmHeader& ph);
+  // 输出设备请求 nframe 帧, 采样率不同时经过最终重采样
   void requestAudioData(PcmSample *buf, u32 nframe, double time);
+  // 以 SPU_WORK_FREQ 生成 nframe 帧, buf 左右交错
+  void render(PcmSample *buf, u32 nframe);
   u32 getOutputRate();
   void readNoiseSampleBlocks(PcmSample *buf, u32 nframe);
+
+friend class PcmResample;
 };
 
 
@@ -14,6 +14,18 @@ namespace ps1e {
            DeviceIOMapper t_ra,    DeviceIOMapper t_cv,  int Number> \
   RET SPUChannel<t_vol_l, t_vol_r, t_sr, t_sa, t_adsr, t_acv, t_ra, t_cv, Number>
 
+extern const s16 spu_gauss_table[0x200];
+
+
+// 4 点高斯插值, s[0..3] 从最旧到最新, i 是插值索引 0..FFh
+static inline s32 gauss_interpolate(const s16* s, u32 i) {
+  s32 out = (spu_gauss_table[0x0FF - i] * s32(s[0])) >> 15;
+  out    += (spu_gauss_table[0x1FF - i] * s32(s[1])) >> 15;
+  out    += (spu_gauss_table[0x100 + i] * s32(s[2])) >> 15;
+  out    += (spu_gauss_table[0x000 + i] * s32(s[3])) >> 15;
+  return out;
+}
+
 
 SPU_CHANNEL_DEF(CONSTRUCT)::SPUChannel(SoundProcessing& parent, Bus& b) :
   spu(parent),
@@ -22,154 +34,167 @@ SPU_CHANNEL_DEF(CONSTRUCT)::SPUChannel(SoundProcessing& parent, Bus& b) :
   pcmSampleRate(*this, b, &SPUChannel::set_sample_rate), 
   pcmStartAddr(*this, b, &SPUChannel::set_start_address),
   adsr(*this, b), 
-  adsrVol(*this, b), 
+  adsrVol(*this, b, &SPUChannel::set_adsr_volume, &SPUChannel::read_adsr_volume), 
   pcmRepeatAddr(*this, b, &SPUChannel::set_repeat_addr), 
-  currVolume(*this, b),
-  resample(this),
-  lowpass(/*parent.getOutputRate()*/)
+  currVolume(*this, b, NULL, &SPUChannel::read_curr_volume)
 {
+  memset(pcm_read_buf, 0, sizeof(pcm_read_buf));
   /*printf("InitCH %d vol.%x rate.%x addr.%x adsrvol.%x repeat.%x cval.%x\n", 
          Number, t_vol, t_sr, t_sa, t_adsr, t_acv, t_ra, t_cv);*/
 }
 
 
-SPU_CHANNEL_DEF(PcmSample)::readPcmSample() {
-  if (pcm_buf_remaining <= 0) {
-    // read next block
-    if (currentReadAddr.changed) {
-      currentReadAddr.set(pcmStartAddr.r.address(), 0, 0);
-      pcm_buf_remaining = 0;
-    }
-    if (repeatAddr.changed) {
-      repeatAddr.set(pcmRepeatAddr.r.address(), 0, 0);
-    }
+SPU_CHANNEL_DEF(void)::decode_next_block() {
+  if (currentReadAddr.changed) {
+    currentReadAddr.set(pcmStartAddr.r.address(), 0, 0);
+    // 新的声音没有之前的采样
+    pcm_read_buf[SPU_PCM_BLK_SZ + 0] = 0;
+    pcm_read_buf[SPU_PCM_BLK_SZ + 1] = 0;
+    pcm_read_buf[SPU_PCM_BLK_SZ + 2] = 0;
+  }
+  if (repeatAddr.changed) {
+    repeatAddr.set(pcmRepeatAddr.r.address(), 0, 0);
+  }
 
-    PcmSample prevh1 = currentReadAddr.hist1;
-    PcmSample prevh2 = currentReadAddr.hist2;
-    AdpcmFlag flag = spu.readAdpcmBlock(pcm_read_buf, currentReadAddr);
-    pcm_buf_remaining = SPU_PCM_BLK_SZ;
-    
-    if (flag.loop_start) {
-      repeatAddr.set(currentReadAddr.addr, prevh1, prevh2);
-      pcmRepeatAddr.r.saveAddr(repeatAddr.addr);
-    }
+  pcm_read_buf[0] = pcm_read_buf[SPU_PCM_BLK_SZ + 0];
+  pcm_read_buf[1] = pcm_read_buf[SPU_PCM_BLK_SZ + 1];
+  pcm_read_buf[2] = pcm_read_buf[SPU_PCM_BLK_SZ + 2];
 
-    if (flag.loop_end) {
-      spu.setEndxFlag(Number);
+  s32 prevh1 = currentReadAddr.hist1;
+  s32 prevh2 = currentReadAddr.hist2;
+  AdpcmFlag flag = spu.readAdpcmBlock(pcm_read_buf + 3, currentReadAddr);
+  
+  if (flag.loop_start) {
+    repeatAddr.set(currentReadAddr.addr, prevh1, prevh2);
+    pcmRepeatAddr.r.saveAddr(repeatAddr.addr);
+  }
 
-      if (flag.loop_repeat) {
-        currentReadAddr = repeatAddr;
-      } else {
-        adsr_state = AdsrState::Release;
-        //TODO: Mute??
-      }
+  if (flag.loop_end) {
+    spu.setEndxFlag(Number);
+
+    if (flag.loop_repeat) {
+      currentReadAddr = repeatAddr;
     } else {
-      currentReadAddr.addr += SPU_ADPCM_BLK_SZ;
+      spu.voices.adsr_state[Number] = SpuAdsrState::Release;
+      //TODO: Mute??
     }
+  } else {
+    currentReadAddr.addr += SPU_ADPCM_BLK_SZ;
   }
-
-  const s32 p = SPU_PCM_BLK_SZ - pcm_buf_remaining;
-  --pcm_buf_remaining;
-  return pcm_read_buf[p];
 }
 
 
-SPU_CHANNEL_DEF(bool)::readSampleBlocks(PcmSample *_in, PcmSample *out, u32 nframe) {
+SPU_CHANNEL_DEF(bool)::readSampleBlocks(const PcmSample *mod, PcmSample *out, u32 nframe) {
   if (adsr.r.v == 0) return false; //TODO: 待验证 ADSR 为0停止工作??
   
   if (spu.isNoise(Number)) {
-    spu.readNoiseSampleBlocks(_in, nframe);
+    spu.readNoiseSampleBlocks(out, nframe);
     //TODO: 扫描/噪音模式是否启用adsr?
-    applyADSR(_in, out, nframe);
+    applyADSR(out, out, nframe);
     return true;
   }
   
-  double rate;
-  if (Number>0 && spu.usePrevChannelFM(Number)) {
-    //TODO: 每个音频帧改变
-    double orate = spu.getOutputRate();
-    double irate = (1.0+ _in[0]) * double(0x1000) * (double(SPU_WORK_FREQ) / double(0x1000));
-    rate = orate/irate;
-  } else {
-    rate = play_rate;
-  }
+  const u32 pitch = spu.voices.pitch[Number];
   // 停止工作, 跳过一个音频块
-  if (rate == 0) return false;
+  if (pitch == 0) return false;
 
-  if (resample.read(_in, nframe, rate)) {
-    if (spu.use_low_pass) {
-      lowpass.filter(_in, nframe, spu.getOutputRate() / rate);
+  const bool fm = Number>0 && spu.usePrevChannelFM(Number);
+  u32 counter = spu.voices.pitch_counter[Number];
+
+  for (u32 i=0; i<nframe; ++i) {
+    while ((counter >> SPU_PITCH_SHIFT) >= SPU_PCM_BLK_SZ) {
+      counter -= SPU_PCM_BLK_SZ << SPU_PITCH_SHIFT;
+      decode_next_block();
     }
-    applyADSR(_in, out, nframe);
-    return true;
+    const s16* s = pcm_read_buf + (counter >> SPU_PITCH_SHIFT);
+    out[i] = PcmSample(gauss_interpolate(s, (counter >> 4) & 0xFF)) / PcmSample(0x8000);
+
+    u32 step = pitch;
+    if (fm) {
+      // 前一个通道的输出作为系数 0.00 .. 1.99
+      s32 factor = s32(mod[i] * 0x8000) + 0x8000;
+      factor = MaxT(0, MinT(0xFFFF, factor));
+      step = u32((s32(s16(step)) * factor) >> 15) & 0xFFFF;
+    }
+    counter += MinT(step, u32(SPU_PITCH_MAX));
+  }
+
+  spu.voices.pitch_counter[Number] = counter;
+  applyADSR(out, out, nframe);
+  return true;
+}
+
+
+// 在一段 ADSR 周期内音量不变, 整段应用同一个增益
+static inline void apply_adsr_gain(const PcmSample* in, PcmSample* out, s32 level, u32 n) {
+  const PcmSample g = level > 0 ? (PcmSample(level) / PcmSample(0x8000)) : 0;
+  for (u32 i = 0; i < n; ++i) {
+    out[i] = in[i] * g;
   }
-  return false;
 }
 
 
 SPU_CHANNEL_DEF(void)::applyADSR(PcmSample *_in, PcmSample *out, u32 lsize) {
+  SpuAdsrState& adsr_state = spu.voices.adsr_state[Number];
+  SpuAdsr& adsr_filter = spu.voices.adsr[Number];
+  u32& adsr_cycles_remaining = spu.voices.adsr_cycles[Number];
   s32 decay_out = (adsr.r.su_lv +1) *0x800;
-  s32 level = adsrVol.r.v;
+  s32 level = spu.voices.adsr_level[Number];
   
   for (u32 i=0; i<lsize;) {
     if (spu.isReleaseOn(Number)) {
-      adsr_state = AdsrState::Release;
+      adsr_state = SpuAdsrState::Release;
       adsr_filter.reset(adsr.r.re_md, 1, adsr.r.re_sh, 0);
       adsr_cycles_remaining = 0;
     }
     else if (spu.isAttackOn(Number)) {
-      adsr_state = AdsrState::Attack;
+      adsr_state = SpuAdsrState::Attack;
       level = 0;
       adsr_filter.reset(adsr.r.at_md, 0, adsr.r.at_sh, adsr.r.at_st);
       adsr_cycles_remaining = 0;
     }
 
-    while (adsr_cycles_remaining > 0 && i <lsize) {
-      if (level > 0) {
-        out[i] = _in[i] * (float(level) / float(0x8000));
-      } else {
-        out[i] = 0;
-      }
-      --adsr_cycles_remaining;
-      ++i;
+    if (adsr_cycles_remaining > 0) {
+      const u32 run = MinT(adsr_cycles_remaining, lsize - i);
+      apply_adsr_gain(_in + i, out + i, level, run);
+      adsr_cycles_remaining -= run;
+      i += run;
     }
 
     switch (adsr_state) {
-    case AdsrState::Release:
+    case SpuAdsrState::Release:
       adsr_filter.next(level, adsr_cycles_remaining);
       if (level <= 0) {
         level = 0;
-        adsr_state = AdsrState::Wait;
+        adsr_state = SpuAdsrState::Wait;
       }
       break;
 
-    case AdsrState::Wait:
-      while (i < lsize) {
-        out[i] = 0;
-        ++i;
-      }
+    case SpuAdsrState::Wait:
+      apply_adsr_gain(_in + i, out + i, 0, lsize - i);
+      i = lsize;
       break;
 
-    case AdsrState::Attack:
+    case SpuAdsrState::Attack:
       adsr_filter.next(level, adsr_cycles_remaining);
       if (level > 0x7FFF) {
         level = 0x7fff;
-        adsr_state = AdsrState::Decay;
+        adsr_state = SpuAdsrState::Decay;
         adsr_filter.reset(1, 1, adsr.r.de_sh, 0);
         decay_out = (adsr.r.su_lv +1) *0x800;
       }
       break;
 
-    case AdsrState::Decay:
+    case SpuAdsrState::Decay:
       adsr_filter.next(level, adsr_cycles_remaining);
       if (level <= decay_out) {
         level = decay_out;
-        adsr_state = AdsrState::Sustain;
+        adsr_state = SpuAdsrState::Sustain;
         adsr_filter.reset(adsr.r.su_md, adsr.r.su_di, adsr.r.su_sh, adsr.r.su_st);
       }
       break;
 
-    case AdsrState::Sustain:
+    case SpuAdsrState::Sustain:
       adsr_filter.next(level, adsr_cycles_remaining);
       if (level < 0) level = 0;
       else if (level > 0x7fff) level = 0x7fff;
@@ -177,22 +202,24 @@ SPU_CHANNEL_DEF(void)::applyADSR(PcmSample *_in, PcmSample *out, u32 lsize) {
     }
   }
   //printf("\r%d %d", Number, level);
-  adsrVol.r.v = u32(level) & 0x07FFF;
+  spu.voices.adsr_level[Number] = level & 0x07FFF;
 }
 
 
-SPU_CHANNEL_DEF(void)::copyStartToRepeat() {
+SPU_CHANNEL_DEF(void)::keyOn() {
   pcmRepeatAddr.r.v = pcmStartAddr.r.v;
   repeatAddr.changed = true;
+  currentReadAddr.changed = true;
+  spu.voices.pitch_counter[Number] = SPU_PCM_BLK_SZ << SPU_PITCH_SHIFT;
   spudbg("set %d start -> repeat, ken on, adsr %x vol %x\n", 
-         Number, adsr.r.v, adsrVol.r.v);
+         Number, adsr.r.v, read_adsr_volume());
 }
 
 
 SPU_CHANNEL_DEF(void)::set_start_address(u32 v, u32) {
   currentReadAddr.changed = true;
   spudbg("set channel %d start address %x (%x << 3) adsr %x vol %x\n", 
-         Number, v<<3, adsr.r.v, adsrVol.r.v);
+         Number, v<<3, adsr.r.v, read_adsr_volume());
 }
 
 
@@ -201,48 +228,44 @@ SPU_CHANNEL_DEF(void)::set_repeat_addr(u32, u32) {
 }
 
 
+// 超过 4000h 的值在步进时被截断, FM 模式需要原始值
 SPU_CHANNEL_DEF(void)::set_sample_rate(u32 v, u32) {
-  double orate = spu.getOutputRate();
-  double irate = double(MinT(0x4000, v)) * (double(SPU_WORK_FREQ) / double(0x1000));
-  double r = orate/irate;
-  if (r < (1.0 / 255.0) || r > 255) {
-    play_rate = 0;
-  } else {
-    play_rate = r;
-  }
-  spudbg("set channel %d sample rate %f\n", Number, r);
+  spu.voices.pitch[Number] = u16(v);
+  spudbg("set channel %d pitch %x\n", Number, v);
 }
 
 
-// 当音量变为扫描模式时, 需要同步 currVolume 寄存器
+// 当音量变为扫描模式时, 扫频从 currVolume 的当前值开始
 SPU_CHANNEL_DEF(void)::set_volume_l(u32 v, u32 old) {
-  const u32 lmask = 1 << 15;
-  if (((v & lmask) == 1) && ((old & lmask) == 0)) {
-    currVolume.r.sl = old << 1;
-  }
-  //ps1e_t::ext_stop = 1;
+  VolData vd;
+  vd.v = u16(v);
+  SpuVolSweep& s = spu.voices.vol_l[Number];
+  s.reset(vd, s.getVol());
   //spudbg("set channel %d volume %x\n", Number, v);
 }
 
 
 SPU_CHANNEL_DEF(void)::set_volume_r(u32 v, u32 old) {
-  const u32 rmask = 1 << 15;
-  if (((v & rmask) == 1) && ((old & rmask) == 0)) {
-    currVolume.r.sh = old << 1;
-  }
+  VolData vd;
+  vd.v = u16(v);
+  SpuVolSweep& s = spu.voices.vol_r[Number];
+  s.reset(vd, s.getVol());
 }
 
 
-SPU_CHANNEL_DEF(VolumeEnvelope*)::getVolumeEnvelope(bool left) {
-  VolData vd;
-  vd.v = u16(left ? voll.r.v : voll.r.v);
-  s32 clevel = (left ? s16(currVolume.r.v & 0xffff) : s16(currVolume.r.v >> 16));
-  return sweet_ve.get(left, vd, clevel);
+SPU_CHANNEL_DEF(void)::set_adsr_volume(u32 v, u32) {
+  spu.voices.adsr_level[Number] = s16(v);
+}
+
+
+SPU_CHANNEL_DEF(u32)::read_adsr_volume() {
+  return u16(spu.voices.adsr_level[Number]);
 }
 
 
-SPU_CHANNEL_DEF(void)::syncVol(VolumeEnvelope* l, VolumeEnvelope* r) {
-  currVolume.r.v = l->getVol() | (r->getVol() << 16);
+SPU_CHANNEL_DEF(u32)::read_curr_volume() {
+  return u16(spu.voices.vol_l[Number].getVol()) 
+       | (u32(u16(spu.voices.vol_r[Number].getVol())) << 16);
 }
 
 
@@ -251,7 +274,7 @@ SPU_CHANNEL_DEF(u32)::getVar(SpuChVarFlag f) {
     case SpuChVarFlag::volume:
       return voll.r.v | (volr.r.v << 16);
     case SpuChVarFlag::work_volume:
-      return currVolume.r.v;
+      return read_curr_volume();
     case SpuChVarFlag::sample_rate:
       return pcmSampleRate.r.v;
     case SpuChVarFlag::start_address:
@@ -261,9 +284,9 @@ SPU_CHANNEL_DEF(u32)::getVar(SpuChVarFlag f) {
     case SpuChVarFlag::adsr:
       return adsr.r.v;
     case SpuChVarFlag::adsr_volume:
-      return adsrVol.r.v;
+      return read_adsr_volume();
     case SpuChVarFlag::adsr_state:
-      return u32(adsr_state);
+      return u32(spu.voices.adsr_state[Number]);
     default: return 0;
   }
 }
@@ -0,0 +1,143 @@
+﻿#include "spu.h"
+
+namespace ps1e {
+
+// 混响工作区总是结束于 7FFFEh, 以半字计
+#define REVERB_END_HW   (SPU_MEM_SIZE >> 1)
+
+
+static inline s32 sat16(s32 x) {
+  if (x > 0x7FFF) return 0x7FFF;
+  if (x < -0x8000) return -0x8000;
+  return x;
+}
+
+
+// 乘法结果除以 8000h
+static inline s32 vmul(s32 a, s32 v) {
+  return (a * v) >> 15;
+}
+
+
+SpuReverb::SpuReverb() : ring(0), len(0), cur(0),
+    pendL(0), pendR(0), half(false), prevL(0), prevR(0), outL(0), outR(0)
+{
+  memset(tap, 0, sizeof(tap));
+  memset(vol, 0, sizeof(vol));
+}
+
+
+void SpuReverb::setBase(u8* mem, u32 base, bool resetAddr) {
+  const u32 begin = (base & SPU_MEM_MASK) >> 1;
+  ring = ((s16*) mem) + begin;
+  len  = REVERB_END_HW - begin;
+  if (resetAddr || cur >= len) {
+    cur = 0;
+  }
+}
+
+
+void SpuReverb::setTap(Tap t, u32 addr, s32 adj) {
+  if (len == 0) {
+    tap[t] = 0;
+    return;
+  }
+  // 偏移可能超过工作区长度, 这里取模一次, 访问时只需比较回绕
+  s32 x = (s32(addr >> 1) + adj) % s32(len);
+  if (x < 0) x += len;
+  tap[t] = u32(x);
+}
+
+
+void SpuReverb::setVolume(Vol v, s16 x) {
+  vol[v] = x;
+}
+
+
+inline s16& SpuReverb::at(Tap t) {
+  u32 i = cur + tap[t];
+  if (i >= len) i -= len;
+  return ring[i];
+}
+
+
+void SpuReverb::step(s32 Lin, s32 Rin, bool write) {
+  Lin = vmul(Lin, vol[vLIN]);
+  Rin = vmul(Rin, vol[vRIN]);
+
+  if (write) {
+    const s32 iir  = vol[vIIR];
+    const s32 wall = vol[vWALL];
+    s32 ls = at(mLSAME2), rs = at(mRSAME2);
+    s32 ld = at(mLDIFF2), rd = at(mRDIFF2);
+
+    at(mLSAME) = s16(sat16(vmul(sat16(Lin + vmul(at(dLSAME), wall) - ls), iir) + ls));
+    at(mRSAME) = s16(sat16(vmul(sat16(Rin + vmul(at(dRSAME), wall) - rs), iir) + rs));
+    at(mLDIFF) = s16(sat16(vmul(sat16(Lin + vmul(at(dRDIFF), wall) - ld), iir) + ld));
+    at(mRDIFF) = s16(sat16(vmul(sat16(Rin + vmul(at(dLDIFF), wall) - rd), iir) + rd));
+  }
+
+  s32 Lout = vmul(at(mLCOMB1), vol[vCOMB1]) + vmul(at(mLCOMB2), vol[vCOMB2])
+           + vmul(at(mLCOMB3), vol[vCOMB3]) + vmul(at(mLCOMB4), vol[vCOMB4]);
+  s32 Rout = vmul(at(mRCOMB1), vol[vCOMB1]) + vmul(at(mRCOMB2), vol[vCOMB2])
+           + vmul(at(mRCOMB3), vol[vCOMB3]) + vmul(at(mRCOMB4), vol[vCOMB4]);
+  Lout = sat16(Lout);
+  Rout = sat16(Rout);
+
+  const s32 apf1 = vol[vAPF1];
+  const s32 apf2 = vol[vAPF2];
+  s32 la1 = at(mLAPF1d), ra1 = at(mRAPF1d);
+
+  Lout = sat16(Lout - vmul(la1, apf1));
+  Rout = sat16(Rout - vmul(ra1, apf1));
+  if (write) {
+    at(mLAPF1) = s16(Lout);
+    at(mRAPF1) = s16(Rout);
+  }
+  Lout = sat16(vmul(Lout, apf1) + la1);
+  Rout = sat16(vmul(Rout, apf1) + ra1);
+
+  s32 la2 = at(mLAPF2d), ra2 = at(mRAPF2d);
+  Lout = sat16(Lout - vmul(la2, apf2));
+  Rout = sat16(Rout - vmul(ra2, apf2));
+  if (write) {
+    at(mLAPF2) = s16(Lout);
+    at(mRAPF2) = s16(Rout);
+  }
+  Lout = sat16(vmul(Lout, apf2) + la2);
+  Rout = sat16(vmul(Rout, apf2) + ra2);
+
+  prevL = outL;
+  prevR = outR;
+  outL  = Lout;
+  outR  = Rout;
+
+  if (++cur >= len) cur = 0;
+}
+
+
+void SpuReverb::process(PcmSample* echo, u32 nframe, bool write) {
+  if (len == 0) {
+    memset(echo, 0, sizeof(PcmSample) * (nframe << 1));
+    return;
+  }
+
+  for (u32 i = 0; i < (nframe<<1); i+=2) {
+    const s32 l = sat16(s32(echo[i+0] * 0x8000));
+    const s32 r = sat16(s32(echo[i+1] * 0x8000));
+
+    if (half) {
+      step((pendL + l) >> 1, (pendR + r) >> 1, write);
+      echo[i+0] = PcmSample(outL) / PcmSample(0x8000);
+      echo[i+1] = PcmSample(outR) / PcmSample(0x8000);
+    } else {
+      pendL = l;
+      pendR = r;
+      echo[i+0] = PcmSample((prevL + outL) >> 1) / PcmSample(0x8000);
+      echo[i+1] = PcmSample((prevR + outR) >> 1) / PcmSample(0x8000);
+    }
+    half = !half;
+  }
+}
+
+}
@@ -0,0 +1,141 @@
+﻿#include "spu.h"
+
+namespace ps1e {
+
+#define WAV_HEADER_SIZE 44
+
+
+static inline s16 to_s16(PcmSample x) {
+  s32 v = s32(x * 0x8000);
+  if (v > 0x7FFF) return 0x7FFF;
+  if (v < -0x8000) return -0x8000;
+  return s16(v);
+}
+
+
+SpuWavSink::SpuWavSink(const char* filename) : f(0), channels(0), frames(0) {
+  f = fopen(filename, "wb");
+  if (!f) {
+    error("Cannot open wav file %s\n", filename);
+    return;
+  }
+  // 先占位, 关闭时写入真正的文件头
+  u8 zero[WAV_HEADER_SIZE] = {0};
+  fwrite(zero, 1, WAV_HEADER_SIZE, f);
+}
+
+
+SpuWavSink::~SpuWavSink() {
+  close();
+}
+
+
+bool SpuWavSink::isOpen() {
+  return f != 0;
+}
+
+
+// 文件是小端格式, 启动时已经检查了 CPU 字节序
+void SpuWavSink::write_header() {
+  const u32 ch    = channels ? channels : 2;
+  const u32 align = ch * sizeof(s16);
+  const u32 data  = frames * align;
+  const u32 riff  = data + WAV_HEADER_SIZE - 8;
+  const u32 rate  = SPU_WORK_FREQ;
+  const u32 bps   = rate * align;
+  const u32 fmtsz = 16;
+  const u16 pcm   = 1;
+  const u16 ch16  = u16(ch);
+  const u16 al16  = u16(align);
+  const u16 bits  = 16;
+
+  fseek(f, 0, SEEK_SET);
+  fwrite("RIFF", 1, 4, f);  fwrite(&riff, 4, 1, f);
+  fwrite("WAVE", 1, 4, f);
+  fwrite("fmt ", 1, 4, f);  fwrite(&fmtsz, 4, 1, f);
+  fwrite(&pcm, 2, 1, f);    fwrite(&ch16, 2, 1, f);
+  fwrite(&rate, 4, 1, f);   fwrite(&bps, 4, 1, f);
+  fwrite(&al16, 2, 1, f);   fwrite(&bits, 2, 1, f);
+  fwrite("data", 1, 4, f);  fwrite(&data, 4, 1, f);
+}
+
+
+void SpuWavSink::close() {
+  if (!f) return;
+  write_header();
+  fclose(f);
+  f = 0;
+}
+
+
+void SpuWavSink::write(const PcmSample* samples, u32 nframe, u32 ch) {
+  if (!f) return;
+  if (channels == 0) {
+    channels = ch;
+  } else if (channels != ch) {
+    error("Wav sink channels changed %d -> %d\n", channels, ch);
+    return;
+  }
+
+  const u32 n = nframe * ch;
+  s16* out = conv.get(n);
+  for (u32 i = 0; i < n; ++i) {
+    out[i] = to_s16(samples[i]);
+  }
+  fwrite(out, sizeof(s16), n, f);
+  frames += nframe;
+}
+
+
+SpuMemorySink::SpuMemorySink(u32 maxFrames, u32 ch)
+: channels(ch), capacity(maxFrames * ch), used(0) {
+  buf = new s16[capacity];
+}
+
+
+SpuMemorySink::~SpuMemorySink() {
+  delete [] buf;
+}
+
+
+void SpuMemorySink::write(const PcmSample* samples, u32 nframe, u32 ch) {
+  if (ch != channels) {
+    error("Memory sink need %d channels, got %d\n", channels, ch);
+    return;
+  }
+  u32 n = nframe * ch;
+  if (n > capacity - used) n = capacity - used;
+  s16* out = buf + used;
+  for (u32 i = 0; i < n; ++i) {
+    out[i] = to_s16(samples[i]);
+  }
+  used += n;
+}
+
+
+void SpuMemorySink::clear() {
+  used = 0;
+}
+
+
+u32 SpuMemorySink::frames() {
+  return used / channels;
+}
+
+
+const s16* SpuMemorySink::data() {
+  return buf;
+}
+
+
+u32 SpuMemorySink::checksum() {
+  u32 h = 0x811C'9DC5;
+  const u8* p = (const u8*) buf;
+  for (u32 i = 0; i < used * sizeof(s16); ++i) {
+    h ^= p[i];
+    h *= 0x0100'0193;
+  }
+  return h;
+}
+
+}
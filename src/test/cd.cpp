@@ -1,5 +1,6 @@
 ﻿#include "test.h"
 #include "../cdrom.h"
+#include <cmath>
 
 namespace ps1e_t {
 
@@ -25,8 +26,201 @@ static void test_cdio() {
 }
 
 
+// 生成一张数据轨+音轨的镜像, 压缩后逐扇区比较
+static void test_hunk_image() {
+  const char* bin  = "test-cd.bin";
+  const char* cue  = "test-cd.cue";
+  const char* hunk = "test-cd.hunk";
+  const int data_sectors  = 40;
+  const int audio_sectors = 60;
+  ps1e::u8 sector[ps1e::CdDrive::AUDIO_BUF_SIZE];
+
+  FILE* f = fopen(bin, "wb");
+  for (int i=0; i<data_sectors; ++i) {
+    memset(sector, 0, sizeof(sector));
+    memset(sector + 1, 0xFF, 10);
+    sector[15] = 2;
+    for (int j=24; j<24+2048; ++j) sector[j] = ps1e::u8(i + j / 16);
+    fwrite(sector, 1, sizeof(sector), f);
+  }
+  ps1e::s16* pcm = (ps1e::s16*) sector;
+  for (int i=0; i<audio_sectors; ++i) {
+    for (int j=0; j<588; ++j) {
+      pcm[j*2+0] = ps1e::s16(sin((i * 588 + j) * 0.05) * 12000);
+      pcm[j*2+1] = ps1e::s16(sin((i * 588 + j) * 0.02) * 8000);
+    }
+    fwrite(sector, 1, sizeof(sector), f);
+  }
+  fclose(f);
+
+  f = fopen(cue, "w");
+  fprintf(f, "FILE \"%s\" BINARY\n", bin);
+  fprintf(f, "  TRACK 01 MODE2/2352\n    INDEX 01 00:00:00\n");
+  fprintf(f, "  TRACK 02 AUDIO\n    PREGAP 00:02:00\n    INDEX 01 00:00:%02d\n", data_sectors);
+  fclose(f);
+
+  {
+    ps1e::CdImage raw, packed;
+    if (!raw.open(cue)) panic("open cue image");
+    if (!ps1e::CdHunkReader::write(raw, hunk)) panic("write hunk image");
+    if (!packed.open(hunk)) panic("open hunk image");
+
+    eq(packed.count(), raw.count(), "hunk track count");
+    eq(packed.lastLsn(), raw.lastLsn(), "hunk last lsn");
+    eq(packed.track(2)->format, raw.track(2)->format, "hunk audio track");
+
+    for (ps1e::CdLsn i=0; i<=raw.lastLsn(); ++i) {
+      const ps1e::u8* a = raw.sector(i);
+      if (!a || !packed.read(i, sector)) panic("hunk sector not read");
+      if (memcmp(a, sector, sizeof(sector))) panic("hunk sector not same");
+    }
+    // 压缩镜像的缓存块会被其他线程替换, 不能返回指针
+    if (packed.sector(0)) panic("hunk image must not map sector");
+
+    f = fopen(hunk, "rb");
+    fseek(f, 0, SEEK_END);
+    const long packed_size = ftell(f);
+    fclose(f);
+    if (packed_size >= long(sizeof(sector)) * (data_sectors + audio_sectors)) {
+      panic("hunk image not compressed");
+    }
+  }
+
+  remove(hunk);
+  remove(cue);
+  remove(bin);
+}
+
+
+// 没有同步头的镜像, 扇区头由位置合成, 2336 字节扇区使用镜像中的子头
+static void test_sector_header(int size) {
+  const char* bin = "test-cd-head.bin";
+  const char* cue = "test-cd-head.cue";
+  ps1e::u8 sector[ps1e::CdDrive::AUDIO_BUF_SIZE] = {0};
+  const ps1e::u8 sub[4] = { 1, 2, 0x64, 1 };
+
+  FILE* f = fopen(bin, "wb");
+  for (int i=0; i<10; ++i) {
+    if (size == ps1e::CdDrive::MODE2_BUF_SIZE) {
+      memcpy(sector, sub, 4);
+      memcpy(sector + 4, sub, 4);
+    }
+    fwrite(sector, 1, size, f);
+  }
+  fclose(f);
+  f = fopen(cue, "w");
+  fprintf(f, "FILE \"%s\" BINARY\n", bin);
+  fprintf(f, "  TRACK 01 %s\n    INDEX 01 00:00:00\n",
+          size == ps1e::CdDrive::MODE2_BUF_SIZE ? "MODE2/2336" : "MODE1/2048");
+  fclose(f);
+
+  {
+    ps1e::CdDrive drive;
+    if (!drive.loadImage(cue)) panic("open header image");
+    const ps1e::CdMsf m = { 0x00, 0x02, 0x05 };
+    drive.seek(&m);
+    ps1e::u8 head[8];
+    drive.sectorHeader(head);
+    if (head[0] != m.m || head[1] != m.s || head[2] != m.f || head[3] != 2) {
+      panic("sector header position");
+    }
+    if (size == ps1e::CdDrive::MODE2_BUF_SIZE) {
+      if (memcmp(head + 4, sub, 4)) panic("sector header from image");
+    } else {
+      if (head[6] != 0x08) panic("sector header form1");
+    }
+  }
+
+  remove(cue);
+  remove(bin);
+}
+
+
+// 所有单元的采样都是 1, 不使用滤波, 解码后应该是常数 0x1000
+static void test_xa_decode() {
+  static ps1e::u8 sub[8 + ps1e::CdXaDecoder::GROUPS * 128];
+  memset(sub, 0x11, sizeof(sub));
+  for (ps1e::u32 g=0; g<ps1e::CdXaDecoder::GROUPS; ++g) {
+    memset(sub + 8 + g * 128, 0, 16);
+  }
+  sub[0] = 1;
+  sub[1] = 0;
+  sub[2] = 0x64;
+  sub[3] = 0x01; // 立体声 37800Hz 4bit
+
+  ps1e::CdSpuVol vol;
+  vol.setall(0);
+  vol.cd_l_spu_l = vol.cd_r_spu_r = 0x80;
+  ps1e::PcmRing ring(0x4000);
+  ps1e::CdXaDecoder* xa = new ps1e::CdXaDecoder();
+
+  eq(xa->decode(sub, vol, &ring), ps1e::u32(2352), "xa stereo frames");
+  ps1e::PcmSample out[2];
+  while (ring.pop(out, 1));
+  if (out[0] != 0.125f || out[1] != 0.125f) panic("xa stereo sample");
+
+  sub[3] = 0x04; // 单声道 18900Hz 4bit
+  eq(xa->decode(sub, vol, &ring), ps1e::u32(9408), "xa mono frames");
+  while (ring.pop(out, 1));
+  if (out[0] != 0.125f || out[1] != 0.125f) panic("xa mono sample");
+  delete xa;
+}
+
+
+// 从 LSN 0 寻道到 LSN 75, 按每种速度策略检查寻道和读取扇区的时钟
+static void test_speed() {
+  ps1e::MemJit j;
+  ps1e::MMU m(j);
+  ps1e::Bus b(m);
+  ps1e::TimerSystem t(b);
+  ps1e::CdDrive d;
+  ps1e::CDrom* cd = new ps1e::CDrom(b, d, t);
+  const ps1e::u32 sector = SYSTEM_CLOCK_FREQ / 75;
+  const ps1e::u32 fast   = SYSTEM_CLOCK_FREQ / 1200;
+  const ps1e::u32 seek   = SYSTEM_CLOCK_FREQ / 300 + 75 * 100;
+  const ps1e::u32 kick   = 0x400;
+  const ps1e::CdMsf from = { 0x00, 0x02, 0x00 };
+  d.seek(&from);
+  cd->setLoc(0x00, 0x03, 0x00);
+  cd->setMode(0);
+
+  eq(cd->sectorCycles(), sector, "cd native sector");
+  eq(cd->seekCycles(), seek, "cd native seek");
+  if (cd->savedCycles() != 0) panic("cd native saved");
+  cd->setMode(1 << 7);
+  eq(cd->sectorCycles(), sector / 2, "cd native double speed");
+  cd->setMode(0);
+
+  cd->setSpeed(ps1e::CdSpeed::multiple, 4);
+  eq(cd->sectorCycles(), sector / 4, "cd x4 sector");
+  eq(cd->seekCycles(), seek / 4, "cd x4 seek");
+  ps1e::u64 saved = (sector - sector / 4) + (seek - seek / 4);
+  if (cd->savedCycles() != saved) panic("cd x4 saved");
+  // 没有送出扇区的等待不计入节省的时钟
+  eq(cd->sectorCycles(false), sector / 4, "cd x4 not delivered");
+  if (cd->savedCycles() != saved) panic("cd x4 not delivered saved");
+
+  cd->setSpeed(ps1e::CdSpeed::multiple, 100);
+  eq(cd->sectorCycles(), fast, "cd x100 sector");
+  eq(cd->seekCycles(), seek / 100, "cd x100 seek");
+  saved += (sector - fast) + (seek - seek / 100);
+
+  cd->setSpeed(ps1e::CdSpeed::instant);
+  eq(cd->sectorCycles(), fast, "cd instant sector");
+  eq(cd->seekCycles(), kick, "cd instant seek");
+  saved += (sector - fast) + (seek - kick);
+  if (cd->savedCycles() != saved) panic("cd instant saved");
+  delete cd;
+}
+
+
 void test_cd() {
   //test_cdio();
+  test_hunk_image();
+  test_sector_header(ps1e::CdDrive::MODE2_BUF_SIZE);
+  test_sector_header(ps1e::CdDrive::DATA_BUF_SIZE);
+  test_xa_decode();
+  test_speed();
 }
 
 
@@ -1,4 +1,5 @@
 ﻿#include "../gpu.h"
+#include "../gpu_soft.h"
 #include "test.h"
 #include <thread>
 #include <chrono>
@@ -452,6 +453,255 @@ static void test_shape(GPU& gpu, Bus& bus) {
 }
 
 
+// 只测试 cpu 端, 不需要 gl 上下文
+static void test_shadow_vram() {
+  ShadowVram* sv = new ShadowVram();
+  u16 in[16*8], out[16*8];
+  for (int i = 0; i < 16*8; ++i) in[i] = i | 0x8000;
+
+  sv->write(1020, 10, 16, 8, in, 1);
+  if (!sv->read(1020, 10, 16, 8, out)) panic("shadow vram not coherent");
+  for (int i = 0; i < 16*8; ++i) eq<u16>(in[i], out[i], "shadow vram write wrap");
+
+  if (!sv->copy(1020, 10, 200, 300, 16, 8, 2)) panic("shadow vram copy");
+  if (!sv->read(200, 300, 16, 8, out)) panic("shadow vram not coherent");
+  for (int i = 0; i < 16*8; ++i) eq<u16>(in[i], out[i], "shadow vram copy");
+
+  // 渲染后必须等待回读
+  GpuDataRange r = { 190, 290, 20, 20 };
+  sv->touch(r, 3);
+  if (sv->read(200, 300, 16, 8, out)) panic("shadow vram must be dirty");
+  if (sv->copy(200, 300, 0, 0, 16, 8, 4)) panic("shadow vram must be dirty");
+  if (!sv->read(0, 0, 16, 8, out)) panic("shadow vram other tile");
+  delete sv;
+}
+
+
+static void display_area(GpuStatus st, u32 x, u32 y, u32 h0, u32 h1, u32 v0, u32 v1,
+                         u32 w, u32 h, const char* what) {
+  GpuRange10 disp = {0};
+  GpuRange12 hori = {0};
+  GpuRange10 veri = {0};
+  disp.x = x;
+  disp.y = y;
+  hori.x = h0;
+  hori.y = h1;
+  veri.x = v0;
+  veri.y = v1;
+  GpuDataRange r;
+  GPU::displayArea(st, disp, hori, veri, r);
+  eq(r.width, w, what);
+  eq(r.height, h, what);
+}
+
+
+static void test_display_area() {
+  GpuStatus st;
+  st.v = 0;
+  st.width0 = 1;
+  // NTSC 320x240, 默认的水平/垂直范围
+  display_area(st, 0, 0, 0x260, 0xC60, 0x10, 0x100, 320, 240, "display ntsc");
+  // 垂直范围无效时 PAL 是 288 行
+  st.video = 1;
+  display_area(st, 0, 0, 0x260, 0xC60, 0, 0, 320, 288, "display pal");
+  st.video = 0;
+  // 368 宽度由 width1 选择, 除数是 7
+  st.width1 = 1;
+  display_area(st, 0, 0, 0, 0, 0x10, 0x100, 368, 240, "display 368");
+  display_area(st, 0, 0, 0x260, 0xC60, 0x10, 0x100, 364, 240, "display 368 range");
+  st.width1 = 0;
+  // 隔行扫描 640x480
+  st.width0 = 3;
+  st.height = 1;
+  st.isinter = 1;
+  display_area(st, 0, 0, 0x260, 0xC60, 0x10, 0x100, 640, 480, "display interlace");
+  st.height = 0;
+  st.isinter = 0;
+  // 24bit 宽度是 16bit 像素的数量, 在显存边界截断
+  st.width0 = 1;
+  st.isrgb24 = 1;
+  display_area(st, 0, 0, 0x260, 0xC60, 0x10, 0x100, 480, 240, "display 24bit");
+  display_area(st, 1000, 500, 0x260, 0xC60, 0x10, 0x100, 24, 12, "display 24bit clip");
+}
+
+
+static u32 be32(const u8* p) {
+  return (u32(p[0]) << 24) | (u32(p[1]) << 16) | (u32(p[2]) << 8) | p[3];
+}
+
+
+static u32 crc32_bits(const u8* p, u32 len) {
+  u32 c = 0xFFFF'FFFF;
+  for (u32 i = 0; i < len; ++i) {
+    c ^= p[i];
+    for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0xEDB8'8320 & (0 - (c & 1)));
+  }
+  return ~c;
+}
+
+
+// 逐块检查 CRC, 解开不压缩的 deflate 块后检查 Adler-32 和像素
+static void test_png() {
+  const char* path = "test-frame.png";
+  const u32 w = 300, h = 250;
+  std::vector<u16> px(w * h);
+  for (u32 i = 0; i < w * h; ++i) px[i] = u16(i * 0x1235);
+  if (!FrameCapture::writePng(path, px.data(), w, h, false)) panic("png write");
+
+  FILE* f = fopen(path, "rb");
+  std::vector<u8> file;
+  u8 buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) file.insert(file.end(), buf, buf + n);
+  fclose(f);
+  remove(path);
+
+  if (file.size() < 8 || memcmp(file.data(), "\x89PNG\r\n\x1A\n", 8)) panic("png signature");
+  std::vector<u8> z;
+  for (size_t off = 8; off + 12 <= file.size(); ) {
+    const u32 len = be32(&file[off]);
+    const u8* type = &file[off + 4];
+    if (off + 12 + len > file.size()) panic("png chunk length");
+    eq(be32(type + 4 + len), crc32_bits(type, len + 4), "png chunk crc");
+    if (memcmp(type, "IHDR", 4) == 0) {
+      eq(be32(type + 4), w, "png width");
+      eq(be32(type + 8), h, "png height");
+    } else if (memcmp(type, "IDAT", 4) == 0) {
+      z.insert(z.end(), type + 4, type + 4 + len);
+    }
+    off += 12 + len;
+  }
+
+  // zlib 头之后是多个 stored 块
+  if (z.size() < 6 || z[0] != 0x78 || (z[0] * 256 + z[1]) % 31) panic("png zlib header");
+  std::vector<u8> raw;
+  size_t p = 2;
+  for (;;) {
+    const u8 last = z[p];
+    const u32 len = z[p + 1] | (z[p + 2] << 8);
+    eq<u32>(len ^ 0xFFFF, z[p + 3] | (z[p + 4] << 8), "png stored length");
+    raw.insert(raw.end(), z.begin() + p + 5, z.begin() + p + 5 + len);
+    p += 5 + len;
+    if (last & 1) break;
+  }
+  u32 a = 1, b = 0;
+  for (u8 c : raw) {
+    a = (a + c) % 65521;
+    b = (b + a) % 65521;
+  }
+  eq(be32(&z[p]), (b << 16) | a, "png adler32");
+
+  eq<u32>(u32(raw.size()), (w * 3 + 1) * h, "png raw size");
+  const u32 y = 17, x = 123;
+  const u16 c = px[y * w + x];
+  const u8* rgb = &raw[y * (w * 3 + 1) + 1 + x * 3];
+  eq<u32>(rgb[0], ((c & 0x1F) << 3) | ((c & 0x1F) >> 2), "png red");
+  eq<u32>(rgb[2], (((c >> 10) & 0x1F) << 3) | (((c >> 10) & 0x1F) >> 2), "png blue");
+}
+
+
+static void soft_random_cmds(SoftGpu& g, u32 seed) {
+  srand(seed);
+  auto v = [] { return u32((rand() % 700) - 50) | (u32((rand() % 600) - 50) << 16); };
+  for (int i = 0; i < 400; ++i) {
+    const u32 c = rand() & 0xFF'FFFF;
+    switch (rand() % 7) {
+      case 0: { // 三角形, 半透明或渐变
+        const u32 op = 0x20 | (rand() & 0x12);
+        g.write(op << 24 | c);
+        for (int j = 0; j < 3; ++j) {
+          if (j && (op & 0x10)) g.write(rand());
+          g.write(v());
+        }
+        break;
+      }
+      case 1: // 纹理四边形, 纹理页可能与目标重叠
+        g.write(0x2C'000000 | c);
+        for (int j = 0; j < 4; ++j) {
+          g.write(v());
+          g.write((rand() & 0xFFFF) | ((j == 0 ? rand() & 0x7FFF : rand() & 0x1FF) << 16));
+        }
+        break;
+      case 2:
+        g.write(0x60'000000 | c);
+        g.write(v());
+        g.write(rand() & 0x00FF'00FF);
+        break;
+      case 3:
+        g.write(0x50'000000 | c);
+        g.write(v()); g.write(rand()); g.write(v());
+        break;
+      case 4:
+        g.write(0x02'000000 | c);
+        g.write(v()); g.write(rand() & 0x00FF'00FF);
+        break;
+      case 5:
+        g.write(0xE1'000000 | (rand() & 0x3FFF));
+        g.write(0xE6'000000 | (rand() & 3));
+        break;
+      case 6: // 复制显存
+        g.write(0x80'000000);
+        g.write(v()); g.write(v()); g.write(0x0020'0020);
+        break;
+    }
+  }
+}
+
+
+// 只测试 cpu 端, 多线程与单线程的结果必须相同
+static void test_soft_gpu() {
+  SoftGpu* a = new SoftGpu(0);
+  SoftGpu* b = new SoftGpu(3);
+  soft_random_cmds(*a, 7);
+  soft_random_cmds(*b, 7);
+  const u16* va = a->vram();
+  const u16* vb = b->vram();
+  for (u32 i = 0; i < SoftGpu::Width * SoftGpu::Height; ++i) {
+    if (va[i] != vb[i]) panic("soft gpu threads differ");
+  }
+  u32 dx, dw;
+  for (u32 r = 0; r < SoftGpu::TileY; ++r) a->takeDirty(r, dx, dw);
+
+  // 跨越 tile 边界的单色矩形
+  u16 out[4];
+  a->write(0xE3'000000);
+  a->write(0xE4'000000 | (511 << 10) | 1023);
+  a->write(0xE5'000000);
+  a->write(0xE6'000000);
+  a->write(0x60'0000F8);
+  a->write(pos(62, 62).v);
+  a->write(pos(4, 1).v);
+  a->read(62, 62, 4, 1, out);
+  for (int i = 0; i < 4; ++i) eq<u16>(out[i], 0x1F, "soft gpu rect");
+  // 只有矩形覆盖的两个 tile 需要上传
+  if (!a->takeDirty(0, dx, dw)) panic("soft gpu rect not dirty");
+  eq<u32>(dx, 0, "soft gpu dirty x");
+  eq<u32>(dw, SoftGpu::TileSize * 2, "soft gpu dirty w");
+  if (a->takeDirty(0, dx, dw) || a->takeDirty(1, dx, dw)) panic("soft gpu dirty not clear");
+
+  // 写显存在边界回绕
+  a->write(0xA0'000000);
+  a->write(pos(1023, 0).v);
+  a->write(pos(2, 1).v);
+  a->write(0x1234'5678);
+  a->read(1023, 0, 2, 1, out);
+  eq<u16>(out[0], 0x5678, "soft gpu upload");
+  eq<u16>(out[1], 0x1234, "soft gpu upload wrap");
+  if (!a->takeDirty(0, dx, dw)) panic("soft gpu upload not dirty");
+  eq<u32>(dw, SoftGpu::Width, "soft gpu dirty wrap");
+  delete a;
+  delete b;
+}
+
+
+void test_gpu_cpu() {
+  test_shadow_vram();
+  test_soft_gpu();
+  test_display_area();
+  test_png();
+}
+
+
 void test_gpu(GPU& gpu, Bus& bus) {
   gpu_basic();
   bus.write32(gp1, 0x0200'0001); // open display
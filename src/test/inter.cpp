@@ -6,6 +6,7 @@
 #include "../serial_port.h"
 #include "../otc.h"
 #include "../cdrom.h"
+#include "../mdec.h"
 #include "../time.h"
 #include <conio.h>
 #include <mutex>
@@ -58,18 +59,23 @@ static void test_mips_inter() {
   Bus bus(mmu);
   TimerSystem ti(bus);
   GPU gpu(bus, ti);
-  SoundProcessing spu(bus);
+  SoundProcessing spu(bus, &ti);
   OrderingTables otc(bus);
   SerialPort spi(bus);
   CdDrive dri;
   dri.loadImage(image[0]);
-  CDrom cdrom(bus, dri);
+  CDrom cdrom(bus, dri, ti);
+  cdrom.setAudioOutput(&spu.cdInput());
+  cdrom.setSpeed(CdSpeed::multiple, 2);
+  MDEC mdec(bus);
+  mdec.setThreads(3);
 
   R3000A cpu(bus, ti);
   bus.bind_irq_receiver(&cpu);
   cpu.reset();
   //test_gpu(gpu, bus); //!!
   debug_system(cpu, bus, mmu, spu);
+  gpu.stopClock();
 
   //cdrom.CmdInit();
   //cdrom.CmdMotorOn();
@@ -48,6 +48,8 @@ int main() {
   test_dma();
   test_cpu();
   test_cd();
+  test_mdec();
+  test_gpu_cpu();
   test_disassembly();
   info("Test all passd\n");
   return 0;
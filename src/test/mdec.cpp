@@ -0,0 +1,167 @@
+﻿#include "test.h"
+#include "../mdec.h"
+#include <cmath>
+#include <vector>
+
+namespace ps1e_t {
+using namespace ps1e;
+
+
+// 标准 IDCT 表: S[u][x] = a(u) * cos((2x+1)uπ/16) * 0x8000
+static void build_scale(s16* s) {
+  const double pi = 3.14159265358979323846;
+  for (int u = 0; u < 8; ++u) {
+    for (int x = 0; x < 8; ++x) {
+      double a = u ? 1 : 1 / sqrt(2.0);
+      s[u*8 + x] = s16(floor(a * cos((2*x + 1) * u * pi / 16) * 0x8000 + 0.5));
+    }
+  }
+}
+
+
+static MdecDecoder* create_decoder(s16* scale) {
+  u8 q[MDEC_BLOCK_SIZE * 2];
+  memset(q, 8, sizeof(q));
+  MdecDecoder* dec = new MdecDecoder();
+  build_scale(scale);
+  dec->setScale(scale);
+  dec->setQuant(q, true);
+  return dec;
+}
+
+
+// 每个块只有 DC, 输出等于 DC 值
+static void test_mdec_dc() {
+  s16 scale[MDEC_BLOCK_SIZE];
+  MdecDecoder* dec = create_decoder(scale);
+  const u16 q1 = 1 << 10;
+  u16 src[] = { 
+    MDEC_PADDING, q1 | 20, MDEC_PADDING, // Cr
+    q1 | 0,  MDEC_PADDING,                  // Cb
+    q1 | 40, MDEC_PADDING, q1 | 40, MDEC_PADDING,
+    q1 | 40, MDEC_PADDING, q1 | 40, MDEC_PADDING,
+  };
+  const u32 n = sizeof(src) / sizeof(src[0]);
+  MdecCommand c{0};
+  c.depth = 2;
+
+  eq(MdecDecoder::scan(src, n, c), n, "mdec scan");
+  eq(MdecDecoder::scan(src, n - 1, c), u32(0), "mdec scan incomplete");
+
+  u8 out[16 * 16 * 3];
+  dec->decode(src, out, c);
+  // R = 40 + 1.402 * 20, G = 40 - 0.7143 * 20, 转换到无符号
+  eq(int(out[0]), 128 + 40 + 28, "mdec rgb24 r");
+  eq(int(out[1]), 128 + 40 - 15, "mdec rgb24 g");
+  eq(int(out[2]), 128 + 40, "mdec rgb24 b");
+  eq(int(out[sizeof(out) - 1]), 128 + 40, "mdec rgb24 last b");
+
+  c.depth = 3;
+  c.sign  = 1;
+  c.bit15 = 1;
+  u16 rgb15[16 * 16];
+  dec->decode(src, (u8*) rgb15, c);
+  eq(int(rgb15[255]), 0x8000 | (5 << 10) | (3 << 5) | 8, "mdec rgb15");
+  delete dec;
+}
+
+
+// 带交流分量的单色块和浮点 IDCT 比较
+static void test_mdec_idct() {
+  s16 scale[MDEC_BLOCK_SIZE];
+  MdecDecoder* dec = create_decoder(scale);
+  const u16 q1 = 1 << 10;
+  // DC, 然后 (run, level) 对
+  u16 src[] = { q1 | 100, 0x0000 | 60, 0x0400 | 35, 0x0800 | 0x3E0, 
+                0x0000 | 12, 0x1400 | 25, 0x0C00 | 0x3F0, MDEC_PADDING };
+  const u32 n = sizeof(src) / sizeof(src[0]);
+  MdecCommand c{0};
+  c.depth = 1;
+  c.sign  = 1;
+  eq(MdecDecoder::scan(src, n, c), n, "mdec mono scan");
+
+  // 按照解码规则还原系数
+  static const u8 zigzag[] = {
+     0,  1,  5,  6, 14, 15, 27, 28,  2,  4,  7, 13, 16, 26, 29, 42,
+     3,  8, 12, 17, 25, 30, 41, 43,  9, 11, 18, 24, 31, 40, 44, 53,
+    10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,
+    21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63,
+  };
+  double blk[MDEC_BLOCK_SIZE] = {0};
+  blk[0] = 100 * 8;
+  u32 k = 0;
+  for (u32 i = 1; i < n - 1; ++i) {
+    k += (src[i] >> 10) + 1;
+    s32 v = s32(u32(src[i]) << 22) >> 22;
+    for (u32 r = 0; r < MDEC_BLOCK_SIZE; ++r) {
+      if (zigzag[r] == k) blk[r] = (v * 8 + 4) / 8;
+    }
+  }
+
+  u8 out[MDEC_BLOCK_SIZE];
+  dec->decode(src, out, c);
+  for (int y = 0; y < 8; ++y) {
+    for (int x = 0; x < 8; ++x) {
+      double sum = 0;
+      for (int u = 0; u < 8; ++u) {
+        for (int v = 0; v < 8; ++v) {
+          sum += scale[u*8 + y] * blk[u*8 + v] * scale[v*8 + x];
+        }
+      }
+      int ref = int(floor(sum / 65536 / 65536 + 0.5));
+      ref = ref < -128 ? -128 : (ref > 127 ? 127 : ref);
+      int got = s8(out[y*8 + x]);
+      if (abs(got - ref) > 1) {
+        eq(got, ref, "mdec idct");
+      }
+    }
+  }
+  delete dec;
+}
+
+
+// 线程池的输出和顺序解码完全相同
+static void test_mdec_workers() {
+  s16 scale[MDEC_BLOCK_SIZE];
+  MdecDecoder* dec = create_decoder(scale);
+  MdecCommand c{0};
+  c.depth = 2;
+  const u32 count = 100;
+  const u32 size = MdecDecoder::outputSize(c);
+
+  std::vector<u16> src;
+  std::vector<u32> offsets;
+  u32 seed = 1;
+  for (u32 m = 0; m < count; ++m) {
+    offsets.push_back(u32(src.size()));
+    for (u32 b = 0; b < MDEC_COLOR_BLOCKS; ++b) {
+      seed = seed * 1103515245 + 12345;
+      src.push_back(u16((1 << 10) | ((seed >> 8) & 0x3FF)));
+      for (u32 k = 0; k < 60; k += 7) {
+        seed = seed * 1103515245 + 12345;
+        src.push_back(u16((6 << 10) | ((seed >> 8) & 0x3FF)));
+      }
+      src.push_back(MDEC_PADDING);
+    }
+  }
+
+  std::vector<u8> a(count * size), b(count * size);
+  for (u32 m = 0; m < count; ++m) {
+    dec->decode(src.data() + offsets[m], a.data() + m * size, c);
+  }
+  MdecWorkers* workers = new MdecWorkers(3);
+  workers->decode(*dec, src.data(), offsets.data(), count, b.data(), c);
+  workers->decode(*dec, src.data(), offsets.data(), count, b.data(), c);
+  if (a != b) panic("mdec workers output");
+  delete workers;
+  delete dec;
+}
+
+
+void test_mdec() {
+  test_mdec_dc();
+  test_mdec_idct();
+  test_mdec_workers();
+}
+
+}
@@ -1,6 +1,7 @@
 ﻿#include "test.h"
 #include "../spu.h"
 #include <conio.h>
+#include <chrono>
 
 namespace ps1e_t {
 using namespace ps1e;
@@ -310,7 +311,6 @@ void play_spu_current_font(SoundProcessing& spu, Bus& b, int use_channel_n) {
       b.printf("\tpress { }           down left/right volume, maybe change to sweet mode\n");
       b.printf("\tpress BS            stop all note\n");
       b.printf("\tpress 0             reset volume to zero\n");
-      b.printf("\tpress /             switch low pass filter\n");
       b.printf("\tpress ,.            change timbre\n");
       b.printf("\tpreee `             switch channel 0 Noise\n");
       b.printf("\tpreee TAB           switch channel 1 Pitch Modulation\n");
@@ -346,11 +346,6 @@ void play_spu_current_font(SoundProcessing& spu, Bus& b, int use_channel_n) {
       volume = 0;
       break;
 
-    case '/':
-      spu.use_low_pass = !spu.use_low_pass;
-      printf("use low pass %d\n", spu.use_low_pass);
-      continue;
-
     case '[':
       volume += 0x0010;
       break;
@@ -470,6 +465,70 @@ static void spu_play_sound(const char *font_file) {
 }
 
 
+// 不使用音频设备, 通道 0 循环播放一个方波块, 返回最终输出的校验和
+static u32 render_capture(u32 nframe, s32& peak, double& ms) {
+  MemJit mj;
+  MMU mmu(mj);
+  Bus b(mmu);
+  SoundProcessing spu(b, NULL, false);
+  SpuMemorySink mix(nframe, 2);
+  SpuMemorySink voice(nframe, 1);
+  spu.setOutputSink(SpuTap::Mix, &mix);
+  spu.setOutputSink(SpuTap::Voice, &voice, 0);
+
+  AdpcmBlock* blk = (AdpcmBlock*) (spu.get_spu_mem() + 0x1000);
+  blk->filter = 0;
+  blk->flag.v = 0b111; // 循环开始/结束/重复
+  for (int i=0; i<14; ++i) {
+    blk->data[i].v = 0x87; // +7, -8
+  }
+
+  ADSRReg a;
+  a.v = 0;
+  a.su_lv = 0xF;
+  a.su_sh = 0x1f;
+
+  b.write32(0x1F80'1D80, 0x3fff'3fff); // 主音量
+  b.write16(0x1F80'1C06, 0x1000 >> 3); // 开始地址
+  b.write16(0x1F80'1C04, 0x1000); // 44100Hz
+  b.write32(0x1F80'1C08, a.v);
+  b.write32(0x1F80'1C00, 0x3fff'3fff); // 通道音量
+  b.write32(0x1F80'1DAA, 0x0000'C000); // SPUCNT, Enable, Unmute
+  b.write32(0x1F80'1D88, 1); // Kon
+
+  const u32 batch = 256;
+  PcmSample out[batch << 1];
+  auto start = std::chrono::high_resolution_clock::now();
+  for (u32 i=0; i<nframe; i+=batch) {
+    spu.render(out, std::min(batch, nframe - i));
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+  eq(mix.frames(), nframe, "spu capture mix frames");
+  eq(voice.frames(), nframe, "spu capture voice frames");
+  peak = 0;
+  for (u32 i=0; i<voice.frames(); ++i) {
+    const s32 v = abs(s32(voice.data()[i]));
+    if (v > peak) peak = v;
+  }
+  return mix.checksum();
+}
+
+
+static void test_spu_capture() {
+  const u32 nframe = SPU_WORK_FREQ;
+  s32 peak1, peak2;
+  double ms1, ms2;
+  u32 sum1 = render_capture(nframe, peak1, ms1);
+  u32 sum2 = render_capture(nframe, peak2, ms2);
+
+  if (peak1 == 0) panic("spu capture no voice output");
+  eq(sum1, sum2, "spu capture checksum");
+  info("SPU render 1s audio %.2fms, checksum %08x\n", ms1 < ms2 ? ms1 : ms2, sum1);
+}
+
+
 static void test_adsr() {
   SpuAdsr a;
   a.reset(0, 0, 0x10, 3);
@@ -500,6 +559,7 @@ void test_spu() {
   };
 
   test_spu_reg();
+  test_spu_capture();
   //test_adsr();
   //spu_play_sound(font_files[0]);
 }
@@ -27,9 +27,12 @@ void test_cpu();
 void test_jit();
 void test_util();
 void test_gpu(ps1e::GPU& gpu, ps1e::Bus& bus);
+// 只使用 cpu 的 gpu 测试, 不需要 OpenGL 上下文
+void test_gpu_cpu();
 void test_dma();
 void test_cd();
 void test_spu();
+void test_mdec();
 
 // 专门用于调试 cpu, 可在任何条件下调用
 void debug_system(ps1e::R3000A& cpu, ps1e::Bus& bus, ps1e::MMU&, ps1e::SoundProcessing&);
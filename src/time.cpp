@@ -264,16 +264,13 @@ void Timer2::systemClock8() {
 // ----------------------------------------------------- Timer System
 
 TimerSystem::TimerSystem(Bus& b) 
-: t0(b), t1(b), t2(b), screenWidth(320), systemClock8c(0)
-, screenHeight(314), exit(0), work1(&TimerSystem::vblank_thread, this)
+: t0(b), t1(b), t2(b), screenWidth(320), systemClock8c(0), exit(0)
 , work2(&TimerSystem::system_clock_thread, this) {
 }
 
 
 TimerSystem::~TimerSystem() {
   exit = true;
-  wait_vblank.notify_all();
-  work1.join();
   //wait_sc.notify_all();
   work2.join();
 }
@@ -293,6 +290,12 @@ void TimerSystem::hblank(bool inside) {
 
 void TimerSystem::systemClock() {
   //wait_sc.notify_all();
+  sched.tick(SYSTEM_CLOCK_PER_OP);
+}
+
+
+ClockScheduler& TimerSystem::scheduler() {
+  return sched;
 }
 
 
@@ -317,20 +320,91 @@ void TimerSystem::system_clock_thread() {
 
 void TimerSystem::vblank(bool inside) {
   t1.vblank(inside);
-  if (inside) wait_vblank.notify_all();
 }
 
+// ----------------------------------------------------- Clock Scheduler
 
-void TimerSystem::vblank_thread() {
-  std::unique_lock<std::mutex> lk(for_vblank);
-  while (!exit) {
-    wait_vblank.wait(lk);
-    //printf("SEND hblank\n");
-    for (int i=0; i<screenHeight; ++i) {
-      hblank(false);
-      hblank(true);
+ClockScheduler::ClockScheduler() : count(0), now(0), next(CLOCK_NEVER) {
+}
+
+
+int ClockScheduler::find(ClockEvent* e) {
+  for (u32 i = 0; i < count; ++i) {
+    if (slots[i].ev == e) return i;
+  }
+  return -1;
+}
+
+
+void ClockScheduler::remove(int i) {
+  slots[i] = slots[--count];
+}
+
+
+void ClockScheduler::update_next() {
+  next = CLOCK_NEVER;
+  for (u32 i = 0; i < count; ++i) {
+    if (slots[i].when < next) next = slots[i].when;
+  }
+}
+
+
+void ClockScheduler::schedule(ClockEvent* e, u32 delay) {
+  int i = find(e);
+  if (i < 0) {
+    if (count >= MAX_EVENT) {
+      error("Too many clock events\n");
+      return;
+    }
+    i = count++;
+    slots[i].ev = e;
+  }
+  slots[i].when = now + delay;
+  if (slots[i].when < next) next = slots[i].when;
+}
+
+
+void ClockScheduler::cancel(ClockEvent* e) {
+  int i = find(e);
+  if (i >= 0) {
+    remove(i);
+    update_next();
+  }
+}
+
+
+bool ClockScheduler::pending(ClockEvent* e) {
+  return find(e) >= 0;
+}
+
+
+// 回调中可能调度或取消其他事件, 每次回调后重新扫描
+void ClockScheduler::run() {
+  bool fired = true;
+  while (fired) {
+    fired = false;
+    for (u32 i = 0; i < count; ++i) {
+      if (slots[i].when > now) continue;
+
+      ClockEvent* e = slots[i].ev;
+      const u64 due = slots[i].when;
+      slots[i].when = CLOCK_NEVER;
+      const u32 d = e->onClock(u32(now - due));
+
+      // 回调没有重新调度自己
+      const int j = find(e);
+      if (j >= 0 && slots[j].when == CLOCK_NEVER) {
+        if (d) {
+          slots[j].when = due + d;
+        } else {
+          remove(j);
+        }
+      }
+      fired = true;
+      break;
     }
   }
+  update_next();
 }
 
 
@@ -12,6 +12,12 @@ namespace ps1e {
 class Timer;
 class TimerTrigger;
 
+// 平均每条指令消耗的系统时钟
+#define SYSTEM_CLOCK_PER_OP   2
+// 系统时钟频率 33.8688MHz
+#define SYSTEM_CLOCK_FREQ     33'868'800
+#define CLOCK_NEVER           (~u64(0))
+
 
 union TimerMode {
   u32 v;
@@ -130,35 +136,80 @@ public:
 };
 
 
+// 在模拟时钟上触发的事件, 在 CPU 线程上调用
+class ClockEvent {
+public:
+  virtual ~ClockEvent() {}
+  // 事件到期, late 是超过预定时间的时钟数.
+  // 返回距离下一次触发的时钟数, 返回 0 则事件从队列中移除.
+  virtual u32 onClock(u32 late) = 0;
+};
+
+
+// 事件调度器, 由 CPU 执行指令推动, 只在 CPU 线程上使用
+class ClockScheduler {
+private:
+  static const u32 MAX_EVENT = 16;
+  struct Slot {
+    ClockEvent* ev;
+    u64 when;
+  };
+
+  Slot slots[MAX_EVENT];
+  u32 count;
+  u64 now;
+  // 最近一个事件的到期时间
+  u64 next;
+
+  int find(ClockEvent* e);
+  void remove(int i);
+  void update_next();
+  void run();
+
+public:
+  ClockScheduler();
+
+  // 在 delay 个时钟后触发 e, 如果 e 已经在队列中则修改触发时间
+  void schedule(ClockEvent* e, u32 delay);
+  void cancel(ClockEvent* e);
+  bool pending(ClockEvent* e);
+  // 从开始运行经过的系统时钟
+  u64 cycles() { return now; }
+
+  // 时钟前进 n 个周期, 运行所有到期的事件
+  void tick(u32 n) {
+    now += n;
+    if (now >= next) run();
+  }
+};
+
+
 class TimerSystem {
 private:
   Timer0 t0;
   Timer1 t1;
   Timer2 t2;
   u16 screenWidth;
-  u16 screenHeight;
   u8 systemClock8c;
   bool exit;
-
-  std::thread work1;
-  std::mutex for_vblank;
-  std::condition_variable wait_vblank;
+  ClockScheduler sched;
 
   std::thread work2;
   //std::mutex for_sc;
   //std::condition_variable wait_sc;
 
-  // 模拟 hblank/dotclock
-  void hblank(bool inside);
-  void vblank_thread();
   void system_clock_thread();
 
 public:
   TimerSystem(Bus& b);
   ~TimerSystem();
 
+  // 由 GPU 按模拟扫描线调用, 模拟 hblank/dotclock
+  void hblank(bool inside);
   void vblank(bool inside);
+  // 每条指令调用一次
   void systemClock();
+  ClockScheduler& scheduler();
 };
 
 }
\ No newline at end of file
@@ -203,15 +203,16 @@ void MemJit::free(void* p) {
     throw std::out_of_range("Not belong (memjit.free)");
   }
 
-  MemBlock *bl = *(it->second);
+  auto li = it->second;
+  MemBlock *bl = *li;
   bl->free(p);
-  addr_map.erase(p);
+  addr_map.erase(it);
 
   if (bl->ref_count() == 0) {
-    if (last == it->second) {
+    if (last == li) {
       last = addr_list.end();
     }
-    addr_list.erase(it->second);
+    addr_list.erase(li);
     delete bl;
   }
 }
@@ -410,4 +411,69 @@ void PrintfBuf::reset() {
   buf[0] = '\0';
 }
 
+
+WorkerPool::WorkerPool(u32 n) : batch(0), busy(0), running(true), task(0), count(0), next(0) {
+  for (u32 i = 0; i < n; ++i) {
+    threads.push_back(new std::thread(&WorkerPool::worker, this));
+  }
+}
+
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    running = false;
+    wake.notify_all();
+  }
+  for (auto t : threads) {
+    t->join();
+    delete t;
+  }
+}
+
+
+u32 WorkerPool::size() {
+  return u32(threads.size());
+}
+
+
+void WorkerPool::worker() {
+  u32 seen = 0;
+  std::unique_lock<std::mutex> lk(lock);
+  for (;;) {
+    wake.wait(lk, [&] { return batch != seen || !running; });
+    if (!running) return;
+    seen = batch;
+    lk.unlock();
+    take();
+    lk.lock();
+    if (--busy == 0) done.notify_one();
+  }
+}
+
+
+void WorkerPool::take() {
+  for (;;) {
+    const u32 i = next.fetch_add(1);
+    if (i >= count) return;
+    task->runTask(i);
+  }
+}
+
+
+void WorkerPool::run(IParallelTask* t, u32 n) {
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    task  = t;
+    count = n;
+    next  = 0;
+    busy  = u32(threads.size());
+    ++batch;
+    wake.notify_all();
+  }
+  take();
+  std::unique_lock<std::mutex> lk(lock);
+  done.wait(lk, [&] { return busy == 0; });
+}
+
 }
\ No newline at end of file
@@ -7,6 +7,11 @@
 #include <unordered_set>
 #include <stdarg.h>
 #include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
 
 namespace ps1e_t {
   extern int ext_stop;
@@ -235,6 +240,44 @@ public:
 };
 
 
+// 可以并行执行的一批任务, 编号之间不能有依赖
+class IParallelTask {
+public:
+  virtual ~IParallelTask() {}
+  virtual void runTask(u32 index) = 0;
+};
+
+
+// 并行执行一批任务的线程池, 线程逐个领取任务编号
+class WorkerPool : public NonCopy {
+private:
+  std::vector<std::thread*> threads;
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+  // 每提交一批加 1
+  u32 batch;
+  // 还没有完成当前批次的线程
+  u32 busy;
+  bool running;
+
+  IParallelTask* task;
+  u32 count;
+  std::atomic<u32> next;
+
+  void worker();
+  void take();
+
+public:
+  WorkerPool(u32 nthread);
+  ~WorkerPool();
+  // 执行 t->runTask(0..n), 调用线程也参与, 全部完成后返回
+  void run(IParallelTask* t, u32 n);
+  // 不包括调用线程
+  u32 size();
+};
+
+
 // 返回 reserve 和 set 逐位运算的结果.
 // 该运算使 set 中的位复制到 reserve 中, 如果对应 reserveMask 位是 1,
 // 否则 reserve 中的位不变.